@@ -37,7 +37,7 @@
 #include "config.h"
 #include "str.h"
 #include "resources.h"
-#include "dns.h"
+#include "worker.h"
 
 #define config_param_register(Param)
 
@@ -74,6 +74,20 @@ config_param_register("ehlo_filter");
  */
 config_param_register("verify_filter");
 
+/* Filters to execute instead of the previous ones when postfix is under
+ * stress (postfix 2.5+ sends stress=yes when it runs out of smtpd
+ * processes).
+ */
+config_param_register("client_filter_stress");
+config_param_register("sender_filter_stress");
+config_param_register("recipient_filter_stress");
+config_param_register("data_filter_stress");
+config_param_register("end_of_data_filter_stress");
+config_param_register("etrn_filter_stress");
+config_param_register("helo_filter_stress");
+config_param_register("ehlo_filter_stress");
+config_param_register("verify_filter_stress");
+
 
 /* Where to bind the server.
  */
@@ -102,31 +116,93 @@ config_param_register("include_explanation");
 config_param_register("use_resolv_conf");
 
 
-static struct {
-    config_t *config;
-} config_g;
-#define _G  config_g
+/* Size of the DNS answers cache of each worker, in kilobytes.
+ * 0 disables the cache.
+ * Postlicyd MUST be restarted to use this configuration variable.
+ */
+config_param_register("dns_cache_size");
 
-static config_t *config_init(config_t *config)
-{
-    p_clear(config, 1);
-    _G.config = config;
-    return config;
-}
+
+/* Maximum time to wait for the answer of a DNS list, in milliseconds.
+ * Postlicyd MUST be restarted to use this configuration variable.
+ */
+config_param_register("dns_timeout");
+
+
+/* Query the DNS lists of the filters reachable from the current protocol
+ * state as soon as a new client is seen, so that their answers are in the
+ * cache when the filters run.
+ * Default is false.
+ */
+config_param_register("dns_prefetch");
+
+
+/* Answer the queries identical to a recent one, on the fields read by the
+ * filters that answered it, with the same answer. The ttl is in seconds,
+ * 0 disables the cache. The size of the cache of each worker is in
+ * kilobytes.
+ * Postlicyd MUST be restarted to use these configuration variables.
+ */
+config_param_register("decision_cache_ttl");
+config_param_register("decision_cache_size");
+
+
+/* Maximum time to answer a query, in milliseconds. When it is reached, the
+ * pending filters are canceled and the query is answered with the fallback
+ * action. 0 disables the deadline.
+ */
+config_param_register("query_deadline_ms");
+
+/* Answer the queries with the fallback action, without running the filters,
+ * when they waited for more than the given time (in milliseconds) in the
+ * event loop before being processed. 0 disables load shedding.
+ */
+config_param_register("query_shed_latency_ms");
+
+/* Action given by the fallback answer. Default is DUNNO.
+ */
+config_param_register("query_fallback");
+
+
+/* Number of workers.
+ * Each worker runs its own event loop in its own thread. 0 means one worker
+ * per online CPU.
+ * Postlicyd MUST be restarted to use this configuration variable.
+ */
+config_param_register("workers");
+
+/* Run the workers in separate processes.
+ * Postlicyd MUST be restarted to use this configuration variable.
+ */
+config_param_register("prefork");
+
+
+DO_INIT(config_t, config);
 DO_NEW(config_t, config);
 
 static void config_wipe(config_t *config)
 {
     for (int i = 0 ; i < SMTP_count ; ++i) {
         config->entry_points[i] = -1;
+        config->stress_entry_points[i] = -1;
+        array_wipe(config->prefetch[i]);
     }
     array_deep_wipe(config->filters, filter_wipe);
     array_deep_wipe(config->params, filter_params_wipe);
     config->port_present = false;
+    config->workers = 1;
+    config->prefork = false;
+    config->dns_cache_size = 1024;
+    config->dns_timeout = 5000;
+    config->dns_prefetch = false;
+    config->decision_cache_size = 1024;
+    config->decision_cache_ttl = 0;
+    config->query_deadline_ms = 0;
+    config->query_shed_latency_ms = 0;
+    p_delete(&config->query_fallback);
     p_delete(&config->socketfile);
     p_delete(&config->log_format);
     p_delete(&config->resolv_conf);
-    _G.config = NULL;
 }
 
 void config_delete(config_t **config)
@@ -134,16 +210,25 @@ void config_delete(config_t **config)
     if (*config) {
         config_wipe(*config);
         p_delete(config);
+        resource_garbage_collect();
     }
 }
 
-static void config_exit()
+config_t *config_ref(config_t *config)
+{
+    __sync_add_and_fetch(&config->refcount, 1);
+    return config;
+}
+
+void config_unref(config_t **config)
 {
-    if (_G.config) {
-        config_delete(&_G.config);
+    if (*config) {
+        if (__sync_sub_and_fetch(&(*config)->refcount, 1) == 0) {
+            config_delete(config);
+        }
+        *config = NULL;
     }
 }
-module_exit(config_exit);
 
 
 static bool config_parse(config_t *config)
@@ -427,6 +512,23 @@ static bool config_build_structure(config_t *config)
           CASE(END_OF_DATA, END_OF_MESSAGE)
           CASE(VERIFY,      VRFY)
           CASE(ETRN,        ETRN)
+#undef    CASE
+#define   CASE(Param, State)                                                 \
+            case ATK_ ## Param ## _FILTER_STRESS:                            \
+              config->stress_entry_points[SMTP_ ## State]                    \
+                  = filter_find_with_name(&config->filters, param->value);   \
+              PARSE_CHECK(config->stress_entry_points[SMTP_ ## State] >= 0,  \
+                          "invalid filter name %s", param->value);           \
+              break;
+          CASE(CLIENT,      CONNECT)
+          CASE(EHLO,        EHLO)
+          CASE(HELO,        HELO)
+          CASE(SENDER,      MAIL)
+          CASE(RECIPIENT,   RCPT)
+          CASE(DATA,        DATA)
+          CASE(END_OF_DATA, END_OF_MESSAGE)
+          CASE(VERIFY,      VRFY)
+          CASE(ETRN,        ETRN)
 #undef    CASE
           FILTER_PARAM_PARSE_INT_PRESENCE(PORT, config->port);
           FILTER_PARAM_PARSE_STRING(SOCKETFILE, config->socketfile, true);
@@ -435,6 +537,21 @@ static bool config_build_structure(config_t *config)
                                     config->resolv_conf, true);
           FILTER_PARAM_PARSE_BOOLEAN(INCLUDE_EXPLANATION,
                                      config->include_explanation);
+          FILTER_PARAM_PARSE_INT(DNS_CACHE_SIZE, config->dns_cache_size);
+          FILTER_PARAM_PARSE_INT(DNS_TIMEOUT, config->dns_timeout);
+          FILTER_PARAM_PARSE_BOOLEAN(DNS_PREFETCH, config->dns_prefetch);
+          FILTER_PARAM_PARSE_INT(DECISION_CACHE_SIZE,
+                                 config->decision_cache_size);
+          FILTER_PARAM_PARSE_INT(DECISION_CACHE_TTL,
+                                 config->decision_cache_ttl);
+          FILTER_PARAM_PARSE_INT(QUERY_DEADLINE_MS,
+                                 config->query_deadline_ms);
+          FILTER_PARAM_PARSE_INT(QUERY_SHED_LATENCY_MS,
+                                 config->query_shed_latency_ms);
+          FILTER_PARAM_PARSE_STRING(QUERY_FALLBACK, config->query_fallback,
+                                    true);
+          FILTER_PARAM_PARSE_INT(WORKERS, config->workers);
+          FILTER_PARAM_PARSE_BOOLEAN(PREFORK, config->prefork);
           default: break;
         }
     }
@@ -446,6 +563,39 @@ static bool config_build_structure(config_t *config)
         return false;
     }
 
+    if (config->dns_cache_size < 0) {
+        err("invalid dns cache size: %d", config->dns_cache_size);
+        return false;
+    }
+
+    if (config->decision_cache_size < 0 || config->decision_cache_ttl < 0) {
+        err("invalid decision cache size or ttl: %d, %d",
+            config->decision_cache_size, config->decision_cache_ttl);
+        return false;
+    }
+
+    if (config->query_deadline_ms < 0 || config->query_shed_latency_ms < 0) {
+        err("invalid query deadline or shed latency: %d, %d",
+            config->query_deadline_ms, config->query_shed_latency_ms);
+        return false;
+    }
+
+    if (config->query_fallback
+        && !query_format_check(config->query_fallback)) {
+        err("invalid query fallback: \"%s\"", config->query_fallback);
+        return false;
+    }
+
+    if (config->dns_timeout <= 0) {
+        err("invalid dns timeout: %d", config->dns_timeout);
+        return false;
+    }
+
+    if (config->workers < 0) {
+        err("invalid number of workers: %d", config->workers);
+        return false;
+    }
+
     if (config->log_format && !query_format_check(config->log_format)) {
         err("invalid log format: \"%s\"", config->log_format);
         return false;
@@ -457,17 +607,75 @@ static bool config_build_structure(config_t *config)
     return ok;
 }
 
-static bool config_build_filters(config_t *config)
+/* Mark the filters reachable from the entry points of @p state, including
+ * the stress ones: the session may come under stress later on.
+ */
+static void config_prefetch_state(config_t *config, int state, bool *reached)
 {
-    foreach (filter, config->filters) {
-        if (!filter_build(filter)) {
-            return false;
+    if (config->entry_points[state] >= 0) {
+        filter_mark_reachable(&config->filters, config->entry_points[state],
+                              reached);
+    }
+    if (config->stress_entry_points[state] >= 0) {
+        filter_mark_reachable(&config->filters,
+                              config->stress_entry_points[state], reached);
+    }
+    for (uint32_t i = 0 ; i < config->filters.len ; ++i) {
+        if (reached[i] && filter_can_prefetch(array_ptr(config->filters, i))) {
+            array_add(config->prefetch[state], i);
         }
     }
+}
+
+/* The filters that may run after a protocol state of the mail transaction
+ * are the ones reachable from the entry points of this state and of the
+ * following ones. VRFY and ETRN are not part of the transaction: only their
+ * own entry points are followed, and they are not followed from the other
+ * states.
+ */
+static void config_build_prefetch(config_t *config)
+{
+    bool *reached;
+
+    if (!config->dns_prefetch || config->filters.len == 0) {
+        return;
+    }
+    reached = p_new(bool, config->filters.len);
+    for (int state = SMTP_END_OF_MESSAGE ; state >= SMTP_CONNECT ; --state) {
+        config_prefetch_state(config, state, reached);
+    }
+    for (int state = SMTP_END_OF_MESSAGE + 1 ; state < SMTP_count ; ++state) {
+        p_clear(reached, config->filters.len);
+        config_prefetch_state(config, state, reached);
+    }
+    p_delete(&reached);
+}
 
+static bool config_build_filter(void *data, int i)
+{
+    config_t *config = data;
+    filter_t *filter = array_ptr(config->filters, i);
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!filter_build(filter)) {
+        err("cannot build filter %s", filter->name);
+        return false;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    notice("filter %s built in %.3fs", filter->name,
+           (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
     return true;
 }
 
+/* Filters are independent from each other (they only reference each other
+ * by index), so they are built concurrently.
+ */
+static bool config_build_filters(config_t *config)
+{
+    return worker_parallel(config->filters.len, config_build_filter, config);
+}
+
 static bool config_load(config_t *config) {
     config_wipe(config);
 
@@ -484,24 +692,20 @@ static bool config_load(config_t *config) {
         err("Invalid configuration: invalid filter");
         return false;
     }
-    if (config->resolv_conf != NULL) {
-        dns_use_local_conf(config->resolv_conf);
-    }
+    config_build_prefetch(config);
 
     resource_garbage_collect();
     return true;
 }
 
-bool config_reload(config_t *config)
-{
-    return config_load(config);
-}
-
 config_t *config_read(const char *file)
 {
+    static unsigned generations = 0;
     config_t *config = config_new();
     config->filename = file;
-    if (!config_reload(config)) {
+    config->refcount = 1;
+    config->generation = __sync_add_and_fetch(&generations, 1);
+    if (!config_load(config)) {
         config_delete(&config);
         return NULL;
     }
@@ -515,11 +719,40 @@ bool config_check(const char *file)
 
     bool ret;
 
-    if ((ret = config_reload(config)))
+    if ((ret = config_load(config)))
         notice("Configuration is good!");
 
     config_delete(&config);
     return ret;
 }
 
+const char *config_query_fallback(const config_t *config)
+{
+    return config->query_fallback && config->query_fallback[0] ?
+           config->query_fallback : DEFAULT_QUERY_FALLBACK;
+}
+
+const char *config_query_deadline(const config_t *config,
+                                  filter_context_t *context, bool *expired)
+{
+    if (context->current_filter == NULL) {
+        return NULL;
+    }
+    *expired = !filter_cancel(context);
+    return config_query_fallback(config);
+}
+
+const char *config_query_shed(const config_t *config, int *waited)
+{
+    *waited = 0;
+    if (config->query_shed_latency_ms <= 0) {
+        return NULL;
+    }
+    *waited = (ev_time() - worker_pending_since()) * 1000;
+    if (*waited < config->query_shed_latency_ms) {
+        return NULL;
+    }
+    return config_query_fallback(config);
+}
+
 /* vim:set et sw=4 sts=4 sws=4: */
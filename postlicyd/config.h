@@ -46,6 +46,16 @@ struct config_t {
      */
     const char *filename;
 
+    /* Number of references on this configuration generation. A reload
+     * builds a new generation, the previous one is deleted once the queries
+     * running against it are done.
+     */
+    int refcount;
+
+    /* Serial number of the generation.
+     */
+    unsigned generation;
+
     /* Parameters.
      */
     A(filter_param_t)  params;
@@ -61,6 +71,16 @@ struct config_t {
      */
     int entry_points[SMTP_count];
 
+    /* Entry points used instead of the previous ones when postfix is under
+     * stress, -1 if the state has no such entry point.
+     */
+    int stress_entry_points[SMTP_count];
+
+    /* Filters with a prefetcher that may run from a given smtp state to the
+     * end of the session (filled only when dns_prefetch is enabled).
+     */
+    A(int) prefetch[SMTP_count];
+
     /* Port on which the program have to bind to.
      * The parameter from CLI override the parameter from configuration file.
      */
@@ -68,6 +88,12 @@ struct config_t {
     bool port_present;
     char *socketfile;
 
+    /* Number of event loop workers (0 means one per CPU).
+     * Workers are processes instead of threads in prefork mode.
+     */
+    int workers;
+    bool prefork;
+
     /* Log message.
      */
     char *log_format;
@@ -76,11 +102,38 @@ struct config_t {
      */
     char *resolv_conf;
 
+    /* Size of the DNS cache of each worker, in kB.
+     */
+    int dns_cache_size;
+
+    /* Maximum time to wait for a DNS list, in ms.
+     */
+    int dns_timeout;
+
+    /* Issue the DNS queries of the reachable filters when a client is seen.
+     */
+    bool dns_prefetch;
+
+    /* Size of the decision cache of each worker, in kB, and lifetime of its
+     * entries, in seconds.
+     */
+    int decision_cache_size;
+    int decision_cache_ttl;
+
+    /* Maximum time to answer a query and maximum time a query may wait in
+     * the event loop before being answered by the fallback, in ms.
+     */
+    int query_deadline_ms;
+    int query_shed_latency_ms;
+    char *query_fallback;
+
     /* Include the explanation from the filter in answer message if available.
      */
     bool include_explanation;
 };
 
+#define DEFAULT_QUERY_FALLBACK  "DUNNO"
+
 #define DEFAULT_LOG_FORMAT                                                   \
     "request client=${client_name}[${client_address}] from=<${sender}> "     \
     "to=<${recipient}> at ${protocol_state}"
@@ -92,10 +145,32 @@ __attribute__((nonnull(1)))
 bool config_check(const char *file);
 
 __attribute__((nonnull(1)))
-bool config_reload(config_t *config);
+config_t *config_ref(config_t *config);
+
+void config_unref(config_t **config);
 
 void config_delete(config_t **config);
 
+/** Action given to the queries answered without waiting for their filters.
+ */
+__attribute__((nonnull(1)))
+const char *config_query_fallback(const config_t *config);
+
+/** The deadline of the query running in @p context is reached: its filter
+ * is canceled and the query must be answered with the returned action.
+ * @p expired is set when the filter cannot be canceled: it will still post
+ * its result, that must be dropped. Returns NULL if no filter is running.
+ */
+__attribute__((nonnull(1,2,3)))
+const char *config_query_deadline(const config_t *config,
+                                  filter_context_t *context, bool *expired);
+
+/** Action given to a query that waited too long in the loop of the worker,
+ * NULL if it must run the filters. The wait is put in @p waited, in ms.
+ */
+__attribute__((nonnull(1,2)))
+const char *config_query_shed(const config_t *config, int *waited);
+
 #endif
 
 /* vim:set et sw=4 sts=4 sws=4: */
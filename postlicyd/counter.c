@@ -111,6 +111,10 @@ filter_constructor(counter)
 
     filter_hook_forward_register(type, HTK_SOFT_MATCH, HTK_HARD_MATCH);
 
+    /* The counters are not part of the query.
+     */
+    filter_uncacheable_register(type);
+
     /* Parameters.
      */
     (void)filter_param_register(type, "counter");
@@ -33,34 +33,64 @@
 /*   see AUTHORS and source files for details                               */
 /****************************************************************************/
 
+#include <pthread.h>
 #include <tcbdb.h>
 
 #include "db.h"
 #include "str.h"
 #include "resources.h"
+#include "buffer.h"
+#include "worker.h"
 
 static struct {
     const clstr_t static_cleanup;
+
+    /* Filters are built concurrently, this makes sure each database is
+     * opened once.
+     */
+    pthread_mutex_t resources_lock;
 } db_g = {
 #define _G  db_g
-    .static_cleanup = CLSTR_IMMED("@@cleanup@@")
+    .static_cleanup = CLSTR_IMMED("@@cleanup@@"),
+    .resources_lock = PTHREAD_MUTEX_INITIALIZER,
 };
 
+typedef struct db_resource_t db_resource_t;
+
 struct db_t {
     unsigned can_expire : 1;
 
     char *ns;
     char *filename;
-    TCBDB **db;
+    db_resource_t *res;
 
     db_checker_f need_cleanup;
     db_entry_checker_f entry_check;
     void *config;
 };
 
-typedef struct db_resource_t {
+struct db_resource_t {
     TCBDB *db;
-} db_resource_t;
+
+    /* The database is shared by all the workers.
+     */
+    pthread_mutex_t lock;
+
+    /* Serializes the opening and the cleanups of the database, that are run
+     * without holding lock.
+     */
+    pthread_mutex_t open_lock;
+
+    /* Entries written during a cleanup.
+     */
+    bool     journaling;
+    buffer_t journal;
+};
+
+/* Copy of the last entry returned by db_get() in the current thread.
+ */
+static __thread buffer_t db_entry_g;
+static __thread buffer_t db_request_g;
 
 DO_ALL(db_t, db);
 
@@ -70,9 +100,30 @@ static void db_resource_wipe(db_resource_t *res)
         tcbdbsync(res->db);
         tcbdbdel(res->db);
     }
+    buffer_wipe(&res->journal);
+    pthread_mutex_destroy(&res->lock);
+    pthread_mutex_destroy(&res->open_lock);
     p_delete(&res);
 }
 
+static void db_master_handler(const void *request, ssize_t len,
+                              buffer_t *answer);
+
+static void db_thread_exit(void)
+{
+    buffer_wipe(&db_entry_g);
+    buffer_wipe(&db_request_g);
+}
+
+static int db_module_init(void)
+{
+    worker_atexit(db_thread_exit);
+    worker_master_register(db_master_handler);
+    return 0;
+}
+module_init(db_module_init);
+module_exit(db_thread_exit);
+
 static bool db_need_cleanup(const db_t *db, TCBDB* tcdb)
 {
     int len = 0;
@@ -87,134 +138,239 @@ static bool db_need_cleanup(const db_t *db, TCBDB* tcdb)
         || db->need_cleanup(*last_cleanup, now, db->config);
 }
 
-static TCBDB** db_resource_acquire(const db_t *db)
+/* Number of entries copied per step of a cleanup: the database is locked
+ * while they are read, so that the workers are only delayed by a step.
+ */
+#define DB_CLEANUP_BATCH  1024
+
+/* Copy the next batch of entries of @p res that did not expire, from the
+ * key in @p last (the first entry if empty), in @p batch. Returns false
+ * once the end of the database is reached.
+ */
+static bool db_cleanup_read(const db_t *db, db_resource_t *res,
+                            buffer_t *last, buffer_t *batch, time_t now,
+                            uint32_t *old_count, uint32_t *new_count)
 {
-    TCBDB *awl_db, *tmp_db;
+    TCXSTR *key = tcxstrnew();
+    TCXSTR *value = tcxstrnew();
+    BDBCUR *cur;
+    bool more;
+
+    buffer_reset(batch);
+    pthread_mutex_lock(&res->lock);
+    cur = tcbdbcurnew(res->db);
+    if (last->len == 0) {
+        more = tcbdbcurfirst(cur);
+    } else {
+        more = tcbdbcurjump(cur, last->data, last->len);
+        if (more && tcbdbcurrec(cur, key, value)
+            && tcxstrsize(key) == (int)last->len
+            && memcmp(tcxstrptr(key), last->data, last->len) == 0) {
+            more = tcbdbcurnext(cur);
+        }
+    }
+    for (int i = 0 ; more && i < DB_CLEANUP_BATCH ; ++i) {
+        uint32_t lens[2];
+
+        tcxstrclear(key);
+        tcxstrclear(value);
+        (void)tcbdbcurrec(cur, key, value);
+        more = tcbdbcurnext(cur);
+        buffer_reset(last);
+        buffer_add(last, tcxstrptr(key), tcxstrsize(key));
+        if (tcxstrsize(key) == (int)_G.static_cleanup.len
+            && memcmp(tcxstrptr(key), _G.static_cleanup.str,
+                      _G.static_cleanup.len) == 0) {
+            continue;
+        }
+        ++*old_count;
+        if (!db->entry_check(tcxstrptr(value), (size_t)tcxstrsize(value),
+                             now, db->config)) {
+            continue;
+        }
+        ++*new_count;
+        lens[0] = tcxstrsize(key);
+        lens[1] = tcxstrsize(value);
+        buffer_add(batch, lens, sizeof(lens));
+        buffer_add(batch, tcxstrptr(key), lens[0]);
+        buffer_add(batch, tcxstrptr(value), lens[1]);
+    }
+    tcbdbcurdel(cur);
+    pthread_mutex_unlock(&res->lock);
+    tcxstrdel(key);
+    tcxstrdel(value);
+    return more;
+}
+
+/* Write the entries of @p batch (as built by db_cleanup_read() or by the
+ * journal) in @p tcdb.
+ */
+static void db_cleanup_write(TCBDB *tcdb, const buffer_t *batch)
+{
+    const char *p = batch->data;
+    const char *end = batch->data + batch->len;
+
+    while (p < end) {
+        uint32_t lens[2];
+
+        memcpy(lens, p, sizeof(lens));
+        p += sizeof(lens);
+        tcbdbput(tcdb, p, lens[0], p + lens[0], lens[1]);
+        p += lens[0] + lens[1];
+    }
+}
+
+/* Remove the expired entries of the database of @p res.
+ *
+ * The entries that did not expire are copied in a new database while the
+ * current one keeps serving the queries, the database is only locked while
+ * a batch of entries is read. The entries written during the copy are
+ * journaled and replayed in the new database before it replaces the current
+ * one. The current database is kept on error.
+ */
+static void db_resource_cleanup(const db_t *db, db_resource_t *res)
+{
+    uint32_t old_count = 0;
+    uint32_t new_count = 0;
+    buffer_t last  = ARRAY_INIT;
+    buffer_t batch = ARRAY_INIT;
+    char tmppath[PATH_MAX];
     time_t now = time(NULL);
+    TCBDB *tmp_db;
+    bool more;
 
-    db_resource_t *res = resource_get(db->ns, db->filename);
-    if (res == NULL) {
-        res = p_new(db_resource_t, 1);
-        resource_set(db->ns, db->filename, res,
-                     (resource_destructor_f)db_resource_wipe);
+    snprintf(tmppath, PATH_MAX, "%s.tmp", db->filename);
+    tmp_db = tcbdbnew();
+    if (!tcbdbopen(tmp_db, tmppath, BDBOWRITER | BDBOCREAT | BDBOTRUNC)) {
+        warn("cannot run database cleanup: "
+             "can't open destination database: %s",
+             tcbdberrmsg(tcbdbecode(tmp_db)));
+        tcbdbdel(tmp_db);
+        return;
     }
 
-    /* Open the database and check if cleanup is needed
+    pthread_mutex_lock(&res->lock);
+    res->journaling = true;
+    buffer_reset(&res->journal);
+    pthread_mutex_unlock(&res->lock);
+
+    do {
+        more = db_cleanup_read(db, res, &last, &batch, now, &old_count,
+                               &new_count);
+        db_cleanup_write(tmp_db, &batch);
+    } while (more);
+    tcbdbput(tmp_db, _G.static_cleanup.str, _G.static_cleanup.len,
+             &now, sizeof(now));
+
+    /* Swap the databases. The new database is kept open through its
+     * temporary path: the file is renamed under its feet.
      */
-    awl_db = res->db;
-    res->db = NULL;
-    if (awl_db == NULL) {
-        awl_db = tcbdbnew();
-        if (!tcbdbopen(awl_db, db->filename, BDBOWRITER | BDBOCREAT)) {
-            err("can not open database: %s", tcbdberrmsg(tcbdbecode(awl_db)));
-            tcbdbdel(awl_db);
-            resource_release(db->ns, db->filename);
-            return NULL;
-        }
+    pthread_mutex_lock(&res->lock);
+    db_cleanup_write(tmp_db, &res->journal);
+    res->journaling = false;
+    buffer_wipe(&res->journal);
+    if (!tcbdbsync(tmp_db)) {
+        err("%s cleanup: cannot write the new database: %s", db->filename,
+            tcbdberrmsg(tcbdbecode(tmp_db)));
+        tcbdbdel(tmp_db);
+        unlink(tmppath);
+    } else if (rename(tmppath, db->filename) != 0) {
+        UNIXERR("rename");
+        tcbdbdel(tmp_db);
+        unlink(tmppath);
+    } else {
+        tcbdbdel(res->db);
+        res->db = tmp_db;
+        tmp_db = NULL;
     }
-    if (!db->can_expire || !db_need_cleanup(db, awl_db)) {
-        notice("%s loaded: no cleanup needed", db->filename);
-        res->db = awl_db;
-        return &res->db;
+    pthread_mutex_unlock(&res->lock);
+
+    if (tmp_db == NULL) {
+        notice("%s cleanup: done in %us, before %u, after %u entries",
+               db->filename, (uint32_t)(time(0) - now), old_count,
+               new_count);
     } else {
-        tcbdbsync(awl_db);
-        tcbdbdel(awl_db);
+        warn("%s cleanup failed, keeping the current database",
+             db->filename);
     }
+    buffer_wipe(&last);
+    buffer_wipe(&batch);
+}
 
-    /* Rebuild a new database after removing too old entries.
+static bool db_resource_open(const db_t *db, db_resource_t *res)
+{
+    bool cleanup;
+
+    /* The database is shared with the previous configuration, it is only
+     * opened by the first configuration that uses it.
      */
-    if (db->can_expire) {
-        uint32_t old_count = 0;
-        uint32_t new_count = 0;
-        bool replace = false;
-        bool trashable = false;
-        char tmppath[PATH_MAX];
-        snprintf(tmppath, PATH_MAX, "%s.tmp", db->filename);
-
-        awl_db = tcbdbnew();
-        if (tcbdbopen(awl_db, db->filename, BDBOREADER)) {
-            tmp_db = tcbdbnew();
-            if (tcbdbopen(tmp_db, tmppath,
-                          BDBOWRITER | BDBOCREAT | BDBOTRUNC)) {
-                BDBCUR *cur = tcbdbcurnew(awl_db);
-                TCXSTR *key, *value;
-
-                key = tcxstrnew();
-                value = tcxstrnew();
-                if (tcbdbcurfirst(cur)) {
-                    replace = true;
-                    do {
-                        tcxstrclear(key);
-                        tcxstrclear(value);
-                        (void)tcbdbcurrec(cur, key, value);
-
-                        if (db->entry_check(tcxstrptr(value),
-                                            (size_t)tcxstrsize(value),
-                                            now, db->config)) {
-                            tcbdbput(tmp_db, tcxstrptr(key), tcxstrsize(key),
-                                     tcxstrptr(value), tcxstrsize(value));
-                            ++new_count;
-                        }
-                        ++old_count;
-                    } while (tcbdbcurnext(cur));
-                    tcbdbput(tmp_db, _G.static_cleanup.str,
-                             _G.static_cleanup.len, &now, sizeof(now));
-                }
-                tcxstrdel(key);
-                tcxstrdel(value);
-                tcbdbcurdel(cur);
-                tcbdbsync(tmp_db);
-            } else {
-                warn("cannot run database cleanup: "
-                     "can't open destination database: %s",
-                     tcbdberrmsg(tcbdbecode(awl_db)));
-            }
-            tcbdbdel(tmp_db);
-        } else {
+    if (res->db == NULL) {
+        TCBDB *awl_db = tcbdbnew();
+
+        if (!tcbdbopen(awl_db, db->filename, BDBOWRITER | BDBOCREAT)) {
             int ecode = tcbdbecode(awl_db);
-            warn("can not open database: %s", tcbdberrmsg(ecode));
-            trashable = (ecode != TCENOPERM && ecode != TCEOPEN
-                         && ecode != TCENOFILE && ecode != TCESUCCESS);
-        }
-        tcbdbdel(awl_db);
+            bool trashable = (ecode != TCENOPERM && ecode != TCEOPEN
+                              && ecode != TCENOFILE && ecode != TCESUCCESS);
 
-        /** Cleanup successful, replace the old database with the new one.
-         */
-        if (trashable) {
-            notice("%s cleanup: database was corrupted, create a new one",
+            warn("can not open database: %s", tcbdberrmsg(ecode));
+            tcbdbdel(awl_db);
+            if (!trashable) {
+                return false;
+            }
+            notice("%s: database was corrupted, create a new one",
                    db->filename);
             unlink(db->filename);
-        } else if (replace) {
-            notice("%s cleanup: done in %us, before %u, after %u entries",
-                   db->filename, (uint32_t)(time(0) - now), old_count,
-                   new_count);
-            unlink(db->filename);
-            if (rename(tmppath, db->filename) != 0) {
-                UNIXERR("rename");
-                resource_release(db->ns, db->filename);
-                return NULL;
+            awl_db = tcbdbnew();
+            if (!tcbdbopen(awl_db, db->filename, BDBOWRITER | BDBOCREAT)) {
+                err("can not open database: %s",
+                    tcbdberrmsg(tcbdbecode(awl_db)));
+                tcbdbdel(awl_db);
+                return false;
             }
-        } else {
-            unlink(tmppath);
-            notice("%s cleanup: done in %us, nothing to do, %u entries",
-                   db->filename, (uint32_t)(time(0) - now), old_count);
         }
+        pthread_mutex_lock(&res->lock);
+        res->db = awl_db;
+        pthread_mutex_unlock(&res->lock);
+    }
+
+    pthread_mutex_lock(&res->lock);
+    cleanup = db->can_expire && db_need_cleanup(db, res->db);
+    pthread_mutex_unlock(&res->lock);
+    if (!cleanup) {
+        notice("%s loaded: no cleanup needed", db->filename);
+        return true;
+    }
+    db_resource_cleanup(db, res);
+    notice("%s loaded", db->filename);
+    return true;
+}
+
+static db_resource_t *db_resource_acquire(const db_t *db)
+{
+    bool ok;
+
+    pthread_mutex_lock(&_G.resources_lock);
+    db_resource_t *res = resource_get(db->ns, db->filename);
+    if (res == NULL) {
+        res = p_new(db_resource_t, 1);
+        pthread_mutex_init(&res->lock, NULL);
+        pthread_mutex_init(&res->open_lock, NULL);
+        resource_set(db->ns, db->filename, res,
+                     (resource_destructor_f)db_resource_wipe);
     }
+    pthread_mutex_unlock(&_G.resources_lock);
 
-    /* Effectively open the database.
+    /* The queries of the previous configuration keep using the database
+     * while it is opened and cleaned up: they only take res->lock.
      */
-    res->db = NULL;
-    awl_db = tcbdbnew();
-    if (!tcbdbopen(awl_db, db->filename, BDBOWRITER | BDBOCREAT)) {
-        err("can not open database: %s", tcbdberrmsg(tcbdbecode(awl_db)));
-        tcbdbdel(awl_db);
-        resource_release(db->ns, db->filename);
+    pthread_mutex_lock(&res->open_lock);
+    ok = db_resource_open(db, res);
+    pthread_mutex_unlock(&res->open_lock);
+    if (!ok) {
+        resource_release(db->ns, db->filename, res);
         return NULL;
     }
-
-    notice("%s loaded", db->filename);
-    res->db = awl_db;
-    return &res->db;
+    return res;
 }
 
 db_t *db_load(const char* ns, const char* path, bool can_expire,
@@ -228,8 +384,8 @@ db_t *db_load(const char* ns, const char* path, bool can_expire,
     db->config = config;
     db->ns = m_strdup(ns);
     db->filename = m_strdup(path);
-    db->db = db_resource_acquire(db);
-    if (db->db == NULL) {
+    db->res = db_resource_acquire(db);
+    if (db->res == NULL) {
         db_delete(&db);
     }
     return db;
@@ -237,38 +393,215 @@ db_t *db_load(const char* ns, const char* path, bool can_expire,
 
 bool db_release(db_t *db)
 {
-    resource_release(db->ns, db->filename);
+    resource_release(db->ns, db->filename, db->res);
     db_delete(&db);
     return true;
 }
 
-const void* db_get(const db_t *db, const void* key, size_t key_len,
-                   size_t *entry_len)
+static const void* db_local_get(const db_t *db, const void* key,
+                                size_t key_len, size_t *entry_len)
 {
     int len = 0;
-    const void* data = tcbdbget3(*db->db, key, key_len, &len);
+    const void* data;
+
+    /* The pointer returned by tokyocabinet is only valid until the next
+     * access to the database, that may happen in another worker: copy it.
+     */
+    pthread_mutex_lock(&db->res->lock);
+    data = db->res->db ? tcbdbget3(db->res->db, key, key_len, &len) : NULL;
+    if (data != NULL) {
+        buffer_reset(&db_entry_g);
+        buffer_add(&db_entry_g, data, len);
+        data = db_entry_g.data;
+    }
+    pthread_mutex_unlock(&db->res->lock);
     *entry_len = len;
     return data;
 }
 
+static bool db_local_put(const db_t *db, const void* key, size_t key_len,
+                         const void* entry, size_t entry_len)
+{
+    bool ok = false;
+
+    pthread_mutex_lock(&db->res->lock);
+    if (db->res->db != NULL) {
+        ok = tcbdbput(db->res->db, key, key_len, entry, entry_len);
+    }
+    if (ok && db->res->journaling) {
+        uint32_t lens[2] = { key_len, entry_len };
+
+        buffer_add(&db->res->journal, lens, sizeof(lens));
+        buffer_add(&db->res->journal, key, key_len);
+        buffer_add(&db->res->journal, entry, entry_len);
+    }
+    pthread_mutex_unlock(&db->res->lock);
+    return ok;
+}
+
+/* In prefork mode, the databases are owned by the master process: the worker
+ * processes forward their accesses to the master and do not wait for the
+ * answers (see db_get_async()). The db_t pointers are the same in the
+ * master and in the workers since the workers are forked after the
+ * configuration is built. A reload forks new workers while the previous
+ * ones finish their queries (for up to WORKER_DRAIN_TIMEOUT): the master
+ * keeps the configuration they were forked with, and thus its databases,
+ * until they all exited and it flushed their requests (see config_retire()
+ * and worker_restart()).
+ */
+typedef enum db_op_t {
+    DB_OP_GET,
+    DB_OP_PUT,
+} db_op_t;
+
+typedef struct db_request_t {
+    db_op_t op;
+    const db_t *db;
+    uint32_t key_len;
+    uint32_t entry_len;
+    char data[];
+} db_request_t;
+
+/* A get sent to the master.
+ */
+typedef struct db_call_t {
+    db_get_f cb;
+    void *data;
+} db_call_t;
+
+/* The answer is a status byte followed by the entry.
+ */
+static void db_remote_answer(void *data, const void *answer, ssize_t len)
+{
+    db_call_t *call = data;
+    const char *status = answer;
+
+    if (status == NULL || len <= 0 || status[0] == 0) {
+        (*call->cb)(call->data, NULL, 0);
+    } else {
+        (*call->cb)(call->data, status + 1, len - 1);
+    }
+    p_delete(&call);
+}
+
+static uint32_t db_remote(db_op_t op, const db_t *db, const void* key,
+                          size_t key_len, const void* entry, size_t entry_len,
+                          db_call_t *call)
+{
+    const db_request_t req = {
+        .op        = op,
+        .db        = db,
+        .key_len   = key_len,
+        .entry_len = entry_len,
+    };
+
+    buffer_reset(&db_request_g);
+    buffer_add(&db_request_g, &req, sizeof(req));
+    buffer_add(&db_request_g, key, key_len);
+    buffer_add(&db_request_g, entry, entry_len);
+    return worker_master_call(db_request_g.data, db_request_g.len,
+                              call ? db_remote_answer : NULL, call);
+}
+
+static void db_master_handler(const void *request, ssize_t len,
+                              buffer_t *answer)
+{
+    const db_request_t *req = request;
+    const void *data = NULL;
+    size_t entry_len = 0;
+
+    if (len < ssizeof(*req)
+        || len != ssizeof(*req) + req->key_len + req->entry_len) {
+        err("invalid database request from worker");
+        buffer_addch(answer, 0);
+        return;
+    }
+    switch (req->op) {
+      case DB_OP_GET:
+        data = db_local_get(req->db, req->data, req->key_len, &entry_len);
+        break;
+
+      case DB_OP_PUT:
+        if (db_local_put(req->db, req->data, req->key_len,
+                         req->data + req->key_len, req->entry_len)) {
+            data = req->data;
+        }
+        break;
+    }
+    buffer_addch(answer, data != NULL);
+    if (data != NULL) {
+        buffer_add(answer, data, entry_len);
+    }
+}
+
+uint32_t db_get_async(const db_t *db, const void* key, size_t key_len,
+                      db_get_f cb, void *data)
+{
+    const void *entry;
+    size_t entry_len = 0;
+
+    if (worker_is_child()) {
+        db_call_t *call = p_new(db_call_t, 1);
+        uint32_t request;
+
+        call->cb   = cb;
+        call->data = data;
+        request = db_remote(DB_OP_GET, db, key, key_len, NULL, 0, call);
+        if (request != 0) {
+            return request;
+        }
+        p_delete(&call);
+        (*cb)(data, NULL, 0);
+        return 0;
+    }
+    entry = db_local_get(db, key, key_len, &entry_len);
+    (*cb)(data, entry, entry_len);
+    return 0;
+}
+
+void db_get_cancel(uint32_t request)
+{
+    db_call_t *call = worker_master_forget(request);
+
+    p_delete(&call);
+}
+
+const void* db_get(const db_t *db, const void* key, size_t key_len,
+                   size_t *entry_len)
+{
+    assert (!worker_is_child());
+    return db_local_get(db, key, key_len, entry_len);
+}
+
 bool db_get_len(const db_t *db, const void* key, size_t key_len,
                 void* entry, size_t entry_len)
 {
     int len = 0;
-    const void* data = tcbdbget3(*db->db, key, key_len, &len);
-    if (len != (int)entry_len || data == NULL) {
-        return false;
-    } else {
+    bool found = false;
+
+    assert (!worker_is_child());
+    pthread_mutex_lock(&db->res->lock);
+    const void* data = db->res->db == NULL ? NULL
+                     : tcbdbget3(db->res->db, key, key_len, &len);
+    if (len == (int)entry_len && data != NULL) {
         memcpy(entry, data, entry_len);
-        return true;
+        found = true;
     }
+    pthread_mutex_unlock(&db->res->lock);
+    return found;
 }
 
 bool db_put(const db_t *db, const void* key, size_t key_len,
             const void* entry, size_t entry_len)
 {
-    tcbdbput(*db->db, key, key_len, entry, entry_len);
-    return true;
+    /* The master processes the requests in order: the put is seen by the
+     * following gets of the worker, there is no need to wait for it.
+     */
+    if (worker_is_child()) {
+        return db_remote(DB_OP_PUT, db, key, key_len, entry, entry_len,
+                         NULL) != 0;
+    }
+    return db_local_put(db, key, key_len, entry, entry_len);
 }
 
 /* vim:set et sw=4 sts=4 sws=4: */
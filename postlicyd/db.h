@@ -40,6 +40,7 @@ typedef struct db_t db_t;
 typedef bool (*db_entry_checker_f)(const void* entry, size_t entry_len,
                                    time_t now, void* config);
 typedef bool (*db_checker_f)(time_t last_cleanup, time_t now, void* config);
+typedef void (*db_get_f)(void *data, const void* entry, size_t entry_len);
 
 /** Load the database at the given path.
  * @param ns The resource namespace.
@@ -64,6 +65,9 @@ bool db_release(db_t *db);
  * The pointer returned by this function is owned by the database handler,
  * you must not free it. If the key cannot be found in the databse, this
  * functions returns NULL.
+ *
+ * This cannot be called from a worker process in prefork mode, use
+ * db_get_async() instead.
  */
 const void* db_get(const db_t *db, const void* key, size_t key_len,
                    size_t *entry_len);
@@ -73,11 +77,33 @@ const void* db_get(const db_t *db, const void* key, size_t key_len,
  * The data is copied in the @p entry buffer. If the key is not found in the
  * database or if the entry does not have the length @p entry_len, this
  * function returrns false.
+ *
+ * This cannot be called from a worker process in prefork mode, use
+ * db_get_async() instead.
  */
 bool db_get_len(const db_t *db, const void* key, size_t key_len,
                 void* entry, size_t entry_len);
 
+/** Get an entry without blocking the worker.
+ *
+ * In a worker process in prefork mode, the entry is requested from the
+ * master and @p cb is called from the event loop once it answered, with a
+ * NULL entry if the key is not found or if the master does not answer in
+ * time. Otherwise, @p cb is called before this function returns.
+ *
+ * The entry given to @p cb is only valid during the call. Returns the
+ * identifier of the pending request, 0 if @p cb was already called.
+ */
+uint32_t db_get_async(const db_t *db, const void* key, size_t key_len,
+                      db_get_f cb, void *data);
+
+/** Forget a pending request of db_get_async(): its callback is not called.
+ */
+void db_get_cancel(uint32_t request);
+
 /** Add or replace the value associated to the given key in the database.
+ * In a worker process in prefork mode, the entry is sent to the master
+ * without waiting for it to be written.
  */
 bool db_put(const db_t *db, const void* key, size_t key_len,
             const void* entry, size_t entry_len);
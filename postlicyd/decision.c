@@ -0,0 +1,358 @@
+/****************************************************************************/
+/*          pfixtools: a collection of postfix related tools                */
+/*          ~~~~~~~~~                                                       */
+/*  ______________________________________________________________________  */
+/*                                                                          */
+/*  Redistribution and use in source and binary forms, with or without      */
+/*  modification, are permitted provided that the following conditions      */
+/*  are met:                                                                */
+/*                                                                          */
+/*  1. Redistributions of source code must retain the above copyright       */
+/*     notice, this list of conditions and the following disclaimer.        */
+/*  2. Redistributions in binary form must reproduce the above copyright    */
+/*     notice, this list of conditions and the following disclaimer in      */
+/*     the documentation and/or other materials provided with the           */
+/*     distribution.                                                        */
+/*  3. The names of its contributors may not be used to endorse or promote  */
+/*     products derived from this software without specific prior written   */
+/*     permission.                                                          */
+/*                                                                          */
+/*  THIS SOFTWARE IS PROVIDED BY THE CONTRIBUTORS ``AS IS'' AND ANY         */
+/*  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       */
+/*  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR      */
+/*  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE CONTRIBUTORS BE LIABLE   */
+/*  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR            */
+/*  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF    */
+/*  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR         */
+/*  BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,   */
+/*  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE    */
+/*  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,       */
+/*  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                      */
+/*                                                                          */
+/*   Copyright (c) 2006-2014 the Authors                                    */
+/*   see AUTHORS and source files for details                               */
+/****************************************************************************/
+
+#include <netdb.h>
+#include "worker.h"
+#include "decision.h"
+
+/* The decision taken for a query only depends on the values of the fields
+ * read by the filters that took it. An entry is keyed by the protocol state,
+ * that set of fields and their values. Since the set of fields is only known
+ * once the filters ran, the sets seen recently for each protocol state are
+ * kept and a lookup tries each of them.
+ *
+ * Entries are chained in their bucket of the hash table and in the LRU list
+ * (most recently used first).
+ */
+#define DECISION_MASKS  8
+
+typedef struct decision_entry_t decision_entry_t;
+struct decision_entry_t {
+    decision_entry_t *next;
+    decision_entry_t *lru_prev;
+    decision_entry_t *lru_next;
+    ev_tstamp expire;
+    uint64_t fields;
+    uint32_t hash;
+    uint32_t size;
+    unsigned state;
+    int key_len;
+    decision_t decision;
+    char data[];
+};
+
+static struct {
+    size_t size;
+    int ttl;
+    uint64_t hits;
+    uint64_t misses;
+} decision_g;
+
+/* Each worker has its own cache.
+ */
+static __thread struct {
+    unsigned generation;
+    uint64_t masks[SMTP_count][DECISION_MASKS];
+    int mask_count[SMTP_count];
+
+    decision_entry_t **buckets;
+    uint32_t bucket_count;
+    uint32_t entries;
+    size_t   memory;
+    decision_entry_t *lru_first;
+    decision_entry_t *lru_last;
+} decision_thread_g;
+#define _G  decision_g
+#define _T  decision_thread_g
+
+
+static uint32_t decision_hash(unsigned state, uint64_t fields,
+                              const char *key, int key_len)
+{
+    uint32_t hash = 2166136261U ^ state;
+
+    hash = (hash ^ (uint32_t)fields) * 16777619U;
+    hash = (hash ^ (uint32_t)(fields >> 32)) * 16777619U;
+    for (int i = 0 ; i < key_len ; ++i) {
+        hash = (hash ^ (uint8_t)key[i]) * 16777619U;
+    }
+    return hash;
+}
+
+static void decision_lru_unlink(decision_entry_t *entry)
+{
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        _T.lru_first = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        _T.lru_last = entry->lru_prev;
+    }
+}
+
+static void decision_lru_push(decision_entry_t *entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = _T.lru_first;
+    if (_T.lru_first) {
+        _T.lru_first->lru_prev = entry;
+    } else {
+        _T.lru_last = entry;
+    }
+    _T.lru_first = entry;
+}
+
+static void decision_remove(decision_entry_t *entry)
+{
+    decision_entry_t **pos = &_T.buckets[entry->hash & (_T.bucket_count - 1)];
+
+    while (*pos != entry) {
+        pos = &(*pos)->next;
+    }
+    *pos = entry->next;
+    decision_lru_unlink(entry);
+    _T.memory -= entry->size;
+    --_T.entries;
+    p_delete(&entry);
+}
+
+static void decision_grow(void)
+{
+    const uint32_t count = _T.bucket_count ? 2 * _T.bucket_count : 256;
+    decision_entry_t **buckets = p_new(decision_entry_t *, count);
+
+    for (uint32_t i = 0 ; i < _T.bucket_count ; ++i) {
+        decision_entry_t *entry = _T.buckets[i];
+
+        while (entry) {
+            decision_entry_t *next = entry->next;
+
+            entry->next = buckets[entry->hash & (count - 1)];
+            buckets[entry->hash & (count - 1)] = entry;
+            entry = next;
+        }
+    }
+    _T.memory += (count - _T.bucket_count) * sizeof(decision_entry_t *);
+    p_delete(&_T.buckets);
+    _T.buckets      = buckets;
+    _T.bucket_count = count;
+}
+
+static void decision_wipe(void)
+{
+    while (_T.lru_last != NULL) {
+        decision_remove(_T.lru_last);
+    }
+    p_delete(&_T.buckets);
+    _T.bucket_count = 0;
+    _T.memory       = 0;
+    p_clear(&_T.mask_count, 1);
+}
+
+/* The entries of a previous configuration are useless.
+ */
+static void decision_check_generation(unsigned generation)
+{
+    if (_T.generation != generation) {
+        decision_wipe();
+        _T.generation = generation;
+    }
+}
+
+static decision_entry_t *decision_find(unsigned state, uint64_t fields,
+                                       const char *key, int key_len)
+{
+    const uint32_t hash = decision_hash(state, fields, key, key_len);
+    decision_entry_t *entry;
+
+    if (_T.bucket_count == 0) {
+        return NULL;
+    }
+    entry = _T.buckets[hash & (_T.bucket_count - 1)];
+    for (; entry != NULL ; entry = entry->next) {
+        if (entry->hash == hash && entry->state == state
+            && entry->fields == fields && entry->key_len == key_len
+            && memcmp(entry->data, key, key_len) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+void decision_cache_set(size_t size, int ttl)
+{
+    _G.size = size;
+    _G.ttl  = ttl;
+}
+
+bool decision_cache_enabled(void)
+{
+    return _G.size > 0 && _G.ttl > 0;
+}
+
+const decision_t *decision_cache_get(unsigned generation,
+                                     const query_t *query)
+{
+    const ev_tstamp now = ev_now(worker_ev_loop());
+    char key[BUFSIZ];
+
+    decision_check_generation(generation);
+    for (int i = 0 ; i < _T.mask_count[query->state] ; ++i) {
+        const uint64_t fields = _T.masks[query->state][i];
+        const int key_len = query_fields_key(key, BUFSIZ, query, fields);
+        decision_entry_t *entry;
+
+        if (key_len < 0) {
+            continue;
+        }
+        entry = decision_find(query->state, fields, key, key_len);
+        if (entry == NULL) {
+            continue;
+        }
+        if (entry->expire <= now) {
+            decision_remove(entry);
+            continue;
+        }
+        __sync_add_and_fetch(&_G.hits, 1);
+        decision_lru_unlink(entry);
+        decision_lru_push(entry);
+        return &entry->decision;
+    }
+    __sync_add_and_fetch(&_G.misses, 1);
+    return NULL;
+}
+
+/* Remember the set of fields, the most recent first.
+ */
+static void decision_add_mask(unsigned state, uint64_t fields)
+{
+    uint64_t *masks = _T.masks[state];
+    int pos = 0;
+
+    while (pos < _T.mask_count[state] && masks[pos] != fields) {
+        ++pos;
+    }
+    if (pos == _T.mask_count[state]) {
+        if (pos < DECISION_MASKS) {
+            ++_T.mask_count[state];
+        } else {
+            --pos;
+        }
+    }
+    memmove(masks + 1, masks, pos * sizeof(uint64_t));
+    masks[0] = fields;
+}
+
+void decision_cache_put(unsigned generation, const query_t *query,
+                        uint64_t fields, const char *filter,
+                        const char *answer, const clstr_t *explanation)
+{
+    const int filter_len = strlen(filter) + 1;
+    const int answer_len = strlen(answer) + 1;
+    const int exp_len    = explanation != NULL ? explanation->len : 0;
+    char key[BUFSIZ];
+    decision_entry_t *entry;
+    int key_len;
+    char *p;
+
+    if (!decision_cache_enabled() || query->state >= SMTP_count) {
+        return;
+    }
+    key_len = query_fields_key(key, BUFSIZ, query, fields);
+    if (key_len < 0) {
+        return;
+    }
+    decision_check_generation(generation);
+    decision_add_mask(query->state, fields);
+    entry = decision_find(query->state, fields, key, key_len);
+    if (entry != NULL) {
+        decision_remove(entry);
+    }
+    if (_T.entries >= _T.bucket_count) {
+        decision_grow();
+    }
+
+    entry = xmalloc(sizeof(decision_entry_t) + key_len + filter_len
+                    + answer_len + exp_len + 1);
+    entry->size    = sizeof(decision_entry_t) + key_len + filter_len
+                   + answer_len + exp_len + 1;
+    entry->hash    = decision_hash(query->state, fields, key, key_len);
+    entry->state   = query->state;
+    entry->fields  = fields;
+    entry->key_len = key_len;
+    entry->expire  = ev_now(worker_ev_loop()) + _G.ttl;
+    p = entry->data;
+    memcpy(p, key, key_len);
+    p += key_len;
+    entry->decision.filter = memcpy(p, filter, filter_len);
+    p += filter_len;
+    entry->decision.answer = memcpy(p, answer, answer_len);
+    p += answer_len;
+    if (exp_len > 0) {
+        memcpy(p, explanation->str, exp_len);
+    }
+    p[exp_len] = '\0';
+    entry->decision.explanation.str = exp_len > 0 ? p : NULL;
+    entry->decision.explanation.len = exp_len;
+
+    entry->next = _T.buckets[entry->hash & (_T.bucket_count - 1)];
+    _T.buckets[entry->hash & (_T.bucket_count - 1)] = entry;
+    decision_lru_push(entry);
+    _T.memory += entry->size;
+    ++_T.entries;
+
+    while (_T.memory > _G.size && _T.lru_last != NULL) {
+        decision_remove(_T.lru_last);
+    }
+}
+
+static void decision_stats(A(worker_stat_t) *stats)
+{
+    worker_stat_add(stats, "decision cache", "hits", _G.hits, false);
+    worker_stat_add(stats, "decision cache", "misses", _G.misses, false);
+}
+
+static int decision_init(void)
+{
+    worker_atexit(decision_wipe);
+    worker_stats_register(decision_stats);
+    return 0;
+}
+module_init(decision_init);
+
+static void decision_exit(void)
+{
+    if (_G.hits + _G.misses > 0) {
+        notice("decision cache: %llu hits, %llu misses",
+               (unsigned long long)_G.hits, (unsigned long long)_G.misses);
+    }
+    decision_wipe();
+}
+module_exit(decision_exit);
+
+/* vim:set et sw=4 sts=4 sws=4: */
@@ -0,0 +1,76 @@
+/****************************************************************************/
+/*          pfixtools: a collection of postfix related tools                */
+/*          ~~~~~~~~~                                                       */
+/*  ______________________________________________________________________  */
+/*                                                                          */
+/*  Redistribution and use in source and binary forms, with or without      */
+/*  modification, are permitted provided that the following conditions      */
+/*  are met:                                                                */
+/*                                                                          */
+/*  1. Redistributions of source code must retain the above copyright       */
+/*     notice, this list of conditions and the following disclaimer.        */
+/*  2. Redistributions in binary form must reproduce the above copyright    */
+/*     notice, this list of conditions and the following disclaimer in      */
+/*     the documentation and/or other materials provided with the           */
+/*     distribution.                                                        */
+/*  3. The names of its contributors may not be used to endorse or promote  */
+/*     products derived from this software without specific prior written   */
+/*     permission.                                                          */
+/*                                                                          */
+/*  THIS SOFTWARE IS PROVIDED BY THE CONTRIBUTORS ``AS IS'' AND ANY         */
+/*  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       */
+/*  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR      */
+/*  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE CONTRIBUTORS BE LIABLE   */
+/*  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR            */
+/*  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF    */
+/*  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR         */
+/*  BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,   */
+/*  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE    */
+/*  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,       */
+/*  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                      */
+/*                                                                          */
+/*   Copyright (c) 2006-2014 the Authors                                    */
+/*   see AUTHORS and source files for details                               */
+/****************************************************************************/
+
+#ifndef PFIXTOOLS_DECISION_H
+#define PFIXTOOLS_DECISION_H
+
+#include "common.h"
+#include "query.h"
+
+/** Answer given to a query, before formatting.
+ */
+typedef struct decision_t {
+    const char *filter;
+    const char *answer;
+    clstr_t explanation;
+} decision_t;
+
+/** Configure the cache of decisions of each worker: maximum memory in bytes
+ * and lifetime of the entries in seconds. A @p ttl of 0 disables the cache.
+ */
+void decision_cache_set(size_t size, int ttl);
+
+bool decision_cache_enabled(void);
+
+/** Look for the decision taken for a query that had the same values as
+ * @p query for all the fields read to take it, in the same protocol state
+ * and with the same configuration @p generation. The returned decision is
+ * valid until the next call to decision_cache_put() in the same worker.
+ */
+__attribute__((nonnull))
+const decision_t *decision_cache_get(unsigned generation,
+                                     const query_t *query);
+
+/** Record the decision taken for @p query. @p fields is the set of the
+ * fields of the query read by the filters that took the decision.
+ */
+__attribute__((nonnull(2,4,5)))
+void decision_cache_put(unsigned generation, const query_t *query,
+                        uint64_t fields, const char *filter,
+                        const char *answer, const clstr_t *explanation);
+
+#endif
+
+/* vim:set et sw=4 sts=4 sws=4: */
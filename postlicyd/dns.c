@@ -34,32 +34,140 @@
 /****************************************************************************/
 
 #include <netdb.h>
+#include <pthread.h>
+#include <arpa/inet.h>
 #include "array.h"
-#include "server.h"
+#include "worker.h"
 #include "dns.h"
 
 
-typedef struct dns_context_t {
-    dns_result_t *result;
+typedef struct dns_context_t dns_context_t;
+struct dns_context_t {
+    dns_answer_t *answer;
     dns_result_callback_f call;
     void *data;
-} dns_context_t;
+    dns_context_t *next;
+};
 ARRAY(dns_context_t);
 DO_ALL(dns_context_t, dns_context)
 
+/* Health of a DNS list, shared by all the workers.
+ * The latency histogram counts the answers by power of two of milliseconds,
+ * it is halved regularly so that it reflects the recent answers. A zone that
+ * keeps failing is opened: its checks fail immediately until the cool-down
+ * expires, then a single query is let through to probe the zone.
+ */
+#define DNS_LATENCY_BUCKETS   16
+#define DNS_LATENCY_SAMPLES   1024
+#define DNS_MIN_DEADLINE      0.25
+#define DNS_BREAKER_FAILURES  5
+#define DNS_BREAKER_COOLDOWN  30
+
+struct dns_health_t {
+    char *name;
+    pthread_mutex_t lock;
+
+    uint32_t histogram[DNS_LATENCY_BUCKETS];
+    uint32_t samples;
+    uint64_t queries;
+    uint64_t errors;
+    uint64_t timeouts;
+    uint64_t rejected;
+
+    int failures;
+    bool open;
+    bool probing;
+    ev_tstamp open_until;
+};
+typedef struct dns_health_t dns_health_t;
+ARRAY(dns_health_t);
+
+/* Query running in unbound. The checks of the same name and type issued
+ * while the query is in flight wait for its answer instead of issuing a new
+ * query. The queries are also chained in the list of the running queries,
+ * that is used to cancel the checks of a caller.
+ *
+ * The queries of a DNS list have a deadline: when it expires, the waiters
+ * get an error and the query stays in the running list until unbound gives
+ * its answer.
+ */
+typedef struct dns_query_t dns_query_t;
+struct dns_query_t {
+    dns_query_t *next;
+    dns_query_t *running_prev;
+    dns_query_t *running_next;
+    dns_context_t *waiters;
+    dns_health_t *health;
+    ev_timer deadline;
+    ev_tstamp start;
+    bool timed_out;
+    uint32_t hash;
+    uint16_t type;
+    char qname[];
+};
+
+#define DNS_QUERY_BUCKETS  1024
+
+/* Cached answer of dns_check(). Entries are chained in their bucket of the
+ * hash table and in the LRU list (most recently used first).
+ */
+typedef struct dns_cache_entry_t dns_cache_entry_t;
+struct dns_cache_entry_t {
+    dns_cache_entry_t *next;
+    dns_cache_entry_t *lru_prev;
+    dns_cache_entry_t *lru_next;
+    ev_tstamp expire;
+    uint32_t hash;
+    uint16_t type;
+    dns_answer_t answer;
+    char qname[];
+};
+
+#define DNS_CACHE_DEFAULT_SIZE  (1 << 20)
+
 static struct {
     char *use_local_config;
+    size_t cache_size;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t coalesced;
+    uint64_t prefetched;
+
+    ev_tstamp timeout;
+    pthread_mutex_t healths_lock;
+    PA(dns_health_t) healths;
+} dns_g = {
+    .cache_size   = DNS_CACHE_DEFAULT_SIZE,
+    .timeout      = 5,
+    .healths_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* The resolver is not thread-safe: each worker gets its own context and its
+ * own cache.
+ */
+static __thread struct {
     struct ub_ctx *ctx;
-    client_t *async_event;
+    ev_io async_event;
     PA(dns_context_t) ctx_pool;
-} dns_g;
+
+    dns_cache_entry_t **buckets;
+    uint32_t bucket_count;
+    uint32_t entries;
+    size_t   memory;
+    dns_cache_entry_t *lru_first;
+    dns_cache_entry_t *lru_last;
+
+    dns_query_t **queries;
+    dns_query_t *running;
+} dns_thread_g;
 #define _G  dns_g
+#define _T  dns_thread_g
 
 
 static dns_context_t *dns_context_acquire(void)
 {
-    if (array_len(_G.ctx_pool) > 0) {
-        return array_pop_last(_G.ctx_pool);
+    if (array_len(_T.ctx_pool) > 0) {
+        return array_pop_last(_T.ctx_pool);
     } else {
         return dns_context_new();
     }
@@ -68,130 +176,908 @@ static dns_context_t *dns_context_acquire(void)
 static void dns_context_release(dns_context_t *context)
 {
     dns_context_wipe(context);
-    array_add(_G.ctx_pool, context);
+    array_add(_T.ctx_pool, context);
 }
 
-static void dns_exit(void)
+/* Cache {{{1
+ */
+
+static uint32_t dns_cache_hash(const char *qname, dns_rrtype_t type)
+{
+    uint32_t hash = 2166136261U ^ type;
+
+    for (; *qname ; ++qname) {
+        hash = (hash ^ (uint8_t)tolower((unsigned char)*qname)) * 16777619U;
+    }
+    return hash;
+}
+
+static inline size_t dns_cache_entry_size(const dns_cache_entry_t *entry)
+{
+    return sizeof(dns_cache_entry_t) + strlen(entry->qname) + 1;
+}
+
+static void dns_cache_lru_unlink(dns_cache_entry_t *entry)
+{
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        _T.lru_first = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        _T.lru_last = entry->lru_prev;
+    }
+}
+
+static void dns_cache_lru_push(dns_cache_entry_t *entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = _T.lru_first;
+    if (_T.lru_first) {
+        _T.lru_first->lru_prev = entry;
+    } else {
+        _T.lru_last = entry;
+    }
+    _T.lru_first = entry;
+}
+
+static void dns_cache_remove(dns_cache_entry_t *entry)
+{
+    dns_cache_entry_t **pos = &_T.buckets[entry->hash & (_T.bucket_count - 1)];
+
+    while (*pos != entry) {
+        pos = &(*pos)->next;
+    }
+    *pos = entry->next;
+    dns_cache_lru_unlink(entry);
+    _T.memory -= dns_cache_entry_size(entry);
+    --_T.entries;
+    p_delete(&entry);
+}
+
+static void dns_cache_grow(void)
+{
+    const uint32_t count = _T.bucket_count ? 2 * _T.bucket_count : 256;
+    dns_cache_entry_t **buckets = p_new(dns_cache_entry_t *, count);
+
+    for (uint32_t i = 0 ; i < _T.bucket_count ; ++i) {
+        dns_cache_entry_t *entry = _T.buckets[i];
+
+        while (entry) {
+            dns_cache_entry_t *next = entry->next;
+
+            entry->next = buckets[entry->hash & (count - 1)];
+            buckets[entry->hash & (count - 1)] = entry;
+            entry = next;
+        }
+    }
+    _T.memory += (count - _T.bucket_count) * sizeof(dns_cache_entry_t *);
+    p_delete(&_T.buckets);
+    _T.buckets      = buckets;
+    _T.bucket_count = count;
+}
+
+static dns_cache_entry_t *dns_cache_find(const char *qname,
+                                         dns_rrtype_t type, uint32_t hash)
+{
+    dns_cache_entry_t *entry;
+
+    if (_T.bucket_count == 0) {
+        return NULL;
+    }
+    entry = _T.buckets[hash & (_T.bucket_count - 1)];
+    for (; entry != NULL ; entry = entry->next) {
+        if (entry->hash == hash && entry->type == type
+            && strcasecmp(entry->qname, qname) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/* Look for a valid cached answer.
+ */
+static bool dns_cache_get(const char *qname, dns_rrtype_t type,
+                          dns_answer_t *answer)
+{
+    dns_cache_entry_t *entry;
+
+    if (_G.cache_size == 0) {
+        return false;
+    }
+    entry = dns_cache_find(qname, type, dns_cache_hash(qname, type));
+    if (entry != NULL && entry->expire <= ev_now(worker_ev_loop())) {
+        dns_cache_remove(entry);
+        entry = NULL;
+    }
+    if (entry == NULL) {
+        __sync_add_and_fetch(&_G.cache_misses, 1);
+        return false;
+    }
+    __sync_add_and_fetch(&_G.cache_hits, 1);
+    dns_cache_lru_unlink(entry);
+    dns_cache_lru_push(entry);
+    *answer = entry->answer;
+    return true;
+}
+
+static void dns_cache_put(const char *qname, dns_rrtype_t type,
+                          const dns_answer_t *answer, int ttl)
 {
-    if (_G.async_event != NULL) {
-        client_io_none(_G.async_event);
+    const uint32_t hash = dns_cache_hash(qname, type);
+    dns_cache_entry_t *entry;
+    size_t len;
+
+    if (_G.cache_size == 0 || ttl <= 0) {
+        return;
+    }
+    entry = dns_cache_find(qname, type, hash);
+    if (entry != NULL) {
+        dns_cache_remove(entry);
     }
-    if (_G.ctx != NULL) {
-        ub_ctx_delete(_G.ctx);
-        _G.ctx = NULL;
+    if (_T.entries >= _T.bucket_count) {
+        dns_cache_grow();
     }
-    if (_G.async_event != NULL) {
-        client_release(_G.async_event);
-        _G.async_event = NULL;
+
+    len   = strlen(qname);
+    entry = xmalloc(sizeof(dns_cache_entry_t) + len + 1);
+    memcpy(entry->qname, qname, len + 1);
+    entry->hash   = hash;
+    entry->type   = type;
+    entry->answer = *answer;
+    entry->expire = ev_now(worker_ev_loop()) + ttl;
+    entry->next   = _T.buckets[hash & (_T.bucket_count - 1)];
+    _T.buckets[hash & (_T.bucket_count - 1)] = entry;
+    dns_cache_lru_push(entry);
+    _T.memory += dns_cache_entry_size(entry);
+    ++_T.entries;
+
+    while (_T.memory > _G.cache_size && _T.lru_last != NULL) {
+        dns_cache_remove(_T.lru_last);
     }
+}
+
+static void dns_cache_wipe(void)
+{
+    while (_T.lru_last != NULL) {
+        dns_cache_remove(_T.lru_last);
+    }
+    p_delete(&_T.buckets);
+    _T.bucket_count = 0;
+    _T.memory       = 0;
+}
+
+void dns_cache_set_size(size_t size)
+{
+    _G.cache_size = size;
+}
+
+/* }}}
+ */
+
+static void dns_thread_exit(void)
+{
+    if (ev_is_active(&_T.async_event)) {
+        ev_io_stop(worker_ev_loop(), &_T.async_event);
+    }
+    if (_T.ctx != NULL) {
+        ub_ctx_delete(_T.ctx);
+        _T.ctx = NULL;
+    }
+    while (_T.running != NULL) {
+        dns_query_t *query = _T.running;
+
+        _T.running = query->running_next;
+        if (ev_is_active(&query->deadline)) {
+            ev_timer_stop(worker_ev_loop(), &query->deadline);
+        }
+        while (query->waiters != NULL) {
+            dns_context_t *context = query->waiters;
+
+            query->waiters = context->next;
+            dns_context_delete(&context);
+        }
+        p_delete(&query);
+    }
+    p_delete(&_T.queries);
+    array_deep_wipe(_T.ctx_pool, dns_context_delete);
+    dns_cache_wipe();
+}
+
+/* Health of the DNS lists {{{1
+ */
+
+static dns_health_t *dns_health_get(const char *name, int len)
+{
+    dns_health_t *health = NULL;
+
+    pthread_mutex_lock(&_G.healths_lock);
+    foreach (h, _G.healths) {
+        if (strncasecmp((*h)->name, name, len) == 0
+            && (*h)->name[len] == '\0') {
+            health = *h;
+            break;
+        }
+    }
+    if (health == NULL) {
+        health = p_new(dns_health_t, 1);
+        health->name = p_dupstr(name, len);
+        pthread_mutex_init(&health->lock, NULL);
+        array_add(_G.healths, health);
+    }
+    pthread_mutex_unlock(&_G.healths_lock);
+    return health;
+}
+
+static void dns_health_delete(dns_health_t **health)
+{
+    if (*health) {
+        pthread_mutex_destroy(&(*health)->lock);
+        p_delete(&(*health)->name);
+        p_delete(health);
+    }
+}
+
+/* Upper bound of the latency (in seconds) of the given fraction of the
+ * answers, or 0 when the zone did not answer enough queries yet.
+ * The lock of the zone must be held.
+ */
+static ev_tstamp dns_health_percentile(const dns_health_t *health,
+                                       double fraction)
+{
+    uint32_t count = 0;
+
+    if (health->samples < 32) {
+        return 0;
+    }
+    for (int i = 0 ; i < DNS_LATENCY_BUCKETS ; ++i) {
+        count += health->histogram[i];
+        if (count >= fraction * health->samples) {
+            return (1 << i) / 1000.;
+        }
+    }
+    return (1 << (DNS_LATENCY_BUCKETS - 1)) / 1000.;
+}
+
+/* The lock of the zone must be held.
+ */
+static ev_tstamp dns_health_deadline(const dns_health_t *health)
+{
+    ev_tstamp deadline = 4 * dns_health_percentile(health, .99);
+
+    if (deadline == 0 || deadline > _G.timeout) {
+        return _G.timeout;
+    }
+    return MAX(deadline, DNS_MIN_DEADLINE);
+}
+
+/* Whether a query can be sent to the zone.
+ */
+static bool dns_health_admit(dns_health_t *health, ev_tstamp now)
+{
+    bool admit = true;
+
+    pthread_mutex_lock(&health->lock);
+    if (health->open) {
+        if (now < health->open_until || health->probing) {
+            ++health->rejected;
+            admit = false;
+        } else {
+            debug("probing dns list %s", health->name);
+            health->probing = true;
+        }
+    }
+    pthread_mutex_unlock(&health->lock);
+    return admit;
+}
+
+static void dns_health_record(dns_health_t *health, ev_tstamp now,
+                              ev_tstamp latency, bool ok, bool timeout)
+{
+    const ev_tstamp latency_ms = 1000 * latency;
+    int bucket = 0;
+
+    pthread_mutex_lock(&health->lock);
+    ++health->queries;
+    if (ok) {
+        while (bucket < DNS_LATENCY_BUCKETS - 1
+               && latency_ms >= (1 << bucket)) {
+            ++bucket;
+        }
+        ++health->histogram[bucket];
+        if (++health->samples >= DNS_LATENCY_SAMPLES) {
+            health->samples = 0;
+            for (int i = 0 ; i < DNS_LATENCY_BUCKETS ; ++i) {
+                health->histogram[i] /= 2;
+                health->samples += health->histogram[i];
+            }
+        }
+        health->failures = 0;
+        if (health->open) {
+            notice("dns list %s answers again, closing its circuit",
+                   health->name);
+            health->open    = false;
+            health->probing = false;
+        }
+    } else {
+        ++health->errors;
+        if (timeout) {
+            ++health->timeouts;
+        }
+        ++health->failures;
+        if (health->probing) {
+            warn("dns list %s still failing, keeping its circuit open for %ds",
+                 health->name, DNS_BREAKER_COOLDOWN);
+            health->probing    = false;
+            health->open_until = now + DNS_BREAKER_COOLDOWN;
+        } else if (!health->open && health->failures >= DNS_BREAKER_FAILURES) {
+            warn("dns list %s failed %d times in a row, opening its circuit "
+                 "for %ds", health->name, health->failures,
+                 DNS_BREAKER_COOLDOWN);
+            health->open       = true;
+            health->open_until = now + DNS_BREAKER_COOLDOWN;
+        }
+    }
+    pthread_mutex_unlock(&health->lock);
+}
+
+void dns_set_timeout(int timeout_ms)
+{
+    _G.timeout = timeout_ms / 1000.;
+}
+
+void dns_zones_stats(A(dns_zone_stats_t) *stats)
+{
+    pthread_mutex_lock(&_G.healths_lock);
+    foreach (h, _G.healths) {
+        dns_health_t *health = *h;
+
+        pthread_mutex_lock(&health->lock);
+        array_add(*stats, ((dns_zone_stats_t){
+            .name     = health->name,
+            .queries  = health->queries,
+            .errors   = health->errors,
+            .timeouts = health->timeouts,
+            .rejected = health->rejected,
+            .p50      = 1000 * dns_health_percentile(health, .50),
+            .p95      = 1000 * dns_health_percentile(health, .95),
+            .p99      = 1000 * dns_health_percentile(health, .99),
+            .deadline = 1000 * dns_health_deadline(health),
+            .open     = health->open,
+        }));
+        pthread_mutex_unlock(&health->lock);
+    }
+    pthread_mutex_unlock(&_G.healths_lock);
+}
+
+/* }}}
+ */
+
+/* The latencies of the lists are the worst ones of the worker processes in
+ * prefork mode.
+ */
+static void dns_stats(A(worker_stat_t) *stats)
+{
+    A(dns_zone_stats_t) zones = ARRAY_INIT;
+    char group[BUFSIZ];
+
+    worker_stat_add(stats, "dns cache", "hits", _G.cache_hits, false);
+    worker_stat_add(stats, "dns cache", "misses", _G.cache_misses, false);
+    worker_stat_add(stats, "dns cache", "coalesced", _G.coalesced, false);
+    worker_stat_add(stats, "dns cache", "prefetched", _G.prefetched, false);
+
+    dns_zones_stats(&zones);
+    foreach (zone, zones) {
+        snprintf(group, sizeof(group), "dns list %s", zone->name);
+        worker_stat_add(stats, group, "queries", zone->queries, false);
+        worker_stat_add(stats, group, "errors", zone->errors, false);
+        worker_stat_add(stats, group, "timeouts", zone->timeouts, false);
+        worker_stat_add(stats, group, "rejected", zone->rejected, false);
+        worker_stat_add(stats, group, "p50_ms", zone->p50, true);
+        worker_stat_add(stats, group, "p99_ms", zone->p99, true);
+        worker_stat_add(stats, group, "deadline_ms", zone->deadline, true);
+        worker_stat_add(stats, group, "open", zone->open, true);
+    }
+    array_wipe(zones);
+}
+
+static int dns_init(void)
+{
+    worker_atexit(dns_thread_exit);
+    worker_stats_register(dns_stats);
+    return 0;
+}
+module_init(dns_init);
+
+static void dns_exit(void)
+{
+    dns_thread_exit();
+    array_deep_wipe(_G.healths, dns_health_delete);
     p_delete(&_G.use_local_config);
-    array_deep_wipe(_G.ctx_pool, dns_context_delete);
 }
 module_exit(dns_exit);
 
+/* In-flight queries {{{1
+ */
+
+static dns_query_t **dns_query_bucket(const char *qname, dns_rrtype_t type,
+                                      uint32_t hash)
+{
+    dns_query_t **pos;
+
+    if (_T.queries == NULL) {
+        _T.queries = p_new(dns_query_t *, DNS_QUERY_BUCKETS);
+    }
+    pos = &_T.queries[hash % DNS_QUERY_BUCKETS];
+    while (*pos != NULL && ((*pos)->hash != hash || (*pos)->type != type
+                            || strcasecmp((*pos)->qname, qname) != 0)) {
+        pos = &(*pos)->next;
+    }
+    return pos;
+}
+
+static void dns_query_start(dns_query_t *query)
+{
+    query->running_prev = NULL;
+    query->running_next = _T.running;
+    if (_T.running != NULL) {
+        _T.running->running_prev = query;
+    }
+    _T.running = query;
+}
+
+static void dns_query_done(dns_query_t *query)
+{
+    if (query->running_prev != NULL) {
+        query->running_prev->running_next = query->running_next;
+    } else {
+        _T.running = query->running_next;
+    }
+    if (query->running_next != NULL) {
+        query->running_next->running_prev = query->running_prev;
+    }
+    p_delete(&query);
+}
+
+/* Give the answer to the waiters of the query.
+ * The query is removed from the table before running the callbacks since
+ * they may issue new checks, but stays in the running list until all the
+ * waiters are done since they may cancel the other ones.
+ */
+static void dns_query_dispatch(dns_query_t *query, const dns_answer_t *answer)
+{
+    *dns_query_bucket(query->qname, query->type, query->hash) = query->next;
+    while (query->waiters != NULL) {
+        dns_context_t *context = query->waiters;
+
+        query->waiters = context->next;
+        *context->answer = *answer;
+        if (context->call != NULL) {
+            context->call(context->answer, context->data);
+        }
+        dns_context_release(context);
+    }
+}
+
+static void dns_query_timeout(struct ev_loop *loop, ev_timer *timer,
+                              int revents)
+{
+    dns_query_t *query = timer->data;
+    const dns_answer_t answer = { .result = DNS_ERROR };
+
+    debug("query for %s timed out", query->qname);
+    query->timed_out = true;
+    dns_health_record(query->health, ev_now(loop), 0, false, true);
+    dns_query_dispatch(query, &answer);
+}
+
 static void dns_callback(void *arg, int err, struct ub_result *result)
 {
-    dns_context_t *context = arg;
+    dns_query_t *query = arg;
+    dns_answer_t answer = { .count = 0 };
+
     if (err != 0 || (result->rcode != DNS_RCODE_NOERROR
                      && result->rcode != DNS_RCODE_NXDOMAIN)) {
         debug("asynchronous request led to an error");
-        *context->result = DNS_ERROR;
+        answer.result = DNS_ERROR;
     } else if (result->nxdomain) {
         debug("asynchronous request done, %s NOT FOUND", result->qname);
-        *context->result = DNS_NOTFOUND;
+        answer.result = DNS_NOTFOUND;
+        dns_cache_put(query->qname, query->type, &answer, result->ttl);
     } else {
         debug("asynchronous request done, %s FOUND", result->qname);
-        *context->result = DNS_FOUND;
-    }
-    if (context->call != NULL) {
-        context->call(context->result, context->data);
+        answer.result = DNS_FOUND;
+        for (int i = 0 ; query->type == DNS_RRT_A && result->data[i] != NULL
+                         && answer.count < DNS_ANSWER_ADDRS ; ++i) {
+            const uint8_t *addr = (const uint8_t *)result->data[i];
+
+            if (result->len[i] == 4) {
+                answer.addrs[answer.count++] = (addr[0] << 24) | (addr[1] << 16)
+                                             | (addr[2] << 8) | addr[3];
+            }
+        }
+        dns_cache_put(query->qname, query->type, &answer, result->ttl);
     }
     ub_resolve_free(result);
-    dns_context_release(context);
+
+    /* The waiters of a query that timed out already got an error.
+     */
+    if (!query->timed_out) {
+        if (query->health != NULL) {
+            const ev_tstamp now = ev_now(worker_ev_loop());
+
+            ev_timer_stop(worker_ev_loop(), &query->deadline);
+            dns_health_record(query->health, now, now - query->start,
+                              answer.result != DNS_ERROR, false);
+        }
+        dns_query_dispatch(query, &answer);
+    }
+    dns_query_done(query);
 }
 
-static int dns_handler(client_t *event, void *config)
+void dns_cancel(void *data)
+{
+    for (dns_query_t *query = _T.running ; query != NULL ;
+         query = query->running_next) {
+        dns_context_t **pos = &query->waiters;
+
+        while (*pos != NULL) {
+            dns_context_t *context = *pos;
+
+            if (context->data == data) {
+                debug("check of %s canceled", query->qname);
+                *pos = context->next;
+                dns_context_release(context);
+            } else {
+                pos = &context->next;
+            }
+        }
+    }
+}
+
+/* }}}
+ */
+
+static void dns_handler(struct ev_loop *loop, ev_io *event, int revents)
 {
     int retval = 0;
     debug("dns_handler called: ub_fd triggered");
-    client_io_none(event);
-    if ((retval = ub_process(_G.ctx)) != 0) {
+    if ((retval = ub_process(_T.ctx)) != 0) {
         err("error in DNS resolution: %s", ub_strerror(retval));
     }
-    client_io_ro(event);
-    return 0;
 }
 
 bool dns_resolve(const char *hostname, dns_rrtype_t type,
                  ub_callback_t callback, void *data)
 {
-    if (_G.ctx == NULL) {
-        _G.ctx = ub_ctx_create();
+    if (_T.ctx == NULL) {
+        _T.ctx = ub_ctx_create();
         if (_G.use_local_config != NULL) {
             debug("using local dns configuration");
-            ub_ctx_resolvconf(_G.ctx, _G.use_local_config);
-        }
-        ub_ctx_async(_G.ctx, true);
-        if ((_G.async_event = client_register(ub_fd(_G.ctx),
-                                              dns_handler, NULL)) == NULL) {
-            crit("cannot register asynchronous DNS event handler");
-            abort();
+            ub_ctx_resolvconf(_T.ctx, _G.use_local_config);
         }
+        ub_ctx_async(_T.ctx, true);
+        ev_io_init(&_T.async_event, dns_handler, ub_fd(_T.ctx), EV_READ);
+        ev_io_start(worker_ev_loop(), &_T.async_event);
     }
     debug("running dns resolution on %s (type: %d)", hostname, type);
-    return (ub_resolve_async(_G.ctx, (char*)hostname, type, DNS_RRC_IN,
+    return (ub_resolve_async(_T.ctx, (char*)hostname, type, DNS_RRC_IN,
                              data, callback, NULL) == 0);
 }
 
-bool dns_check(const char *hostname, dns_rrtype_t type, dns_result_t *result,
-               dns_result_callback_f callback, void *data)
+/* Issue a query for the given name and register it in the in-flight table
+ * at @p pos, with @p waiters as its initial list of waiters.
+ */
+static bool dns_query_launch(const char *hostname, dns_rrtype_t type,
+                             uint32_t hash, dns_query_t **pos,
+                             dns_health_t *health, dns_context_t *waiters)
 {
-    dns_context_t *context = dns_context_acquire();
-    context->result = result;
+    const size_t len = strlen(hostname);
+    dns_query_t *query;
+
+    query = xmalloc(sizeof(dns_query_t) + len + 1);
+    memcpy(query->qname, hostname, len + 1);
+    query->hash    = hash;
+    query->type    = type;
+    query->waiters = waiters;
+    query->next    = NULL;
+    query->health  = health;
+    query->start   = ev_now(worker_ev_loop());
+    query->timed_out = false;
+    *pos = query;
+    if (!dns_resolve(hostname, type, dns_callback, query)) {
+        *pos = NULL;
+        p_delete(&query);
+        if (health != NULL) {
+            dns_health_record(health, ev_now(worker_ev_loop()), 0, false,
+                              false);
+        }
+        return false;
+    }
+    dns_query_start(query);
+    ev_timer_init(&query->deadline, dns_query_timeout, 0., 0.);
+    query->deadline.data = query;
+    if (health != NULL) {
+        pthread_mutex_lock(&health->lock);
+        ev_timer_set(&query->deadline, dns_health_deadline(health), 0.);
+        pthread_mutex_unlock(&health->lock);
+        ev_timer_start(worker_ev_loop(), &query->deadline);
+    }
+    return true;
+}
+
+static bool dns_check_zone(const char *hostname, dns_rrtype_t type,
+                           dns_health_t *health, dns_answer_t *answer,
+                           dns_result_callback_f callback, void *data)
+{
+    const uint32_t hash = dns_cache_hash(hostname, type);
+    dns_context_t *context;
+    dns_query_t **pos;
+
+    if (dns_cache_get(hostname, type, answer)) {
+        debug("cached answer for %s (type: %d)", hostname, type);
+        return true;
+    }
+    context = dns_context_acquire();
+    context->answer = answer;
     context->call   = callback;
     context->data   = data;
-    if (dns_resolve(hostname, type, dns_callback, context)) {
-        *result = DNS_ASYNC;
+    context->next   = NULL;
+
+    pos = dns_query_bucket(hostname, type, hash);
+    if (*pos != NULL) {
+        debug("query for %s (type: %d) already in flight", hostname, type);
+        context->next = (*pos)->waiters;
+        (*pos)->waiters = context;
+        __sync_add_and_fetch(&_G.coalesced, 1);
+        answer->result = DNS_ASYNC;
         return true;
-    } else {
-        *result = DNS_ERROR;
+    }
+    if (health != NULL && !dns_health_admit(health, ev_now(worker_ev_loop()))) {
+        debug("dns list %s is open, not querying %s", health->name, hostname);
+        answer->result = DNS_ERROR;
+        dns_context_release(context);
+        return false;
+    }
+    if (!dns_query_launch(hostname, type, hash, pos, health, context)) {
+        answer->result = DNS_ERROR;
         dns_context_release(context);
         return false;
     }
+    answer->result = DNS_ASYNC;
+    return true;
 }
 
-bool dns_rbl_check(const char *rbl, uint32_t ip, dns_result_t *result,
-                   dns_result_callback_f callback, void *data)
+/* Query the name only to fill the cache: nobody waits for the answer.
+ * Nothing is done if the answer is already cached or being fetched, or if
+ * the list is considered down (the circuit is left to real queries).
+ */
+static void dns_prefetch_zone(const char *hostname, dns_rrtype_t type,
+                              dns_health_t *health)
+{
+    const uint32_t hash = dns_cache_hash(hostname, type);
+    const ev_tstamp now = ev_now(worker_ev_loop());
+    dns_cache_entry_t *entry;
+    dns_query_t **pos;
+
+    if (_G.cache_size == 0) {
+        return;
+    }
+    entry = dns_cache_find(hostname, type, hash);
+    if (entry != NULL && entry->expire > now) {
+        return;
+    }
+    pos = dns_query_bucket(hostname, type, hash);
+    if (*pos != NULL) {
+        return;
+    }
+    if (health != NULL) {
+        bool open;
+
+        pthread_mutex_lock(&health->lock);
+        open = health->open;
+        pthread_mutex_unlock(&health->lock);
+        if (open) {
+            return;
+        }
+    }
+    debug("prefetching %s (type: %d)", hostname, type);
+    if (dns_query_launch(hostname, type, hash, pos, health, NULL)) {
+        __sync_add_and_fetch(&_G.prefetched, 1);
+    }
+}
+
+bool dns_check(const char *hostname, dns_rrtype_t type, dns_answer_t *answer,
+               dns_result_callback_f callback, void *data)
+{
+    return dns_check_zone(hostname, type, NULL, answer, callback, data);
+}
+
+/* Name of the entry of @p ip in the given rbl, false if it is too long.
+ */
+static bool dns_rbl_name(const dns_zone_t *zone, uint32_t ip,
+                         char host[static 257])
 {
-    char host[257];
     int len;
 
     len = snprintf(host, 257, "%d.%d.%d.%d.%s.",
                    ip & 0xff, (ip >> 8) & 0xff,
                    (ip >> 16) & 0xff, (ip >> 24) & 0xff,
-                   rbl);
-    if (len >= (int)sizeof(host))
-        return DNS_ERROR;
+                   zone->name);
+    if (len >= 257) {
+        return false;
+    }
     if (host[len - 2] == '.')
         host[len - 1] = '\0';
-    return dns_check(host, DNS_RRT_A, result, callback, data);
+    return true;
 }
 
-bool dns_rhbl_check(const char *rhbl, const char *hostname,
-                    dns_result_t *result, dns_result_callback_f callback,
-                    void *data)
+/* Name of the entry of @p hostname in the given rhbl.
+ */
+static bool dns_rhbl_name(const dns_zone_t *zone, const char *hostname,
+                          char host[static 257])
 {
-    char host[257];
     int len;
 
-    len = snprintf(host, 257, "%s.%s.", hostname, rhbl);
-    if (len >= (int)sizeof(host))
-        return DNS_ERROR;
+    len = snprintf(host, 257, "%s.%s.", hostname, zone->name);
+    if (len >= 257) {
+        return false;
+    }
     if (host[len - 2] == '.')
         host[len - 1] = '\0';
-    return dns_check(host, DNS_RRT_A, result, callback, data);
+    return true;
+}
+
+bool dns_rbl_check(const dns_zone_t *zone, uint32_t ip, dns_answer_t *answer,
+                   dns_result_callback_f callback, void *data)
+{
+    char host[257];
+
+    if (!dns_rbl_name(zone, ip, host)) {
+        answer->result = DNS_ERROR;
+        return false;
+    }
+    return dns_check_zone(host, DNS_RRT_A, zone->health, answer, callback,
+                          data);
+}
+
+void dns_rbl_prefetch(const dns_zone_t *zone, uint32_t ip)
+{
+    char host[257];
+
+    if (dns_rbl_name(zone, ip, host)) {
+        dns_prefetch_zone(host, DNS_RRT_A, zone->health);
+    }
+}
+
+bool dns_rhbl_check(const dns_zone_t *zone, const char *hostname,
+                    dns_answer_t *answer, dns_result_callback_f callback,
+                    void *data)
+{
+    char host[257];
+
+    if (!dns_rhbl_name(zone, hostname, host)) {
+        answer->result = DNS_ERROR;
+        return false;
+    }
+    return dns_check_zone(host, DNS_RRT_A, zone->health, answer, callback,
+                          data);
+}
+
+void dns_rhbl_prefetch(const dns_zone_t *zone, const char *hostname)
+{
+    char host[257];
+
+    if (dns_rhbl_name(zone, hostname, host)) {
+        dns_prefetch_zone(host, DNS_RRT_A, zone->health);
+    }
 }
 
+/* DNS lists {{{1
+ */
+
+static bool dns_parse_addr(const char *str, uint32_t *addr)
+{
+    struct in_addr in;
+
+    if (inet_pton(AF_INET, str, &in) != 1) {
+        return false;
+    }
+    *addr = ntohl(in.s_addr);
+    return true;
+}
+
+bool dns_zone_add(A(dns_zone_t) *zones, const char *spec, int weight)
+{
+    const char *cond = strpbrk(spec, "=&");
+    const int len = cond ? cond - spec : (int)strlen(spec);
+    dns_rule_t rule = { .match = DNS_MATCH_ANY, .weight = weight };
+    dns_zone_t *zone = NULL;
+
+    if (len == 0) {
+        return false;
+    }
+    if (cond != NULL && *cond == '=') {
+        rule.match = DNS_MATCH_ADDR;
+        if (!dns_parse_addr(cond + 1, &rule.value)) {
+            return false;
+        }
+    } else if (cond != NULL) {
+        rule.match = DNS_MATCH_MASK;
+        if (!dns_parse_addr(cond + 1, &rule.value)) {
+            char *end;
+
+            errno = 0;
+            rule.value = strtoul(cond + 1, &end, 0);
+            if (end == cond + 1 || *end != '\0' || errno != 0) {
+                return false;
+            }
+        }
+
+        /* The lists give their codes in the last octet of a 127.0.0.0/8
+         * address: a mask with other bits would match any answer.
+         */
+        if (rule.value == 0 || rule.value > 0xff) {
+            return false;
+        }
+    }
+
+    foreach (z, *zones) {
+        if (strncasecmp(z->name, spec, len) == 0 && z->name[len] == '\0') {
+            zone = z;
+            break;
+        }
+    }
+    if (zone == NULL) {
+        array_add(*zones, ((dns_zone_t){
+            .name   = p_dupstr(spec, len),
+            .health = dns_health_get(spec, len),
+        }));
+        zone = &array_last(*zones);
+    }
+    array_add(zone->rules, rule);
+    zone->weight += weight;
+    return true;
+}
+
+void dns_zones_wipe(A(dns_zone_t) *zones)
+{
+    foreach (zone, *zones) {
+        p_delete(&zone->name);
+        array_wipe(zone->rules);
+    }
+    array_wipe(*zones);
+}
+
+int dns_zone_score(const dns_zone_t *zone, const dns_answer_t *answer)
+{
+    int score = 0;
+
+    if (answer->result != DNS_FOUND) {
+        return 0;
+    }
+    foreach (rule, zone->rules) {
+        bool match = rule->match == DNS_MATCH_ANY;
+
+        for (int i = 0 ; !match && i < answer->count ; ++i) {
+            if (rule->match == DNS_MATCH_ADDR) {
+                match = answer->addrs[i] == rule->value;
+            } else {
+                match = (answer->addrs[i] & rule->value) != 0;
+            }
+        }
+        if (match) {
+            score += rule->weight;
+        }
+    }
+    return score;
+}
+
+/* }}}
+ */
+
 void dns_use_local_conf(const char* resolv)
 {
     p_delete(&_G.use_local_config);
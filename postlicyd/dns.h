@@ -83,7 +83,67 @@ typedef enum {
 } dns_rcode_t;
 
 
-typedef void (*dns_result_callback_f)(dns_result_t *result, void *data);
+/** Answer of a check. For A records, the addresses of the answer are given
+ * (in host order), up to DNS_ANSWER_ADDRS of them.
+ */
+#define DNS_ANSWER_ADDRS  8
+
+typedef struct dns_answer_t {
+    dns_result_t result;
+    uint8_t  count;
+    uint32_t addrs[DNS_ANSWER_ADDRS];
+} dns_answer_t;
+ARRAY(dns_answer_t);
+
+typedef void (*dns_result_callback_f)(dns_answer_t *answer, void *data);
+
+
+/** DNS lists.
+ * A list zone can be given several weights, each one with a condition on the
+ * address returned by the list: this lets a combined list (encoding several
+ * lists in the 127.0.0.x answers) be checked with a single query.
+ */
+typedef enum {
+    DNS_MATCH_ANY,
+    DNS_MATCH_ADDR,
+    DNS_MATCH_MASK,
+} dns_match_t;
+
+typedef struct dns_rule_t {
+    dns_match_t match;
+    uint32_t value;
+    int weight;
+} dns_rule_t;
+ARRAY(dns_rule_t);
+
+typedef struct dns_health_t dns_health_t;
+
+typedef struct dns_zone_t {
+    char *name;
+    A(dns_rule_t) rules;
+    dns_health_t *health;
+
+    /* Sum of the weights of the rules.
+     */
+    int weight;
+} dns_zone_t;
+ARRAY(dns_zone_t);
+
+/** Add a weight to a zone. The zone is given as +zone+ (any answer),
+ * +zone=a.b.c.d+ (the answer contains the address) or +zone&mask+ (the
+ * last octet of an address of the answer has one of the bits of the mask,
+ * given as an address or an integer). A mask with no bit or with bits
+ * outside of the last octet is rejected.
+ */
+__attribute__((nonnull(1,2)))
+bool dns_zone_add(A(dns_zone_t) *zones, const char *spec, int weight);
+
+void dns_zones_wipe(A(dns_zone_t) *zones);
+
+/** Weight of the answer to a check in the given zone.
+ */
+__attribute__((nonnull(1,2)))
+int dns_zone_score(const dns_zone_t *zone, const dns_answer_t *answer);
 
 /** Run a DNS resolution for the given host with the given host and RRT
  */
@@ -92,28 +152,80 @@ bool dns_resolve(const char *hostname, dns_rrtype_t type,
                  ub_callback_t callback, void *data);
 
 /** Fetch the DNS record of the given type.
+ * If the answer is in the cache of the worker, @p answer is set immediately
+ * and the callback is not called. Otherwise answer->result is set to
+ * DNS_ASYNC and the callback is called once the answer is received.
  */
-__attribute__((nonnull(1,4)))
-bool dns_check(const char *hostname, dns_rrtype_t type, dns_result_t *result,
+__attribute__((nonnull(1,3)))
+bool dns_check(const char *hostname, dns_rrtype_t type, dns_answer_t *answer,
                dns_result_callback_f callback, void *data);
 
+/** Cancel the pending checks issued with the given callback data: their
+ * callbacks are not called. The queries keep running so that their answers
+ * still fill the cache.
+ */
+void dns_cancel(void *data);
+
 /** Check the presence of the given IP in the given rbl.
+ * The queries to a DNS list have a deadline, and fail immediately while the
+ * list is considered as down.
  */
 __attribute__((nonnull(1,3)))
-bool dns_rbl_check(const char *rbl, uint32_t ip, dns_result_t *result,
+bool dns_rbl_check(const dns_zone_t *zone, uint32_t ip, dns_answer_t *answer,
                   dns_result_callback_f callback, void *data);
 
+/** Query the entry of @p ip in the given rbl ahead of its check, to have
+ * the answer in the cache when dns_rbl_check() is called. Nothing is done
+ * when the cache is disabled.
+ */
+__attribute__((nonnull(1)))
+void dns_rbl_prefetch(const dns_zone_t *zone, uint32_t ip);
+
 /** Check the presence of the given hostname in the given rhbl.
  */
 __attribute__((nonnull(1,2,3)))
-bool dns_rhbl_check(const char *rhbl, const char *hostname,
-                    dns_result_t *result, dns_result_callback_f callback,
+bool dns_rhbl_check(const dns_zone_t *zone, const char *hostname,
+                    dns_answer_t *answer, dns_result_callback_f callback,
                     void *data);
 
+/** Query the entry of @p hostname in the given rhbl ahead of its check.
+ */
+__attribute__((nonnull(1,2)))
+void dns_rhbl_prefetch(const dns_zone_t *zone, const char *hostname);
+
 /** Use local DNS configuration (/etc/resolv.conf, /etc/hosts).
  */
 void dns_use_local_conf(const char* resolv);
 
+/** Maximum memory used by the answers cache of each worker, in bytes.
+ * Answers are cached for their TTL, including negative answers (NXDOMAIN).
+ * 0 disables the cache.
+ */
+void dns_cache_set_size(size_t size);
+
+/** Maximum time to wait for the answer of a DNS list, in milliseconds. The
+ * deadline of the queries of a list adapts to its latency up to this value.
+ */
+void dns_set_timeout(int timeout_ms);
+
+/** Health of the DNS lists. Latencies are in milliseconds.
+ */
+typedef struct dns_zone_stats_t {
+    const char *name;
+    uint64_t queries;
+    uint64_t errors;
+    uint64_t timeouts;
+    uint64_t rejected;
+    uint32_t p50;
+    uint32_t p95;
+    uint32_t p99;
+    uint32_t deadline;
+    bool open;
+} dns_zone_stats_t;
+ARRAY(dns_zone_stats_t);
+
+void dns_zones_stats(A(dns_zone_stats_t) *stats);
+
 #endif
 
 /* vim:set et sw=4 sts=4 sws=4: */
@@ -62,6 +62,19 @@ struct filter_description_t {
     bool hooks[HTK_count];
     filter_result_t forward[HTK_count];
 
+    /* Speculative queries
+     */
+    filter_prefetcher_f prefetcher;
+
+    /* The filter has side effects
+     */
+    bool uncacheable;
+
+    /* Asynchronous results of the children, cancellation
+     */
+    filter_child_handler_f child_handler;
+    filter_canceler_f      canceler;
+
     /* Valid parameters
      */
     bool params[ATK_count];
@@ -98,7 +111,7 @@ static struct {
     }
 };
 
-uint32_t filter_running_g = 0;
+__thread uint32_t filter_running_g = 0;
 
 #define filter_declare(filter)                                               \
     filter_constructor_prototype(filter);                                    \
@@ -112,6 +125,7 @@ filter_declare(spf)
 filter_declare(hang)
 filter_declare(rate)
 filter_declare(srs)
+filter_declare(parallel)
 
 static int filter_module_init(void)
 {
@@ -177,6 +191,33 @@ void filter_hook_forward_register(filter_type_t filter,
     ((filter_description_t*)filter)->forward[source] = target;
 }
 
+void filter_prefetcher_register(filter_type_t filter,
+                                filter_prefetcher_f prefetcher)
+{
+    CHECK_FILTER(filter->id);
+    ((filter_description_t*)filter)->prefetcher = prefetcher;
+}
+
+void filter_child_handler_register(filter_type_t filter,
+                                   filter_child_handler_f handler)
+{
+    CHECK_FILTER(filter->id);
+    ((filter_description_t*)filter)->child_handler = handler;
+}
+
+void filter_canceler_register(filter_type_t filter,
+                              filter_canceler_f canceler)
+{
+    CHECK_FILTER(filter->id);
+    ((filter_description_t*)filter)->canceler = canceler;
+}
+
+void filter_uncacheable_register(filter_type_t filter)
+{
+    CHECK_FILTER(filter->id);
+    ((filter_description_t*)filter)->uncacheable = true;
+}
+
 filter_param_id_t filter_param_register(filter_type_t filter,
                                         const char *name)
 {
@@ -215,6 +256,7 @@ bool filter_build(filter_t *filter)
 
 bool filter_update_references(filter_t *filter, A(filter_t) *filter_list)
 {
+    filter->siblings = filter_list;
     foreach (hook, filter->hooks) {
         if (!hook->postfix) {
             hook->filter_id = filter_find_with_name(filter_list, hook->value);
@@ -263,6 +305,27 @@ bool filter_check_safety(A(filter_t) *array)
     return true;
 }
 
+void filter_mark_reachable(const A(filter_t) *array, int entry,
+                           bool *reached)
+{
+    if (reached[entry]) {
+        return;
+    }
+    reached[entry] = true;
+    foreach (hook, array_elt(*array, entry).hooks) {
+        if (!hook->postfix) {
+            filter_mark_reachable(array, hook->filter_id, reached);
+        }
+    }
+}
+
+void filter_depends_on(filter_t *filter, postlicyd_token field)
+{
+    assert(field >= 0 && field < 64 && "Invalid query field");
+    assert(!filter->type->uncacheable && "Filter has side effects");
+    filter->depends |= QUERY_FIELD(field);
+}
+
 void filter_wipe(filter_t *filter)
 {
     if (filter->type->destructor) {
@@ -311,9 +374,104 @@ const filter_hook_t *filter_hook_for_result(const filter_t *filter,
     }
 }
 
-const filter_hook_t *filter_run(const filter_t *filter, const query_t *query,
-                                filter_context_t *context)
+static filter_memo_t *filter_memo_find(filter_context_t *context,
+                                       const filter_t *filter)
 {
+    foreach (memo, context->memos) {
+        if (memo->filter == filter) {
+            return memo;
+        }
+    }
+    return NULL;
+}
+
+static void filter_memo_wipe(filter_memo_t *memo)
+{
+    p_delete(&memo->key);
+    p_delete(&memo->explanation);
+}
+
+/* The results of the children of a filter are kept in the context of
+ * the query.
+ */
+static inline filter_context_t *filter_memo_context(filter_context_t *context)
+{
+    return context->parent != NULL ? context->parent : context;
+}
+
+/* Record the result of the filter if a memo is waiting for it from this
+ * context. If the filter gave no explanation, the one of the query before it
+ * ran is restored.
+ */
+static void filter_memo_set(filter_context_t *context, const filter_t *filter,
+                            filter_result_t result)
+{
+    filter_memo_t *memo = filter_memo_find(filter_memo_context(context),
+                                           filter);
+
+    if (memo == NULL || memo->key == NULL || memo->runner != context) {
+        return;
+    }
+    if (context->explanation.str == NULL) {
+        context->explanation = memo->previous;
+    } else if (result != HTK_ABORT) {
+        memo->explanation = p_dupstr(context->explanation.str,
+                                     context->explanation.len);
+    }
+    if (result == HTK_ABORT) {
+        return;
+    }
+    memo->result = result;
+    memo->runner = NULL;
+}
+
+static filter_result_t filter_run_result(const filter_t *filter,
+                                         const query_t *query,
+                                         filter_context_t *context)
+{
+    char key[BUFSIZ];
+    int key_len = -1;
+
+    if (filter->depends != 0) {
+        key_len = query_fields_key(key, BUFSIZ, query, filter->depends);
+    }
+    if (key_len >= 0) {
+        filter_context_t *memos = filter_memo_context(context);
+        filter_memo_t *memo = filter_memo_find(memos, filter);
+
+        if (memo != NULL && memo->result != HTK_ASYNC
+            && memo->key_len == key_len
+            && memcmp(memo->key, key, key_len) == 0) {
+            debug("reusing result %s of filter %s", htokens[memo->result],
+                  filter->name);
+            if (memo->explanation != NULL) {
+                filter_set_explanation(context, memo->explanation, -1);
+            }
+            context->current_filter = NULL;
+            return memo->result;
+        }
+        if (memo == NULL) {
+            filter_memo_t new_memo = { .filter = filter };
+            array_add(memos->memos, new_memo);
+            memo = array_ptr(memos->memos, array_len(memos->memos) - 1);
+        }
+
+        /* The explanation of the previous run of the filter is released.
+         */
+        if (context->explanation.str == memo->explanation) {
+            filter_set_explanation(context, NULL, 0);
+        }
+        filter_memo_wipe(memo);
+        memo->key     = p_dupstr(key, key_len);
+        memo->key_len = key_len;
+        memo->result  = HTK_ASYNC;
+        memo->runner  = context;
+
+        /* The memo keeps the explanation given by this filter only. */
+        memo->previous = context->explanation;
+        filter_set_explanation(context, NULL, 0);
+    }
+
     debug("running filter %s (%s)", filter->name, filter->type->name);
     filter_running_g++;
     filter_result_t res = filter->type->runner(filter, query, context);
@@ -323,10 +481,50 @@ const filter_hook_t *filter_run(const filter_t *filter, const query_t *query,
     } else {
         filter_running_g--;
         context->current_filter = NULL;
+        if (filter->depends != 0) {
+            filter_memo_set(context, filter, res);
+        }
     }
 
     debug("filter run, result is %s", htokens[res]);
-    return filter_hook_for_result(filter, res);
+    return res;
+}
+
+const filter_hook_t *filter_run(const filter_t *filter, const query_t *query,
+                                filter_context_t *context)
+{
+    return filter_hook_for_result(filter,
+                                  filter_run_result(filter, query, context));
+}
+
+filter_result_t filter_run_child(const filter_t *filter, const query_t *query,
+                                 filter_context_t *child,
+                                 const filter_t *parent_filter,
+                                 filter_context_t *parent)
+{
+    assert(parent_filter->type->child_handler != NULL
+           && "Filter cannot run children");
+    child->parent        = parent;
+    child->parent_filter = parent_filter;
+    child->explanation.str = NULL;
+    child->explanation.len = 0;
+    memcpy(child->instance, parent->instance, sizeof(child->instance));
+    memcpy(child->counters, parent->counters, sizeof(child->counters));
+    return filter_run_result(filter, query, child);
+}
+
+bool filter_cancel(filter_context_t *context)
+{
+    const filter_t *filter = context->current_filter;
+
+    if (filter == NULL || filter->type->canceler == NULL) {
+        return false;
+    }
+    debug("canceling filter %s", filter->name);
+    filter->type->canceler(context);
+    filter_running_g--;
+    context->current_filter = NULL;
+    return true;
 }
 
 bool filter_test(const filter_t *filter, const query_t *query,
@@ -337,6 +535,22 @@ bool filter_test(const filter_t *filter, const query_t *query,
     return !!(filter->type->runner(filter, query, context) == result);
 }
 
+bool filter_is_cacheable(const filter_t *filter)
+{
+    return filter->depends != 0 && !filter->type->uncacheable;
+}
+
+bool filter_can_prefetch(const filter_t *filter)
+{
+    return filter->type->prefetcher != NULL;
+}
+
+void filter_prefetch(const filter_t *filter, const query_t *query)
+{
+    debug("prefetching for filter %s (%s)", filter->name, filter->type->name);
+    filter->type->prefetcher(filter, query);
+}
+
 void filter_set_name(filter_t *filter, const char *name, int len)
 {
     filter->name = p_dupstr(name, len);
@@ -455,10 +669,13 @@ void filter_context_prepare(filter_context_t *context, void *qctx)
     context->explanation.str = NULL;
     context->explanation.len = 0;
     context->data = qctx;
+    context->parent = NULL;
+    context->parent_filter = NULL;
 }
 
 void filter_context_wipe(filter_context_t *context)
 {
+    array_deep_wipe(context->memos, filter_memo_wipe);
     for (int i = 0 ; i < FTK_count ; ++i) {
         if (_G.filter_descriptions[i].ctx_destructor != NULL) {
             _G.filter_descriptions[i].ctx_destructor(context->contexts[i]);
@@ -475,6 +692,15 @@ void filter_context_clean(filter_context_t *context)
 {
     p_clear(&context->counters, 1);
     context->instance[0] = '\0';
+    filter_context_forget(context);
+}
+
+void filter_context_forget(filter_context_t *context)
+{
+    foreach (memo, context->memos) {
+        filter_memo_wipe(memo);
+    }
+    array_len(context->memos) = 0;
 }
 
 void filter_post_async_result(filter_context_t *context,
@@ -487,6 +713,13 @@ void filter_post_async_result(filter_context_t *context,
         return;
     }
     filter_running_g--;
+    if (filter->depends != 0) {
+        filter_memo_set(context, filter, result);
+    }
+    if (context->parent != NULL) {
+        context->parent_filter->type->child_handler(context, result);
+        return;
+    }
     hook = filter_hook_for_result(filter, result);
     _G.async_handler(context, hook);
 }
@@ -74,7 +74,10 @@ ARRAY(filter_param_t)
 
 /** Description of a filter.
  */
-typedef struct filter_t {
+typedef struct filter_t filter_t;
+ARRAY(filter_t)
+
+struct filter_t {
     char *name;
     filter_type_t type;
 
@@ -86,8 +89,37 @@ typedef struct filter_t {
     /* Loop checking flags.
      */
     int last_seen;
-}filter_t; 
-ARRAY(filter_t)
+
+    /* Query fields the result of the filter depends on (one bit per
+     * postlicyd_token). The result of a filter that declares its
+     * dependencies is reused as long as these fields do not change.
+     */
+    uint64_t depends;
+
+    /* Filters of the configuration, for the filters that run other filters.
+     */
+    const A(filter_t) *siblings;
+};
+
+/** Result of a filter for the current instance.
+ */
+typedef struct filter_memo_t {
+    const filter_t *filter;
+    filter_result_t result;
+
+    /* Values of the fields the filter depends on. */
+    char *key;
+    int   key_len;
+
+    /* Context running the filter while its result is pending, and the
+     * explanation of the query before the filter ran.
+     */
+    const struct filter_context_t *runner;
+    clstr_t previous;
+
+    char *explanation;
+} filter_memo_t;
+ARRAY(filter_memo_t)
 
 #define MAX_COUNTERS (64)
 
@@ -104,6 +136,7 @@ typedef struct filter_context_t {
      */
     char instance[64];
     uint32_t counters[MAX_COUNTERS];
+    A(filter_memo_t) memos;
 
     /* filter explanation
      */
@@ -112,10 +145,15 @@ typedef struct filter_context_t {
     /* connection context
      */
     void *data;
+
+    /* context of the filter this one runs for (see filter_run_child())
+     */
+    struct filter_context_t *parent;
+    const filter_t *parent_filter;
 } filter_context_t;
 
 
-#define FILTER_INIT { NULL, NULL, ARRAY_INIT, NULL, ARRAY_INIT, -1 }
+#define FILTER_INIT { NULL, NULL, ARRAY_INIT, NULL, ARRAY_INIT, -1, 0, NULL }
 #define CHECK_FILTER(Filter)                                                 \
     assert(Filter != FTK_UNKNOWN && Filter != FTK_count                      \
            && "Unknown filter type")
@@ -140,9 +178,16 @@ typedef void (*filter_context_destructor_f)(void*);
 typedef void (*filter_async_handler_f)(filter_context_t *context,
                                        const filter_hook_t *result);
 
-/** Number of filter currently running.
+typedef void (*filter_prefetcher_f)(const filter_t *filter,
+                                    const query_t *query);
+
+typedef void (*filter_child_handler_f)(filter_context_t *child,
+                                       filter_result_t result);
+typedef void (*filter_canceler_f)(filter_context_t *context);
+
+/** Number of filter currently running in the current worker.
  */
-extern uint32_t filter_running_g;
+extern __thread uint32_t filter_running_g;
 
 /* Registration.
  */
@@ -184,6 +229,39 @@ void filter_hook_forward_register(filter_type_t filter,
                                   filter_result_t source,
                                   filter_result_t target);
 
+/** Declare that filters of this type have side effects (they update a
+ * database, count queries, delay the answer...). Their result is never
+ * reused, even for identical queries.
+ */
+void filter_uncacheable_register(filter_type_t filter);
+
+/** Register the handler of the asynchronous results of the children of a
+ * filter of type @p filter (see filter_run_child()).
+ */
+__attribute__((nonnull(2)))
+void filter_child_handler_register(filter_type_t filter,
+                                   filter_child_handler_f handler);
+
+/** Register a canceler.
+ *
+ * The canceler of a filter stops its pending asynchronous operations: the
+ * filter will not post any result for the given context.
+ */
+__attribute__((nonnull(2)))
+void filter_canceler_register(filter_type_t filter,
+                              filter_canceler_f canceler);
+
+/** Register a prefetcher.
+ *
+ * The prefetcher of a filter is called as soon as a new client is seen when
+ * the filter may be run later in the session. It issues the network queries
+ * the filter is likely to need so that their answers are cached when the
+ * filter runs. It must not have any other side effect.
+ */
+__attribute__((nonnull(2)))
+void filter_prefetcher_register(filter_type_t filter,
+                                filter_prefetcher_f prefetcher);
+
 
 /* Filter builder.
  */
@@ -211,6 +289,14 @@ bool filter_add_hook(filter_t *filter, const char *name, int name_len,
 __attribute__((nonnull(1)))
 bool filter_build(filter_t *filter);
 
+/** Declare that the result of the filter only depends on the given query
+ * fields, to be called by the constructor of the filter for each of them.
+ * Its result is then computed once per instance and reused by the following
+ * queries as long as these fields keep the same value.
+ */
+__attribute__((nonnull(1)))
+void filter_depends_on(filter_t *filter, postlicyd_token field);
+
 __attribute__((nonnull(1,2)))
 static inline int filter_find_with_name(const A(filter_t) *array,
                                         const char *name)
@@ -239,6 +325,13 @@ bool filter_update_references(filter_t *filter, A(filter_t) *array);
 __attribute__((nonnull(1)))
 bool filter_check_safety(A(filter_t) *array);
 
+/** Mark in @p reached the filters that may be run starting from the filter
+ * @p entry.
+ */
+__attribute__((nonnull(1,3)))
+void filter_mark_reachable(const A(filter_t) *array, int entry,
+                           bool *reached);
+
 __attribute__((nonnull(1)))
 static inline void filter_hook_wipe(filter_hook_t *hook)
 {
@@ -267,6 +360,36 @@ __attribute__((nonnull(1,2)))
 bool filter_test(const filter_t *filter, const query_t *query,
                  filter_context_t *context, filter_result_t expt);
 
+/** Run @p filter as a child of @p parent_filter. The child gets its own
+ * context @p child, prepared with filter_context_prepare(): the asynchronous
+ * result of the child is given to the child handler of the parent instead of
+ * continuing the filter graph.
+ */
+__attribute__((nonnull(1,2,3,4,5)))
+filter_result_t filter_run_child(const filter_t *filter, const query_t *query,
+                                 filter_context_t *child,
+                                 const filter_t *parent_filter,
+                                 filter_context_t *parent);
+
+/** Stop the pending asynchronous operations of the filter running in
+ * @p context. Returns false if the filter cannot be canceled: it will still
+ * post its result.
+ */
+__attribute__((nonnull(1)))
+bool filter_cancel(filter_context_t *context);
+
+/** Whether the result of the filter only depends on the query fields it
+ * declared.
+ */
+__attribute__((nonnull(1)))
+bool filter_is_cacheable(const filter_t *filter);
+
+__attribute__((nonnull(1)))
+bool filter_can_prefetch(const filter_t *filter);
+
+__attribute__((nonnull(1,2)))
+void filter_prefetch(const filter_t *filter, const query_t *query);
+
 
 /* Parsing Helpers
  */
@@ -332,6 +455,11 @@ void filter_context_wipe(filter_context_t *context);
 __attribute__((nonnull))
 void filter_context_clean(filter_context_t *context);
 
+/** Drop the results of the filters kept for the current instance.
+ */
+__attribute__((nonnull))
+void filter_context_forget(filter_context_t *context);
+
 __attribute__((nonnull))
 void* filter_context(const filter_t * filter, filter_context_t *context);
 
@@ -141,75 +141,54 @@ static bool greylist_db_load(greylist_config_t *config,
     return true;
 }
 
-static
-bool try_greylist(const greylist_config_t *config, const query_t *query)
+/* State of a query while the entries of the databases are fetched: in
+ * prefork mode, they are fetched from the master (see db_get_async()).
+ */
+typedef struct greylist_query_t {
+    const greylist_config_t *config;
+    filter_context_t *context;
+    time_t   now;
+    buffer_t addr;
+    buffer_t key;
+    struct awl_entry aent;
+
+    uint32_t request;
+    filter_result_t result;
+    bool async;
+} greylist_query_t;
+
+static void greylist_done(greylist_query_t *q, bool ok)
 {
-#define INCR_AWL                                                             \
-    aent.count++;                                                            \
-    aent.last = now;                                                         \
-    debug("whitelist entry for %.*s updated, count %d",                      \
-          (int)c_addr->len, c_addr->str, aent.count);                        \
-    db_put(config->awl, c_addr->str, c_addr->len, &aent, sizeof(aent));
+    q->request = 0;
+    q->result  = ok ? HTK_WHITELIST : HTK_GREYLIST;
+    if (q->async) {
+        q->async = false;
+        filter_post_async_result(q->context, q->result);
+    }
+}
 
-    char key[BUFSIZ];
+static void greylist_incr_awl(greylist_query_t *q)
+{
+    q->aent.count++;
+    q->aent.last = q->now;
+    debug("whitelist entry for %.*s updated, count %d",
+          (int)q->addr.len, q->addr.data, q->aent.count);
+    db_put(q->config->awl, q->addr.data, q->addr.len, &q->aent,
+           sizeof(q->aent));
+}
 
-    time_t now = time(NULL);
+static void greylist_obj_fetched(void *data, const void *entry,
+                                 size_t entry_len)
+{
+    greylist_query_t *q = data;
+    const greylist_config_t *config = q->config;
+    time_t now = q->now;
     struct obj_entry oent = { now, now };
-    struct awl_entry aent = { 0, 0 };
-    const clstr_t *c_addr = &query->client_address;
-
-    size_t klen;
-
-    /* Auto whitelist clients.
-     */
-    if (config->client_awl) {
-        if (db_get_len(config->awl, c_addr->str, c_addr->len,
-                       &aent, sizeof(aent))) {
-            debug("client %.*s has a whitelist entry, count is %d",
-                  (int)c_addr->len, c_addr->str, aent.count);
-        }
-
-        if (!greylist_check_awlentry(config, &aent, now)) {
-            aent.count = 0;
-            aent.last  = 0;
-            debug("client %.*s whitelist entry too old",
-                  (int)c_addr->len, c_addr->str);
-        }
-
-        /* Whitelist if count is enough.
-         */
-        if (aent.count >= config->client_awl) {
-            debug("client %.*s whitelisted", (int)c_addr->len, c_addr->str);
-            if (now < aent.last + 3600) {
-                INCR_AWL
-            }
-
-            /* OK.
-             */
-            return true;
-        }
-    }
-
-    /* Lookup.
-     */
-    const clstr_t *cnet = query_field_for_id(query,
-                                             config->lookup_by_host ?
-                                             PTK_CLIENT_ADDRESS :
-                                             PTK_NORMALIZED_CLIENT);
-    const clstr_t *sender = NULL;
-    if (!config->no_sender) {
-        sender = query_field_for_id(query,
-                                    config->normalize_sender ?
-                                    PTK_NORMALIZED_SENDER :
-                                    PTK_SENDER);
-    }
-    klen = snprintf(key, sizeof(key), "%s/%s/%s", cnet->str,
-                    config->no_sender ? "" : sender->str,
-                    config->no_recipient ? "" : query->recipient.str);
-    klen = MIN(klen, ssizeof(key) - 1);
 
-    if (db_get_len(config->obj, key, klen, &oent, sizeof(oent))) {
-        debug("found a greylist entry for %.*s", (int)klen, key);
+    if (entry != NULL && entry_len == sizeof(oent)) {
+        memcpy(&oent, entry, sizeof(oent));
+        debug("found a greylist entry for %.*s", (int)q->key.len,
+              q->key.data);
     }
 
     /* Discard stored first-seen if it is the first retrial and
@@ -217,7 +196,7 @@ bool try_greylist(const greylist_config_t *config, const query_t *query)
      */
     if (!greylist_check_objentry(config, &oent, now)) {
         oent.first = now;
-        debug("invalid retry for %.*s: %s", (int)klen, key,
+        debug("invalid retry for %.*s: %s", (int)q->key.len, q->key.data,
               (config->max_age > 0 && now - oent.last > config->max_age) ?
                   "too old entry"
                 : (oent.last - oent.first < config->delay ?
@@ -227,7 +206,7 @@ bool try_greylist(const greylist_config_t *config, const query_t *query)
     /* Update.
      */
     oent.last = now;
-    db_put(config->obj, key, klen, &oent, sizeof(oent));
+    db_put(config->obj, q->key.data, q->key.len, &oent, sizeof(oent));
 
     /* Auto whitelist clients:
      *  algorithm:
@@ -237,19 +216,107 @@ bool try_greylist(const greylist_config_t *config, const query_t *query)
      *        - client whitelisted already ? -> update last-seen timestamp.
      */
     if (oent.first + config->delay < now) {
-        debug("valid retry for %.*s", (int)klen, key);
+        debug("valid retry for %.*s", (int)q->key.len, q->key.data);
         if (config->client_awl) {
-            INCR_AWL
+            greylist_incr_awl(q);
         }
 
         /* OK
          */
-        return true;
+        greylist_done(q, true);
+        return;
     }
 
     /* DUNNO
      */
-    return false;
+    greylist_done(q, false);
+}
+
+static void greylist_lookup(greylist_query_t *q)
+{
+    q->request = db_get_async(q->config->obj, q->key.data, q->key.len,
+                              greylist_obj_fetched, q);
+}
+
+static void greylist_awl_fetched(void *data, const void *entry,
+                                 size_t entry_len)
+{
+    greylist_query_t *q = data;
+    const greylist_config_t *config = q->config;
+
+    p_clear(&q->aent, 1);
+    if (entry != NULL && entry_len == sizeof(q->aent)) {
+        memcpy(&q->aent, entry, sizeof(q->aent));
+        debug("client %.*s has a whitelist entry, count is %d",
+              (int)q->addr.len, q->addr.data, q->aent.count);
+    }
+
+    if (!greylist_check_awlentry(config, &q->aent, q->now)) {
+        q->aent.count = 0;
+        q->aent.last  = 0;
+        debug("client %.*s whitelist entry too old",
+              (int)q->addr.len, q->addr.data);
+    }
+
+    /* Whitelist if count is enough.
+     */
+    if (q->aent.count >= config->client_awl) {
+        debug("client %.*s whitelisted", (int)q->addr.len, q->addr.data);
+        if (q->now < q->aent.last + 3600) {
+            greylist_incr_awl(q);
+        }
+
+        /* OK.
+         */
+        greylist_done(q, true);
+        return;
+    }
+    greylist_lookup(q);
+}
+
+/* Start the greylisting of @p query. The result is in q->result, HTK_ASYNC
+ * if an entry is being fetched.
+ */
+static void try_greylist(greylist_query_t *q, const query_t *query)
+{
+    const greylist_config_t *config = q->config;
+    const clstr_t *c_addr = &query->client_address;
+    char key[BUFSIZ];
+    size_t klen;
+
+    const clstr_t *cnet = query_field_for_id(query,
+                                             config->lookup_by_host ?
+                                             PTK_CLIENT_ADDRESS :
+                                             PTK_NORMALIZED_CLIENT);
+    const clstr_t *sender = NULL;
+    if (!config->no_sender) {
+        sender = query_field_for_id(query,
+                                    config->normalize_sender ?
+                                    PTK_NORMALIZED_SENDER :
+                                    PTK_SENDER);
+    }
+    klen = snprintf(key, sizeof(key), "%s/%s/%s", cnet->str,
+                    config->no_sender ? "" : sender->str,
+                    config->no_recipient ? "" : query->recipient.str);
+    klen = MIN(klen, ssizeof(key) - 1);
+
+    q->now    = time(NULL);
+    q->result = HTK_ASYNC;
+    q->async  = false;
+    p_clear(&q->aent, 1);
+    buffer_reset(&q->addr);
+    buffer_add(&q->addr, c_addr->str, c_addr->len);
+    buffer_reset(&q->key);
+    buffer_add(&q->key, key, klen);
+
+    /* Auto whitelist clients.
+     */
+    if (config->client_awl) {
+        q->request = db_get_async(config->awl, q->addr.data, q->addr.len,
+                                  greylist_awl_fetched, q);
+    } else {
+        greylist_lookup(q);
+    }
 }
 
 
@@ -327,6 +394,8 @@ static filter_result_t greylist_filter(const filter_t *filter,
                                        filter_context_t *context)
 {
     const greylist_config_t *config = filter->data;
+    greylist_query_t *q = filter_context(filter, context);
+
     if (!config->no_recipient && query->state != SMTP_RCPT) {
         warn("greylisting on recipient only works "
              "as smtpd_recipient_restrictions");
@@ -337,7 +406,40 @@ static filter_result_t greylist_filter(const filter_t *filter,
         return HTK_ABORT;
     }
 
-    return try_greylist(config, query) ? HTK_WHITELIST : HTK_GREYLIST;
+    q->config  = config;
+    q->context = context;
+    try_greylist(q, query);
+    q->async = q->result == HTK_ASYNC;
+    return q->result;
+}
+
+static void greylist_filter_cancel(filter_context_t *context)
+{
+    greylist_query_t *q = filter_context(context->current_filter, context);
+
+    if (q->request != 0) {
+        db_get_cancel(q->request);
+        q->request = 0;
+    }
+    q->async = false;
+}
+
+static void *greylist_context_constructor(void)
+{
+    return p_new(greylist_query_t, 1);
+}
+
+static void greylist_context_destructor(void *data)
+{
+    greylist_query_t *q = data;
+
+    /* The connection closed while the entry was being fetched. */
+    if (q->request != 0) {
+        db_get_cancel(q->request);
+    }
+    buffer_wipe(&q->addr);
+    buffer_wipe(&q->key);
+    p_delete(&q);
 }
 
 filter_constructor(greylist)
@@ -345,13 +447,19 @@ filter_constructor(greylist)
     filter_type_t type
         = filter_register("greylist", greylist_filter_constructor,
                           greylist_filter_destructor,
-                          greylist_filter, NULL, NULL);
+                          greylist_filter, greylist_context_constructor,
+                          greylist_context_destructor);
     /* Hooks.
      */
     (void)filter_hook_register(type, "abort");
     (void)filter_hook_register(type, "greylist");
     (void)filter_hook_register(type, "whitelist");
 
+    /* The greylist database is updated by each query.
+     */
+    filter_uncacheable_register(type);
+    filter_canceler_register(type, greylist_filter_cancel);
+
     /* Parameters.
      */
     (void)filter_param_register(type, "lookup_by_host");
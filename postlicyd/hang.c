@@ -33,7 +33,7 @@
 /*   see AUTHORS and source files for details                               */
 /****************************************************************************/
 
-#include "server.h"
+#include "worker.h"
 
 /* postlicyd filter declaration */
 
@@ -79,9 +79,10 @@ static void hang_filter_destructor(filter_t *filter)
     filter->data = data;
 }
 
-static void hang_filter_async(void* arg)
+static void hang_filter_async(struct ev_loop *loop, ev_timer *timer,
+                              int revents)
 {
-    filter_context_t *context = arg;
+    filter_context_t *context = timer->data;
     filter_post_async_result(context, HTK_TIMEOUT);
 }
 
@@ -90,23 +91,55 @@ static filter_result_t hang_filter(const filter_t *filter,
                                    filter_context_t *context)
 {
     const hang_filter_t *data = filter->data;
-    start_timer(data->timeout, hang_filter_async, context);
+    ev_timer *timer = filter_context(filter, context);
+    ev_timer_set(timer, data->timeout / 1000., 0.);
+    timer->data = context;
+    ev_timer_start(worker_ev_loop(), timer);
     return HTK_ASYNC;
 }
 
+static void hang_filter_cancel(filter_context_t *context)
+{
+    ev_timer *timer = filter_context(context->current_filter, context);
+    ev_timer_stop(worker_ev_loop(), timer);
+}
+
+static void *hang_context_constructor(void)
+{
+    ev_timer *timer = p_new(ev_timer, 1);
+    ev_init(timer, hang_filter_async);
+    return timer;
+}
+
+static void hang_context_destructor(void *data)
+{
+    ev_timer *timer = data;
+    if (ev_is_active(timer)) {
+        ev_timer_stop(worker_ev_loop(), timer);
+    }
+    p_delete(&timer);
+}
+
 
 filter_constructor(hang)
 {
     filter_type_t filter_type
         = filter_register("hang", hang_filter_constructor,
                           hang_filter_destructor, hang_filter,
-                          NULL, NULL);
+                          hang_context_constructor,
+                          hang_context_destructor);
 
     /* Hooks
      */
     (void)filter_hook_register(filter_type, "timeout");
     (void)filter_hook_register(filter_type, "async");
 
+    filter_canceler_register(filter_type, hang_filter_cancel);
+
+    /* The answer is delayed.
+     */
+    filter_uncacheable_register(filter_type);
+
     /* Parameters
      */
     (void)filter_param_register(filter_type, "timeout_ms");
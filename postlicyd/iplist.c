@@ -36,6 +36,7 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/mman.h>
+#include <fcntl.h>
 
 #include "common.h"
 #include "iplist.h"
@@ -44,6 +45,8 @@
 #include "array.h"
 #include "resources.h"
 #include "dns.h"
+#include "worker.h"
+#include "buffer.h"
 
 #define IPv4_BITS        5
 #define IPv4_PREFIX(ip)  ((uint32_t)(ip) >> IPv4_BITS)
@@ -61,22 +64,177 @@ enum {
     RIGHT_HEAVY = 2,
 };
 
-struct rbldb_t {
-    char        *filename;
-    A(uint16_t) *ips;
-};
-ARRAY(rbldb_t)
+/* Compiled image of an ip list.
+ *
+ * The ips of the list are grouped by their upper 16 bits in a compressed
+ * sparse row layout: a single table of offsets gives the location of each
+ * group in a contiguous payload of 16 bits words. A group is either the
+ * sorted list of the lower 16 bits of its ips, or, when it is dense, a bitmap
+ * of 65536 bits (that is not larger than the sorted list). A lookup reads two
+ * adjacent offsets and then either a single word of the bitmap or the
+ * sorted list of the group.
+ *
+ * Networks (CIDR blocks and ranges of addresses) are not expanded: they are
+ * stored after the payload as a sorted array of disjoint intervals, that is
+ * searched when the ip is not found in its group.
+ *
+ * IPv6 addresses and prefixes are stored in a multibit trie with 6 bits
+ * strides (a simplified poptrie): each node has a bitmap of its 64 slots
+ * that lead to a child node and a bitmap of the slots that are entirely
+ * listed. The children of a node are contiguous, the child of a slot is
+ * found by counting the bits of the children bitmap before that slot. A
+ * lookup visits at most one node per stride of the longest prefix.
+ *
+ * The image is either built in memory from a text list, or mapped as is from
+ * a file written by rbldb_compile(). All the fields are stored in host byte
+ * order.
+ */
+#define RBLDB_IMAGE_MAGIC    "PFXIPLST"
+#define RBLDB_IMAGE_VERSION  4
+#define RBLDB_IMAGE_ENDIAN   0x01020304
+
+#define RBLDB_BITMAP         0x80000000U
+#define RBLDB_OFFSET_MASK    (~RBLDB_BITMAP)
+#define RBLDB_BITMAP_WORDS   ((1 << 16) / 16)
+
+typedef struct rbldb_image_t {
+    char     magic[8];
+    uint32_t version;
+    uint32_t endian;
+    uint32_t count;
+    uint32_t words;
+    uint32_t bitmaps;
+    uint32_t ranges;
+    uint32_t v6_count;
+    uint32_t v6_nodes;
+
+    /* The group of the ips whose upper bits are i is stored in
+     * payload[offsets[i]..offsets[i + 1]] (without the RBLDB_BITMAP flag). The
+     * flag is set on offsets[i] when the group is a bitmap.
+     */
+    uint32_t offsets[(1 << 16) + 1];
+    uint16_t payload[];
+
+    /* Followed by:
+     * rbldb_range_t   ranges[ranges];     (aligned on 4 bytes)
+     * rbldb_v6_node_t v6[v6_nodes];       (aligned on 8 bytes)
+     */
+} rbldb_image_t;
+
+typedef struct rbldb_range_t {
+    uint32_t start;
+    uint32_t end;
+} rbldb_range_t;
+ARRAY(rbldb_range_t)
+
+typedef struct rbldb_v6_node_t {
+    uint64_t children;
+    uint64_t listed;
+    uint32_t base;
+    uint32_t padding;
+} rbldb_v6_node_t;
+ARRAY(rbldb_v6_node_t)
+
+typedef struct rbldb_v6_prefix_t {
+    uint64_t hi;
+    uint64_t lo;
+    int      len;
+} rbldb_v6_prefix_t;
+ARRAY(rbldb_v6_prefix_t)
+
+#define RBLDB_V6_STRIDE  6
+
+static inline size_t rbldb_image_ranges_offset(uint32_t words)
+{
+    return sizeof(rbldb_image_t) + ((words * sizeof(uint16_t) + 3) & ~3);
+}
+
+static inline size_t rbldb_image_v6_offset(uint32_t words, uint32_t ranges)
+{
+    return (rbldb_image_ranges_offset(words)
+            + ranges * sizeof(rbldb_range_t) + 7) & ~(size_t)7;
+}
+
+static inline const rbldb_v6_node_t *
+rbldb_image_v6(const rbldb_image_t *image)
+{
+    return (const rbldb_v6_node_t *)((const char *)image
+                                     + rbldb_image_v6_offset(image->words,
+                                                             image->ranges));
+}
+
+/* Slot of the address hi:lo at the given depth (in bits). The address is
+ * padded with zeros after its 128 bits.
+ */
+static inline unsigned rbldb_v6_slot(uint64_t hi, uint64_t lo, int depth)
+{
+    if (depth <= 64 - RBLDB_V6_STRIDE) {
+        return (hi >> (64 - RBLDB_V6_STRIDE - depth)) & 0x3f;
+    } else if (depth < 64) {
+        return ((hi << (depth + RBLDB_V6_STRIDE - 64))
+                | (lo >> (128 - RBLDB_V6_STRIDE - depth))) & 0x3f;
+    } else if (depth <= 128 - RBLDB_V6_STRIDE) {
+        return (lo >> (128 - RBLDB_V6_STRIDE - depth)) & 0x3f;
+    } else {
+        return (lo << (depth + RBLDB_V6_STRIDE - 128)) & 0x3f;
+    }
+}
+
+static inline const rbldb_range_t *
+rbldb_image_ranges(const rbldb_image_t *image)
+{
+    return (const rbldb_range_t *)((const char *)image
+                                   + rbldb_image_ranges_offset(image->words));
+}
+
+/* Index of the last range starting at or before ip, -1 if none.
+ */
+static inline int32_t rbldb_range_find(const rbldb_range_t *ranges,
+                                       uint32_t count, uint32_t ip)
+{
+    uint32_t l = 0, r = count;
+
+    while (l < r) {
+        uint32_t i = (r + l) / 2;
+
+        if (ranges[i].start <= ip) {
+            l = i + 1;
+        } else {
+            r = i;
+        }
+    }
+    return (int32_t)l - 1;
+}
 
 typedef struct rbldb_resource_t {
     time_t mtime;
     off_t  size;
-    A(uint16_t) ips[1 << 16];
+
+    /* The image is either mapped from a compiled file or allocated.
+     */
+    bool   mapped;
+    file_map_t map;
+    rbldb_image_t *image;
+    size_t image_size;
+    bool   locked;
 } rbldb_resource_t;
 
+struct rbldb_t {
+    char        *filename;
+    rbldb_resource_t *res;
+    const rbldb_image_t *image;
+};
+ARRAY(rbldb_t)
+
 static void rbldb_resource_wipe(rbldb_resource_t *res)
 {
-    for (int i = 0 ; i < 1 << 16 ; ++i) {
-        array_wipe(res->ips[i]);
+    if (res->locked) {
+        munlock(res->image, res->image_size);
+    }
+    if (res->mapped) {
+        file_map_close(&res->map);
+    } else {
+        p_delete(&res->image);
     }
     p_delete(&res);
 }
@@ -133,93 +291,556 @@ static int parse_ipv4(const char *s, const char **out, uint32_t *ip)
     return 0;
 }
 
-rbldb_t *rbldb_create(const char *file, bool lock)
+/* Parse an ip or a network: a.b.c.d, a.b.c.d/nn, a.b.c.d-e.f.g.h, a.b.c.d-n
+ * (range of the last byte) and the rbldns netblocks a.b.c and a.b.
+ */
+static int parse_ipv4_range(const char *s, const char **out,
+                            uint32_t *start, uint32_t *end)
 {
-    rbldb_t *db;
-    file_map_t map;
-    const char *p, *end;
-    uint32_t ips = 0;
-    time_t now = time(0);
+    uint32_t ip = 0;
+    int octets = 0;
+    int o;
 
-    if (!file_map_open(&map, file, false)) {
-        return NULL;
+    for (;;) {
+        o = get_o(s, &s);
+        if (o & ~0xff)
+            return -1;
+        ip |= o << (24 - 8 * octets);
+        if (++octets == 4 || *s != '.')
+            break;
+        ++s;
+    }
+    if (octets < 2)
+        return -1;
+    *start = ip;
+    *end   = octets == 4 ? ip : ip | (0xffffffffU >> (8 * octets));
+
+    if (*s == '/') {
+        char *next;
+        long bits = strtol(s + 1, &next, 10);
+        uint32_t mask;
+
+        if (next == s + 1 || bits < 0 || bits > 32)
+            return -1;
+        mask   = bits == 0 ? 0 : 0xffffffffU << (32 - bits);
+        *start = ip & mask;
+        *end   = *start | ~mask;
+        s      = next;
+    } else if (*s == '-' && octets == 4) {
+        const char *p = s + 1;
+        uint32_t last;
+
+        if (parse_ipv4(p, &p, &last) == 0) {
+            *end = last;
+        } else {
+            o = get_o(s + 1, &p);
+            if (o & ~0xff)
+                return -1;
+            *end = (ip & ~0xffU) | o;
+        }
+        if (*end < *start)
+            return -1;
+        s = p;
     }
 
-    rbldb_resource_t *res = resource_get("iplist", file);
-    if (res == NULL) {
-        res = p_new(rbldb_resource_t, 1);
-        resource_set("iplist", file, res,
-                     (resource_destructor_f)rbldb_resource_wipe);
+    *out = s;
+    return 0;
+}
+
+/* Parse an IPv6 address or prefix: x:x::x or x:x::x/nn.
+ */
+static int parse_ipv6_prefix(const char *s, const char **out,
+                             rbldb_v6_prefix_t *prefix)
+{
+    char buf[INET6_ADDRSTRLEN];
+    uint8_t ip[16];
+    int len = 0;
+
+    while (isxdigit((unsigned char)s[len]) || s[len] == ':' || s[len] == '.') {
+        if (len == INET6_ADDRSTRLEN - 1) {
+            return -1;
+        }
+        buf[len] = s[len];
+        ++len;
     }
+    buf[len] = '\0';
+    if (memchr(buf, ':', len) == NULL || inet_pton(AF_INET6, buf, ip) != 1) {
+        return -1;
+    }
+    s += len;
 
-    db = p_new(rbldb_t, 1);
-    db->filename = m_strdup(file);
-    db->ips = res->ips;
-    if (map.st.st_size == res->size && map.st.st_mtime == res->mtime) {
-        notice("%s loaded: already up-to-date", file);
-        file_map_close(&map);
-        return db;
+    prefix->hi = prefix->lo = 0;
+    for (int i = 0 ; i < 8 ; ++i) {
+        prefix->hi = (prefix->hi << 8) | ip[i];
+        prefix->lo = (prefix->lo << 8) | ip[i + 8];
+    }
+    prefix->len = 128;
+    if (*s == '/') {
+        char *next;
+        long bits = strtol(s + 1, &next, 10);
+
+        if (next == s + 1 || bits < 0 || bits > 128)
+            return -1;
+        prefix->len = bits;
+        s = next;
     }
-    res->size  = map.st.st_size;
-    res->mtime = map.st.st_mtime;
 
-    p   = map.map;
-    end = map.end;
-    while (end > p && end[-1] != '\n') {
-        --end;
+    /* Clear the bits after the prefix.
+     */
+    if (prefix->len <= 64) {
+        prefix->lo = 0;
+        prefix->hi &= prefix->len == 0 ? 0 : ~0ULL << (64 - prefix->len);
+    } else {
+        prefix->lo &= ~0ULL << (128 - prefix->len);
     }
-    if (end != map.end) {
-        warn("%s: final \\n missing, ignoring last line", file);
+    *out = s;
+    return 0;
+}
+
+/* Build the node @p node of the trie from the prefixes of its subtree,
+ * sorted by address.
+ */
+static void rbldb_v6_build(A(rbldb_v6_node_t) *nodes, uint32_t node,
+                           const rbldb_v6_prefix_t *prefixes, int count,
+                           int depth)
+{
+    uint64_t listed = 0, children = 0;
+    uint32_t base = array_len(*nodes);
+
+    for (int i = 0 ; i < count ; ++i) {
+        const rbldb_v6_prefix_t *prefix = &prefixes[i];
+        const unsigned slot = rbldb_v6_slot(prefix->hi, prefix->lo, depth);
+
+        if (prefix->len <= depth + RBLDB_V6_STRIDE) {
+            const int span = 1 << (depth + RBLDB_V6_STRIDE - prefix->len);
+            listed |= (span == 64 ? ~0ULL : ((1ULL << span) - 1)) << slot;
+        }
+    }
+    for (int i = 0 ; i < count ; ++i) {
+        const rbldb_v6_prefix_t *prefix = &prefixes[i];
+        const unsigned slot = rbldb_v6_slot(prefix->hi, prefix->lo, depth);
+
+        if (prefix->len > depth + RBLDB_V6_STRIDE
+            && !(listed & (1ULL << slot))) {
+            children |= 1ULL << slot;
+        }
+    }
+    array_elt(*nodes, node).children = children;
+    array_elt(*nodes, node).listed   = listed;
+    array_elt(*nodes, node).base     = base;
+    if (children == 0) {
+        return;
     }
 
-    /* Initialize the length of array (can be reused).
+    /* The children are allocated together, then built one by one: the
+     * prefixes of a slot are contiguous.
      */
-    for (int i = 0 ; i < 1 << 16 ; ++i) {
-        array_unlock(res->ips[i]);
-        array_len(res->ips[i]) = 0;
+    array_ensure_capacity_delta(*nodes, __builtin_popcountll(children));
+    p_clear(array_end(*nodes), __builtin_popcountll(children));
+    array_len(*nodes) += __builtin_popcountll(children);
+    for (int i = 0 ; i < count ;) {
+        const unsigned slot = rbldb_v6_slot(prefixes[i].hi, prefixes[i].lo,
+                                            depth);
+        int j = i + 1;
+
+        while (j < count
+               && rbldb_v6_slot(prefixes[j].hi, prefixes[j].lo, depth) == slot) {
+            ++j;
+        }
+        if (children & (1ULL << slot)) {
+            rbldb_v6_build(nodes, base + __builtin_popcountll(children
+                                                  & ((1ULL << slot) - 1)),
+                           prefixes + i, j - i, depth + RBLDB_V6_STRIDE);
+        }
+        i = j;
+    }
+}
+
+static size_t rbldb_image_size(uint32_t words, uint32_t ranges,
+                               uint32_t v6_nodes)
+{
+    return rbldb_image_v6_offset(words, ranges)
+         + v6_nodes * sizeof(rbldb_v6_node_t);
+}
+
+/* Build the image of a text list: one ip or network per line, lines that do
+ * not start with an ip are ignored.
+ */
+static rbldb_image_t *rbldb_image_build(const file_map_t *map,
+                                        const char *file, size_t *size)
+{
+    A(uint32_t) ips = ARRAY_INIT;
+    A(rbldb_range_t) ranges = ARRAY_INIT;
+    A(rbldb_v6_prefix_t) prefixes = ARRAY_INIT;
+    A(rbldb_v6_node_t) v6 = ARRAY_INIT;
+    uint32_t *offsets = p_new(uint32_t, (1 << 16) + 1);
+    uint32_t *lens = p_new(uint32_t, 1 << 16);
+    uint16_t *lows;
+    rbldb_image_t *image;
+    const char *p, *end;
+    uint32_t count = 0, words = 0, bitmaps = 0;
+
+    p   = map->map;
+    end = map->end;
+    while (end > p && end[-1] != '\n') {
+        --end;
+    }
+    if (end != map->end) {
+        warn("%s: final \\n missing, ignoring last line", file);
     }
 
     while (p < end) {
-        uint32_t ip;
+        rbldb_range_t range;
+        rbldb_v6_prefix_t prefix;
 
         while (*p == ' ' || *p == '\t' || *p == '\r')
             p++;
 
-        if (parse_ipv4(p, &p, &ip) < 0) {
-            p = (char *)memchr(p, '\n', end - p) + 1;
+        if (parse_ipv4_range(p, &p, &range.start, &range.end) == 0) {
+            if (range.start == range.end) {
+                array_add(ips, range.start);
+            } else {
+                array_add(ranges, range);
+            }
+        } else if (parse_ipv6_prefix(p, &p, &prefix) == 0) {
+            array_add(prefixes, prefix);
         } else {
-            array_add(res->ips[ip >> 16], ip & 0xffff);
-            ++ips;
+            p = (char *)memchr(p, '\n', end - p) + 1;
         }
     }
-    file_map_close(&map);
 
-    /* Lookup may perform serveral I/O, so avoid swap.
+    /* IPv6 trie.
      */
-    for (int i = 0 ; i < 1 << 16 ; ++i) {
-        array_adjust(res->ips[i]);
-        if (lock && !array_lock(res->ips[i])) {
-            UNIXERR("mlock");
+    if (prefixes.len > 0) {
+#       define QSORT_TYPE rbldb_v6_prefix_t
+#       define QSORT_BASE prefixes.data
+#       define QSORT_NELT prefixes.len
+#       define QSORT_LT(a,b) (a->hi < b->hi || (a->hi == b->hi && a->lo < b->lo))
+#       include "qsort.c"
+        array_add(v6, (rbldb_v6_node_t){ .base = 0 });
+        rbldb_v6_build(&v6, 0, prefixes.data, prefixes.len, 0);
+    }
+
+    /* Sort the networks and merge the overlapping or adjacent ones.
+     */
+    if (ranges.len > 1) {
+        uint32_t len = 0;
+#       define QSORT_TYPE rbldb_range_t
+#       define QSORT_BASE ranges.data
+#       define QSORT_NELT ranges.len
+#       define QSORT_LT(a,b) a->start < b->start
+#       include "qsort.c"
+        foreach (range, ranges) {
+            rbldb_range_t *last = len > 0 ? array_ptr(ranges, len - 1) : NULL;
+            if (last != NULL && (last->end == 0xffffffffU
+                                 || range->start <= last->end + 1)) {
+                last->end = MAX(last->end, range->end);
+            } else {
+                array_elt(ranges, len++) = *range;
+            }
         }
-        if (res->ips[i].len) {
+        ranges.len = len;
+    }
+
+    /* Bucket the ips by their upper bits (counting sort), then sort and
+     * deduplicate each bucket.
+     */
+    lows = p_new(uint16_t, MAX(ips.len, 1));
+    foreach (ip, ips) {
+        ++offsets[(*ip >> 16) + 1];
+    }
+    for (int i = 0 ; i < 1 << 16 ; ++i) {
+        offsets[i + 1] += offsets[i];
+    }
+    /* offsets[i] is used as the insertion point of the bucket i, this moves
+     * it to the start of the bucket i + 1: shift the offsets back after.
+     */
+    foreach (ip, ips) {
+        lows[offsets[*ip >> 16]++] = *ip & 0xffff;
+    }
+    for (int i = (1 << 16) ; i > 0 ; --i) {
+        offsets[i] = offsets[i - 1];
+    }
+    offsets[0] = 0;
+    array_wipe(ips);
+
+    for (int i = 0 ; i < 1 << 16 ; ++i) {
+        uint16_t *bucket = lows + offsets[i];
+        uint32_t len = offsets[i + 1] - offsets[i];
+        if (len > 1) {
 #       define QSORT_TYPE uint16_t
-#       define QSORT_BASE res->ips[i].data
-#       define QSORT_NELT res->ips[i].len
+#       define QSORT_BASE bucket
+#       define QSORT_NELT len
 #       define QSORT_LT(a,b) *a < *b
 #       include "qsort.c"
         }
+        lens[i] = MIN(len, 1);
+        for (uint32_t j = 1 ; j < len ; ++j) {
+            if (bucket[j] != bucket[lens[i] - 1]) {
+                bucket[lens[i]++] = bucket[j];
+            }
+        }
+        count += lens[i];
+
+        /* The offsets of the image count the words of the payload.
+         */
+        words += lens[i] >= RBLDB_BITMAP_WORDS ? RBLDB_BITMAP_WORDS : lens[i];
+    }
+
+    *size = rbldb_image_size(words, ranges.len, v6.len);
+    image = xmalloc(*size);
+    p_clear(image, 1);
+    memcpy(image->magic, RBLDB_IMAGE_MAGIC, sizeof(image->magic));
+    image->version = RBLDB_IMAGE_VERSION;
+    image->endian  = RBLDB_IMAGE_ENDIAN;
+    image->count   = count;
+    image->words   = words;
+    image->ranges  = ranges.len;
+    if (words & 1) {
+        image->payload[words] = 0;
+    }
+    memcpy((char *)image + rbldb_image_ranges_offset(words), ranges.data,
+           ranges.len * sizeof(rbldb_range_t));
+    image->v6_count = prefixes.len;
+    image->v6_nodes = v6.len;
+    memset((char *)image + rbldb_image_ranges_offset(words)
+           + ranges.len * sizeof(rbldb_range_t), 0,
+           rbldb_image_v6_offset(words, ranges.len)
+           - rbldb_image_ranges_offset(words)
+           - ranges.len * sizeof(rbldb_range_t));
+    memcpy((char *)image + rbldb_image_v6_offset(words, ranges.len), v6.data,
+           v6.len * sizeof(rbldb_v6_node_t));
+    array_wipe(ranges);
+    array_wipe(prefixes);
+    array_wipe(v6);
+
+    words = 0;
+    for (int i = 0 ; i < 1 << 16 ; ++i) {
+        const uint16_t *bucket = lows + offsets[i];
+        uint16_t *out = image->payload + words;
+
+        image->offsets[i] = words;
+        if (lens[i] >= RBLDB_BITMAP_WORDS) {
+            image->offsets[i] |= RBLDB_BITMAP;
+            ++bitmaps;
+            memset(out, 0, RBLDB_BITMAP_WORDS * sizeof(uint16_t));
+            for (uint32_t j = 0 ; j < lens[i] ; ++j) {
+                out[bucket[j] >> 4] |= 1 << (bucket[j] & 0xf);
+            }
+            words += RBLDB_BITMAP_WORDS;
+        } else {
+            memcpy(out, bucket, lens[i] * sizeof(uint16_t));
+            words += lens[i];
+        }
+    }
+    image->offsets[1 << 16] = words;
+    image->bitmaps = bitmaps;
+    p_delete(&lows);
+    p_delete(&lens);
+    p_delete(&offsets);
+    return image;
+}
+
+static bool rbldb_image_is_compiled(const file_map_t *map)
+{
+    return map->end - map->map >= (ssize_t)sizeof(RBLDB_IMAGE_MAGIC) - 1
+        && memcmp(map->map, RBLDB_IMAGE_MAGIC,
+                  sizeof(RBLDB_IMAGE_MAGIC) - 1) == 0;
+}
+
+static bool rbldb_image_check(const file_map_t *map, const char *file)
+{
+    const rbldb_image_t *image = (const rbldb_image_t *)map->map;
+    const size_t size = map->end - map->map;
+
+    if (size < sizeof(rbldb_image_t)) {
+        err("%s: truncated ip list image", file);
+        return false;
+    }
+    if (image->endian != RBLDB_IMAGE_ENDIAN) {
+        err("%s: ip list image compiled on a different architecture", file);
+        return false;
+    }
+    if (image->version != RBLDB_IMAGE_VERSION) {
+        err("%s: unsupported ip list image version %u", file, image->version);
+        return false;
+    }
+    if (size != rbldb_image_size(image->words, image->ranges,
+                                 image->v6_nodes)
+        || image->offsets[0] & RBLDB_OFFSET_MASK
+        || image->offsets[1 << 16] != image->words) {
+        err("%s: corrupted ip list image", file);
+        return false;
+    }
+    for (int i = 0 ; i < 1 << 16 ; ++i) {
+        const uint32_t start = image->offsets[i] & RBLDB_OFFSET_MASK;
+        const uint32_t end   = image->offsets[i + 1] & RBLDB_OFFSET_MASK;
+        if (start > end || ((image->offsets[i] & RBLDB_BITMAP)
+                            && end - start != RBLDB_BITMAP_WORDS)) {
+            err("%s: corrupted ip list image", file);
+            return false;
+        }
+    }
+    for (uint32_t i = 0 ; i < image->ranges ; ++i) {
+        const rbldb_range_t *range = rbldb_image_ranges(image) + i;
+        if (range->start > range->end
+            || (i > 0 && range[-1].end >= range->start)) {
+            err("%s: corrupted ip list image", file);
+            return false;
+        }
+    }
+    for (uint32_t i = 0 ; i < image->v6_nodes ; ++i) {
+        const rbldb_v6_node_t *node = rbldb_image_v6(image) + i;
+        if (node->children != 0
+            && (node->base <= i || node->base > image->v6_nodes
+                || image->v6_nodes - node->base
+                   < (uint32_t)__builtin_popcountll(node->children))) {
+            err("%s: corrupted ip list image", file);
+            return false;
+        }
+    }
+    return true;
+}
+
+rbldb_t *rbldb_create(const char *file, bool lock)
+{
+    rbldb_t *db;
+    rbldb_resource_t *res;
+    file_map_t map;
+    time_t now = time(0);
+
+    if (!file_map_open(&map, file, false)) {
+        return NULL;
+    }
+
+    /* The current version of the list may be in use by running queries, so
+     * it is never modified: a new version is built if the file changed.
+     */
+    res = resource_get("iplist", file);
+    if (res != NULL) {
+        if (map.st.st_size == res->size && map.st.st_mtime == res->mtime) {
+            notice("%s loaded: already up-to-date", file);
+            file_map_close(&map);
+            goto done;
+        }
+        resource_release("iplist", file, res);
     }
+    res = p_new(rbldb_resource_t, 1);
+    res->size  = map.st.st_size;
+    res->mtime = map.st.st_mtime;
+
+    /* A compiled image is used in place: its pages are shared through the
+     * page cache and nothing has to be parsed or sorted.
+     */
+    if (rbldb_image_is_compiled(&map)) {
+        if (!rbldb_image_check(&map, file)) {
+            file_map_close(&map);
+            p_delete(&res);
+            return NULL;
+        }
+        res->mapped     = true;
+        res->map        = map;
+        res->image      = (rbldb_image_t *)map.map;
+        res->image_size = map.end - map.map;
+    } else {
+        res->image = rbldb_image_build(&map, file, &res->image_size);
+        file_map_close(&map);
+    }
+
+    /* Lookup may perform serveral I/O, so avoid swap.
+     */
+    if (lock) {
+        if (mlock(res->image, res->image_size) < 0) {
+            UNIXERR("mlock");
+        } else {
+            res->locked = true;
+        }
+    }
+
+    resource_set("iplist", file, res,
+                 (resource_destructor_f)rbldb_resource_wipe);
+    notice("%s loaded: done in %us, %u IPs, %u networks, %u IPv6 prefixes, "
+           "%zukB, %u dense /16%s", file, (uint32_t)(time(0) - now),
+           res->image->count, res->image->ranges, res->image->v6_count,
+           res->image_size >> 10, res->image->bitmaps,
+           res->mapped ? " (compiled image)" : "");
 
-    notice("%s loaded: done in %us, %u IPs", file, (uint32_t)(time(0) - now),
-           ips);
+  done:
+    db = p_new(rbldb_t, 1);
+    db->filename = m_strdup(file);
+    db->res   = res;
+    db->image = res->image;
     return db;
 }
 
+bool rbldb_compile(const char *file, const char *output)
+{
+    char tmp[PATH_MAX];
+    rbldb_image_t *image;
+    file_map_t map;
+    size_t size;
+    ssize_t written = 0;
+    uint32_t count, ranges, v6_count;
+    int fd;
+
+    if (!file_map_open(&map, file, false)) {
+        return false;
+    }
+    if (rbldb_image_is_compiled(&map)) {
+        err("%s is already a compiled ip list", file);
+        file_map_close(&map);
+        return false;
+    }
+    image = rbldb_image_build(&map, file, &size);
+    count  = image->count;
+    ranges = image->ranges;
+    v6_count = image->v6_count;
+    file_map_close(&map);
+
+    /* The image is renamed once complete since a running postlicyd may have
+     * the previous one mapped.
+     */
+    snprintf(tmp, sizeof(tmp), "%s.tmp", output);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        UNIXERR("open");
+        p_delete(&image);
+        return false;
+    }
+    while (written < (ssize_t)size) {
+        ssize_t res = write(fd, (const char *)image + written, size - written);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            UNIXERR("write");
+            break;
+        }
+        written += res;
+    }
+    p_delete(&image);
+    if (written != (ssize_t)size || fsync(fd) < 0) {
+        close(fd);
+        unlink(tmp);
+        return false;
+    }
+    close(fd);
+    if (rename(tmp, output) < 0) {
+        UNIXERR("rename");
+        unlink(tmp);
+        return false;
+    }
+    notice("%s compiled into %s, %u IPs, %u networks, %u IPv6 prefixes, "
+           "%zukB", file, output, count, ranges, v6_count, size >> 10);
+    return true;
+}
+
 static void rbldb_wipe(rbldb_t *db)
 {
-    resource_release("iplist", db->filename);
+    resource_release("iplist", db->filename, db->res);
     p_delete(&db->filename);
-    db->ips = NULL;
+    db->res   = NULL;
+    db->image = NULL;
 }
 
 void rbldb_delete(rbldb_t **db)
@@ -230,37 +851,538 @@ void rbldb_delete(rbldb_t **db)
     }
 }
 
-uint32_t rbldb_stats(const rbldb_t *rbl)
+void rbldb_stats(const rbldb_t *rbl, uint32_t *ipv4, uint32_t *ipv6)
 {
-    uint32_t ips = 0;
-    for (int i = 0 ; i < 1 << 16 ; ++i) {
-        ips += array_len(rbl->ips[i]);
+    if (ipv4) {
+        *ipv4 = rbl->image->count + rbl->image->ranges;
+    }
+    if (ipv6) {
+        *ipv6 = rbl->image->v6_count;
     }
-    return ips;
+}
+
+size_t rbldb_memory(const rbldb_t *rbl)
+{
+    return rbldb_image_size(rbl->image->words, rbl->image->ranges,
+                            rbl->image->v6_nodes);
+}
+
+static bool rbldb_ipv4_range_lookup(const rbldb_image_t *image, uint32_t ip)
+{
+    const rbldb_range_t *ranges = rbldb_image_ranges(image);
+    int32_t i = rbldb_range_find(ranges, image->ranges, ip);
+
+    return i >= 0 && ip <= ranges[i].end;
 }
 
 bool rbldb_ipv4_lookup(const rbldb_t *db, uint32_t ip)
 {
     const uint16_t hip = ip >> 16;
     const uint16_t lip = ip & 0xffff;
-    int l = 0, r = db->ips[hip].len;
+    const uint32_t start = db->image->offsets[hip];
+    const uint16_t *ips = db->image->payload;
+    uint32_t l, r;
 
+    if (start & RBLDB_BITMAP) {
+        ips += start & RBLDB_OFFSET_MASK;
+        if (ips[lip >> 4] & (1 << (lip & 0xf))) {
+            return true;
+        }
+        return db->image->ranges && rbldb_ipv4_range_lookup(db->image, ip);
+    }
+    l = start;
+    r = db->image->offsets[hip + 1] & RBLDB_OFFSET_MASK;
     while (l < r) {
-        int i = (r + l) / 2;
+        uint32_t i = (r + l) / 2;
 
-        if (array_elt(db->ips[hip], i) == lip)
+        if (ips[i] == lip)
             return true;
 
-        if (lip < array_elt(db->ips[hip], i)) {
+        if (lip < ips[i]) {
             r = i;
         } else {
             l = i + 1;
         }
     }
+    return db->image->ranges && rbldb_ipv4_range_lookup(db->image, ip);
+}
+
+bool rbldb_ipv6_lookup(const rbldb_t *db, const uint8_t ip[16])
+{
+    const rbldb_v6_node_t *nodes;
+    uint64_t hi = 0, lo = 0;
+    uint32_t node = 0;
+
+    if (db->image->v6_nodes == 0) {
+        return false;
+    }
+    for (int i = 0 ; i < 8 ; ++i) {
+        hi = (hi << 8) | ip[i];
+        lo = (lo << 8) | ip[i + 8];
+    }
+    nodes = rbldb_image_v6(db->image);
+    for (int depth = 0 ; depth < 128 ; depth += RBLDB_V6_STRIDE) {
+        const uint64_t bit = 1ULL << rbldb_v6_slot(hi, lo, depth);
+
+        if (nodes[node].listed & bit) {
+            return true;
+        }
+        if (!(nodes[node].children & bit)) {
+            return false;
+        }
+        node = nodes[node].base
+             + __builtin_popcountll(nodes[node].children & (bit - 1));
+    }
     return false;
 }
 
 
+/* Merged lookup table of several lists.
+ *
+ * The table maps each ip found in one of the lists to the bitmask of the
+ * lists that contain it, so that a filter with several lists performs a single
+ * lookup per query. It uses the same layout as the image of a list (without
+ * bitmaps): the sorted lower bits of the ips of a /16 group are stored in
+ * keys[offsets[i]..offsets[i + 1]] and lists[] holds the index of their
+ * bitmask in masks[]. The lists share few distinct bitmasks, so an entry costs
+ * 4 bytes.
+ *
+ * The table is a copy of the lists held in memory next to them: it is only
+ * built below RBLDB_MERGE_MAX_IPS ips, and it is locked in memory when one of
+ * its lists is.
+ *
+ * The table is shared by the filters that use the same lists. It is rebuilt
+ * if one of its lists changed.
+ */
+#define RBLDB_MERGE_MAX_MASKS  (1 << 16)
+
+typedef struct rbldb_merge_resource_t {
+    int      count;
+    time_t   mtimes[RBLDB_MERGE_MAX];
+    off_t    sizes[RBLDB_MERGE_MAX];
+
+    uint32_t *offsets;
+    uint16_t *keys;
+    uint16_t *lists;
+    size_t   entries;
+    uint32_t *masks;
+    uint32_t mask_count;
+
+    /* Disjoint networks, each with the bitmask of the lists covering it.
+     */
+    rbldb_range_t *ranges;
+    uint32_t *range_masks;
+    uint32_t range_count;
+
+    bool     locked;
+} rbldb_merge_resource_t;
+
+struct rbldb_merge_t {
+    char *key;
+    rbldb_merge_resource_t *res;
+};
+
+/* Size of the arrays of the table, in the order of rbldb_merge_arrays.
+ */
+#define RBLDB_MERGE_ARRAYS  6
+
+static void rbldb_merge_arrays(const rbldb_merge_resource_t *res,
+                               const void *arrays[RBLDB_MERGE_ARRAYS],
+                               size_t sizes[RBLDB_MERGE_ARRAYS])
+{
+    arrays[0] = res->offsets;
+    sizes[0]  = ((1 << 16) + 1) * sizeof(uint32_t);
+    arrays[1] = res->keys;
+    sizes[1]  = res->entries * sizeof(uint16_t);
+    arrays[2] = res->lists;
+    sizes[2]  = res->entries * sizeof(uint16_t);
+    arrays[3] = res->masks;
+    sizes[3]  = res->mask_count * sizeof(uint32_t);
+    arrays[4] = res->ranges;
+    sizes[4]  = res->range_count * sizeof(rbldb_range_t);
+    arrays[5] = res->range_masks;
+    sizes[5]  = res->range_count * sizeof(uint32_t);
+}
+
+static size_t rbldb_merge_size(const rbldb_merge_resource_t *res)
+{
+    const void *arrays[RBLDB_MERGE_ARRAYS];
+    size_t sizes[RBLDB_MERGE_ARRAYS];
+    size_t size = 0;
+
+    rbldb_merge_arrays(res, arrays, sizes);
+    for (int i = 0 ; i < RBLDB_MERGE_ARRAYS ; ++i) {
+        size += sizes[i];
+    }
+    return size;
+}
+
+/* Lookup may perform serveral I/O, so avoid swap, as for the lists.
+ */
+static void rbldb_merge_lock(rbldb_merge_resource_t *res)
+{
+    const void *arrays[RBLDB_MERGE_ARRAYS];
+    size_t sizes[RBLDB_MERGE_ARRAYS];
+
+    rbldb_merge_arrays(res, arrays, sizes);
+    for (int i = 0 ; i < RBLDB_MERGE_ARRAYS ; ++i) {
+        if (sizes[i] > 0 && mlock(arrays[i], sizes[i]) < 0) {
+            UNIXERR("mlock");
+            while (i-- > 0) {
+                if (sizes[i] > 0) {
+                    munlock(arrays[i], sizes[i]);
+                }
+            }
+            return;
+        }
+    }
+    res->locked = true;
+}
+
+static void rbldb_merge_resource_wipe(rbldb_merge_resource_t *res)
+{
+    if (res->locked) {
+        const void *arrays[RBLDB_MERGE_ARRAYS];
+        size_t sizes[RBLDB_MERGE_ARRAYS];
+
+        rbldb_merge_arrays(res, arrays, sizes);
+        for (int i = 0 ; i < RBLDB_MERGE_ARRAYS ; ++i) {
+            if (sizes[i] > 0) {
+                munlock(arrays[i], sizes[i]);
+            }
+        }
+    }
+    p_delete(&res->offsets);
+    p_delete(&res->keys);
+    p_delete(&res->lists);
+    p_delete(&res->masks);
+    p_delete(&res->ranges);
+    p_delete(&res->range_masks);
+    p_delete(&res);
+}
+
+static bool rbldb_merge_is_uptodate(const rbldb_merge_resource_t *res,
+                                    rbldb_t * const *rbls, int count)
+{
+    if (res->count != count) {
+        return false;
+    }
+    for (int i = 0 ; i < count ; ++i) {
+        if (res->mtimes[i] != rbls[i]->res->mtime
+            || res->sizes[i] != rbls[i]->res->size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Write the sorted lower bits of the ips of the group @p hip in @p out.
+ */
+static uint32_t rbldb_group_get(const rbldb_image_t *image, uint16_t hip,
+                                uint16_t *out)
+{
+    const uint32_t start = image->offsets[hip];
+    const uint32_t end   = image->offsets[hip + 1] & RBLDB_OFFSET_MASK;
+    const uint16_t *group = image->payload + (start & RBLDB_OFFSET_MASK);
+    uint32_t len = 0;
+
+    if (!(start & RBLDB_BITMAP)) {
+        len = end - (start & RBLDB_OFFSET_MASK);
+        memcpy(out, group, len * sizeof(uint16_t));
+        return len;
+    }
+    for (uint32_t i = 0 ; i < RBLDB_BITMAP_WORDS ; ++i) {
+        for (uint16_t word = group[i] ; word ; word &= word - 1) {
+            out[len++] = (i << 4) | __builtin_ctz(word);
+        }
+    }
+    return len;
+}
+
+/* Split the networks of the lists at all their bounds: each segment between
+ * two consecutive bounds is covered by a fixed set of lists.
+ */
+static void rbldb_merge_build_ranges(rbldb_merge_resource_t *res,
+                                     rbldb_t * const *rbls, int count)
+{
+    A(uint64_t) bounds = ARRAY_INIT;
+    A(rbldb_range_t) ranges = ARRAY_INIT;
+    A(uint32_t) masks = ARRAY_INIT;
+    uint32_t len = 0;
+
+    for (int i = 0 ; i < count ; ++i) {
+        const rbldb_image_t *image = rbls[i]->image;
+        for (uint32_t j = 0 ; j < image->ranges ; ++j) {
+            array_add(bounds, rbldb_image_ranges(image)[j].start);
+            array_add(bounds, (uint64_t)rbldb_image_ranges(image)[j].end + 1);
+        }
+    }
+    if (bounds.len == 0) {
+        return;
+    }
+#   define QSORT_TYPE uint64_t
+#   define QSORT_BASE bounds.data
+#   define QSORT_NELT bounds.len
+#   define QSORT_LT(a,b) *a < *b
+#   include "qsort.c"
+    foreach (bound, bounds) {
+        if (len == 0 || array_elt(bounds, len - 1) != *bound) {
+            array_elt(bounds, len++) = *bound;
+        }
+    }
+    bounds.len = len;
+
+    for (uint32_t i = 0 ; i + 1 < bounds.len ; ++i) {
+        const rbldb_range_t segment = {
+            .start = array_elt(bounds, i),
+            .end   = array_elt(bounds, i + 1) - 1,
+        };
+        uint32_t mask = 0;
+
+        for (int j = 0 ; j < count ; ++j) {
+            const rbldb_image_t *image = rbls[j]->image;
+            if (image->ranges
+                && rbldb_ipv4_range_lookup(image, segment.start)) {
+                mask |= 1U << j;
+            }
+        }
+        if (mask == 0) {
+            continue;
+        }
+        if (ranges.len > 0 && array_last(masks) == mask
+            && array_last(ranges).end + 1 == segment.start) {
+            array_last(ranges).end = segment.end;
+        } else {
+            array_add(ranges, segment);
+            array_add(masks, mask);
+        }
+    }
+    array_wipe(bounds);
+    array_adjust(ranges);
+    array_adjust(masks);
+    res->ranges      = ranges.data;
+    res->range_masks = masks.data;
+    res->range_count = ranges.len;
+}
+
+/* Index of @p mask in the distinct bitmasks of @p res, -1 if there are
+ * already RBLDB_MERGE_MAX_MASKS of them. @p slots is an open addressing
+ * table of 2 * RBLDB_MERGE_MAX_MASKS indexes + 1 (0 for an empty slot).
+ */
+static int rbldb_merge_mask_index(A(uint32_t) *masks, uint32_t *slots,
+                                  uint32_t mask)
+{
+    uint32_t h = (mask * 0x9e3779b1U) >> 15;
+
+    for (;; h = (h + 1) & (2 * RBLDB_MERGE_MAX_MASKS - 1)) {
+        if (slots[h] == 0) {
+            if (masks->len == RBLDB_MERGE_MAX_MASKS) {
+                return -1;
+            }
+            array_add(*masks, mask);
+            slots[h] = masks->len;
+            return masks->len - 1;
+        }
+        if (array_elt(*masks, slots[h] - 1) == mask) {
+            return slots[h] - 1;
+        }
+    }
+}
+
+/* Build the merged table, NULL if the lists combine in too many distinct
+ * bitmasks.
+ */
+static rbldb_merge_resource_t *rbldb_merge_build(rbldb_t * const *rbls,
+                                                 int count)
+{
+    rbldb_merge_resource_t *res = p_new(rbldb_merge_resource_t, 1);
+    uint16_t *lows = p_new(uint16_t, 1 << 16);
+    uint32_t *slots = p_new(uint32_t, 2 * RBLDB_MERGE_MAX_MASKS);
+    A(uint32_t) pairs = ARRAY_INIT;
+    A(uint16_t) keys  = ARRAY_INIT;
+    A(uint32_t) entry_masks = ARRAY_INIT;
+    A(uint16_t) lists = ARRAY_INIT;
+    A(uint32_t) masks = ARRAY_INIT;
+
+    res->count   = count;
+    res->offsets = p_new(uint32_t, (1 << 16) + 1);
+    for (int i = 0 ; i < count ; ++i) {
+        res->mtimes[i] = rbls[i]->res->mtime;
+        res->sizes[i]  = rbls[i]->res->size;
+    }
+
+    /* In each group, the entries of all the lists are tagged with the index
+     * of their list (in the 5 lower bits) and sorted: the entries of the
+     * same ip are consecutive.
+     */
+    for (int hip = 0 ; hip < 1 << 16 ; ++hip) {
+        array_len(pairs) = 0;
+        for (int i = 0 ; i < count ; ++i) {
+            uint32_t len = rbldb_group_get(rbls[i]->image, hip, lows);
+            array_ensure_capacity_delta(pairs, len);
+            for (uint32_t j = 0 ; j < len ; ++j) {
+                array_elt(pairs, array_len(pairs)++) = (lows[j] << 5) | i;
+            }
+        }
+        res->offsets[hip] = array_len(keys);
+        if (array_len(pairs) > 1) {
+#       define QSORT_TYPE uint32_t
+#       define QSORT_BASE pairs.data
+#       define QSORT_NELT pairs.len
+#       define QSORT_LT(a,b) *a < *b
+#       include "qsort.c"
+        }
+        array_len(entry_masks) = 0;
+        foreach (pair, pairs) {
+            const uint16_t lip = *pair >> 5;
+            if (array_len(keys) > res->offsets[hip]
+                && array_last(keys) == lip) {
+                array_last(entry_masks) |= 1U << (*pair & 0x1f);
+            } else {
+                array_add(keys, lip);
+                array_add(entry_masks, 1U << (*pair & 0x1f));
+            }
+        }
+        foreach (mask, entry_masks) {
+            int index = rbldb_merge_mask_index(&masks, slots, *mask);
+            if (index < 0) {
+                break;
+            }
+            array_add(lists, index);
+        }
+        if (array_len(lists) != array_len(keys)) {
+            break;
+        }
+    }
+    array_wipe(pairs);
+    array_wipe(entry_masks);
+    p_delete(&lows);
+    p_delete(&slots);
+    if (array_len(lists) != array_len(keys)) {
+        array_wipe(keys);
+        array_wipe(lists);
+        array_wipe(masks);
+        rbldb_merge_resource_wipe(res);
+        return NULL;
+    }
+    res->offsets[1 << 16] = array_len(keys);
+    res->entries = array_len(keys);
+    res->mask_count = array_len(masks);
+    array_adjust(keys);
+    array_adjust(lists);
+    array_adjust(masks);
+    res->keys  = keys.data;
+    res->lists = lists.data;
+    res->masks = masks.data;
+
+    rbldb_merge_build_ranges(res, rbls, count);
+    return res;
+}
+
+rbldb_merge_t *rbldb_merge(rbldb_t * const *rbls, int count)
+{
+    rbldb_merge_t *merge;
+    rbldb_merge_resource_t *res;
+    buffer_t key = ARRAY_INIT;
+    time_t now = time(0);
+    uint64_t ips = 0;
+    bool lock = false;
+
+    if (count == 0 || count > RBLDB_MERGE_MAX) {
+        return NULL;
+    }
+    for (int i = 0 ; i < count ; ++i) {
+        ips  += rbls[i]->image->count;
+        lock |= rbls[i]->res->locked;
+    }
+    if (ips > RBLDB_MERGE_MAX_IPS) {
+        notice("%d lists not merged: %llu IPs, looked up one by one", count,
+               (unsigned long long)ips);
+        return NULL;
+    }
+    for (int i = 0 ; i < count ; ++i) {
+        if (i > 0) {
+            buffer_addch(&key, '\n');
+        }
+        buffer_addstr(&key, rbls[i]->filename);
+    }
+
+    resource_lock("iplist-merge", key.data);
+    res = resource_get("iplist-merge", key.data);
+    if (res != NULL) {
+        if (rbldb_merge_is_uptodate(res, rbls, count)) {
+            goto done;
+        }
+        resource_release("iplist-merge", key.data, res);
+    }
+    res = rbldb_merge_build(rbls, count);
+    if (res == NULL) {
+        notice("%d lists not merged: more than %d combinations of lists, "
+               "looked up one by one", count, RBLDB_MERGE_MAX_MASKS);
+        resource_unlock("iplist-merge", key.data);
+        buffer_wipe(&key);
+        return NULL;
+    }
+    if (lock) {
+        rbldb_merge_lock(res);
+    }
+    resource_set("iplist-merge", key.data, res,
+                 (resource_destructor_f)rbldb_merge_resource_wipe);
+    notice("%d lists merged: done in %us, %zu IPs, %u networks, %zukB%s",
+           count, (uint32_t)(time(0) - now), res->entries, res->range_count,
+           rbldb_merge_size(res) >> 10, res->locked ? ", locked" : "");
+
+  done:
+    resource_unlock("iplist-merge", key.data);
+    merge = p_new(rbldb_merge_t, 1);
+    merge->key = m_strdup(key.data);
+    merge->res = res;
+    buffer_wipe(&key);
+    return merge;
+}
+
+void rbldb_merge_delete(rbldb_merge_t **merge)
+{
+    if (*merge) {
+        resource_release("iplist-merge", (*merge)->key, (*merge)->res);
+        p_delete(&(*merge)->key);
+        p_delete(merge);
+    }
+}
+
+uint32_t rbldb_merge_ipv4_lookup(const rbldb_merge_t *merge, uint32_t ip)
+{
+    const rbldb_merge_resource_t *res = merge->res;
+    const uint16_t hip = ip >> 16;
+    const uint16_t lip = ip & 0xffff;
+    uint32_t l = res->offsets[hip];
+    uint32_t r = res->offsets[hip + 1];
+    uint32_t mask = 0;
+
+    while (l < r) {
+        uint32_t i = (r + l) / 2;
+
+        if (res->keys[i] == lip) {
+            mask = res->masks[res->lists[i]];
+            break;
+        }
+
+        if (lip < res->keys[i]) {
+            r = i;
+        } else {
+            l = i + 1;
+        }
+    }
+    if (res->range_count) {
+        int32_t i = rbldb_range_find(res->ranges, res->range_count, ip);
+        if (i >= 0 && ip <= res->ranges[i].end) {
+            mask |= res->range_masks[i];
+        }
+    }
+    return mask;
+}
+
+
 /* postlicyd filter declaration */
 
 #include "filter.h"
@@ -268,42 +1390,74 @@ bool rbldb_ipv4_lookup(const rbldb_t *db, uint32_t ip)
 typedef struct iplist_filter_t {
     PA(rbldb_t) rbls;
     A(int)      weights;
-    A(char)     hosts;
-    A(int)      host_offsets;
-    A(int)      host_weights;
+    rbldb_merge_t *merge;
+
+    /* Weight of all the lists if they have the same, -1 otherwise.
+     */
+    int         uniform_weight;
+    A(dns_zone_t) zones;
 
     int32_t     hard_threshold;
     int32_t     soft_threshold;
 } iplist_filter_t;
 
 typedef struct iplist_async_data_t {
-    A(dns_result_t) results;
+    A(dns_answer_t) results;
     int awaited;
     uint32_t sum;
+    uint32_t pending;
     bool error;
 } iplist_async_data_t;
+/* A list file to load while building the filter.
+ */
+typedef struct iplist_load_t {
+    const char *file;
+    bool lock;
+    int weight;
+    rbldb_t *rbl;
+} iplist_load_t;
+ARRAY(iplist_load_t)
+
 DO_INIT(iplist_filter_t, iplist_filter);
 DO_NEW(iplist_filter_t, iplist_filter);
 
 static void iplist_filter_wipe(iplist_filter_t *rbl)
 {
+    rbldb_merge_delete(&rbl->merge);
     array_deep_wipe(rbl->rbls, rbldb_delete);
     array_wipe(rbl->weights);
-    array_wipe(rbl->hosts);
-    array_wipe(rbl->host_offsets);
-    array_wipe(rbl->host_weights);
+    dns_zones_wipe(&rbl->zones);
 }
 DO_DELETE(iplist_filter_t, iplist_filter);
 
 
+static bool iplist_load_job(void *data, int i)
+{
+    iplist_load_t *load = array_ptr(*(A(iplist_load_t) *)data, i);
+
+    /* Several configurations may load the same file at once.
+     */
+    resource_lock("iplist", load->file);
+    load->rbl = rbldb_create(load->file, load->lock);
+    resource_unlock("iplist", load->file);
+    if (load->rbl == NULL) {
+        err("cannot load rbl db from %s", load->file);
+        return false;
+    }
+    return true;
+}
+
 static bool iplist_filter_constructor(filter_t *filter)
 {
     iplist_filter_t *data = iplist_filter_new();
+    A(iplist_load_t) loads = ARRAY_INIT;
+    bool loaded;
 
 #define PARSE_CHECK(Expr, Str, ...)                                          \
     if (!(Expr)) {                                                           \
         err(Str, ##__VA_ARGS__);                                             \
         iplist_filter_delete(&data);                                         \
+        array_wipe(loads);                                                   \
         return false;                                                        \
     }
 
@@ -324,7 +1478,6 @@ static bool iplist_filter_constructor(filter_t *filter)
           case ATK_FILE: case ATK_RBLDNS: {
             bool lock = false;
             int  weight = 0;
-            rbldb_t *rbl = NULL;
             const char *current = param->value;
             const char *p = m_strchrnul(param->value, ':');
             char *next = NULL;
@@ -353,13 +1506,14 @@ static bool iplist_filter_constructor(filter_t *filter)
                                 (int)(p - current), current);
                     break;
 
-                  case 2:
-                    rbl = rbldb_create(current, lock);
-                    PARSE_CHECK(rbl != NULL,
-                                "cannot load rbl db from %s", current);
-                    array_add(data->rbls, rbl);
-                    array_add(data->weights, weight);
-                    break;
+                  case 2: {
+                    iplist_load_t load = {
+                        .file   = current,
+                        .lock   = lock,
+                        .weight = weight,
+                    };
+                    array_add(loads, load);
+                  } break;
                 }
                 if (i != 2) {
                     current = p + 1;
@@ -369,8 +1523,9 @@ static bool iplist_filter_constructor(filter_t *filter)
           } break;
 
           /* dns parameter.
-           *  weight:hostname.
-           * define a RBL to use through DNS resolution.
+           *  weight:hostname, weight:hostname=a.b.c.d or weight:hostname&mask
+           * define a RBL to use through DNS resolution. A RBL given several
+           * times with conditions on its answer is queried only once.
            */
           case ATK_DNS: {
             int  weight = 0;
@@ -389,9 +1544,8 @@ static bool iplist_filter_constructor(filter_t *filter)
                     break;
 
                   case 1:
-                    array_add(data->host_offsets, array_len(data->hosts));
-                    array_append(data->hosts, current, strlen(current) + 1);
-                    array_add(data->host_weights, weight);
+                    PARSE_CHECK(dns_zone_add(&data->zones, current, weight),
+                                "illegal dns list %s", current);
                     break;
                 }
                 if (i != 1) {
@@ -421,8 +1575,36 @@ static bool iplist_filter_constructor(filter_t *filter)
         }
     }
 
-    PARSE_CHECK(data->rbls.len || data->host_offsets.len,
+    /* The files are parsed and sorted concurrently.
+     */
+    loaded = worker_parallel(loads.len, iplist_load_job, &loads);
+    foreach (load, loads) {
+        if (load->rbl != NULL) {
+            array_add(data->rbls, load->rbl);
+            array_add(data->weights, load->weight);
+        }
+    }
+    PARSE_CHECK(loaded, "cannot load the lists of the filter %s",
+                filter->name);
+    array_wipe(loads);
+
+    /* With several lists, a single lookup in their merged table gives all
+     * the lists that contain the ip.
+     */
+    data->uniform_weight = array_len(data->weights) ? data->weights.data[0]
+                                                    : -1;
+    foreach (weight, data->weights) {
+        if (*weight != data->uniform_weight) {
+            data->uniform_weight = -1;
+        }
+    }
+    if (data->rbls.len > 1) {
+        data->merge = rbldb_merge(data->rbls.data, data->rbls.len);
+    }
+
+    PARSE_CHECK(data->rbls.len || data->zones.len,
                 "no file parameter in the filter %s", filter->name);
+    filter_depends_on(filter, PTK_CLIENT_ADDRESS);
     filter->data = data;
     return true;
 }
@@ -434,47 +1616,58 @@ static void iplist_filter_destructor(filter_t *filter)
     filter->data = data;
 }
 
-static void iplist_filter_async(dns_result_t *result, void *arg)
+/* Result of the filter given the answers received so far, HTK_ASYNC if the
+ * pending answers may still change it. The weights are positive, so the
+ * score can only grow by the weights of the pending queries.
+ */
+static filter_result_t iplist_async_result(const iplist_filter_t *data,
+                                           const iplist_async_data_t *async)
+{
+    const int64_t sum = async->sum;
+    const int64_t max = sum + async->pending;
+
+    if (sum >= data->hard_threshold) {
+        return HTK_HARD_MATCH;
+    }
+    if (async->error) {
+        return async->awaited > 0 ? HTK_ASYNC : HTK_ERROR;
+    }
+    if (max < data->hard_threshold) {
+        if (sum >= data->soft_threshold) {
+            return HTK_SOFT_MATCH;
+        } else if (max < data->soft_threshold) {
+            return HTK_FAIL;
+        }
+    }
+    return HTK_ASYNC;
+}
+
+static void iplist_filter_async(dns_answer_t *answer, void *arg)
 {
     filter_context_t   *context = arg;
     const filter_t      *filter = context->current_filter;
     const iplist_filter_t *data = filter->data;
     iplist_async_data_t  *async = filter_context(filter, context);
+    const int rbl = answer - array_ptr(async->results, 0);
+    const dns_zone_t *zone = array_ptr(data->zones, rbl);
+    filter_result_t res;
 
-
-    if (*result != DNS_ERROR) {
+    if (answer->result != DNS_ERROR) {
         async->error = false;
     }
+    async->sum += dns_zone_score(zone, answer);
+    async->pending -= zone->weight;
     --async->awaited;
 
     debug("got asynchronous request result for filter %s, rbl %d, "
-          "still awaiting %d answers", filter->name,
-          (int)(result - array_ptr(async->results, 0)), async->awaited);
-
-    if (async->awaited == 0) {
-        filter_result_t res = HTK_FAIL;
-        if (async->error) {
-            res = HTK_ERROR;
-        } else {
-            for (uint32_t i = 0 ; i < array_len(data->host_offsets) ; ++i) {
-                int weight = array_elt(data->host_weights, i);
-
-                switch (array_elt(async->results, i)) {
-                  case DNS_ASYNC:
-                    crit("no more awaited answer but result is ASYNC");
-                    abort();
-                  case DNS_FOUND:
-                    async->sum += weight;
-                    break;
-                  default:
-                    break;
-                }
-            }
-            if (async->sum >= (uint32_t)data->hard_threshold) {
-                res = HTK_HARD_MATCH;
-            } else if (async->sum >= (uint32_t)data->soft_threshold) {
-                res = HTK_SOFT_MATCH;
-            }
+          "still awaiting %d answers", filter->name, rbl, async->awaited);
+
+    res = iplist_async_result(data, async);
+    if (res != HTK_ASYNC) {
+        if (async->awaited > 0) {
+            debug("filter %s decided, ignoring %d pending answers",
+                  filter->name, async->awaited);
+            dns_cancel(context);
         }
         debug("answering to filter %s", filter->name);
         filter_post_async_result(context, res);
@@ -486,6 +1679,7 @@ static filter_result_t iplist_filter(const filter_t *filter,
                                      filter_context_t *context)
 {
     uint32_t ip;
+    uint8_t ip6[16];
     int32_t sum = 0;
     const char *end = NULL;
     const iplist_filter_t *data = filter->data;
@@ -497,44 +1691,95 @@ static filter_result_t iplist_filter(const filter_t *filter,
     }
 
     if (parse_ipv4(query->client_address.str, &end, &ip) != 0) {
-        if (strchr(query->client_address.str, ':')) {
-            /* iplist only works on IPv4 */
+        if (inet_pton(AF_INET6, query->client_address.str, ip6) != 1) {
+            warn("invalid client address: %s, expected ipv4 or ipv6",
+                 query->client_address.str);
+            return HTK_ERROR;
+        }
+
+        /* rbl lookups are only performed for IPv4 addresses, IPv6 addresses
+         * are only checked against the local lists.
+         */
+        if (data->rbls.len == 0) {
             return HTK_FAIL;
         }
-        warn("invalid client address: %s, expected ipv4",
-             query->client_address.str);
-        return HTK_ERROR;
+        for (uint32_t i = 0 ; i < data->rbls.len ; ++i) {
+            if (rbldb_ipv6_lookup(array_elt(data->rbls, i), ip6)) {
+                sum += array_elt(data->weights, i);
+                if (sum >= data->hard_threshold) {
+                    return HTK_HARD_MATCH;
+                }
+            }
+        }
+        if (sum >= data->soft_threshold) {
+            return HTK_SOFT_MATCH;
+        }
+        return HTK_FAIL;
     }
-    for (uint32_t i = 0 ; i < data->rbls.len ; ++i) {
-        const rbldb_t *rbl = array_elt(data->rbls, i);
-        int weight   = array_elt(data->weights, i);
-        if (rbldb_ipv4_lookup(rbl, ip)) {
-            sum += weight;
-            if (sum >= data->hard_threshold) {
-                return HTK_HARD_MATCH;
+    if (data->merge != NULL) {
+        uint32_t lists = rbldb_merge_ipv4_lookup(data->merge, ip);
+        if (data->uniform_weight >= 0) {
+            sum = __builtin_popcount(lists) * data->uniform_weight;
+        } else {
+            for (; lists != 0 ; lists &= lists - 1) {
+                sum += array_elt(data->weights, __builtin_ctz(lists));
+                if (sum >= data->hard_threshold) {
+                    break;
+                }
             }
         }
+        if (sum >= data->hard_threshold) {
+            return HTK_HARD_MATCH;
+        }
         error = false;
+    } else {
+        for (uint32_t i = 0 ; i < data->rbls.len ; ++i) {
+            const rbldb_t *rbl = array_elt(data->rbls, i);
+            int weight   = array_elt(data->weights, i);
+            if (rbldb_ipv4_lookup(rbl, ip)) {
+                sum += weight;
+                if (sum >= data->hard_threshold) {
+                    return HTK_HARD_MATCH;
+                }
+            }
+            error = false;
+        }
     }
-    if (array_len(data->host_offsets) > 0) {
+    if (array_len(data->zones) > 0) {
         iplist_async_data_t *async = filter_context(filter, context);
-        array_ensure_exact_capacity(async->results,
-                                    array_len(data->host_offsets));
+        array_ensure_exact_capacity(async->results, array_len(data->zones));
         async->sum = sum;
+        async->pending = 0;
         async->awaited = 0;
-        for (uint32_t i = 0 ; i < data->host_offsets.len ; ++i) {
-            const char *rbl = array_ptr(data->hosts,
-                                        array_elt(data->host_offsets, i));
-            if (dns_rbl_check(rbl, ip, array_ptr(async->results, i),
-                             iplist_filter_async, context)) {
+        for (uint32_t i = 0 ; i < data->zones.len ; ++i) {
+            const dns_zone_t *zone = array_ptr(data->zones, i);
+            dns_answer_t *answer = array_ptr(async->results, i);
+
+            if (dns_rbl_check(zone, ip, answer, iplist_filter_async,
+                              context)) {
                 error = false;
-                ++async->awaited;
+                if (answer->result == DNS_ASYNC) {
+                    async->pending += zone->weight;
+                    ++async->awaited;
+                } else {
+                    /* Answer from the dns cache. */
+                    async->sum += dns_zone_score(zone, answer);
+                }
             }
         }
-        debug("filter %s awaiting %d asynchronous queries",
-              filter->name, async->awaited);
         async->error = error;
-        return HTK_ASYNC;
+        if (async->awaited > 0) {
+            filter_result_t res = iplist_async_result(data, async);
+
+            if (res != HTK_ASYNC) {
+                dns_cancel(context);
+                return res;
+            }
+            debug("filter %s awaiting %d asynchronous queries",
+                  filter->name, async->awaited);
+            return HTK_ASYNC;
+        }
+        sum = async->sum;
     }
     if (error) {
         err("filter %s: all the rbl returned an error", filter->name);
@@ -549,6 +1794,27 @@ static filter_result_t iplist_filter(const filter_t *filter,
     }
 }
 
+static void iplist_filter_prefetch(const filter_t *filter,
+                                   const query_t *query)
+{
+    const iplist_filter_t *data = filter->data;
+    const char *end = NULL;
+    uint32_t ip;
+
+    if (data->zones.len == 0 || query->client_address.str == NULL
+        || parse_ipv4(query->client_address.str, &end, &ip) != 0) {
+        return;
+    }
+    foreach (zone, data->zones) {
+        dns_rbl_prefetch(zone, ip);
+    }
+}
+
+static void iplist_filter_cancel(filter_context_t *context)
+{
+    dns_cancel(context);
+}
+
 static void *iplist_context_constructor(void)
 {
     return p_new(iplist_async_data_t, 1);
@@ -580,6 +1846,9 @@ filter_constructor(iplist)
     filter_hook_forward_register(filter_type, HTK_SOFT_MATCH, HTK_HARD_MATCH);
     filter_hook_forward_register(filter_type, HTK_ERROR, HTK_FAIL);
 
+    filter_prefetcher_register(filter_type, iplist_filter_prefetch);
+    filter_canceler_register(filter_type, iplist_filter_cancel);
+
     /* Parameters.
      */
     (void)filter_param_register(filter_type, "file");
@@ -38,11 +38,44 @@
 
 typedef struct rbldb_t rbldb_t;
 
+/** Load an ip list. The file is either a text list (one ip per line) or an
+ * image produced by rbldb_compile() that is mapped without any copy.
+ */
 rbldb_t *rbldb_create(const char *file, bool lock);
 void rbldb_delete(rbldb_t **);
 
-uint32_t rbldb_stats(const rbldb_t *rbl);
+/** Number of IPv4 entries (addresses and networks) and of IPv6 prefixes of
+ * the list.
+ */
+void rbldb_stats(const rbldb_t *rbl, uint32_t *ipv4, uint32_t *ipv6);
+
+/** Memory used by the lookup table of the list, in bytes.
+ */
+size_t rbldb_memory(const rbldb_t *rbl);
 bool rbldb_ipv4_lookup(const rbldb_t *rbl, uint32_t ip);
+bool rbldb_ipv6_lookup(const rbldb_t *rbl, const uint8_t ip[16]);
+
+/** Merged lookup table of several lists.
+ * A lookup returns the bitmask of the lists that contain the ip: bit i is set
+ * when the ip is in rbls[i].
+ */
+typedef struct rbldb_merge_t rbldb_merge_t;
+
+#define RBLDB_MERGE_MAX      32
+#define RBLDB_MERGE_MAX_IPS  (16 << 20)
+
+/** Get the merged table of the given lists (it is shared by the callers
+ * that merge the same lists). Returns NULL if there is no list, more than
+ * RBLDB_MERGE_MAX lists, or more than RBLDB_MERGE_MAX_IPS single ips in the
+ * lists: they are then looked up one by one.
+ */
+rbldb_merge_t *rbldb_merge(rbldb_t * const *rbls, int count);
+void rbldb_merge_delete(rbldb_merge_t **merge);
+uint32_t rbldb_merge_ipv4_lookup(const rbldb_merge_t *merge, uint32_t ip);
+
+/** Compile the text list @p file into the image @p output.
+ */
+bool rbldb_compile(const char *file, const char *output);
 
 #endif
 
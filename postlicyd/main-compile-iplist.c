@@ -0,0 +1,91 @@
+/****************************************************************************/
+/*          pfixtools: a collection of postfix related tools                */
+/*          ~~~~~~~~~                                                       */
+/*  ______________________________________________________________________  */
+/*                                                                          */
+/*  Redistribution and use in source and binary forms, with or without      */
+/*  modification, are permitted provided that the following conditions      */
+/*  are met:                                                                */
+/*                                                                          */
+/*  1. Redistributions of source code must retain the above copyright       */
+/*     notice, this list of conditions and the following disclaimer.        */
+/*  2. Redistributions in binary form must reproduce the above copyright    */
+/*     notice, this list of conditions and the following disclaimer in      */
+/*     the documentation and/or other materials provided with the           */
+/*     distribution.                                                        */
+/*  3. The names of its contributors may not be used to endorse or promote  */
+/*     products derived from this software without specific prior written   */
+/*     permission.                                                          */
+/*                                                                          */
+/*  THIS SOFTWARE IS PROVIDED BY THE CONTRIBUTORS ``AS IS'' AND ANY         */
+/*  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       */
+/*  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR      */
+/*  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE CONTRIBUTORS BE LIABLE   */
+/*  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR            */
+/*  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF    */
+/*  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR         */
+/*  BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,   */
+/*  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE    */
+/*  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,       */
+/*  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                      */
+/*                                                                          */
+/*   Copyright (c) 2006-2014 the Authors                                    */
+/*   see AUTHORS and source files for details                               */
+/****************************************************************************/
+
+#include <getopt.h>
+
+#include "common.h"
+#include "iplist.h"
+
+#define DAEMON_NAME             "postlicyd-compile-iplist"
+#define DAEMON_VERSION          PFIXTOOLS_VERSION
+
+DECLARE_MAIN
+
+static void usage(void)
+{
+    fputs("usage: "DAEMON_NAME" [options] list image\n"
+          "\n"
+          "Compile the text ip list \"list\" into the image \"image\" that\n"
+          "postlicyd loads without parsing it.\n"
+          "\n"
+          "Options:\n"
+          "    -h|--help                     show this help\n"
+          "    -q|--quiet                    only report errors\n",
+          stderr);
+}
+
+int main(int argc, char *argv[])
+{
+    struct option longopts[] = {
+        { "help", no_argument, NULL, 'h' },
+        { "quiet", no_argument, NULL, 'q' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    log_syslog = false;
+    for (int c = 0; (c = getopt_long(argc, argv, "hq",
+                                     longopts, NULL)) >= 0;) {
+        switch (c) {
+          case 'q':
+            log_level = LOG_WARNING;
+            break;
+          case 'h':
+            usage();
+            return EXIT_SUCCESS;
+          default:
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind != 2) {
+        usage();
+        return EXIT_FAILURE;
+    }
+    return rbldb_compile(argv[optind], argv[optind + 1]) ? EXIT_SUCCESS
+                                                         : EXIT_FAILURE;
+}
+
+/* vim:set et sw=4 sts=4 sws=4: */
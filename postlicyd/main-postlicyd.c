@@ -40,9 +40,13 @@
 
 #include <srs2.h>
 
+#include <pthread.h>
+
 #include "policy_tokens.h"
-#include "server.h"
+#include "worker.h"
 #include "config.h"
+#include "dns.h"
+#include "decision.h"
 #include "query.h"
 
 #define DAEMON_NAME             "postlicyd"
@@ -56,20 +60,71 @@ DECLARE_MAIN
 typedef struct query_context_t {
     query_t query;
     filter_context_t context;
-    client_t *client;
+    conn_t *client;
+
+    /* Configuration generation the current query runs against.
+     */
+    config_t *config;
+
+    /* Generation the results kept in the filter context come from.
+     */
+    unsigned generation;
+
+    /* Fields read by the filters run for the current query, the decision
+     * can be cached only if all these filters declared them.
+     */
+    uint64_t fields;
+    bool cacheable;
+
+    /* Deadline of the current query. The query is expired when it has been
+     * answered by the fallback while its filter could not be canceled: the
+     * connection is then suspended until the filter gives its result.
+     */
+    ev_timer deadline;
+    bool expired;
 } query_context_t;
 
 static struct {
+    /* Current configuration generation.
+     */
     config_t *config;
-    bool      refresh;
-    PA(client_t) busy;
-} postlicyd_g;
+    pthread_mutex_t config_lock;
+
+    /* Configuration reload. The new generation is built in a separate thread
+     * while the queries keep running, then swapped in the main loop.
+     */
+    bool      reloading;
+    bool      reload_pending;
+    config_t *reloaded;
+    ev_async  reload_done;
+
+    /* Queries received while postfix is under stress, and the ones that
+     * went through the stress entry points.
+     */
+    uint64_t stressed;
+    uint64_t stress_path;
+} postlicyd_g = {
 #define _G  postlicyd_g
+    .config_lock = PTHREAD_MUTEX_INITIALIZER,
+};
 
-static void *query_starter(listener_t *server)
+static config_t *config_acquire(void)
+{
+    pthread_mutex_lock(&_G.config_lock);
+    config_t *config = config_ref(_G.config);
+    pthread_mutex_unlock(&_G.config_lock);
+    return config;
+}
+
+static void policy_deadline(struct ev_loop *loop, ev_timer *timer,
+                            int revents);
+
+static void *query_starter(void)
 {
     query_context_t *context = p_new(query_context_t, 1);
     filter_context_prepare(&context->context, context);
+    ev_init(&context->deadline, policy_deadline);
+    context->deadline.data = context;
     return context;
 }
 
@@ -77,41 +132,130 @@ static void query_stopper(void *data)
 {
     query_context_t **context = data;
     if (*context) {
+        if (ev_is_active(&(*context)->deadline)) {
+            ev_timer_stop(worker_ev_loop(), &(*context)->deadline);
+        }
         filter_context_wipe(&(*context)->context);
+        config_unref(&(*context)->config);
         p_delete(context);
     }
 }
 
+/* Release the configuration once the query is answered.
+ */
+static void query_done(query_context_t *context)
+{
+    if (context->context.current_filter == NULL) {
+        if (ev_is_active(&context->deadline)) {
+            ev_timer_stop(worker_ev_loop(), &context->deadline);
+        }
+        config_unref(&context->config);
+    }
+}
+
+static void *config_reload_thread(void *arg)
+{
+    const char *filename = arg;
+    bool again;
+
+    do {
+        notice("reloading configuration");
+        config_t *config = config_read(filename);
+        if (config == NULL) {
+            err("error while reloading configuration, "
+                "keeping the current one");
+        }
+
+        pthread_mutex_lock(&_G.config_lock);
+        if (config != NULL) {
+            config_unref(&_G.reloaded);
+            _G.reloaded = config;
+        }
+        again = _G.reload_pending;
+        _G.reload_pending = false;
+        _G.reloading = again;
+        pthread_mutex_unlock(&_G.config_lock);
+    } while (again);
+
+    ev_async_send(ev_default_loop(0), &_G.reload_done);
+    return NULL;
+}
+
+static void config_retire(void *data)
+{
+    config_t *config = data;
+
+    config_unref(&config);
+}
+
+/* Called in the main loop when a new generation is ready.
+ */
+static void config_reload_done(struct ev_loop *loop, ev_async *w, int revents)
+{
+    config_t *old;
+
+    pthread_mutex_lock(&_G.config_lock);
+    if (_G.reloaded == NULL) {
+        pthread_mutex_unlock(&_G.config_lock);
+        return;
+    }
+
+    old = _G.config;
+    _G.config   = _G.reloaded;
+    _G.reloaded = NULL;
+    pthread_mutex_unlock(&_G.config_lock);
+
+    notice("configuration reloaded");
+
+    /* In prefork mode, the workers of the previous generation reference it
+     * until they have answered their queries and exited.
+     */
+    if (worker_is_prefork()) {
+        worker_restart(config_retire, old);
+    } else {
+        config_unref(&old);
+    }
+}
+
 static bool config_refresh(void *mconfig)
 {
-    _G.refresh = true;
-    if (filter_running_g > 0) {
+    pthread_t thread;
+    pthread_attr_t attr;
+    bool ok = true;
+
+    pthread_mutex_lock(&_G.config_lock);
+    if (_G.reloading) {
+        _G.reload_pending = true;
+        pthread_mutex_unlock(&_G.config_lock);
         return true;
     }
-    log_state = "refreshing ";
-    notice("reloading configuration");
-    bool ret = config_reload(mconfig);
-    log_state = "";
-    foreach (server, _G.busy) {
-        client_io_ro(*server);
+    _G.reloading = true;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, config_reload_thread,
+                       (void *)_G.config->filename) != 0) {
+        UNIXERR("pthread_create");
+        _G.reloading = false;
+        ok = false;
     }
-    array_len(_G.busy) = 0;
-    _G.refresh = false;
-    return ret;
+    pthread_attr_destroy(&attr);
+    pthread_mutex_unlock(&_G.config_lock);
+    return ok;
 }
 
-static void policy_answer(client_t *pcy, const char *message)
+static void policy_answer(conn_t *pcy, const char *message)
 {
-    query_context_t *context = client_data(pcy);
+    query_context_t *context = conn_data(pcy);
     const query_t *query = &context->query;
-    buffer_t *buf = client_output_buffer(pcy);
+    buffer_t *buf = conn_output_buffer(pcy);
 
     /* Write reply "action=ACTION [text]" */
     buffer_addstr(buf, "action=");
     if (!query_format_buffer(buf, message, query)) {
         buffer_addstr(buf, message);
     }
-    if (_G.config->include_explanation) {
+    if (context->config->include_explanation) {
         const clstr_t *exp = &context->context.explanation;
         if (exp->len > 0) {
             buffer_addstr(buf, ": ");
@@ -121,15 +265,16 @@ static void policy_answer(client_t *pcy, const char *message)
     buffer_addstr(buf, "\n\n");
 
     /* Finalize query. */
-    buf = client_input_buffer(pcy);
+    buf = conn_input_buffer(pcy);
     buffer_consume(buf, query->eoq - buf->data);
-    client_io_rw(pcy);
+    conn_io_rw(pcy);
 }
 
-static const filter_t *next_filter(client_t *pcy, const filter_t *filter,
+static const filter_t *next_filter(conn_t *pcy, const filter_t *filter,
                                    const query_t *query,
                                    const filter_hook_t *hook, bool *ok)
 {
+    const config_t *config = ((query_context_t *)conn_data(pcy))->config;
     char log_prefix[BUFSIZ];
     log_prefix[0] = '\0';
 
@@ -137,14 +282,17 @@ static const filter_t *next_filter(client_t *pcy, const filter_t *filter,
     if (log_level >= LOG_ ## Level) {                                        \
         if (log_prefix[0] == '\0') {                                         \
             query_format(log_prefix, BUFSIZ,                                 \
-                         _G.config->log_format && _G.config->log_format[0] ? \
-                         _G.config->log_format : DEFAULT_LOG_FORMAT, query); \
+                         config->log_format && config->log_format[0] ?       \
+                         config->log_format : DEFAULT_LOG_FORMAT, query);    \
         }                                                                    \
         __log(LOG_ ## Level, "%s: " Msg, log_prefix, ##__VA_ARGS__);         \
     }
 
     if (hook != NULL) {
-        query_context_t *context = client_data(pcy);
+        query_context_t *context = conn_data(pcy);
+        if (hook->warn != NULL || hook->cost > 0) {
+            context->cacheable = false;
+        }
         if (hook->counter >= 0 && hook->counter < MAX_COUNTERS
             && hook->cost > 0) {
             context->context.counters[hook->counter] += hook->cost;
@@ -167,39 +315,60 @@ static const filter_t *next_filter(client_t *pcy, const filter_t *filter,
         *ok = true;
         return NULL;
     } else if (hook->postfix) {
+        query_context_t *context = conn_data(pcy);
         log_reply(NOTICE, "answer %s from filter %s: \"%s\"",
                   htokens[hook->type], filter->name, hook->value);
+        if (context->cacheable) {
+            decision_cache_put(config->generation, query, context->fields,
+                               filter->name, hook->value,
+                               &context->context.explanation);
+        }
         policy_answer(pcy, hook->value);
         *ok = true;
         return NULL;
     } else {
         log_reply(DEBUG, "answer %s from filter %s: next filter %s",
                   htokens[hook->type], filter->name,
-                  (array_ptr(_G.config->filters, hook->filter_id))->name);
-        return array_ptr(_G.config->filters, hook->filter_id);
+                  (array_ptr(config->filters, hook->filter_id))->name);
+        return array_ptr(config->filters, hook->filter_id);
     }
 #undef log_reply
 }
 
-static bool policy_process(client_t *pcy, const config_t *mconfig)
+static bool policy_process(conn_t *pcy, const config_t *mconfig)
 {
-    query_context_t *context = client_data(pcy);
+    query_context_t *context = conn_data(pcy);
     const query_t *query = &context->query;
     const filter_t *filter;
-    if (mconfig->entry_points[query->state] == -1) {
-        warn("no filter defined for current protocol_state (%s)",
-             smtp_state_names_g[query->state].str);
-        return false;
-    }
+    int entry_point = mconfig->entry_points[query->state];
+
     if (context->context.current_filter != NULL) {
         filter = context->context.current_filter;
     } else {
-        filter = array_ptr(mconfig->filters,
-                           mconfig->entry_points[query->state]);
+        if (query_under_stress(query)) {
+            if (mconfig->stress_entry_points[query->state] >= 0) {
+                __sync_add_and_fetch(&_G.stress_path, 1);
+                entry_point = mconfig->stress_entry_points[query->state];
+                debug("postfix under stress, using the stress filters");
+
+                /* The stress answers must not be given to normal queries. */
+                context->cacheable = false;
+            }
+        }
+        if (entry_point == -1) {
+            warn("no filter defined for current protocol_state (%s)",
+                 smtp_state_names_g[query->state].str);
+            return false;
+        }
+        filter = array_ptr(mconfig->filters, entry_point);
     }
     context->context.current_filter = NULL;
     while (true) {
         bool  ok = false;
+        if (!filter_is_cacheable(filter)) {
+            context->cacheable = false;
+        }
+        context->fields |= filter->depends;
         const filter_hook_t *hook = filter_run(filter, query,
                                                &context->context);
         filter = next_filter(pcy, filter, query, hook, &ok);
@@ -209,22 +378,96 @@ static bool policy_process(client_t *pcy, const config_t *mconfig)
     }
 }
 
-static int policy_run(client_t *pcy, void* vconfig)
+static void policy_cached_answer(conn_t *pcy, const decision_t *decision)
 {
-    const config_t *mconfig = vconfig;
-    if (_G.refresh) {
-        array_add(_G.busy, pcy);
-        return 0;
+    query_context_t *context = conn_data(pcy);
+    const config_t *config = context->config;
+
+    if (log_level >= LOG_NOTICE) {
+        char log_prefix[BUFSIZ];
+
+        query_format(log_prefix, BUFSIZ,
+                     config->log_format && config->log_format[0] ?
+                     config->log_format : DEFAULT_LOG_FORMAT, &context->query);
+        notice("%s: cached answer from filter %s: \"%s\"", log_prefix,
+               decision->filter, decision->answer);
+    }
+    filter_set_explanation(&context->context, decision->explanation.str,
+                           decision->explanation.len);
+    policy_answer(pcy, decision->answer);
+}
+
+/* Answer with the fallback action, without waiting for the filters.
+ */
+static void policy_fallback(conn_t *pcy, const char *action,
+                            const char *reason)
+{
+    query_context_t *context = conn_data(pcy);
+    const config_t *config = context->config;
+
+    if (log_level >= LOG_WARNING) {
+        char log_prefix[BUFSIZ];
+
+        query_format(log_prefix, BUFSIZ,
+                     config->log_format && config->log_format[0] ?
+                     config->log_format : DEFAULT_LOG_FORMAT, &context->query);
+        warn("%s: fallback answer, %s", log_prefix, reason);
     }
+    filter_set_explanation(&context->context, NULL, 0);
+    policy_answer(pcy, action);
+}
 
-    query_context_t *context = client_data(pcy);
+static void policy_deadline(struct ev_loop *loop, ev_timer *timer,
+                            int revents)
+{
+    query_context_t *context = timer->data;
+    const filter_t *filter = context->context.current_filter;
+    const char *action;
+    char reason[BUFSIZ];
+
+    if (filter == NULL) {
+        return;
+    }
+    snprintf(reason, BUFSIZ, "deadline reached in filter %s", filter->name);
+    action = config_query_deadline(context->config, &context->context,
+                                   &context->expired);
+    policy_fallback(context->client, action, reason);
+    query_done(context);
+}
+
+/* First query of a client: run the prefetchers of the filters that may be
+ * run until the end of the session.
+ */
+static void policy_prefetch(const config_t *mconfig, const query_t *query)
+{
+    foreach (id, mconfig->prefetch[query->state]) {
+        filter_prefetch(array_ptr(mconfig->filters, *id), query);
+    }
+}
+
+static int policy_run(conn_t *pcy, void* vconfig)
+{
+    query_context_t *context = conn_data(pcy);
     query_t         *query   = &context->query;
     context->client = pcy;
 
-    buffer_t *buf   = client_input_buffer(pcy);
+    /* The previous query is still running, the next one is read once it
+     * is done.
+     */
+    if (context->expired) {
+        if (conn_output_buffer(pcy)->len > 0) {
+            conn_io_wo(pcy);
+        } else {
+            conn_io_none(pcy);
+        }
+        return 0;
+    }
+
+    buffer_t *buf   = conn_input_buffer(pcy);
     int search_offs = MAX(0, (int)(buf->len - 1));
-    int nb          = client_read(pcy);
+    int nb          = conn_read(pcy);
     const char *eoq;
+    bool new_instance;
 
     if (nb < 0) {
         if (errno == EAGAIN || errno == EINTR)
@@ -247,14 +490,63 @@ static int policy_run(client_t *pcy, void* vconfig)
     }
     query->eoq = eoq + strlen("\n\n");
 
+    /* Counted before the cache and the shedding may answer the query. */
+    if (query_under_stress(query)) {
+        __sync_add_and_fetch(&_G.stressed, 1);
+    }
+
     /* The instance changed => reset the static context */
-    if (query->instance.str == NULL || query->instance.len == 0
-        || strcmp(context->context.instance, query->instance.str) != 0) {
+    new_instance = query->instance.str == NULL || query->instance.len == 0
+                || strcmp(context->context.instance, query->instance.str) != 0;
+    if (new_instance) {
         filter_context_clean(&context->context);
         m_strcat(context->context.instance, 64, query->instance.str);
     }
-    client_io_none(pcy);
-    return policy_process(pcy, mconfig) ? 0 : -1;
+    conn_io_none(pcy);
+    context->config = config_acquire();
+    if (context->generation != context->config->generation) {
+        filter_context_forget(&context->context);
+        context->generation = context->config->generation;
+    }
+    int waited;
+    const char *shed = config_query_shed(context->config, &waited);
+
+    if (shed != NULL) {
+        char reason[BUFSIZ];
+
+        snprintf(reason, BUFSIZ, "query waited %dms", waited);
+        policy_fallback(pcy, shed, reason);
+        query_done(context);
+        return 0;
+    }
+    if (new_instance && !query_under_stress(query)) {
+        policy_prefetch(context->config, query);
+    }
+    if (decision_cache_enabled()) {
+        const decision_t *decision;
+
+        decision = decision_cache_get(context->config->generation, query);
+        if (decision != NULL) {
+            policy_cached_answer(pcy, decision);
+            query_done(context);
+            return 0;
+        }
+    }
+    context->fields    = 0;
+    context->cacheable = decision_cache_enabled();
+    if (!policy_process(pcy, context->config)) {
+        return -1;
+    }
+    if (context->context.current_filter != NULL
+        && context->config->query_deadline_ms > 0) {
+        /* The timer is relative to the time the loop received the query.
+         */
+        ev_timer_set(&context->deadline,
+                     context->config->query_deadline_ms / 1000., 0.);
+        ev_timer_start(worker_ev_loop(), &context->deadline);
+    }
+    query_done(context);
+    return 0;
 }
 
 static void policy_async_handler(filter_context_t *context,
@@ -264,29 +556,56 @@ static void policy_async_handler(filter_context_t *context,
     const filter_t *filter = context->current_filter;
     query_context_t *qctx  = context->data;
     query_t         *query = &qctx->query;
-    client_t        *server = qctx->client;
+    conn_t          *server = qctx->client;
 
+    if (qctx->expired) {
+        /* The query has already been answered by the fallback. */
+        qctx->expired = false;
+        context->current_filter = NULL;
+        query_done(qctx);
+        conn_io_rw(server);
+        return;
+    }
     context->current_filter = next_filter(server, filter, query, hook, &ok);
     if (context->current_filter != NULL) {
-        ok = policy_process(server, _G.config);
+        ok = policy_process(server, qctx->config);
     }
     if (!ok) {
-        client_release(server);
-    }
-    if (_G.refresh && filter_running_g == 0) {
-        config_refresh(_G.config);
+        conn_release(server);
+    } else {
+        query_done(qctx);
     }
 }
 
+static void postlicyd_atfork_prepare(void)
+{
+    pthread_mutex_lock(&_G.config_lock);
+}
+
+static void postlicyd_atfork_release(void)
+{
+    pthread_mutex_unlock(&_G.config_lock);
+}
+
+static void postlicyd_stats(A(worker_stat_t) *stats)
+{
+    worker_stat_add(stats, "stress", "queries", _G.stressed, false);
+    worker_stat_add(stats, "stress", "stress_filters", _G.stress_path, false);
+}
+
 static int postlicyd_init(void)
 {
     filter_async_handler_register(policy_async_handler);
+    worker_stats_register(postlicyd_stats);
+    pthread_atfork(postlicyd_atfork_prepare, postlicyd_atfork_release,
+                   postlicyd_atfork_release);
     return 0;
 }
 
 static void postlicyd_shutdown(void)
 {
-    array_deep_wipe(_G.busy, client_delete);
+    config_unref(&_G.reloaded);
+    config_unref(&_G.config);
 }
 module_init(postlicyd_init);
 module_exit(postlicyd_shutdown);
@@ -396,6 +715,14 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    if (_G.config->resolv_conf != NULL) {
+        dns_use_local_conf(_G.config->resolv_conf);
+    }
+    dns_cache_set_size((size_t)_G.config->dns_cache_size << 10);
+    dns_set_timeout(_G.config->dns_timeout);
+    decision_cache_set((size_t)_G.config->decision_cache_size << 10,
+                       _G.config->decision_cache_ttl);
+
     // If we specified socketfile on cmd line, override what's in config
     if (socketfile) {
         p_delete(&_G.config->socketfile);
@@ -416,17 +743,23 @@ int main(int argc, char *argv[])
 
     pidfile_refresh();
 
+    worker_setup(_G.config->workers, _G.config->prefork);
+
     if (_G.config->socketfile) {
-        if (start_unix_listener(_G.config->socketfile) == NULL)
+        if (!worker_listen_unix(_G.config->socketfile))
             return EXIT_FAILURE;
     }
 
     if (_G.config->port_present) {
-        if (start_tcp_listener(_G.config->port) == NULL)
+        if (!worker_listen_tcp(_G.config->port))
             return EXIT_FAILURE;
     }
 
-    int ret = server_loop(query_starter, query_stopper, policy_run, config_refresh, _G.config);
+    ev_async_init(&_G.reload_done, config_reload_done);
+    ev_async_start(ev_default_loop(0), &_G.reload_done);
+
+    int ret = worker_loop(query_starter, query_stopper, policy_run,
+                          config_refresh, NULL, NULL);
 
     // Cleanup socket file
     if (_G.config->socketfile) {
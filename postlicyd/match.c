@@ -36,7 +36,9 @@
 #include "filter.h"
 #include "str.h"
 #include "regexp.h"
+#include "regexpset.h"
 #include "policy_tokens.h"
+#include "worker.h"
 
 enum condition_t {
     MATCH_UNKNOWN  = 0,
@@ -58,12 +60,26 @@ typedef struct match_condition_t {
 
     union {
       clstr_t value;
-      regexp_t     regexp;
+      struct {
+          int set;
+          int index;
+      } regexp;
     } data;
 } match_condition_t;
 ARRAY(match_condition_t)
 #define CONDITION_INIT { .field = PTK_UNKNOWN }
 
+/* The regexps of the conditions on a field, matched in a single scan of the
+ * field the first time one of them is evaluated. The results of the set are
+ * stored in the words [offset..] of the results of the query.
+ */
+typedef struct match_regexps_t {
+    postlicyd_token field;
+    regexp_set_t   *set;
+    int             offset;
+} match_regexps_t;
+ARRAY(match_regexps_t)
+
 struct match_operator_t {
     const clstr_t short_name;
     const clstr_t long_name;
@@ -72,8 +88,6 @@ struct match_operator_t {
 };
 
 static struct {
-    buffer_t match_buffer;
-
     const char * const condition_names[MATCH_NUMBER];
     const struct match_operator_t operators[];
 } match_g = {
@@ -113,8 +127,21 @@ static struct {
     }
 };
 
+static __thread struct {
+    buffer_t match_buffer;
+
+    /* Results of the regexp sets for the current query, the bit i of
+     * match_done is set once the set i has been matched.
+     */
+    A(uint64_t) match_results;
+    uint64_t    match_done;
+} match_thread_g;
+#define _T  match_thread_g
+
 typedef struct match_config_t {
     A(match_condition_t) conditions;
+    A(match_regexps_t)   regexps;
+    int  result_words;
     bool match_all;
 } match_config_t;
 DO_INIT(match_config_t, match_config);
@@ -122,22 +149,41 @@ DO_NEW(match_config_t, match_config);
 
 static inline void match_condition_wipe(match_condition_t *condition)
 {
-    if (condition->condition == MATCH_MATCH
-        || condition->condition == MATCH_DONTMATCH) {
-        regexp_wipe(&condition->data.regexp);
-    } else {
+    if (condition->condition != MATCH_MATCH
+        && condition->condition != MATCH_DONTMATCH) {
         char *str = (char*)condition->data.value.str;
         p_delete(&str);
         condition->data.value.str = NULL;
         condition->data.value.len = 0;
     }
 }
+static inline void match_regexps_wipe(match_regexps_t *regexps)
+{
+    regexp_set_delete(&regexps->set);
+}
 static inline void match_config_wipe(match_config_t *config)
 {
     array_deep_wipe(config->conditions, match_condition_wipe);
+    array_deep_wipe(config->regexps, match_regexps_wipe);
 }
 DO_DELETE(match_config_t, match_config)
 
+/* Index of the regexp set of @p field in @p config, created if needed.
+ */
+static int match_config_regexps(match_config_t *config, postlicyd_token field)
+{
+    match_regexps_t regexps = { .field = field };
+
+    for (int i = 0 ; i < config->regexps.len ; ++i) {
+        if (array_elt(config->regexps, i).field == field) {
+            return i;
+        }
+    }
+    regexps.set = regexp_set_new();
+    array_add(config->regexps, regexps);
+    return config->regexps.len - 1;
+}
+
 static bool match_filter_constructor(filter_t *filter)
 {
     match_config_t *config = match_config_new();
@@ -220,8 +266,13 @@ static bool match_filter_constructor(filter_t *filter)
                             "invalid regexp");
                 reg.str = regexp.data;
                 reg.len = regexp.len;
-                PARSE_CHECK(regexp_compile_str(&condition.data.regexp, &reg,
-                                               condition.case_sensitive),
+                condition.data.regexp.set
+                    = match_config_regexps(config, condition.field);
+                condition.data.regexp.index
+                    = regexp_set_add(array_elt(config->regexps,
+                                               condition.data.regexp.set).set,
+                                     &reg, condition.case_sensitive);
+                PARSE_CHECK(condition.data.regexp.index >= 0,
                             "cannot compile regexp %.*s", (int)(end - p), p);
               } break;
 
@@ -245,6 +296,29 @@ static bool match_filter_constructor(filter_t *filter)
 
     PARSE_CHECK(config->conditions.len > 0,
                 "no condition defined");
+    foreach (regexps, config->regexps) {
+        PARSE_CHECK(regexp_set_compile(regexps->set),
+                    "cannot compile the regexps of the conditions on %s",
+                    ptokens[regexps->field]);
+        regexps->offset = config->result_words;
+        config->result_words
+            += REGEXP_SET_WORDS(regexp_set_count(regexps->set));
+    }
+
+    /* The right hand expressions may refer to other fields of the query.
+     */
+    foreach (condition, config->conditions) {
+        uint64_t fields = QUERY_FIELD(condition->field);
+
+        if (condition->condition != MATCH_EMPTY
+            && condition->condition != MATCH_MATCH
+            && condition->condition != MATCH_DONTMATCH) {
+            fields |= query_format_fields(condition->data.value.str);
+        }
+        for (; fields != 0 ; fields &= fields - 1) {
+            filter_depends_on(filter, __builtin_ctzll(fields));
+        }
+    }
     filter->data = config;
     buffer_wipe(&regexp);
     return true;
@@ -257,20 +331,40 @@ static void match_filter_destructor(filter_t *filter)
     filter->data = config;
 }
 
-static inline bool match_condition(const match_condition_t *cond,
+/* Check whether @p field matches the regexp of @p cond. All the regexps of
+ * the set are matched on the first call for the query.
+ */
+static inline bool match_regexp(const match_config_t *config,
+                                const match_condition_t *cond,
+                                const clstr_t *field)
+{
+    const int set   = cond->data.regexp.set;
+    const int index = cond->data.regexp.index;
+    const match_regexps_t *regexps = array_ptr(config->regexps, set);
+    uint64_t *results = array_ptr(_T.match_results, regexps->offset);
+
+    if (!(_T.match_done & (1ULL << set))) {
+        regexp_set_match(regexps->set, field, results);
+        _T.match_done |= 1ULL << set;
+    }
+    return results[index / 64] & (1ULL << (index % 64));
+}
+
+static inline bool match_condition(const match_config_t *config,
+                                   const match_condition_t *cond,
                                    const query_t *query)
 {
     const clstr_t *field = query_field_for_id(query, cond->field);
     if (cond->condition != MATCH_EMPTY && cond->condition != MATCH_MATCH
         && cond->condition != MATCH_DONTMATCH) {
-        buffer_reset(&_G.match_buffer);
-        query_format_buffer(&_G.match_buffer, cond->data.value.str, query);
+        buffer_reset(&_T.match_buffer);
+        query_format_buffer(&_T.match_buffer, cond->data.value.str, query);
     }
     debug("running condition: \"%s\" %s %s\"%s\"",
           field->str, _G.condition_names[cond->condition],
           cond->case_sensitive ? "" : "(alternative) ",
           cond->condition != MATCH_MATCH && cond->condition != MATCH_DONTMATCH
-              && cond->data.value.str ? _G.match_buffer.data : "(none)");
+              && cond->data.value.str ? _T.match_buffer.data : "(none)");
     switch (cond->condition) {
       case MATCH_EQUAL:
       case MATCH_DIFFER:
@@ -278,10 +372,10 @@ static inline bool match_condition(const match_condition_t *cond,
             return cond->condition != MATCH_DIFFER;
         }
         if (cond->case_sensitive) {
-            return !!((strcmp(field->str, _G.match_buffer.data) == 0)
+            return !!((strcmp(field->str, _T.match_buffer.data) == 0)
                       ^ (cond->condition == MATCH_DIFFER));
         } else {
-            return !!(!ascii_strcasecmp(field->str, _G.match_buffer.data)
+            return !!(!ascii_strcasecmp(field->str, _T.match_buffer.data)
                       ^ (cond->condition == MATCH_DIFFER));
         }
         break;
@@ -291,10 +385,10 @@ static inline bool match_condition(const match_condition_t *cond,
             return false;
         }
         if (cond->case_sensitive) {
-            return strstr(field->str, _G.match_buffer.data);
+            return strstr(field->str, _T.match_buffer.data);
         } else {
-            return m_stristrn(field->str, _G.match_buffer.data,
-                              _G.match_buffer.len);
+            return m_stristrn(field->str, _T.match_buffer.data,
+                              _T.match_buffer.len);
         }
         break;
 
@@ -303,9 +397,9 @@ static inline bool match_condition(const match_condition_t *cond,
             return false;
         }
         if (cond->case_sensitive) {
-            return strstr(_G.match_buffer.data, field->str);
+            return strstr(_T.match_buffer.data, field->str);
         } else {
-            return m_stristr(_G.match_buffer.data, field->str);
+            return m_stristr(_T.match_buffer.data, field->str);
         }
         break;
 
@@ -317,13 +411,13 @@ static inline bool match_condition(const match_condition_t *cond,
         if (field == NULL || field->str == NULL) {
             return false;
         }
-        return regexp_match_str(&cond->data.regexp, field);
+        return match_regexp(config, cond, field);
 
       case MATCH_DONTMATCH:
         if (field == NULL || field->str == NULL) {
             return false;
         }
-        return !regexp_match_str(&cond->data.regexp, field);
+        return !match_regexp(config, cond, field);
 
       default:
         assert(false && "invalid condition type");
@@ -336,8 +430,11 @@ static filter_result_t match_filter(const filter_t *filter,
                                     filter_context_t *context)
 {
     const match_config_t *config = filter->data;
+
+    array_ensure_exact_capacity(_T.match_results, config->result_words);
+    _T.match_done = 0;
     foreach (condition, config->conditions) {
-        bool r = match_condition(condition, query);
+        bool r = match_condition(config, condition, query);
         if (!r && config->match_all) {
             debug("condition failed, match_all failed");
             return HTK_FAIL;
@@ -355,6 +452,13 @@ static filter_result_t match_filter(const filter_t *filter,
     }
 }
 
+static void match_exit(void)
+{
+    buffer_wipe(&_T.match_buffer);
+    array_wipe(_T.match_results);
+}
+module_exit(match_exit);
+
 filter_constructor(match)
 {
     filter_type_t type
@@ -370,13 +474,9 @@ filter_constructor(match)
      */
     (void)filter_param_register(type, "match_all");
     (void)filter_param_register(type, "condition");
-    return 0;
-}
 
-static void match_exit(void)
-{
-    buffer_wipe(&_G.match_buffer);
+    worker_atexit(match_exit);
+    return 0;
 }
-module_exit(match_exit);
 
 /* vim:set et sw=4 sts=4 sws=4: */
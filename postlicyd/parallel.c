@@ -0,0 +1,440 @@
+/****************************************************************************/
+/*          pfixtools: a collection of postfix related tools                */
+/*          ~~~~~~~~~                                                       */
+/*  ______________________________________________________________________  */
+/*                                                                          */
+/*  Redistribution and use in source and binary forms, with or without      */
+/*  modification, are permitted provided that the following conditions      */
+/*  are met:                                                                */
+/*                                                                          */
+/*  1. Redistributions of source code must retain the above copyright       */
+/*     notice, this list of conditions and the following disclaimer.        */
+/*  2. Redistributions in binary form must reproduce the above copyright    */
+/*     notice, this list of conditions and the following disclaimer in      */
+/*     the documentation and/or other materials provided with the           */
+/*     distribution.                                                        */
+/*  3. The names of its contributors may not be used to endorse or promote  */
+/*     products derived from this software without specific prior written   */
+/*     permission.                                                          */
+/*                                                                          */
+/*  THIS SOFTWARE IS PROVIDED BY THE CONTRIBUTORS ``AS IS'' AND ANY         */
+/*  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       */
+/*  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR      */
+/*  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE CONTRIBUTORS BE LIABLE   */
+/*  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR            */
+/*  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF    */
+/*  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR         */
+/*  BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,   */
+/*  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE    */
+/*  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,       */
+/*  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                      */
+/*                                                                          */
+/*   Copyright (c) 2006-2014 the Authors                                    */
+/*   see AUTHORS and source files for details                               */
+/****************************************************************************/
+
+#include "filter.h"
+
+/* A child of the filter, and the results of the child that add its weight
+ * to the score.
+ */
+typedef struct parallel_child_t {
+    int  filter_id;
+    int  weight;
+    bool results[HTK_count];
+} parallel_child_t;
+ARRAY(parallel_child_t)
+
+typedef struct parallel_filter_t {
+    A(parallel_child_t) children;
+
+    int32_t hard_threshold;
+    int32_t soft_threshold;
+} parallel_filter_t;
+
+/* Context of a running child. The filter context comes first so that the
+ * slot is found from the context given to the child handler.
+ */
+typedef struct parallel_slot_t {
+    filter_context_t context;
+    struct parallel_async_t *async;
+
+    /* Index of the child, -1 if its result is no longer awaited. */
+    int child;
+} parallel_slot_t;
+PARRAY(parallel_slot_t)
+
+typedef struct parallel_async_t {
+    const filter_t   *filter;
+    filter_context_t *context;
+
+    /* All the slots, the free ones and the ones of the awaited children.
+     */
+    PA(parallel_slot_t) slots;
+    PA(parallel_slot_t) pool;
+    PA(parallel_slot_t) running;
+
+    int awaited;
+    int32_t sum;
+    int32_t pending;
+    bool error;
+} parallel_async_t;
+
+DO_INIT(parallel_filter_t, parallel_filter);
+DO_NEW(parallel_filter_t, parallel_filter);
+
+static void parallel_filter_wipe(parallel_filter_t *data)
+{
+    array_wipe(data->children);
+}
+DO_DELETE(parallel_filter_t, parallel_filter);
+
+static bool parallel_filter_constructor(filter_t *filter)
+{
+    parallel_filter_t *data = parallel_filter_new();
+
+#define PARSE_CHECK(Expr, Str, ...)                                          \
+    if (!(Expr)) {                                                           \
+        err(Str, ##__VA_ARGS__);                                             \
+        parallel_filter_delete(&data);                                       \
+        return false;                                                        \
+    }
+
+    data->hard_threshold = 1;
+    data->soft_threshold = 1;
+    foreach (param, filter->params) {
+        switch (param->type) {
+          /* child parameter is:
+           *  weight:filter_name:result[,result...]
+           * the filter is run along with the other children of the filter,
+           * its weight is added to the score when it gives one of the
+           * listed results.
+           */
+          case ATK_CHILD: {
+            parallel_child_t child;
+            const char *current = param->value;
+            const char *p = m_strchrnul(current, ':');
+            char *next = NULL;
+
+            p_clear(&child, 1);
+            PARSE_CHECK(*p, "child parameter must contains a weight option");
+            child.weight = strtol(current, &next, 10);
+            PARSE_CHECK(next == p && child.weight >= 0
+                        && child.weight <= 1024,
+                        "illegal weight value %.*s",
+                        (int)(p - current), current);
+
+            current = p + 1;
+            p = m_strchrnul(current, ':');
+            PARSE_CHECK(*p, "child parameter must contains a list of results");
+            {
+                char name[p - current + 1];
+                memcpy(name, current, p - current);
+                name[p - current] = '\0';
+                child.filter_id = filter_find_with_name(filter->siblings,
+                                                        name);
+                PARSE_CHECK(child.filter_id >= 0,
+                            "invalid filter name %s", name);
+            }
+            PARSE_CHECK(array_ptr(*filter->siblings, child.filter_id)->type
+                        != filter->type,
+                        "the child %.*s of the filter %s is a parallel "
+                        "filter", (int)(p - current), current, filter->name);
+
+            do {
+                filter_result_t result;
+
+                current = p + 1;
+                p = m_strchrnul(current, ',');
+                result = hook_tokenize(current, p - current);
+                PARSE_CHECK(result != HTK_UNKNOWN && result != HTK_ASYNC,
+                            "invalid result %.*s", (int)(p - current),
+                            current);
+                child.results[result] = true;
+            } while (*p);
+            array_add(data->children, child);
+          } break;
+
+          /* hard_threshold parameter is an integer.
+           *  If the score is greater or equal than this threshold,
+           *  the hook "hard_match" is called.
+           * default is 1;
+           */
+          FILTER_PARAM_PARSE_INT(HARD_THRESHOLD, data->hard_threshold);
+
+          /* soft_threshold parameter is an integer.
+           *  if the score is greater or equal than this threshold
+           *  and smaller than the hard_threshold, the hook
+           *  "soft_match" is called.
+           * default is 1;
+           */
+          FILTER_PARAM_PARSE_INT(SOFT_THRESHOLD, data->soft_threshold);
+
+          default: break;
+        }
+    }
+
+    PARSE_CHECK(data->children.len > 0,
+                "no child parameter in the filter %s", filter->name);
+    filter->data = data;
+    return true;
+}
+
+static void parallel_filter_destructor(filter_t *filter)
+{
+    parallel_filter_t *data = filter->data;
+    parallel_filter_delete(&data);
+    filter->data = data;
+}
+
+static inline const filter_t *parallel_child_filter(const filter_t *filter,
+                                                    const parallel_child_t
+                                                    *child)
+{
+    return array_ptr(*filter->siblings, child->filter_id);
+}
+
+static parallel_slot_t *parallel_slot_acquire(parallel_async_t *async)
+{
+    parallel_slot_t *slot;
+
+    if (array_len(async->pool) > 0) {
+        return array_pop_last(async->pool);
+    }
+    slot = p_new(parallel_slot_t, 1);
+    filter_context_prepare(&slot->context, async->context->data);
+    slot->async = async;
+    array_add(async->slots, slot);
+    return slot;
+}
+
+static void parallel_slot_release(parallel_async_t *async,
+                                  parallel_slot_t *slot)
+{
+    slot->child = -1;
+    array_add(async->pool, slot);
+}
+
+/* Stop awaiting the children. The ones that cannot be canceled keep their
+ * slot until their result arrives.
+ */
+static void parallel_abandon(parallel_async_t *async)
+{
+    foreach (slot, async->running) {
+        if (filter_cancel(&(*slot)->context)) {
+            parallel_slot_release(async, *slot);
+        } else {
+            (*slot)->child = -1;
+        }
+    }
+    array_len(async->running) = 0;
+}
+
+/* Same rule as the iplist filter: the weights are positive, the score can
+ * only grow by the weights of the awaited children.
+ */
+static filter_result_t parallel_async_result(const parallel_filter_t *data,
+                                             const parallel_async_t *async)
+{
+    const int64_t sum = async->sum;
+    const int64_t max = sum + async->pending;
+
+    if (sum >= data->hard_threshold) {
+        return HTK_HARD_MATCH;
+    }
+    if (async->error) {
+        return async->awaited > 0 ? HTK_ASYNC : HTK_ERROR;
+    }
+    if (max < data->hard_threshold) {
+        if (sum >= data->soft_threshold) {
+            return HTK_SOFT_MATCH;
+        } else if (max < data->soft_threshold) {
+            return HTK_FAIL;
+        }
+    }
+    return HTK_ASYNC;
+}
+
+static void parallel_account(parallel_async_t *async,
+                             const parallel_child_t *child,
+                             const filter_context_t *context,
+                             filter_result_t result)
+{
+    if (result != HTK_ERROR && result != HTK_ABORT) {
+        async->error = false;
+    }
+    if (child->results[result]) {
+        async->sum += child->weight;
+        if (context->explanation.str != NULL) {
+            filter_set_explanation(async->context, context->explanation.str,
+                                   context->explanation.len);
+        }
+    }
+    async->pending -= child->weight;
+    --async->awaited;
+}
+
+static void parallel_child_result(filter_context_t *context,
+                                  filter_result_t result)
+{
+    parallel_slot_t       *slot = (parallel_slot_t *)context;
+    parallel_async_t     *async = slot->async;
+    const filter_t      *filter = async->filter;
+    const parallel_filter_t *data = filter->data;
+    filter_result_t res;
+
+    if (slot->child < 0) {
+        debug("ignoring late result of a child of filter %s", filter->name);
+        array_add(async->pool, slot);
+        return;
+    }
+    for (int i = 0 ; i < array_len(async->running) ; ++i) {
+        if (array_elt(async->running, i) == slot) {
+            array_elt(async->running, i)
+                = array_elt(async->running, array_len(async->running) - 1);
+            --array_len(async->running);
+            break;
+        }
+    }
+    parallel_account(async, array_ptr(data->children, slot->child),
+                     context, result);
+    parallel_slot_release(async, slot);
+
+    debug("got result %s for filter %s, still awaiting %d children",
+          htokens[result], filter->name, async->awaited);
+
+    res = parallel_async_result(data, async);
+    if (res != HTK_ASYNC) {
+        if (async->awaited > 0) {
+            debug("filter %s decided, ignoring %d pending children",
+                  filter->name, async->awaited);
+            parallel_abandon(async);
+        }
+        debug("answering to filter %s", filter->name);
+        filter_post_async_result(async->context, res);
+    }
+}
+
+static filter_result_t parallel_filter(const filter_t *filter,
+                                       const query_t *query,
+                                       filter_context_t *context)
+{
+    const parallel_filter_t *data = filter->data;
+    parallel_async_t *async = filter_context(filter, context);
+
+    async->filter  = filter;
+    async->context = context;
+    async->sum     = 0;
+    async->pending = 0;
+    async->awaited = array_len(data->children);
+    async->error   = true;
+    foreach (child, data->children) {
+        async->pending += child->weight;
+    }
+
+    /* All the children are started before waiting for any of them, the
+     * children not started yet are accounted as pending.
+     */
+    for (int i = 0 ; i < array_len(data->children) ; ++i) {
+        const parallel_child_t *child = array_ptr(data->children, i);
+        parallel_slot_t *slot = parallel_slot_acquire(async);
+        filter_result_t res;
+
+        slot->child = i;
+        res = filter_run_child(parallel_child_filter(filter, child), query,
+                               &slot->context, filter, context);
+        if (res == HTK_ASYNC) {
+            array_add(async->running, slot);
+            continue;
+        }
+        parallel_account(async, child, &slot->context, res);
+        parallel_slot_release(async, slot);
+
+        res = parallel_async_result(data, async);
+        if (res != HTK_ASYNC) {
+            parallel_abandon(async);
+            return res;
+        }
+    }
+    debug("filter %s awaiting %d children", filter->name, async->awaited);
+    return HTK_ASYNC;
+}
+
+static void parallel_filter_cancel(filter_context_t *context)
+{
+    parallel_abandon(filter_context(context->current_filter, context));
+}
+
+static void parallel_filter_prefetch(const filter_t *filter,
+                                     const query_t *query)
+{
+    const parallel_filter_t *data = filter->data;
+
+    foreach (child, data->children) {
+        const filter_t *child_filter = parallel_child_filter(filter, child);
+
+        if (filter_can_prefetch(child_filter)) {
+            filter_prefetch(child_filter, query);
+        }
+    }
+}
+
+static void *parallel_context_constructor(void)
+{
+    return p_new(parallel_async_t, 1);
+}
+
+static void parallel_context_destructor(void *data)
+{
+    parallel_async_t *async = data;
+
+    foreach (slot, async->slots) {
+        if ((*slot)->context.current_filter != NULL) {
+            (void)filter_cancel(&(*slot)->context);
+        }
+        filter_context_wipe(&(*slot)->context);
+        p_delete(slot);
+    }
+    array_wipe(async->slots);
+    array_wipe(async->pool);
+    array_wipe(async->running);
+    p_delete(&async);
+}
+
+filter_constructor(parallel)
+{
+    filter_type_t filter_type
+        = filter_register("parallel", parallel_filter_constructor,
+                          parallel_filter_destructor, parallel_filter,
+                          parallel_context_constructor,
+                          parallel_context_destructor);
+
+    /* Hooks.
+     */
+    (void)filter_hook_register(filter_type, "error");
+    (void)filter_hook_register(filter_type, "fail");
+    (void)filter_hook_register(filter_type, "hard_match");
+    (void)filter_hook_register(filter_type, "soft_match");
+    (void)filter_hook_register(filter_type, "async");
+
+    filter_hook_forward_register(filter_type, HTK_SOFT_MATCH, HTK_HARD_MATCH);
+    filter_hook_forward_register(filter_type, HTK_ERROR, HTK_FAIL);
+
+    filter_child_handler_register(filter_type, parallel_child_result);
+    filter_canceler_register(filter_type, parallel_filter_cancel);
+    filter_prefetcher_register(filter_type, parallel_filter_prefetch);
+
+    /* The answer depends on the children, that are not cached through
+     * this filter.
+     */
+    filter_uncacheable_register(filter_type);
+
+    /* Parameters.
+     */
+    (void)filter_param_register(filter_type, "child");
+    (void)filter_param_register(filter_type, "hard_threshold");
+    (void)filter_param_register(filter_type, "soft_threshold");
+    return 0;
+}
+
+/* vim:set et sw=4 sts=4 sws=4: */
@@ -37,6 +37,10 @@
 #include "policy_tokens.h"
 #include "str.h"
 
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
 const clstr_t smtp_state_names_g[] = {
     [SMTP_CONNECT]        = CLSTR_IMMED("CONNECT"),
     [SMTP_HELO]           = CLSTR_IMMED("HELO"),
@@ -326,6 +330,58 @@ const clstr_t *query_field_for_id(const query_t *query, postlicyd_token id)
     }
 }
 
+void query_lowercase(char *dest, const char *src, int len)
+{
+    int i = 0;
+
+#ifdef __SSE2__
+    /* 16 chars at once: 0x20 is added to the bytes in [A-Z]. The bytes above
+     * 0x7f are negative in the signed comparisons and left unchanged.
+     */
+    const __m128i before_a = _mm_set1_epi8('A' - 1);
+    const __m128i after_z  = _mm_set1_epi8('Z' + 1);
+    const __m128i delta    = _mm_set1_epi8('a' - 'A');
+
+    for (; i + 16 <= len ; i += 16) {
+        __m128i chars = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(chars, before_a),
+                                      _mm_cmplt_epi8(chars, after_z));
+
+        chars = _mm_add_epi8(chars, _mm_and_si128(upper, delta));
+        _mm_storeu_si128((__m128i *)(dest + i), chars);
+    }
+#endif
+    for (; i < len ; ++i) {
+        dest[i] = ascii_tolower(src[i]);
+    }
+    dest[len] = '\0';
+}
+
+const clstr_t *query_field_lowercase(const query_t *query, postlicyd_token id)
+{
+    query_t *q = (query_t *)query;
+    const clstr_t *field;
+    query_lowercase_t *lower;
+
+    for (int i = 0 ; i < query->lowercase_count ; ++i) {
+        if (query->lowercase[i].id == id) {
+            return &query->lowercase[i].str;
+        }
+    }
+    field = query_field_for_id(query, id);
+    if (field == NULL || query->lowercase_count == QUERY_LOWERCASE_MAX
+        || query->l_used + field->len >= QUERY_LOWERCASE_SIZE) {
+        return NULL;
+    }
+    lower = &q->lowercase[q->lowercase_count++];
+    lower->id      = id;
+    lower->str.str = q->l_buffer + q->l_used;
+    lower->str.len = field->len;
+    query_lowercase(q->l_buffer + q->l_used, field->str, field->len);
+    q->l_used += field->len + 1;
+    return &lower->str;
+}
+
 const clstr_t *query_field_for_name(const query_t *query, const char *name)
 {
     postlicyd_token id = policy_tokenize(name, strlen(name));
@@ -464,6 +520,63 @@ ssize_t query_format(char *dest, size_t len, const char *fmt,
     return pos;
 }
 
+/* Whether the token is a field of the query, the other tokens expand to a
+ * constant (see query_format_field_content()).
+ */
+static bool query_is_field(postlicyd_token id)
+{
+    static const query_t empty;
+
+    /* Computed from the other fields on first use.
+     */
+    if (id == PTK_NORMALIZED_SENDER || id == PTK_NORMALIZED_CLIENT) {
+        return true;
+    }
+    return query_field_for_id(&empty, id) != NULL;
+}
+
+uint64_t query_format_fields(const char *fmt)
+{
+    uint64_t fields = 0;
+
+    while ((fmt = strstr(fmt, "${")) != NULL) {
+        const char *end = fmt += 2;
+        postlicyd_token tok;
+
+        while (*end != '\0' && *end != '}' && *end != '[') {
+            ++end;
+        }
+        tok = policy_tokenize(fmt, end - fmt);
+        if (tok >= 0 && tok < 64 && query_is_field(tok)) {
+            fields |= QUERY_FIELD(tok);
+        }
+        fmt = end;
+    }
+    return fields;
+}
+
+int query_fields_key(char *key, int size, const query_t *query,
+                     uint64_t fields)
+{
+    int pos = 0;
+
+    for (; fields != 0 ; fields &= fields - 1) {
+        const postlicyd_token id = (postlicyd_token)__builtin_ctzll(fields);
+        const clstr_t *field = query_field_for_id(query, id);
+        const int len = (field != NULL && field->str != NULL) ? field->len : 0;
+
+        if (pos + len + 1 > size) {
+            return -1;
+        }
+        if (len > 0) {
+            memcpy(key + pos, field->str, len);
+        }
+        pos += len;
+        key[pos++] = '\0';
+    }
+    return pos;
+}
+
 bool query_format_buffer(buffer_t *buf, const char *fmt, const query_t *query)
 {
     buffer_ensure(buf, m_strlen(fmt) + 64);
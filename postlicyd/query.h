@@ -58,6 +58,14 @@ enum smtp_state {
 extern const clstr_t smtp_state_names_g[];
 
 /* \see http://www.postfix.org/SMTPD_POLICY_README.html */
+#define QUERY_LOWERCASE_MAX   8
+#define QUERY_LOWERCASE_SIZE  2048
+
+typedef struct query_lowercase_t {
+    postlicyd_token id;
+    clstr_t str;
+} query_lowercase_t;
+
 typedef struct query_t {
     unsigned state : 4;
     unsigned esmtp : 1;
@@ -106,6 +114,14 @@ typedef struct query_t {
 
     char n_sender[256];
     char n_client[64];
+
+    /* Fields in lowercase, computed on first use and shared by the filters
+     * that run on the query (see query_field_lowercase()).
+     */
+    query_lowercase_t lowercase[QUERY_LOWERCASE_MAX];
+    int  lowercase_count;
+    int  l_used;
+    char l_buffer[QUERY_LOWERCASE_SIZE];
 } query_t;
 
 /** Parse the content of the text to fill the query.
@@ -116,6 +132,14 @@ typedef struct query_t {
 __attribute__((nonnull(1,2)))
 bool query_parse(query_t *query, char *p);
 
+/** Whether postfix is under stress (too many smtpd processes).
+ */
+static inline bool query_under_stress(const query_t *query)
+{
+    return query->stress.len == 3
+        && strncasecmp(query->stress.str, "yes", 3) == 0;
+}
+
 /** Return the value of the field with the given name.
  */
 __attribute__((nonnull(1,2)))
@@ -126,6 +150,20 @@ const clstr_t *query_field_for_name(const query_t *query, const char *name);
 __attribute__((nonnull))
 const clstr_t *query_field_for_id(const query_t *query, postlicyd_token id);
 
+/** Returns the value of the field with the given id in lowercase (ASCII
+ * letters only, \0 terminated). The value is computed once per query.
+ * Returns NULL if the field is unknown or if there is no room left in the
+ * query to store it.
+ */
+__attribute__((nonnull))
+const clstr_t *query_field_lowercase(const query_t *query, postlicyd_token id);
+
+/** Copy the \p len first chars of \p src in \p dest in lowercase (ASCII
+ * letters only) and add a \0.
+ */
+__attribute__((nonnull))
+void query_lowercase(char *dest, const char *src, int len);
+
 /** Formats the given string by replacing ${field_name} with the content
  * of the query.
  * Unknown and empty fields are filled with (null).
@@ -144,6 +182,23 @@ bool query_format_buffer(buffer_t *buf, const char *fmt,
  */
 #define query_format_check(fmt) (query_format(NULL, 0, fmt, NULL) >= 0)
 
+/** Set of query fields, one bit per postlicyd_token.
+ */
+#define QUERY_FIELD(Id)  (UINT64_C(1) << (Id))
+
+/** Fields referenced by the given query-format string. The tokens that are
+ * not fields of the query (such as ${request}) are left out.
+ */
+__attribute__((nonnull))
+uint64_t query_format_fields(const char *fmt);
+
+/** Writes the values of the given fields in @p key, separated by '\\0'.
+ * The unknown fields are empty. Returns the length of the key, or -1 if it does not fit in @p size bytes.
+ */
+__attribute__((nonnull))
+int query_fields_key(char *key, int size, const query_t *query,
+                     uint64_t fields);
+
 #endif
 
 /* vim:set et sw=4 sts=4 sws=4: */
@@ -180,24 +180,34 @@ static inline int rate_delay_for_slot(int slot, int delay)
     return (delay * slot) / RATE_MAX_SLOTS;
 }
 
-static filter_result_t rate_filter(const filter_t *filter,
-                                   const query_t *query,
-                                   filter_context_t *context)
+/* State of a query while its entry is fetched: in prefork mode, it is
+ * fetched from the master (see db_get_async()).
+ */
+typedef struct rate_query_t {
+    const rate_config_t *config;
+    filter_context_t *context;
+    time_t now;
+    char   key[BUFSIZ];
+    size_t key_len;
+
+    uint32_t request;
+    filter_result_t result;
+    bool async;
+} rate_query_t;
+
+static filter_result_t rate_count(rate_query_t *q, const void *data,
+                                  size_t entry_len)
 {
     static size_t entry_header_len = offsetof(struct rate_entry_t, entries);
-    char key[BUFSIZ];
-    const rate_config_t *config = filter->data;
-    time_t now = time(NULL);
-    size_t key_len, entry_len;
+    const rate_config_t *config = q->config;
+    const char *key = q->key;
+    size_t key_len = q->key_len;
+    time_t now = q->now;
     struct rate_entry_t entry;
     p_clear(&entry, 1);
 
-    key_len = query_format(key, sizeof(key), config->key_format, query);
-    if (key_len >= BUFSIZ) {
-        key_len = BUFSIZ - 1;
-    }
-    const void *data = db_get(config->db, key, key_len, &entry_len);
-    if (rate_db_check_entry(data, entry_len, now, (void*)config)) {
+    if (data != NULL
+        && rate_db_check_entry(data, entry_len, now, (void*)config)) {
         memcpy(&entry, data, entry_len);
         debug("rate entry found for \"%s\"", key);
         if (entry.active_entries == 0) {
@@ -293,11 +303,74 @@ static filter_result_t rate_filter(const filter_t *filter,
     }
 }
 
+static void rate_fetched(void *data, const void *entry, size_t entry_len)
+{
+    rate_query_t *q = data;
+
+    q->request = 0;
+    q->result  = rate_count(q, entry, entry_len);
+    if (q->async) {
+        q->async = false;
+        filter_post_async_result(q->context, q->result);
+    }
+}
+
+static filter_result_t rate_filter(const filter_t *filter,
+                                   const query_t *query,
+                                   filter_context_t *context)
+{
+    rate_query_t *q = filter_context(filter, context);
+
+    q->config  = filter->data;
+    q->context = context;
+    q->now     = time(NULL);
+    q->key_len = query_format(q->key, sizeof(q->key), q->config->key_format,
+                              query);
+    if (q->key_len >= BUFSIZ) {
+        q->key_len = BUFSIZ - 1;
+    }
+    q->result  = HTK_ASYNC;
+    q->async   = false;
+    q->request = db_get_async(q->config->db, q->key, q->key_len,
+                              rate_fetched, q);
+    q->async   = q->result == HTK_ASYNC;
+    return q->result;
+}
+
+static void rate_filter_cancel(filter_context_t *context)
+{
+    rate_query_t *q = filter_context(context->current_filter, context);
+
+    if (q->request != 0) {
+        db_get_cancel(q->request);
+        q->request = 0;
+    }
+    q->async = false;
+}
+
+static void *rate_context_constructor(void)
+{
+    return p_new(rate_query_t, 1);
+}
+
+static void rate_context_destructor(void *data)
+{
+    rate_query_t *q = data;
+
+    /* The connection closed while the entry was being fetched. */
+    if (q->request != 0) {
+        db_get_cancel(q->request);
+    }
+    p_delete(&q);
+}
+
 filter_constructor(rate)
 {
     filter_type_t type = filter_register("rate", rate_filter_constructor,
                                          rate_filter_destructor,
-                                         rate_filter, NULL, NULL);
+                                         rate_filter,
+                                         rate_context_constructor,
+                                         rate_context_destructor);
 
     /* Hooks
      */
@@ -311,6 +384,11 @@ filter_constructor(rate)
     filter_hook_forward_register(type, HTK_HARD_MATCH_START, HTK_HARD_MATCH);
     filter_hook_forward_register(type, HTK_SOFT_MATCH, HTK_HARD_MATCH);
 
+    /* Each query is counted.
+     */
+    filter_uncacheable_register(type);
+    filter_canceler_register(type, rate_filter_cancel);
+
     /* Parameters
      */
     (void)filter_param_register(type, "key");
@@ -0,0 +1,467 @@
+/****************************************************************************/
+/*          pfixtools: a collection of postfix related tools                */
+/*          ~~~~~~~~~                                                       */
+/*  ______________________________________________________________________  */
+/*                                                                          */
+/*  Redistribution and use in source and binary forms, with or without      */
+/*  modification, are permitted provided that the following conditions      */
+/*  are met:                                                                */
+/*                                                                          */
+/*  1. Redistributions of source code must retain the above copyright       */
+/*     notice, this list of conditions and the following disclaimer.        */
+/*  2. Redistributions in binary form must reproduce the above copyright    */
+/*     notice, this list of conditions and the following disclaimer in      */
+/*     the documentation and/or other materials provided with the           */
+/*     distribution.                                                        */
+/*  3. The names of its contributors may not be used to endorse or promote  */
+/*     products derived from this software without specific prior written   */
+/*     permission.                                                          */
+/*                                                                          */
+/*  THIS SOFTWARE IS PROVIDED BY THE CONTRIBUTORS ``AS IS'' AND ANY         */
+/*  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       */
+/*  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR      */
+/*  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE CONTRIBUTORS BE LIABLE   */
+/*  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR            */
+/*  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF    */
+/*  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR         */
+/*  BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,   */
+/*  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE    */
+/*  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,       */
+/*  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                      */
+/*                                                                          */
+/*   Copyright (c) 2006-2014 the Authors                                    */
+/*   see AUTHORS and source files for details                               */
+/****************************************************************************/
+
+#include <pcre.h>
+
+#include "str.h"
+#include "buffer.h"
+#include "worker.h"
+#include "regexpset.h"
+
+/* Sets of regexps.
+ *
+ * The patterns of a set are compiled in an alternation in which each
+ * pattern is followed by a callout, and the alternation by (*FAIL): the
+ * alternation never matches, so PCRE tries every pattern at every position
+ * of the string in a single call, and the callout records the patterns that
+ * reach their end. The callout finds its pattern from its position in the
+ * alternation.
+ *
+ * The alternations are cut in chunks to stay below the size limit of the
+ * compiled patterns. The patterns that refer to their own groups (by number
+ * or by name) or whose syntax may leak out of their alternative are matched
+ * alone, as the patterns of a chunk that cannot be compiled.
+ *
+ * The (*FAIL) makes PCRE backtrack through all the alternation, so a scan
+ * may exceed the match limit where each pattern alone would not. When a scan
+ * fails, the patterns of the chunk are matched one by one for that string
+ * only: the following strings are scanned again.
+ */
+#define REGEXP_SET_CHUNK_SIZE  (16 << 10)
+
+typedef struct regexp_set_pattern_t {
+    uint32_t    source;
+    uint32_t    len;
+    bool        cs;
+
+    /* Compiled pattern if it is matched alone. */
+    pcre       *re;
+    pcre_extra *extra;
+
+    /* Compiled pattern if it is in an alternation, to match it alone when
+     * the scan of the alternation fails.
+     */
+    pcre       *fallback;
+    pcre_extra *fallback_extra;
+} regexp_set_pattern_t;
+ARRAY(regexp_set_pattern_t)
+
+/* An alternation of patterns. The callout that follows the pattern
+ * patterns[i] ends at positions[i] in the alternation.
+ */
+typedef struct regexp_set_chunk_t {
+    A(int)      patterns;
+    A(int)      positions;
+    pcre       *re;
+    pcre_extra *extra;
+
+    /* Set once a scan of the alternation failed and it was reported. */
+    int         warned;
+} regexp_set_chunk_t;
+ARRAY(regexp_set_chunk_t)
+
+struct regexp_set_t {
+    buffer_t sources;
+    A(regexp_set_pattern_t) patterns;
+    A(regexp_set_chunk_t)   chunks;
+};
+
+typedef struct regexp_set_scan_t {
+    const regexp_set_chunk_t *chunk;
+    uint64_t *matches;
+    int       count;
+} regexp_set_scan_t;
+
+/* The JIT stack of the alternations, one per thread.
+ */
+static __thread pcre_jit_stack *regexp_set_jit_stack_g;
+
+static pcre_jit_stack *regexp_set_jit_stack(void *data)
+{
+    if (regexp_set_jit_stack_g == NULL) {
+        regexp_set_jit_stack_g = pcre_jit_stack_alloc(32 << 10, 1 << 20);
+    }
+    return regexp_set_jit_stack_g;
+}
+
+static int regexp_set_callout(pcre_callout_block *block)
+{
+    regexp_set_scan_t *scan = block->callout_data;
+    int l = 0, r;
+
+    /* Callout of a regexp that is not a set. */
+    if (scan == NULL) {
+        return 0;
+    }
+    r = scan->chunk->positions.len;
+    while (l < r) {
+        int i = (r + l) / 2;
+
+        if (array_elt(scan->chunk->positions, i) < block->pattern_position) {
+            l = i + 1;
+        } else {
+            r = i;
+        }
+    }
+    if (l < scan->chunk->positions.len
+        && array_elt(scan->chunk->positions, l) == block->pattern_position) {
+        const int pattern = array_elt(scan->chunk->patterns, l);
+        const uint64_t bit = 1ULL << (pattern % 64);
+
+        if (!(scan->matches[pattern / 64] & bit)) {
+            scan->matches[pattern / 64] |= bit;
+            ++scan->count;
+        }
+    }
+    return 0;
+}
+
+static void regexp_set_pattern_wipe(regexp_set_pattern_t *pattern)
+{
+    if (pattern->extra != NULL) {
+        pcre_free_study(pattern->extra);
+    }
+    if (pattern->re != NULL) {
+        pcre_free(pattern->re);
+    }
+    if (pattern->fallback_extra != NULL) {
+        pcre_free_study(pattern->fallback_extra);
+    }
+    if (pattern->fallback != NULL) {
+        pcre_free(pattern->fallback);
+    }
+}
+
+static void regexp_set_chunk_wipe(regexp_set_chunk_t *chunk)
+{
+    array_wipe(chunk->patterns);
+    array_wipe(chunk->positions);
+    if (chunk->extra != NULL) {
+        pcre_free_study(chunk->extra);
+    }
+    if (chunk->re != NULL) {
+        pcre_free(chunk->re);
+    }
+}
+
+regexp_set_t *regexp_set_new(void)
+{
+    return p_new(regexp_set_t, 1);
+}
+
+void regexp_set_delete(regexp_set_t **set)
+{
+    if (*set) {
+        buffer_wipe(&(*set)->sources);
+        array_deep_wipe((*set)->patterns, regexp_set_pattern_wipe);
+        array_deep_wipe((*set)->chunks, regexp_set_chunk_wipe);
+        p_delete(set);
+    }
+}
+
+int regexp_set_count(const regexp_set_t *set)
+{
+    return set->patterns.len;
+}
+
+/* Check that @p pattern can be put in an alternation with other patterns:
+ * its groups are numbered from the groups of the patterns that precede it,
+ * and a \Q or a comment of the extended syntax would run past its end.
+ */
+static bool regexp_set_can_combine(const char *pattern, const pcre *re)
+{
+    int backrefs = 0, names = 0;
+
+    if (pcre_fullinfo(re, NULL, PCRE_INFO_BACKREFMAX, &backrefs) != 0
+        || pcre_fullinfo(re, NULL, PCRE_INFO_NAMECOUNT, &names) != 0
+        || backrefs > 0 || names > 0) {
+        return false;
+    }
+    for (const char *p = pattern ; *p ; ++p) {
+        if (p[0] == '\\') {
+            if (p[1] == 'Q' || p[1] == 'g' || p[1] == 'k') {
+                return false;
+            }
+            if (p[1] != '\0') {
+                ++p;
+            }
+        } else if (p[0] == '(' && p[1] == '*') {
+            /* Verbs and start of pattern options. */
+            return false;
+        } else if (p[0] == '(' && p[1] == '?') {
+            /* Recursions, subroutine calls, conditions, callouts, and options
+             * that may enable the extended syntax.
+             */
+            const char *q = p + 2;
+
+            if (isdigit((unsigned char)*q)
+                || (*q != '\0' && strchr("+R&P(C", *q) != NULL)
+                || (*q == '-' && isdigit((unsigned char)q[1]))) {
+                return false;
+            }
+            while (isalpha((unsigned char)*q) || *q == '-') {
+                if (*q == 'x') {
+                    return false;
+                }
+                ++q;
+            }
+        }
+    }
+    return true;
+}
+
+int regexp_set_add(regexp_set_t *set, const clstr_t *pattern, bool cs)
+{
+    regexp_set_pattern_t p = {
+        .source = set->sources.len,
+        .len    = pattern->len,
+        .cs     = cs,
+    };
+    const char *error;
+    int erroffset;
+
+    buffer_add(&set->sources, pattern->str, pattern->len);
+    buffer_addch(&set->sources, '\0');
+    p.re = pcre_compile(set->sources.data + p.source, cs ? 0 : PCRE_CASELESS,
+                        &error, &erroffset, NULL);
+    if (p.re == NULL) {
+        err("invalid regexp %.*s: %s", (int)pattern->len, pattern->str,
+            error);
+        set->sources.len = p.source;
+        return -1;
+    }
+    if (regexp_set_can_combine(set->sources.data + p.source, p.re)) {
+        p.fallback = p.re;
+        p.re = NULL;
+    }
+    array_add(set->patterns, p);
+    return set->patterns.len - 1;
+}
+
+static void regexp_set_study(pcre *re, pcre_extra **extra)
+{
+    const char *error = NULL;
+
+    *extra = pcre_study(re, PCRE_STUDY_JIT_COMPILE, &error);
+    if (error != NULL) {
+        warn("cannot study regexp: %s", error);
+    }
+}
+
+/* Compile the alternation of the patterns [from, to[ of @p set that are
+ * not matched alone. If it cannot be compiled, the patterns are matched
+ * alone.
+ */
+static bool regexp_set_chunk_build(regexp_set_t *set, int from, int to)
+{
+    regexp_set_chunk_t chunk;
+    buffer_t source = ARRAY_INIT;
+    const char *error;
+    int erroffset;
+    int options = PCRE_NO_START_OPTIMIZE;
+
+#ifdef PCRE_NO_AUTO_POSSESS
+    /* Auto-possessification may skip the callouts. */
+    options |= PCRE_NO_AUTO_POSSESS;
+#endif
+    p_clear(&chunk, 1);
+    buffer_addstr(&source, "(?:");
+    for (int i = from ; i < to ; ++i) {
+        const regexp_set_pattern_t *p = array_ptr(set->patterns, i);
+
+        if (p->re != NULL) {
+            continue;
+        }
+        if (chunk.patterns.len > 0) {
+            buffer_addch(&source, '|');
+        }
+        buffer_addstr(&source, p->cs ? "(?:" : "(?i:");
+        buffer_add(&source, set->sources.data + p->source, p->len);
+        buffer_addstr(&source, ")(?C)");
+        array_add(chunk.patterns, i);
+        array_add(chunk.positions, source.len);
+    }
+    buffer_addstr(&source, ")(*FAIL)");
+    if (chunk.patterns.len > 0) {
+        chunk.re = pcre_compile(source.data, options, &error, &erroffset,
+                                NULL);
+    }
+    buffer_wipe(&source);
+    if (chunk.patterns.len == 0) {
+        regexp_set_chunk_wipe(&chunk);
+        return true;
+    }
+    if (chunk.re != NULL) {
+        regexp_set_study(chunk.re, &chunk.extra);
+        if (chunk.extra != NULL) {
+            pcre_assign_jit_stack(chunk.extra, regexp_set_jit_stack, NULL);
+        }
+        array_add(set->chunks, chunk);
+        return true;
+    }
+
+    warn("cannot combine %d regexps (%s), matching them one by one",
+         chunk.patterns.len, error);
+    foreach (i, chunk.patterns) {
+        regexp_set_pattern_t *p = array_ptr(set->patterns, *i);
+
+        p->re = p->fallback;
+        p->fallback = NULL;
+    }
+    regexp_set_chunk_wipe(&chunk);
+    return true;
+}
+
+bool regexp_set_compile(regexp_set_t *set)
+{
+    uint32_t size = 0;
+    int from = 0;
+
+    for (int i = 0 ; i < set->patterns.len ; ++i) {
+        const regexp_set_pattern_t *p = array_ptr(set->patterns, i);
+
+        if (p->re != NULL) {
+            continue;
+        }
+        if (size > 0 && size + p->len > REGEXP_SET_CHUNK_SIZE) {
+            if (!regexp_set_chunk_build(set, from, i)) {
+                return false;
+            }
+            from = i;
+            size = 0;
+        }
+        size += p->len;
+    }
+    if (!regexp_set_chunk_build(set, from, set->patterns.len)) {
+        return false;
+    }
+
+    foreach (p, set->patterns) {
+        if (p->re != NULL) {
+            regexp_set_study(p->re, &p->extra);
+        } else {
+            regexp_set_study(p->fallback, &p->fallback_extra);
+        }
+    }
+    return true;
+}
+
+/* Match @p str against the patterns of @p chunk one by one, skipping the
+ * ones the scan already found.
+ */
+static void regexp_set_chunk_match_alone(const regexp_set_t *set,
+                                         const regexp_set_chunk_t *chunk,
+                                         const clstr_t *str,
+                                         regexp_set_scan_t *scan)
+{
+    foreach (i, chunk->patterns) {
+        const regexp_set_pattern_t *p = array_ptr(set->patterns, *i);
+        const uint64_t bit = 1ULL << (*i % 64);
+
+        if (!(scan->matches[*i / 64] & bit)
+            && pcre_exec(p->fallback, p->fallback_extra, str->str,
+                         str->len, 0, 0, NULL, 0) >= 0) {
+            scan->matches[*i / 64] |= bit;
+            ++scan->count;
+        }
+    }
+}
+
+int regexp_set_match(const regexp_set_t *set, const clstr_t *str,
+                     uint64_t *matches)
+{
+    regexp_set_scan_t scan = { NULL, matches, 0 };
+    int res;
+
+    p_clear(matches, REGEXP_SET_WORDS(set->patterns.len));
+    foreach (chunk, set->chunks) {
+        pcre_extra extra;
+
+        /* The callout data is given per call, the chunk is shared by the
+         * threads.
+         */
+        if (chunk->extra != NULL) {
+            extra = *chunk->extra;
+        } else {
+            p_clear(&extra, 1);
+        }
+        extra.flags       |= PCRE_EXTRA_CALLOUT_DATA;
+        extra.callout_data = &scan;
+        scan.chunk = chunk;
+        res = pcre_exec(chunk->re, &extra, str->str, str->len, 0, 0, NULL, 0);
+        if (res != PCRE_ERROR_NOMATCH) {
+            /* The patterns the scan did not reach are unknown. The chunk is
+             * shared by the threads, only the first failure is reported.
+             */
+            if (__sync_lock_test_and_set(&((regexp_set_chunk_t *)chunk)->warned,
+                                         1) == 0) {
+                warn("regexp set scan aborted: error %d, matching its %d "
+                     "regexps one by one for this string", res,
+                     chunk->patterns.len);
+            }
+            regexp_set_chunk_match_alone(set, chunk, str, &scan);
+        }
+    }
+    for (int i = 0 ; i < set->patterns.len ; ++i) {
+        const regexp_set_pattern_t *p = array_ptr(set->patterns, i);
+
+        if (p->re != NULL
+            && pcre_exec(p->re, p->extra, str->str, str->len, 0, 0,
+                         NULL, 0) >= 0) {
+            matches[i / 64] |= 1ULL << (i % 64);
+            ++scan.count;
+        }
+    }
+    return scan.count;
+}
+
+static void regexp_set_thread_exit(void)
+{
+    if (regexp_set_jit_stack_g != NULL) {
+        pcre_jit_stack_free(regexp_set_jit_stack_g);
+        regexp_set_jit_stack_g = NULL;
+    }
+}
+
+static int regexp_set_module_init(void)
+{
+    pcre_callout = regexp_set_callout;
+    worker_atexit(regexp_set_thread_exit);
+    return 0;
+}
+module_init(regexp_set_module_init);
+module_exit(regexp_set_thread_exit);
+
+/* vim:set et sw=4 sts=4 sws=4: */
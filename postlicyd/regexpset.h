@@ -0,0 +1,73 @@
+/****************************************************************************/
+/*          pfixtools: a collection of postfix related tools                */
+/*          ~~~~~~~~~                                                       */
+/*  ______________________________________________________________________  */
+/*                                                                          */
+/*  Redistribution and use in source and binary forms, with or without      */
+/*  modification, are permitted provided that the following conditions      */
+/*  are met:                                                                */
+/*                                                                          */
+/*  1. Redistributions of source code must retain the above copyright       */
+/*     notice, this list of conditions and the following disclaimer.        */
+/*  2. Redistributions in binary form must reproduce the above copyright    */
+/*     notice, this list of conditions and the following disclaimer in      */
+/*     the documentation and/or other materials provided with the           */
+/*     distribution.                                                        */
+/*  3. The names of its contributors may not be used to endorse or promote  */
+/*     products derived from this software without specific prior written   */
+/*     permission.                                                          */
+/*                                                                          */
+/*  THIS SOFTWARE IS PROVIDED BY THE CONTRIBUTORS ``AS IS'' AND ANY         */
+/*  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       */
+/*  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR      */
+/*  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE CONTRIBUTORS BE LIABLE   */
+/*  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR            */
+/*  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF    */
+/*  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR         */
+/*  BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,   */
+/*  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE    */
+/*  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,       */
+/*  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                      */
+/*                                                                          */
+/*   Copyright (c) 2006-2014 the Authors                                    */
+/*   see AUTHORS and source files for details                               */
+/****************************************************************************/
+
+#ifndef PFIXTOOLS_REGEXPSET_H
+#define PFIXTOOLS_REGEXPSET_H
+
+/** A set of regexps matched in a single scan of the string, that reports
+ * all the patterns that match.
+ */
+typedef struct regexp_set_t regexp_set_t;
+
+/** Number of words of the bitmap of the patterns that match a string.
+ */
+#define REGEXP_SET_WORDS(count)  (((count) + 63) / 64)
+
+regexp_set_t *regexp_set_new(void);
+void regexp_set_delete(regexp_set_t **set);
+
+/** Add a pattern to the set. Returns its index in the set, or -1 if the
+ * pattern is not a valid regexp.
+ */
+int regexp_set_add(regexp_set_t *set, const clstr_t *pattern, bool cs);
+
+/** Compile the set, once all its patterns are added.
+ */
+bool regexp_set_compile(regexp_set_t *set);
+
+/** Number of patterns of the set.
+ */
+int regexp_set_count(const regexp_set_t *set);
+
+/** Match @p str against all the patterns of the set. The bit i of
+ * @p matches (REGEXP_SET_WORDS(count) words) is set if the pattern i matches
+ * @p str. Returns the number of patterns that match.
+ */
+int regexp_set_match(const regexp_set_t *set, const clstr_t *str,
+                     uint64_t *matches);
+
+#endif
+
+/* vim:set et sw=4 sts=4 sws=4: */
@@ -33,14 +33,21 @@
 /*   see AUTHORS and source files for details                               */
 /****************************************************************************/
 
+#include <pthread.h>
+
 #include "str.h"
 #include "array.h"
 #include "resources.h"
 
+/* Resources are shared by all the configuration generations alive. When a
+ * resource is replaced, the previous version is retired: it is kept until the
+ * generations that still use it release it.
+ */
 typedef struct resource_t {
     char *key;
     void *data;
     int  refcount;
+    bool current;
     resource_destructor_f destructor;
 } resource_t;
 ARRAY(resource_t);
@@ -49,8 +56,17 @@ ARRAY(resource_t);
 
 static struct {
     A(resource_t) resources;
-} resources_g;
+
+    /* Keys locked by resource_lock(): only their key is set.
+     */
+    A(resource_t) loading;
+    pthread_mutex_t lock;
+    pthread_cond_t  loaded;
+} resources_g = {
 #define _G  resources_g
+    .lock   = PTHREAD_MUTEX_INITIALIZER,
+    .loaded = PTHREAD_COND_INITIALIZER,
+};
 
 #define RESOURCE_KEY                                                         \
     char rskey[BUFSIZ];                                                      \
@@ -68,62 +84,105 @@ static inline void resource_wipe(resource_t *res)
     *res = vr;
 }
 
-static inline resource_t *resource_find(const char *key, bool create)
+static inline resource_t *resource_find(const char *key, const void *data)
 {
     foreach (res, _G.resources) {
-        if (strcmp(res->key, key) == 0) {
+        if (strcmp(res->key, key) == 0
+            && (data == NULL ? res->current : res->data == data)) {
             return res;
         }
     }
-    if (create) {
-        resource_t res = RESOURCE_INIT;
-        res.key = m_strdup(key);
-        array_add(_G.resources, res);
-        return &array_last(_G.resources);
+    return NULL;
+}
+
+static inline resource_t *resource_find_loading(const char *key)
+{
+    foreach (res, _G.loading) {
+        if (strcmp(res->key, key) == 0) {
+            return res;
+        }
     }
     return NULL;
 }
 
+void resource_lock(const char *ns, const char *key)
+{
+    resource_t res = RESOURCE_INIT;
+    RESOURCE_KEY;
+    pthread_mutex_lock(&_G.lock);
+    while (resource_find_loading(rskey) != NULL) {
+        pthread_cond_wait(&_G.loaded, &_G.lock);
+    }
+    res.key = m_strdup(rskey);
+    array_add(_G.loading, res);
+    pthread_mutex_unlock(&_G.lock);
+}
+
+void resource_unlock(const char *ns, const char *key)
+{
+    RESOURCE_KEY;
+    pthread_mutex_lock(&_G.lock);
+    resource_t *entry = resource_find_loading(rskey);
+    assert(entry != NULL);
+    resource_wipe(entry);
+    *entry = array_elt(_G.loading, array_len(_G.loading) - 1);
+    --array_len(_G.loading);
+    pthread_cond_broadcast(&_G.loaded);
+    pthread_mutex_unlock(&_G.lock);
+}
+
 void *resource_get(const char *ns, const char *key)
 {
+    void *data = NULL;
     RESOURCE_KEY;
-    resource_t *entry = resource_find(rskey, false);
-    if (entry == NULL) {
-        return NULL;
-    } else {
+    pthread_mutex_lock(&_G.lock);
+    resource_t *entry = resource_find(rskey, NULL);
+    if (entry != NULL) {
         ++entry->refcount;
-        return entry->data;
+        data = entry->data;
     }
+    pthread_mutex_unlock(&_G.lock);
+    return data;
 }
 
 bool resource_set(const char *ns, const char *key, void *data,
                   resource_destructor_f destructor) {
     RESOURCE_KEY;
-    resource_t *entry = resource_find(rskey, true);
-    if (entry->data != NULL) {
-        if (entry->destructor) {
-            entry->destructor(entry->data);
-        }
+    pthread_mutex_lock(&_G.lock);
+    resource_t *entry = resource_find(rskey, NULL);
+    if (entry != NULL) {
+        debug("resource: retiring %s, still %d references", entry->key,
+              entry->refcount);
+        entry->current = false;
     }
-    entry->refcount  += 1;
-    entry->data       = data;
-    entry->destructor = destructor;
+
+    resource_t res = RESOURCE_INIT;
+    res.key        = m_strdup(rskey);
+    res.data       = data;
+    res.refcount   = 1;
+    res.current    = true;
+    res.destructor = destructor;
+    array_add(_G.resources, res);
+    pthread_mutex_unlock(&_G.lock);
     return true;
 }
 
-void resource_release(const char *ns, const char *key)
+void resource_release(const char *ns, const char *key, const void *data)
 {
     RESOURCE_KEY;
-    resource_t *entry = resource_find(rskey, false);
+    pthread_mutex_lock(&_G.lock);
+    resource_t *entry = resource_find(rskey, data);
     if (entry != NULL) {
         assert(entry->refcount > 0);
         --entry->refcount;
     }
+    pthread_mutex_unlock(&_G.lock);
 }
 
 void resource_garbage_collect(void)
 {
     uint32_t used = 0;
+    pthread_mutex_lock(&_G.lock);
     foreach (res, _G.resources) {
         uint32_t pos = res - _G.resources.data;
         if (res->key != NULL && res->refcount == 0) {
@@ -141,11 +200,13 @@ void resource_garbage_collect(void)
     debug("resource gc: before %d resources, after %d",
           array_len(_G.resources), used);
     array_len(_G.resources) = used;
+    pthread_mutex_unlock(&_G.lock);
 }
 
 static void resources_exit(void)
 {
     array_deep_wipe(_G.resources, resource_wipe);
+    array_deep_wipe(_G.loading, resource_wipe);
 }
 module_exit(resources_exit);
 
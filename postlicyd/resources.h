@@ -40,15 +40,35 @@
 
 typedef void (*resource_destructor_f)(void *);
 
+/** Reserve the loading of a resource, waiting for the thread that is
+ * loading it if any. Between resource_lock() and resource_unlock(), the
+ * caller is the only one to look up and install versions of the resource:
+ * when several configurations load the same file at once, the first one
+ * builds it and the other ones get the version it installed.
+ */
+__attribute__((nonnull(2)))
+void resource_lock(const char *ns, const char *key);
+
+__attribute__((nonnull(2)))
+void resource_unlock(const char *ns, const char *key);
+
+/** Get a new reference on the current version of a resource.
+ */
 __attribute__((nonnull(2)))
 void *resource_get(const char *ns, const char *key);
 
+/** Install a new version of a resource. The caller owns a reference on it.
+ * The previous version (if any) is destroyed once all its references have
+ * been released.
+ */
 __attribute__((nonnull(2,3)))
 bool resource_set(const char *ns, const char *key, void *data,
                   resource_destructor_f destructor);
 
-__attribute__((nonnull(1)))
-void resource_release(const char *ns, const char *key);
+/** Release a reference on the given version of a resource.
+ */
+__attribute__((nonnull(1,2,3)))
+void resource_release(const char *ns, const char *key, const void *data);
 
 void resource_garbage_collect(void);
 
@@ -39,6 +39,7 @@
 #include "spf_tokens.h"
 #include "buffer.h"
 #include "utils.h"
+#include "worker.h"
 
 #define SPF_MAX_RECUSION 15
 
@@ -101,11 +102,15 @@ struct spf_t {
 #define current_rule(spf) array_elt((spf)->rules, (spf)->current_rule)
 
 static struct {
+    char domainname[128];
+    uint8_t domainname_len;
+} spf_g;
+#define _G  spf_g
+
+static __thread struct {
     PA(spf_t) spf_pool;
     A(spf_rule_t) spf_rule_pool;
 
-    char domainname[128];
-    uint8_t domainname_len;
     buffer_t query_buffer;
     buffer_t dns_buffer;
 
@@ -113,8 +118,8 @@ static struct {
     int acquired;
     int deleted;
     int released;
-} spf_g = {
-#define _G  spf_g
+} spf_thread_g = {
+#define _T  spf_thread_g
     .spf_pool      = ARRAY_INIT,
     .spf_rule_pool = ARRAY_INIT,
 
@@ -125,7 +130,7 @@ static struct {
 DO_INIT(spf_t, spf);
 static spf_t *spf_new(void)
 {
-    _G.created++;
+    _T.created++;
     return spf_init(p_new(spf_t, 1));
 }
 
@@ -136,7 +141,7 @@ static void spf_rule_wipe(spf_rule_t *rule)
 
 static void spf_wipe(spf_t *spf)
 {
-    array_append(_G.spf_rule_pool, array_start(spf->rules),
+    array_append(_T.spf_rule_pool, array_start(spf->rules),
                  array_len(spf->rules));
     array_wipe(spf->rules);
     array_wipe(spf->domain);
@@ -152,7 +157,7 @@ static void spf_wipe(spf_t *spf)
 static void spf_delete(spf_t **spf)
 {
     if (*spf) {
-        _G.deleted++;
+        _T.deleted++;
         spf_wipe(*spf);
         p_delete(spf);
     }
@@ -160,21 +165,34 @@ static void spf_delete(spf_t **spf)
 
 static spf_t *spf_acquire(void)
 {
-    _G.acquired++;
+    _T.acquired++;
     spf_t *spf = NULL;
-    if (array_len(_G.spf_pool)) {
-        spf = array_pop_last(_G.spf_pool);
+    if (array_len(_T.spf_pool)) {
+        spf = array_pop_last(_T.spf_pool);
         spf_init(spf);
     } else {
         spf = spf_new();
     }
     debug("spf pool: acquiring %p - pool length: %d (created %d)", spf,
-          array_len(_G.spf_pool), _G.created);
+          array_len(_T.spf_pool), _T.created);
     return spf;
 }
 
+static void spf_module_exit(void)
+{
+    array_deep_wipe(_T.spf_pool, spf_delete);
+    array_deep_wipe(_T.spf_rule_pool, spf_rule_wipe);
+    buffer_wipe(&_T.query_buffer);
+    buffer_wipe(&_T.dns_buffer);
+    debug("spf: Created: %d, Deleted: %d, Acquired: %d, Release: %d",
+          _T.created, _T.deleted, _T.acquired, _T.released);
+}
+module_exit(spf_module_exit);
+
 static int spf_module_init(void)
 {
+    worker_atexit(spf_module_exit);
+
     if (gethostname(_G.domainname, 128) < 0) {
         strcpy(_G.domainname, "localhost");
         _G.domainname_len = 9;
@@ -197,27 +215,16 @@ static int spf_module_init(void)
 }
 module_init(spf_module_init);
 
-static void spf_module_exit(void)
-{
-    array_deep_wipe(_G.spf_pool, spf_delete);
-    array_deep_wipe(_G.spf_rule_pool, spf_rule_wipe);
-    buffer_wipe(&_G.query_buffer);
-    buffer_wipe(&_G.dns_buffer);
-    debug("spf: Created: %d, Deleted: %d, Acquired: %d, Release: %d",
-          _G.created, _G.deleted, _G.acquired, _G.released);
-}
-module_exit(spf_module_exit);
-
 static bool spf_release(spf_t *spf, bool decrement)
 {
     if (decrement) {
         --spf->queries;
     }
     if (spf->canceled && spf->queries == 0) {
-        _G.released++;
+        _T.released++;
         debug("spf pool: releasing %p - pool length: %d (created: %d)",
-              spf, array_len(_G.spf_pool) + 1, _G.created);
-        array_append(_G.spf_rule_pool, array_start(spf->rules),
+              spf, array_len(_T.spf_pool) + 1, _T.created);
+        array_append(_T.spf_rule_pool, array_start(spf->rules),
                      array_len(spf->rules));
         array_len(spf->rules) = 0;
         buffer_reset(&spf->domain);
@@ -239,7 +246,7 @@ static bool spf_release(spf_t *spf, bool decrement)
         spf->validated = bak.validated;
         spf->domainspec = bak.domainspec;
         spf->explanation = bak.explanation;
-        array_add(_G.spf_pool, spf);
+        array_add(_T.spf_pool, spf);
         return true;
     }
     return false;
@@ -281,14 +288,14 @@ static bool spf_validate_domain(const char* restrict domain)
 static bool spf_query(spf_t *spf, const char* query, dns_rrtype_t rtype,
                       ub_callback_t cb)
 {
-    buffer_reset(&_G.query_buffer);
-    buffer_addstr(&_G.query_buffer, query);
-    if (array_last(_G.query_buffer) != '.') {
-        buffer_addch(&_G.query_buffer, '.');
+    buffer_reset(&_T.query_buffer);
+    buffer_addstr(&_T.query_buffer, query);
+    if (array_last(_T.query_buffer) != '.') {
+        buffer_addch(&_T.query_buffer, '.');
     }
     debug("spf (depth=%d): performing query of type %d for %s",
           spf->recursions, rtype, query);
-    if (dns_resolve(array_start(_G.query_buffer), rtype, cb, spf)) {
+    if (dns_resolve(array_start(_T.query_buffer), rtype, cb, spf)) {
         if (rtype == DNS_RRT_A || rtype == DNS_RRT_AAAA) {
             ++spf->a_resolutions;
         }
@@ -403,14 +410,14 @@ spf_expansion_t spf_expand_pattern(spf_t *spf, buffer_t * restrict buffer,
         pos->len = array_len(spf->domain);
         break;
       case 'i': {
-        buffer_reset(&_G.dns_buffer);
+        buffer_reset(&_T.dns_buffer);
         if (!spf->is_ip6) {
-            ip_print_4(&_G.dns_buffer, spf->ip4, false, false);
+            ip_print_4(&_T.dns_buffer, spf->ip4, false, false);
         } else {
-            ip_print_6(&_G.dns_buffer, spf->ip6, false, false);
+            ip_print_6(&_T.dns_buffer, spf->ip6, false, false);
         }
-        pos->str = array_start(_G.dns_buffer);
-        pos->len = array_len(_G.dns_buffer);
+        pos->str = array_start(_T.dns_buffer);
+        pos->len = array_len(_T.dns_buffer);
       } break;
       case 'p':
         if (array_len(spf->validated) > 0) {
@@ -443,10 +450,10 @@ spf_expansion_t spf_expand_pattern(spf_t *spf, buffer_t * restrict buffer,
         pos->len = _G.domainname_len;
         break;
       case 't': {
-        buffer_reset(&_G.dns_buffer);
-        buffer_addf(&_G.dns_buffer, "%lu", (long int)time(0));
-        pos->str = array_start(_G.dns_buffer);
-        pos->len = array_len(_G.dns_buffer);
+        buffer_reset(&_T.dns_buffer);
+        buffer_addf(&_T.dns_buffer, "%lu", (long int)time(0));
+        pos->str = array_start(_T.dns_buffer);
+        pos->len = array_len(_T.dns_buffer);
       } break;
       default:
         return SPFEXP_SYNTAX;
@@ -915,7 +922,7 @@ static void spf_mx_receive(void* arg, int err, struct ub_result* result)
           spf->recursions, result->qname);
     for (i = 0 ; result->data[i] != NULL ; ++i) {
         const char* pos = result->data[i] + 2;
-        buffer_reset(&_G.dns_buffer);
+        buffer_reset(&_T.dns_buffer);
         if (i >= 10) {
             info("spf (depth=%d): too many MX entries for %s",
                  spf->recursions, result->qname);
@@ -924,11 +931,11 @@ static void spf_mx_receive(void* arg, int err, struct ub_result* result)
         while (*pos != '\0') {
             uint8_t count = *pos;
             ++pos;
-            buffer_add(&_G.dns_buffer, pos, count);
-            buffer_addch(&_G.dns_buffer, '.');
+            buffer_add(&_T.dns_buffer, pos, count);
+            buffer_addch(&_T.dns_buffer, '.');
             pos += count;
         }
-        spf_query(spf, array_start(_G.dns_buffer),
+        spf_query(spf, array_start(_T.dns_buffer),
                   spf->is_ip6 ? DNS_RRT_AAAA : DNS_RRT_A,
                   spf_a_receive);
     }
@@ -988,7 +995,7 @@ static void spf_ptr_receive(void* arg, int err, struct ub_result* result)
     }
     for (int i = 0 ; result->data[i] != NULL ; ++i) {
         const char* pos = result->data[i];
-        buffer_reset(&_G.dns_buffer);
+        buffer_reset(&_T.dns_buffer);
         if (spf->a_resolutions >= 10) {
             info("spf (depth=%d): too many PTR entries for %s",
                  spf->recursions, result->qname);
@@ -997,43 +1004,43 @@ static void spf_ptr_receive(void* arg, int err, struct ub_result* result)
         while (*pos != '\0') {
             uint8_t count = *pos;
             ++pos;
-            buffer_add(&_G.dns_buffer, pos, count);
-            buffer_addch(&_G.dns_buffer, '.');
+            buffer_add(&_T.dns_buffer, pos, count);
+            buffer_addch(&_T.dns_buffer, '.');
             pos += count;
         }
 
         debug("spf (depth=%d): found %s, to be compared to %s",
-              spf->recursions, array_start(_G.dns_buffer),
+              spf->recursions, array_start(_T.dns_buffer),
               array_start(spf->domainspec));
-        ssize_t diff = ((ssize_t)array_len(_G.dns_buffer))
+        ssize_t diff = ((ssize_t)array_len(_T.dns_buffer))
                      - ((ssize_t)array_len(spf->domainspec));
         bool match = false;
         if (diff == 0) {
             if (strcasecmp(array_start(spf->domainspec),
-                           array_start(_G.dns_buffer)) == 0) {
+                           array_start(_T.dns_buffer)) == 0) {
                 debug("spf (depth=%d): PTR potential entry found for "
                       "domain %s", spf->recursions,
-                      array_start(_G.dns_buffer));
+                      array_start(_T.dns_buffer));
                 match = true;
             }
-        } else if (diff > 0 && array_elt(_G.dns_buffer, diff - 1) == '.') {
+        } else if (diff > 0 && array_elt(_T.dns_buffer, diff - 1) == '.') {
             if (strcasecmp(array_start(spf->domainspec),
-                           array_ptr(_G.dns_buffer, diff)) == 0) {
+                           array_ptr(_T.dns_buffer, diff)) == 0) {
                 debug("spf (depth=%d): PTR potential entry found for "
                       "subdomain %s", spf->recursions,
-                      array_start(_G.dns_buffer));
+                      array_start(_T.dns_buffer));
                 match = true;
             }
         }
         if (match) {
-            spf_query(spf, array_start(_G.dns_buffer),
+            spf_query(spf, array_start(_T.dns_buffer),
                       spf->is_ip6 ? DNS_RRT_AAAA : DNS_RRT_A, spf_a_receive);
         }
     }
     if (spf->a_resolutions == 0 && spf->in_macro) {
         for (int i = 0 ; result->data[i] != NULL ; ++i) {
             const char* pos = result->data[i];
-            buffer_reset(&_G.dns_buffer);
+            buffer_reset(&_T.dns_buffer);
             if (spf->a_resolutions >= 10) {
                 info("spf (depth=%d): too many PTR entries for %s",
                      spf->recursions, result->qname);
@@ -1042,11 +1049,11 @@ static void spf_ptr_receive(void* arg, int err, struct ub_result* result)
             while (*pos != '\0') {
                 uint8_t count = *pos;
                 ++pos;
-                buffer_add(&_G.dns_buffer, pos, count);
-                buffer_addch(&_G.dns_buffer, '.');
+                buffer_add(&_T.dns_buffer, pos, count);
+                buffer_addch(&_T.dns_buffer, '.');
                 pos += count;
             }
-            spf_query(spf, array_start(_G.dns_buffer),
+            spf_query(spf, array_start(_T.dns_buffer),
                       spf->is_ip6 ? DNS_RRT_AAAA : DNS_RRT_A, spf_a_receive);
         }
     }
@@ -1081,18 +1088,18 @@ static bool spf_run_ptr_resolution(spf_t *spf, const char* domainspec,
         if (array_last(spf->domainspec) != '.') {
             buffer_addch(&spf->domainspec, '.');
         }
-        buffer_reset(&_G.dns_buffer);
+        buffer_reset(&_T.dns_buffer);
         if (!spf->is_ip6) {
-            ip_print_4(&_G.dns_buffer, spf->ip4, false, true);
-            buffer_addstr(&_G.dns_buffer, ".in-addr.arpa.");
+            ip_print_4(&_T.dns_buffer, spf->ip4, false, true);
+            buffer_addstr(&_T.dns_buffer, ".in-addr.arpa.");
         } else {
-            ip_print_6(&_G.dns_buffer, spf->ip6, false, true);
-            buffer_addstr(&_G.dns_buffer, ".ip6.arpa.");
+            ip_print_6(&_T.dns_buffer, spf->ip6, false, true);
+            buffer_addstr(&_T.dns_buffer, ".ip6.arpa.");
         }
         if (spf->use_domain) {
             buffer_addstr(&spf->validated, "unknown");
         }
-        spf_query(spf, array_start(_G.dns_buffer), DNS_RRT_PTR,
+        spf_query(spf, array_start(_T.dns_buffer), DNS_RRT_PTR,
                   spf_ptr_receive);
         return true;
       default:
@@ -1541,8 +1548,8 @@ static bool spf_parse(spf_t *spf)
         }
 
         spf_rule_t rule = SPF_RULE_INIT;
-        if (array_len(_G.spf_rule_pool) > 0) {
-            rule = array_pop_last(_G.spf_rule_pool);
+        if (array_len(_T.spf_rule_pool) > 0) {
+            rule = array_pop_last(_T.spf_rule_pool);
         }
         rule.qualifier = qual;
         rule.rule = id;
@@ -38,6 +38,7 @@
 /* postlicyd filter declaration */
 
 #include "filter.h"
+#include "worker.h"
 
 typedef struct spf_filter_t {
     unsigned use_spf_record : 1;
@@ -45,7 +46,7 @@ typedef struct spf_filter_t {
     unsigned use_explanation: 1;
 } spf_filter_t;
 
-static struct {
+static __thread struct {
     buffer_t domain;
     buffer_t sender;
     buffer_t ip;
@@ -91,6 +92,11 @@ static bool spf_filter_constructor(filter_t *filter)
         }
     }
 
+    filter_depends_on(filter, PTK_CLIENT_ADDRESS);
+    filter_depends_on(filter, PTK_HELO_NAME);
+    if (!data->check_helo) {
+        filter_depends_on(filter, PTK_SENDER);
+    }
     filter->data = data;
     return true;
 }
@@ -125,6 +131,10 @@ static filter_result_t spf_code_to_result(spf_code_t code) {
 static void spf_filter_async(spf_code_t result, const char* exp, void *arg)
 {
     filter_context_t *context = arg;
+    spf_t **spf = filter_context(context->current_filter, context);
+
+    /* The lookup is released once its result is given. */
+    *spf = NULL;
     filter_post_async_result_with_explanation(context,
                                               spf_code_to_result(result),
                                               exp, -1);
@@ -151,21 +161,45 @@ filter_result_t spf_filter(const filter_t *filter, const query_t *query,
     }
 
     spf_code_t res;
-    if (spf_check(array_start(_G.ip), array_start(_G.domain),
-                  array_start(_G.sender), query->helo_name.str,
-                  spf_filter_async, !data->use_spf_record,
-                  !data->use_explanation, context, &res) == NULL) {
+    spf_t **spf = filter_context(filter, context);
+    *spf = spf_check(array_start(_G.ip), array_start(_G.domain),
+                     array_start(_G.sender), query->helo_name.str,
+                     spf_filter_async, !data->use_spf_record,
+                     !data->use_explanation, context, &res);
+    if (*spf == NULL) {
         err("filter %s: error while trying to run spf check", filter->name);
         return spf_code_to_result(res);
     }
     return HTK_ASYNC;
 }
 
+static void spf_filter_cancel(filter_context_t *context)
+{
+    spf_t **spf = filter_context(context->current_filter, context);
+
+    if (*spf != NULL) {
+        spf_cancel(*spf);
+        *spf = NULL;
+    }
+}
+
+static void *spf_context_constructor(void)
+{
+    return p_new(spf_t *, 1);
+}
+
+static void spf_context_destructor(void *data)
+{
+    spf_t **spf = data;
+    p_delete(&spf);
+}
+
 
 static void spf_exit(void)
 {
     array_wipe(_G.domain);
     array_wipe(_G.sender);
+    array_wipe(_G.ip);
 }
 module_exit(spf_exit);
 
@@ -175,7 +209,8 @@ filter_constructor(spf)
     filter_type_t filter_type
         = filter_register("spf", spf_filter_constructor,
                           spf_filter_destructor, spf_filter,
-                          NULL, NULL);
+                          spf_context_constructor,
+                          spf_context_destructor);
 
     /* Hooks.
      */
@@ -193,11 +228,15 @@ filter_constructor(spf)
     filter_hook_forward_register(filter_type, HTK_PERM_ERROR, HTK_NONE);
     filter_hook_forward_register(filter_type, HTK_SOFT_FAIL, HTK_FAIL);
 
+    filter_canceler_register(filter_type, spf_filter_cancel);
+
     /* Parameters.
      */
     (void)filter_param_register(filter_type, "use_spf_record");
     (void)filter_param_register(filter_type, "use_explanation");
     (void)filter_param_register(filter_type, "check_helo");
+
+    worker_atexit(spf_exit);
     return 0;
 }
 
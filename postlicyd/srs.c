@@ -131,6 +131,9 @@ static bool srs_filter_constructor(filter_t *filter)
         .str = bounce_domain,
         .len = m_strlen(bounce_domain)
     };
+    filter_depends_on(filter, PTK_PROTOCOL_STATE);
+    filter_depends_on(filter, PTK_RECIPIENT);
+    filter_depends_on(filter, PTK_RECIPIENT_DOMAIN);
     filter->data = config;
     return true;
 }
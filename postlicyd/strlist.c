@@ -33,36 +33,1083 @@
 /*   see AUTHORS and source files for details                               */
 /****************************************************************************/
 
+#include <sys/mman.h>
+#include <fcntl.h>
+
 #include "filter.h"
-#include "trie.h"
+#include "strlist.h"
+#include "regexp.h"
+#include "regexpset.h"
 #include "file.h"
 #include "str.h"
 #include "dns.h"
 #include "policy_tokens.h"
 #include "resources.h"
+#include "worker.h"
+
+/* Compiled string lists.
+ *
+ * The strings of one or several lists are stored in a radix trie whose
+ * terminals carry the bitmask of the lists that contain the string: bit i is
+ * set when the string is in the list i. A lookup performs a single descent
+ * whatever the number of lists: the lists of the terminals met along the
+ * path that are looked up for a prefix match are collected on the way, all
+ * the lists of the terminal reached at the end of the string match.
+ *
+ * The children of a node are contiguous and sorted by the first character of
+ * their label (a node with a single child is merged with it, up to 255
+ * characters). A regexp is attached to the node of its anchor and tested on
+ * the rest of the string when that node is reached.
+ *
+ * The strings can also be stored in a minimal acyclic automaton (DAFSA):
+ * the states that have the same lists, regexps and transitions are merged,
+ * so the common endings of the strings are stored once as well as their
+ * common beginnings, which is much smaller for large lists of similar
+ * strings such as host names. The automaton uses the nodes of the trie: the
+ * nodes that lead to a merged state share its children, and a chain of
+ * states with a single transition is the label of a node. The children of a
+ * node always follow it, so the lookup is the same for both engines.
+ *
+ * The trie is stored in a single block without any pointer, the strings of
+ * the lists that are looked up by suffix are inserted reversed and the
+ * lookup reads the string backwards.
+ *
+ * The image of the trie of a file is either built in memory from the text
+ * list, or mapped as is from a file written by strlist_compile(). All the
+ * fields are stored in host byte order. The regexps are compiled when the
+ * image is loaded.
+ */
+#define STRDB_LISTS_MAX  64
+
+#define STRDB_IMAGE_MAGIC    "PFXSTRLS"
+#define STRDB_IMAGE_VERSION  1
+#define STRDB_IMAGE_ENDIAN   0x01020304
+
+#define STRDB_ENGINE_TRIE   0
+#define STRDB_ENGINE_DAFSA  1
+
+typedef struct strdb_image_t {
+    char     magic[8];
+    uint32_t version;
+    uint32_t endian;
+
+    /* Kind of the text list: a rbldns zone file (its hosts are the list 0,
+     * its domains the list 1) or a list of strings stored reversed.
+     */
+    uint8_t  rhbl;
+    uint8_t  reverse;
+    uint8_t  engine;
+    uint8_t  padding;
+    uint32_t domains;
+
+    uint32_t entries;
+    uint32_t nodes;
+    uint32_t values;
+    uint32_t regexps;
+    uint32_t labels;
+    uint32_t patterns;
+
+    /* Followed by:
+     * strdb_value_t  values[values];      (aligned on 8 bytes)
+     * strdb_node_t   nodes[nodes];
+     * strdb_regexp_t regexps[regexps];
+     * char           labels[labels];
+     * char           patterns[patterns];
+     */
+} strdb_image_t;
+
+/* Lists of a terminal. The regexps of the node are
+ * regexps[regexp..regexp + regexp_count].
+ */
+typedef struct strdb_value_t {
+    uint64_t lists;
+    uint32_t regexp;
+    uint32_t regexp_count;
+} strdb_value_t;
+ARRAY(strdb_value_t)
+
+/* The node 0 is the root. The label of a node is
+ * labels[label..label + label_len], c is its first character. value is 0 if
+ * the node is not a terminal (values[0] is not used).
+ */
+typedef struct strdb_node_t {
+    uint32_t children;
+    uint32_t label;
+    uint32_t value;
+    uint8_t  c;
+    uint8_t  label_len;
+    uint16_t child_count;
+} strdb_node_t;
+ARRAY(strdb_node_t)
+
+typedef struct strdb_regexp_t {
+    uint32_t pattern;
+    uint16_t pattern_len;
+    uint8_t  list;
+    uint8_t  cs;
+} strdb_regexp_t;
+ARRAY(strdb_regexp_t)
+
+struct strdb_t {
+    /* The image is either mapped from a compiled file or allocated.
+     */
+    bool     mapped;
+    file_map_t map;
+    strdb_image_t *image;
+    size_t   image_size;
+    bool     locked;
+
+    /* Pointers in the image. */
+    const strdb_value_t  *values;
+    const strdb_node_t   *nodes;
+    const strdb_regexp_t *regexps;
+    const char           *labels;
+    const char           *patterns;
+
+    regexp_t *compiled;
+
+    /* Regexps of the terminals that have several of them, matched in a
+     * single scan. Indexed by value, NULL if no terminal needs one.
+     */
+    regexp_set_t **sets;
+};
+
+static inline size_t strdb_image_nodes_offset(uint32_t values)
+{
+    return ((sizeof(strdb_image_t) + 7) & ~(size_t)7)
+         + values * sizeof(strdb_value_t);
+}
+
+static inline size_t strdb_image_regexps_offset(const strdb_image_t *image)
+{
+    return strdb_image_nodes_offset(image->values)
+         + image->nodes * sizeof(strdb_node_t);
+}
+
+static inline size_t strdb_image_labels_offset(const strdb_image_t *image)
+{
+    return strdb_image_regexps_offset(image)
+         + image->regexps * sizeof(strdb_regexp_t);
+}
+
+static inline size_t strdb_image_size(const strdb_image_t *image)
+{
+    return strdb_image_labels_offset(image) + image->labels + image->patterns;
+}
+
+static void strdb_wipe(strdb_t *db)
+{
+    if (db->sets != NULL) {
+        for (uint32_t i = 0 ; i < db->image->values ; ++i) {
+            regexp_set_delete(&db->sets[i]);
+        }
+        p_delete(&db->sets);
+    }
+    if (db->compiled != NULL) {
+        for (uint32_t i = 0 ; i < db->image->regexps ; ++i) {
+            regexp_wipe(&db->compiled[i]);
+        }
+        p_delete(&db->compiled);
+    }
+    if (db->locked) {
+        munlock(db->image, db->image_size);
+    }
+    if (db->mapped) {
+        file_map_close(&db->map);
+    } else {
+        p_delete(&db->image);
+    }
+    p_clear(db, 1);
+}
+
+/* Set the pointers of @p db in its image and compile its regexps.
+ */
+static bool strdb_setup(strdb_t *db, bool lock)
+{
+    const strdb_image_t *image = db->image;
+    const char *base = (const char *)image;
+
+    db->image_size = strdb_image_size(image);
+    db->values   = (const strdb_value_t *)(base
+                       + strdb_image_nodes_offset(0));
+    db->nodes    = (const strdb_node_t *)(base
+                       + strdb_image_nodes_offset(image->values));
+    db->regexps  = (const strdb_regexp_t *)(base
+                       + strdb_image_regexps_offset(image));
+    db->labels   = base + strdb_image_labels_offset(image);
+    db->patterns = db->labels + image->labels;
+
+    db->compiled = p_new(regexp_t, image->regexps);
+    for (uint32_t i = 0 ; i < image->regexps ; ++i) {
+        const strdb_regexp_t *re = &db->regexps[i];
+        clstr_t pattern = { db->patterns + re->pattern, re->pattern_len };
+
+        if (!regexp_compile_str(&db->compiled[i], &pattern, re->cs)) {
+            err("cannot compile regexp %.*s", (int)pattern.len, pattern.str);
+            return false;
+        }
+    }
+    for (uint32_t i = 1 ; i < image->values ; ++i) {
+        const strdb_value_t *value = &db->values[i];
+
+        if (value->regexp_count < 2) {
+            continue;
+        }
+        if (db->sets == NULL) {
+            db->sets = p_new(regexp_set_t *, image->values);
+        }
+        db->sets[i] = regexp_set_new();
+        for (uint32_t j = 0 ; j < value->regexp_count ; ++j) {
+            const strdb_regexp_t *re = &db->regexps[value->regexp + j];
+            clstr_t pattern = { db->patterns + re->pattern, re->pattern_len };
+
+            if (regexp_set_add(db->sets[i], &pattern, re->cs) < 0) {
+                return false;
+            }
+        }
+        if (!regexp_set_compile(db->sets[i])) {
+            err("cannot compile the regexps of a string list");
+            return false;
+        }
+    }
+
+    /* A lookup reads nodes spread over the whole image, keep it in memory.
+     */
+    if (lock) {
+        if (mlock(db->image, db->image_size) < 0) {
+            UNIXERR("mlock");
+        } else {
+            db->locked = true;
+        }
+    }
+    return true;
+}
+
+size_t strdb_memory(const strdb_t *db)
+{
+    return db->image_size;
+}
+
+/* Index of the child of @p node whose label starts with @p c, -1 if none.
+ */
+static inline int32_t strdb_child_find(const strdb_t *db,
+                                       const strdb_node_t *node, uint8_t c)
+{
+    uint32_t l = node->children;
+    uint32_t r = node->children + node->child_count;
+
+    while (l < r) {
+        uint32_t i = (r + l) / 2;
+
+        if (db->nodes[i].c < c) {
+            l = i + 1;
+        } else {
+            r = i;
+        }
+    }
+    if (l < node->children + node->child_count && db->nodes[l].c == c) {
+        return l;
+    }
+    return -1;
+}
+
+/* Patterns of a regexp set that matched, per thread.
+ */
+static __thread A(uint64_t) strdb_matches_g;
+
+static void strdb_exit(void)
+{
+    array_wipe(strdb_matches_g);
+}
+module_exit(strdb_exit);
+
+/* Lists of the regexps of @p value that match @p rest, @p lists are already
+ * matched.
+ */
+static uint64_t strdb_regexps_match(const strdb_t *db, uint32_t value_id,
+                                    const clstr_t *rest, uint64_t lists)
+{
+    const strdb_value_t *value = &db->values[value_id];
+    const strdb_regexp_t *regexps = &db->regexps[value->regexp];
+    uint64_t wanted = 0;
+
+    for (uint32_t i = 0 ; i < value->regexp_count ; ++i) {
+        wanted |= 1ULL << regexps[i].list;
+    }
+    if (!(wanted & ~lists)) {
+        return lists;
+    }
+    if (value->regexp_count < 2) {
+        if (regexp_match_str(&db->compiled[value->regexp], rest)) {
+            lists |= wanted;
+        }
+        return lists;
+    }
+
+    array_ensure_exact_capacity(strdb_matches_g,
+                                REGEXP_SET_WORDS(value->regexp_count));
+    if (regexp_set_match(db->sets[value_id], rest,
+                         array_start(strdb_matches_g)) > 0) {
+        for (uint32_t i = 0 ; i < value->regexp_count ; ++i) {
+            if (array_elt(strdb_matches_g, i / 64) & (1ULL << (i % 64))) {
+                lists |= 1ULL << regexps[i].list;
+            }
+        }
+    }
+    return lists;
+}
+
+uint64_t strdb_lookup(const strdb_t *db, uint64_t partial,
+                      const char *str, int len, bool reverse)
+{
+#define CHAR(i)  ((uint8_t)(reverse ? str[len - 1 - (i)] : str[(i)]))
+    const strdb_node_t *node = db->nodes;
+    uint64_t lists = 0;
+    int depth = 0;
+
+    while (true) {
+        if (node->value != 0) {
+            const strdb_value_t *value = &db->values[node->value];
+
+            lists |= (depth == len) ? value->lists : value->lists & partial;
+            if (value->regexp_count > 0) {
+                clstr_t rest = { reverse ? str : str + depth, len - depth };
+
+                lists = strdb_regexps_match(db, node->value, &rest, lists);
+            }
+        }
+        if (depth == len) {
+            break;
+        }
+
+        int32_t child = strdb_child_find(db, node, CHAR(depth));
+        if (child < 0) {
+            break;
+        }
+        node = &db->nodes[child];
+        if (len - depth < node->label_len) {
+            break;
+        }
+        for (int i = 1 ; i < node->label_len ; ++i) {
+            if ((uint8_t)db->labels[node->label + i] != CHAR(depth + i)) {
+                return lists;
+            }
+        }
+        depth += node->label_len;
+    }
+    return lists;
+#undef CHAR
+}
+
+
+/* Strings (or regexp anchors) added to a trie before it is built.
+ */
+typedef struct strdb_record_t {
+    uint32_t key;
+    uint32_t len;
+    uint64_t lists;
+    int32_t  regexp;
+} strdb_record_t;
+ARRAY(strdb_record_t)
+
+/* State of a DAFSA being built. Its transitions read
+ * arc_labels[arcs..arcs + arc_count] and lead to the states
+ * targets[arcs..arcs + arc_count]. value is 0 if the state is not final.
+ */
+typedef struct strdb_state_t {
+    uint32_t arcs;
+    uint32_t arc_count;
+    uint32_t value;
+} strdb_state_t;
+ARRAY(strdb_state_t)
+
+/* State of a DAFSA on the path of the last string added, not registered
+ * yet.
+ */
+typedef struct strdb_dafsa_temp_t {
+    uint64_t lists;
+    A(strdb_regexp_t) regexps;
+    buffer_t labels;
+    A(uint32_t) targets;
+} strdb_dafsa_temp_t;
+ARRAY(strdb_dafsa_temp_t)
+
+typedef struct strdb_builder_t {
+    buffer_t keys;
+    A(strdb_record_t) records;
+    A(strdb_regexp_t) records_regexps;
+
+    A(strdb_value_t)  values;
+    A(strdb_node_t)   nodes;
+    A(strdb_regexp_t) regexps;
+    buffer_t          labels;
+    buffer_t          patterns;
+
+    /* DAFSA: the registered states are found by their content in an open
+     * addressing table of their index + 1.
+     */
+    A(strdb_state_t)  states;
+    A(uint32_t)       targets;
+    buffer_t          arc_labels;
+    A(strdb_dafsa_temp_t) path;
+    uint32_t         *registry;
+    uint32_t          registry_size;
+} strdb_builder_t;
+
+static void strdb_dafsa_temp_wipe(strdb_dafsa_temp_t *t)
+{
+    array_wipe(t->regexps);
+    buffer_wipe(&t->labels);
+    array_wipe(t->targets);
+}
+
+static void strdb_builder_wipe(strdb_builder_t *b)
+{
+    buffer_wipe(&b->keys);
+    array_wipe(b->records);
+    array_wipe(b->records_regexps);
+    array_wipe(b->values);
+    array_wipe(b->nodes);
+    array_wipe(b->regexps);
+    buffer_wipe(&b->labels);
+    buffer_wipe(&b->patterns);
+    array_wipe(b->states);
+    array_wipe(b->targets);
+    buffer_wipe(&b->arc_labels);
+    array_deep_wipe(b->path, strdb_dafsa_temp_wipe);
+    p_delete(&b->registry);
+}
+
+static void strdb_builder_add(strdb_builder_t *b, const char *key, int len,
+                              uint64_t lists)
+{
+    strdb_record_t record = { b->keys.len, len, lists, -1 };
+
+    buffer_add(&b->keys, key, len);
+    array_add(b->records, record);
+}
+
+static void strdb_builder_add_regexp(strdb_builder_t *b,
+                                     const char *key, int len, int list,
+                                     const char *pattern, int pattern_len,
+                                     bool cs)
+{
+    strdb_record_t record = { b->keys.len, len, 0, b->records_regexps.len };
+    strdb_regexp_t regexp = { b->patterns.len, pattern_len, list, cs };
+
+    buffer_add(&b->keys, key, len);
+    buffer_add(&b->patterns, pattern, pattern_len);
+    array_add(b->records, record);
+    array_add(b->records_regexps, regexp);
+}
+
+static inline bool strdb_record_lt(const char *keys, const strdb_record_t *a,
+                                   const strdb_record_t *b)
+{
+    int cmp = memcmp(keys + a->key, keys + b->key, MIN(a->len, b->len));
+
+    return cmp < 0 || (cmp == 0 && a->len < b->len);
+}
+
+/* Build the node @p node from the sorted records [lo, hi[ that all begin with
+ * the @p depth characters of the path of the node.
+ */
+static void strdb_build_node(strdb_builder_t *b, uint32_t node,
+                             uint32_t lo, uint32_t hi, uint32_t depth)
+{
+    const char *keys = b->keys.data;
+    strdb_value_t value = { 0, b->regexps.len, 0 };
+    uint32_t count = 0;
+    uint32_t first;
+
+    /* The records of the string of the node come first, the entries of the
+     * same string in several lists are merged.
+     */
+    while (lo < hi && array_elt(b->records, lo).len == depth) {
+        const strdb_record_t *record = array_ptr(b->records, lo);
+
+        if (record->regexp >= 0) {
+            array_add(b->regexps,
+                      array_elt(b->records_regexps, record->regexp));
+            ++value.regexp_count;
+        } else {
+            value.lists |= record->lists;
+        }
+        ++lo;
+    }
+    if (value.lists != 0 || value.regexp_count != 0) {
+        array_elt(b->nodes, node).value = b->values.len;
+        array_add(b->values, value);
+    }
+
+    for (uint32_t i = lo ; i < hi ; ++count) {
+        const char c = keys[array_elt(b->records, i).key + depth];
+        while (i < hi && keys[array_elt(b->records, i).key + depth] == c) {
+            ++i;
+        }
+    }
+    if (count == 0) {
+        return;
+    }
+    first = b->nodes.len;
+    array_ensure_capacity_delta(b->nodes, count);
+    p_clear(array_end(b->nodes), count);
+    b->nodes.len += count;
+    array_elt(b->nodes, node).children    = first;
+    array_elt(b->nodes, node).child_count = count;
+
+    for (uint32_t i = lo, child = first ; i < hi ; ++child) {
+        const strdb_record_t *start = array_ptr(b->records, i);
+        const char *key = keys + start->key;
+        uint32_t j = i + 1;
+        uint32_t end, label_len;
+
+        while (j < hi && keys[array_elt(b->records, j).key + depth]
+                         == key[depth]) {
+            ++j;
+        }
+
+        /* The records are sorted, so the common prefix of the first and
+         * the last records of the group is common to the whole group.
+         */
+        end = MIN(start->len, array_elt(b->records, j - 1).len);
+        label_len = depth + 1;
+        while (label_len < end
+               && key[label_len] == keys[array_elt(b->records, j - 1).key
+                                         + label_len]) {
+            ++label_len;
+        }
+        label_len = MIN(label_len - depth, 255);
+
+        array_elt(b->nodes, child).c         = key[depth];
+        array_elt(b->nodes, child).label     = b->labels.len;
+        array_elt(b->nodes, child).label_len = label_len;
+        buffer_add(&b->labels, key + depth, label_len);
+        strdb_build_node(b, child, i, j, depth + label_len);
+        i = j;
+    }
+}
+
+static inline uint32_t strdb_dafsa_hash(uint64_t lists,
+                                        const strdb_regexp_t *regexps,
+                                        uint32_t regexp_count,
+                                        const char *labels,
+                                        const uint32_t *targets,
+                                        uint32_t count)
+{
+#define MIX(v)  h = (h ^ (uint64_t)(v)) * 0x9e3779b97f4a7c15ULL
+    uint64_t h = 0;
+
+    MIX(lists);
+    MIX(count);
+    for (uint32_t i = 0 ; i < regexp_count ; ++i) {
+        MIX(((uint64_t)regexps[i].pattern << 8) | regexps[i].list);
+    }
+    for (uint32_t i = 0 ; i < count ; ++i) {
+        MIX(((uint64_t)(uint8_t)labels[i] << 32) | targets[i]);
+    }
+    return h ^ (h >> 32);
+#undef MIX
+}
+
+static inline uint32_t strdb_dafsa_state_hash(const strdb_builder_t *b,
+                                              uint32_t id)
+{
+    const strdb_state_t *state = array_ptr(b->states, id);
+    const strdb_value_t *value = array_ptr(b->values, state->value);
+
+    return strdb_dafsa_hash(value->lists,
+                            array_ptr(b->regexps, value->regexp),
+                            value->regexp_count,
+                            b->arc_labels.data + state->arcs,
+                            array_ptr(b->targets, state->arcs),
+                            state->arc_count);
+}
+
+static inline uint32_t strdb_dafsa_temp_hash(const strdb_dafsa_temp_t *t)
+{
+    return strdb_dafsa_hash(t->lists, t->regexps.data, t->regexps.len,
+                            t->labels.data, t->targets.data, t->labels.len);
+}
+
+static bool strdb_dafsa_equals(const strdb_builder_t *b, uint32_t id,
+                               const strdb_dafsa_temp_t *t)
+{
+    const strdb_state_t *state = array_ptr(b->states, id);
+    const strdb_value_t *value = array_ptr(b->values, state->value);
+
+    return value->lists == t->lists
+        && value->regexp_count == (uint32_t)t->regexps.len
+        && state->arc_count == (uint32_t)t->labels.len
+        && (t->regexps.len == 0
+            || memcmp(array_ptr(b->regexps, value->regexp), t->regexps.data,
+                      t->regexps.len * sizeof(strdb_regexp_t)) == 0)
+        && (t->labels.len == 0
+            || (memcmp(b->arc_labels.data + state->arcs, t->labels.data,
+                       t->labels.len) == 0
+                && memcmp(array_ptr(b->targets, state->arcs),
+                          t->targets.data,
+                          t->targets.len * sizeof(uint32_t)) == 0));
+}
+
+static void strdb_dafsa_registry_grow(strdb_builder_t *b)
+{
+    const uint32_t size = MAX(2 * b->registry_size, 1024);
+    const uint32_t mask = size - 1;
+
+    p_delete(&b->registry);
+    b->registry      = p_new(uint32_t, size);
+    b->registry_size = size;
+    for (uint32_t id = 0 ; id < (uint32_t)b->states.len ; ++id) {
+        uint32_t slot = strdb_dafsa_state_hash(b, id) & mask;
+
+        while (b->registry[slot] != 0) {
+            slot = (slot + 1) & mask;
+        }
+        b->registry[slot] = id + 1;
+    }
+}
+
+/* Index of the state with the content of @p t, registered if it is new. The
+ * states reached from @p t are already registered, so a state always has a
+ * higher index than the states it leads to.
+ */
+static uint32_t strdb_dafsa_register(strdb_builder_t *b,
+                                     const strdb_dafsa_temp_t *t)
+{
+    strdb_state_t state = { b->targets.len, t->labels.len, 0 };
+    uint32_t mask, slot;
+
+    if (2 * ((uint32_t)b->states.len + 1) > b->registry_size) {
+        strdb_dafsa_registry_grow(b);
+    }
+    mask = b->registry_size - 1;
+    for (slot = strdb_dafsa_temp_hash(t) & mask ; b->registry[slot] != 0 ;
+         slot = (slot + 1) & mask) {
+        if (strdb_dafsa_equals(b, b->registry[slot] - 1, t)) {
+            return b->registry[slot] - 1;
+        }
+    }
+
+    if (t->lists != 0 || t->regexps.len != 0) {
+        strdb_value_t value = { t->lists, b->regexps.len, t->regexps.len };
+
+        state.value = b->values.len;
+        array_add(b->values, value);
+        foreach (re, t->regexps) {
+            array_add(b->regexps, *re);
+        }
+    }
+    buffer_add(&b->arc_labels, t->labels.data, t->labels.len);
+    foreach (target, t->targets) {
+        array_add(b->targets, *target);
+    }
+    b->registry[slot] = b->states.len + 1;
+    array_add(b->states, state);
+    return b->states.len - 1;
+}
+
+/* Register the states of the path deeper than @p depth, @p key is the string
+ * of the path.
+ */
+static void strdb_dafsa_minimize(strdb_builder_t *b, const char *key,
+                                 uint32_t *path_len, uint32_t depth)
+{
+    while (*path_len > depth) {
+        strdb_dafsa_temp_t *child  = array_ptr(b->path, *path_len);
+        strdb_dafsa_temp_t *parent = array_ptr(b->path, *path_len - 1);
+        uint32_t id = strdb_dafsa_register(b, child);
+
+        buffer_addch(&parent->labels, key[*path_len - 1]);
+        array_add(parent->targets, id);
+        child->lists = 0;
+        child->regexps.len = 0;
+        buffer_reset(&child->labels);
+        child->targets.len = 0;
+        --*path_len;
+    }
+}
+
+/* Store the DAFSA whose initial state is @p root in the nodes of @p b. A
+ * state gets its own children if it is final, if it has several transitions
+ * (or none) or if several transitions lead to it. The other states are
+ * merged in the label of the node that leads to them.
+ */
+static void strdb_dafsa_store(strdb_builder_t *b, uint32_t root)
+{
+    const uint32_t count = b->states.len;
+    const strdb_state_t *states = b->states.data;
+    const uint32_t *targets = b->targets.data;
+    uint8_t  *incoming = p_new(uint8_t, count);
+    bool     *branch   = p_new(bool, count);
+    uint32_t *children = p_new(uint32_t, count);
+    uint32_t next = 1;
+
+    foreach (target, b->targets) {
+        incoming[*target] += incoming[*target] < 2;
+    }
+    for (uint32_t id = 0 ; id < count ; ++id) {
+        branch[id] = id == root || incoming[id] > 1 || states[id].value != 0
+                  || states[id].arc_count != 1;
+    }
+
+    /* The states are visited in decreasing index order, so the children of
+     * a node are stored after it. A label is cut after 255 characters, the
+     * state that follows it gets its own children.
+     */
+    for (uint32_t id = count ; id-- > 0 ; ) {
+        if (!branch[id]) {
+            continue;
+        }
+        for (uint32_t i = 0 ; i < states[id].arc_count ; ++i) {
+            uint32_t state = targets[states[id].arcs + i];
+
+            for (uint32_t len = 1 ; !branch[state] ; ++len) {
+                if (len == 255) {
+                    branch[state] = true;
+                    break;
+                }
+                state = targets[states[state].arcs];
+            }
+        }
+        children[id] = next;
+        next += states[id].arc_count;
+    }
+
+    array_ensure_capacity_delta(b->nodes, next);
+    p_clear(b->nodes.data, next);
+    b->nodes.len = next;
+    for (uint32_t id = count ; id-- > 0 ; ) {
+        if (!branch[id]) {
+            continue;
+        }
+        if (id == root) {
+            strdb_node_t *node = array_ptr(b->nodes, 0);
+
+            node->value       = states[id].value;
+            node->children    = states[id].arc_count ? children[id] : 0;
+            node->child_count = states[id].arc_count;
+        }
+        for (uint32_t i = 0 ; i < states[id].arc_count ; ++i) {
+            strdb_node_t *node = array_ptr(b->nodes, children[id] + i);
+            uint32_t state = targets[states[id].arcs + i];
+
+            node->c     = b->arc_labels.data[states[id].arcs + i];
+            node->label = b->labels.len;
+            buffer_addch(&b->labels, node->c);
+            while (!branch[state]) {
+                const uint32_t arc = states[state].arcs;
+
+                buffer_addch(&b->labels, b->arc_labels.data[arc]);
+                state = targets[arc];
+            }
+            node->label_len   = b->labels.len - node->label;
+            node->value       = states[state].value;
+            node->children    = states[state].arc_count ? children[state] : 0;
+            node->child_count = states[state].arc_count;
+        }
+    }
+    p_delete(&incoming);
+    p_delete(&branch);
+    p_delete(&children);
+}
 
+/* Build the DAFSA of the sorted records of @p b by incremental minimization:
+ * the states of the path of a string are registered when the next string
+ * leaves that path, the sort order guarantees they do not change afterwards.
+ */
+static void strdb_dafsa_build(strdb_builder_t *b)
+{
+    const char *keys = b->keys.data;
+    const char *prev = NULL;
+    uint32_t prev_len = 0;
+    uint32_t path_len = 0;
+    strdb_dafsa_temp_t temp;
+
+    p_clear(&temp, 1);
+    array_add(b->path, temp);
+    foreach (record, b->records) {
+        const char *key = keys + record->key;
+        uint32_t common = 0;
+        strdb_dafsa_temp_t *t;
+
+        while (common < prev_len && common < record->len
+               && prev[common] == key[common]) {
+            ++common;
+        }
+        strdb_dafsa_minimize(b, prev, &path_len, common);
+        while ((uint32_t)b->path.len <= record->len) {
+            array_add(b->path, temp);
+        }
+        path_len = record->len;
+
+        t = array_ptr(b->path, path_len);
+        if (record->regexp >= 0) {
+            array_add(t->regexps,
+                      array_elt(b->records_regexps, record->regexp));
+        } else {
+            t->lists |= record->lists;
+        }
+        prev     = key;
+        prev_len = record->len;
+    }
+    strdb_dafsa_minimize(b, prev, &path_len, 0);
+    strdb_dafsa_store(b, strdb_dafsa_register(b, array_ptr(b->path, 0)));
+}
+
+/* Build the image of the trie (or of the DAFSA if @p dafsa is set) of the
+ * records added to @p b.
+ */
+static strdb_image_t *strdb_image_build(strdb_builder_t *b, bool dafsa)
+{
+    const char *keys = b->keys.data;
+    strdb_value_t none = { 0, 0, 0 };
+    strdb_node_t  root = { 0, 0, 0, 0, 0, 0 };
+    strdb_image_t header;
+    char *image;
+
+    if (b->records.len > 1) {
+#       define QSORT_TYPE strdb_record_t
+#       define QSORT_BASE b->records.data
+#       define QSORT_NELT b->records.len
+#       define QSORT_LT(a,b) strdb_record_lt(keys, a, b)
+#       include "qsort.c"
+    }
+    array_add(b->values, none);
+    if (dafsa) {
+        strdb_dafsa_build(b);
+    } else {
+        array_add(b->nodes, root);
+        strdb_build_node(b, 0, 0, b->records.len, 0);
+    }
+
+    p_clear(&header, 1);
+    memcpy(header.magic, STRDB_IMAGE_MAGIC, sizeof(header.magic));
+    header.version  = STRDB_IMAGE_VERSION;
+    header.endian   = STRDB_IMAGE_ENDIAN;
+    header.engine   = dafsa ? STRDB_ENGINE_DAFSA : STRDB_ENGINE_TRIE;
+    header.entries  = b->records.len;
+    header.values   = b->values.len;
+    header.nodes    = b->nodes.len;
+    header.regexps  = b->regexps.len;
+    header.labels   = b->labels.len;
+    header.patterns = b->patterns.len;
+
+    image = p_new(char, strdb_image_size(&header));
+    memcpy(image, &header, sizeof(header));
+    memcpy(image + strdb_image_nodes_offset(0), b->values.data,
+           b->values.len * sizeof(strdb_value_t));
+    memcpy(image + strdb_image_nodes_offset(header.values), b->nodes.data,
+           b->nodes.len * sizeof(strdb_node_t));
+    memcpy(image + strdb_image_regexps_offset(&header), b->regexps.data,
+           b->regexps.len * sizeof(strdb_regexp_t));
+    memcpy(image + strdb_image_labels_offset(&header), b->labels.data,
+           b->labels.len);
+    memcpy(image + strdb_image_labels_offset(&header) + b->labels.len,
+           b->patterns.data, b->patterns.len);
+    strdb_builder_wipe(b);
+    return (strdb_image_t *)image;
+}
+
+/* Build the trie (or the DAFSA) of the records added to @p b.
+ */
+static bool strdb_build(strdb_builder_t *b, strdb_t *db, bool dafsa,
+                        bool lock)
+{
+    p_clear(db, 1);
+    db->image = strdb_image_build(b, dafsa);
+    if (!strdb_setup(db, lock)) {
+        strdb_wipe(db);
+        return false;
+    }
+    return true;
+}
+
+static bool strdb_image_is_compiled(const file_map_t *map)
+{
+    return map->end - map->map >= (ssize_t)sizeof(STRDB_IMAGE_MAGIC) - 1
+        && memcmp(map->map, STRDB_IMAGE_MAGIC,
+                  sizeof(STRDB_IMAGE_MAGIC) - 1) == 0;
+}
+
+/* Check that the lookup of any string in the mapped image stays in the
+ * image.
+ */
+static bool strdb_image_check(const file_map_t *map, const char *file)
+{
+    const strdb_image_t *image = (const strdb_image_t *)map->map;
+    const size_t size = map->end - map->map;
+    const strdb_value_t  *values;
+    const strdb_node_t   *nodes;
+    const strdb_regexp_t *regexps;
+
+    if (size < sizeof(strdb_image_t)) {
+        err("%s: truncated string list image", file);
+        return false;
+    }
+    if (image->endian != STRDB_IMAGE_ENDIAN) {
+        err("%s: string list image compiled on a different architecture",
+            file);
+        return false;
+    }
+    if (image->version != STRDB_IMAGE_VERSION) {
+        err("%s: unsupported string list image version %u", file,
+            image->version);
+        return false;
+    }
+    if (image->nodes == 0 || image->values == 0
+        || image->engine > STRDB_ENGINE_DAFSA
+        || image->nodes > size / sizeof(strdb_node_t)
+        || image->values > size / sizeof(strdb_value_t)
+        || image->regexps > size / sizeof(strdb_regexp_t)
+        || image->labels > size || image->patterns > size
+        || size != strdb_image_size(image)) {
+        err("%s: corrupted string list image", file);
+        return false;
+    }
+    values  = (const strdb_value_t *)(map->map + strdb_image_nodes_offset(0));
+    nodes   = (const strdb_node_t *)(map->map
+                  + strdb_image_nodes_offset(image->values));
+    regexps = (const strdb_regexp_t *)(map->map
+                  + strdb_image_regexps_offset(image));
+    for (uint32_t i = 0 ; i < image->nodes ; ++i) {
+        const strdb_node_t *node = &nodes[i];
+
+        if (node->value >= image->values
+            || node->label > image->labels
+            || image->labels - node->label < node->label_len
+            || (i > 0 && (node->label_len == 0
+                          || map->map[strdb_image_labels_offset(image)
+                                      + node->label] != (char)node->c))
+            || (node->child_count > 0
+                && (node->children <= i || node->children > image->nodes
+                    || image->nodes - node->children < node->child_count))) {
+            err("%s: corrupted string list image", file);
+            return false;
+        }
+    }
+    for (uint32_t i = 0 ; i < image->values ; ++i) {
+        if (values[i].regexp > image->regexps
+            || image->regexps - values[i].regexp < values[i].regexp_count) {
+            err("%s: corrupted string list image", file);
+            return false;
+        }
+    }
+    for (uint32_t i = 0 ; i < image->regexps ; ++i) {
+        if (regexps[i].pattern > image->patterns
+            || image->patterns - regexps[i].pattern < regexps[i].pattern_len
+            || regexps[i].list >= STRDB_LISTS_MAX) {
+            err("%s: corrupted string list image", file);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Add to @p b the entries of the list @p from of @p db as entries of the list
+ * @p to. @p key holds the @p depth characters of the path of @p node.
+ */
+static void strdb_builder_merge(strdb_builder_t *b, const strdb_t *db,
+                                const strdb_node_t *node,
+                                char *key, uint32_t depth, int from, int to)
+{
+    if (node->value != 0) {
+        const strdb_value_t *value = &db->values[node->value];
+
+        if (value->lists & (1ULL << from)) {
+            strdb_builder_add(b, key, depth, 1ULL << to);
+        }
+        for (uint32_t i = 0 ; i < value->regexp_count ; ++i) {
+            const strdb_regexp_t *re = &db->regexps[value->regexp + i];
+
+            if (re->list == from) {
+                strdb_builder_add_regexp(b, key, depth, to,
+                                         db->patterns + re->pattern,
+                                         re->pattern_len, re->cs);
+            }
+        }
+    }
+    for (uint32_t i = 0 ; i < node->child_count ; ++i) {
+        const strdb_node_t *child = &db->nodes[node->children + i];
+
+        memcpy(key + depth, db->labels + child->label, child->label_len);
+        strdb_builder_merge(b, db, child, key, depth + child->label_len,
+                            from, to);
+    }
+}
+
+typedef struct strlist_resource_t strlist_resource_t;
+
+/* A list of the filter. A rbldns zone file gives two lists: its hosts (the
+ * list 0 of its trie) and its domains (the list 1).
+ */
 typedef struct strlist_local_t {
-    char     *filename;
-    trie_t   **db;
+    char     *key;
+    strlist_resource_t *res;
+    int      list;
     int      weight;
     unsigned reverse     :1;
     unsigned partial     :1;
+    unsigned lock        :1;
+    unsigned dafsa       :1;
 } strlist_local_t;
 ARRAY(strlist_local_t)
 
-typedef struct strlist_resource_t {
+struct strlist_resource_t {
     off_t  size;
     time_t mtime;
-    trie_t *trie1;
-    trie_t *trie2;
-} strlist_resource_t;
+    bool   rhbl;
+    uint32_t counts[2];
+    strdb_t db;
+};
+
+/* Trie of the lists of several files, rebuilt if one of them changed.
+ */
+typedef struct strlist_merge_resource_t {
+    int      count;
+    time_t   mtimes[STRDB_LISTS_MAX];
+    off_t    sizes[STRDB_LISTS_MAX];
+    strdb_t  db;
+} strlist_merge_resource_t;
+
+/* The lists that share an orientation: the bit i of a lookup in db matches
+ * the i-th list of that orientation in the filter.
+ */
+typedef struct strlist_set_t {
+    const strdb_t *db;
+    char     *merge_key;
+    strlist_merge_resource_t *merge;
+
+    uint64_t partial;
+    int      count;
+    int      weights[STRDB_LISTS_MAX];
+} strlist_set_t;
+
+/* A list file to load while building the filter.
+ */
+typedef struct strlist_load_t {
+    const char *file;
+    int  weight;
+    bool reverse;
+    bool partial;
+    bool lock;
+    bool dafsa;
+    bool rhbl;
+
+    bool loaded;
+    strlist_local_t hosts;
+    strlist_local_t domains;
+} strlist_load_t;
+ARRAY(strlist_load_t)
 
 typedef struct strlist_config_t {
     A(strlist_local_t) locals;
 
-    A(char)     hosts;
-    A(int)      host_offsets;
-    A(int)      host_weights;
+    /* Lists looked up from the beginning and from the end of the strings.
+     */
+    strlist_set_t sets[2];
+
+    A(dns_zone_t) zones;
 
     int soft_threshold;
     int hard_threshold;
@@ -79,36 +1126,50 @@ typedef struct strlist_config_t {
 }strlist_config_t; 
 
 typedef struct strlist_async_data_t {
-    A(dns_result_t) results;
+    A(dns_answer_t) results;
     int awaited;
     uint32_t sum;
+    uint32_t pending;
     bool error;
 }strlist_async_data_t; 
 
 static void strlist_local_wipe(strlist_local_t *entry)
 {
-    if (entry->filename != NULL) {
-        resource_release("strlist", entry->filename);
-        p_delete(&entry->filename);
+    if (entry->key != NULL) {
+        resource_release("strlist", entry->key, entry->res);
+        p_delete(&entry->key);
     }
 }
 
 static void strlist_resource_wipe(strlist_resource_t *res)
 {
-    trie_delete(&res->trie1);
-    trie_delete(&res->trie2);
+    strdb_wipe(&res->db);
+    p_delete(&res);
+}
+
+static void strlist_merge_resource_wipe(strlist_merge_resource_t *res)
+{
+    strdb_wipe(&res->db);
     p_delete(&res);
 }
 
+static void strlist_set_wipe(strlist_set_t *set)
+{
+    if (set->merge_key != NULL) {
+        resource_release("strlist-merge", set->merge_key, set->merge);
+        p_delete(&set->merge_key);
+    }
+}
+
 DO_INIT(strlist_config_t, strlist_config)
 DO_NEW(strlist_config_t, strlist_config)
 
 static void strlist_config_wipe(strlist_config_t *config)
 {
+    strlist_set_wipe(&config->sets[0]);
+    strlist_set_wipe(&config->sets[1]);
     array_deep_wipe(config->locals, strlist_local_wipe);
-    array_wipe(config->hosts);
-    array_wipe(config->host_offsets);
-    array_wipe(config->host_weights);
+    dns_zones_wipe(&config->zones);
 }
 DO_DELETE(strlist_config_t, strlist_config)
 
@@ -122,273 +1183,589 @@ static inline void strlist_copy(char *dest, const char *str, ssize_t str_len,
                 ++dest;
             }
         } else {
-            for (int i = 0 ; i < str_len ; ++i) {
-                *dest = ascii_tolower(str[i]);
-                ++dest;
-            }
+            query_lowercase(dest, str, str_len);
+            return;
         }
     }
     *dest = '\0';
 }
 
 
-static bool strlist_create(strlist_local_t *local,
-                           const char *file, int weight,
-                           bool reverse, bool partial, bool lock,
-                           bool allowregexp)
+/* Parse the text list mapped in @p map in @p b.
+ */
+static bool strlist_parse(strdb_builder_t *b, const file_map_t *map,
+                          const char *file, bool reverse, bool allowregexp,
+                          uint32_t *count)
 {
-    file_map_t map;
     const char *p, *end;
     char line[BUFSIZ];
-    uint32_t count = 0;
-    time_t now = time(0);
     buffer_t anchor = ARRAY_INIT; /* prefix or suffix */
     buffer_t regexp = ARRAY_INIT;
 
-    if (!file_map_open(&map, file, false)) {
-        return false;
+    p   = map->map;
+    end = map->end;
+    while (end > p && end[-1] != '\n') {
+        --end;
+    }
+    if (end != map->end) {
+        warn("%s: final \\n missing, ignoring last line", file);
+    }
+
+  #define CHECK_DATA(cond, message, ...)                                     \
+    if (!(cond)) {                                                           \
+        err(message, __VA_ARGS__);                                           \
+        buffer_wipe(&anchor);                                                \
+        buffer_wipe(&regexp);                                                \
+        return false;                                                        \
+    }
+
+    while (p < end && p != NULL) {
+        const char *eol = (char *)memchr(p, '\n', end - p);
+        if (eol == NULL) {
+            eol = end;
+        }
+        CHECK_DATA(eol - p < BUFSIZ, "%s not loaded: unreasonnable long line",
+                   file);
+        if (*p != '#') {
+            const char *eos = eol;
+            while (p < eos && isspace(*p)) {
+                ++p;
+            }
+            while (p < eos && isspace(eos[-1])) {
+                --eos;
+            }
+            if (p < eos) {
+                clstr_t substr = { p, eos - p };
+                if (allowregexp && *p == '/') {
+                    bool cs = false;
+
+                    buffer_reset(&anchor);
+                    buffer_reset(&regexp);
+                    CHECK_DATA(regexp_parse_str(&substr,
+                                                reverse ? NULL : &anchor,
+                                                &regexp,
+                                                reverse ? &anchor : NULL,
+                                                &cs),
+                               "cannot parse regexp %.*s", (int)substr.len,
+                               substr.str);
+                    CHECK_DATA(anchor.len > 0, "no fix %s found in %.*s",
+                               reverse ? "suffix" : "prefix", (int)substr.len,
+                               substr.str);
+                    strlist_copy(line, anchor.data, anchor.len, reverse);
+                    strdb_builder_add_regexp(b, line, anchor.len, 0,
+                                             regexp.data, regexp.len, cs);
+                } else {
+                    strlist_copy(line, substr.str, substr.len, reverse);
+                    strdb_builder_add(b, line, substr.len, 1);
+                }
+                ++*count;
+            }
+        }
+        p = eol + 1;
     }
-    p   = map.map;
-    end = map.end;
+    buffer_wipe(&anchor);
+    buffer_wipe(&regexp);
+  #undef CHECK_DATA
+    return true;
+}
+
+/* Parse the rbldns zone file mapped in @p map in @p b: the hosts are the
+ * list 0 and the domains the list 1.
+ */
+static bool strlist_rhbl_parse(strdb_builder_t *b, const file_map_t *map,
+                               const char *file, uint32_t *host_count,
+                               uint32_t *domain_count)
+{
+    const char *p, *end;
+    char line[BUFSIZ];
+
+    p   = map->map;
+    end = map->end;
     while (end > p && end[-1] != '\n') {
         --end;
     }
-    if (end != map.end) {
+    if (end != map->end) {
         warn("%s: final \\n missing, ignoring last line", file);
     }
 
-    strlist_resource_t *res = resource_get("strlist", file);
-    if (res == NULL) {
-        res = p_new(strlist_resource_t, 1);
-        resource_set("strlist", file, res,
-                     (resource_destructor_f)strlist_resource_wipe);
-    } else if (res->trie2 != NULL) {
-        err("%s not loaded: the file is already used as a rbldns zone file",
-            file);
-        resource_release("strlist", file);
-        file_map_close(&map);
+    while (p < end && p != NULL) {
+        const char *eol = (char *)memchr(p, '\n', end - p);
+        if (eol == NULL) {
+            eol = end;
+        }
+        if (eol - p >= BUFSIZ) {
+            err("%s not loaded: unreasonnable long line", file);
+            return false;
+        }
+        if (*p != '#') {
+            const char *eos = eol;
+            while (p < eos && isspace(*p)) {
+                ++p;
+            }
+            while (p < eos && isspace(eos[-1])) {
+                --eos;
+            }
+            if (p < eos) {
+                if (isalnum(*p)) {
+                    strlist_copy(line, p, eos - p, true);
+                    strdb_builder_add(b, line, eos - p, 1 << 0);
+                    ++*host_count;
+                } else if (*p == '*') {
+                    ++p;
+                    strlist_copy(line, p, eos - p, true);
+                    strdb_builder_add(b, line, eos - p, 1 << 1);
+                    ++*domain_count;
+                }
+            }
+        }
+        p = eol + 1;
+    }
+    if (*host_count == 0 && *domain_count == 0) {
+        err("%s not loaded: no data found", file);
+        return false;
+    }
+    return true;
+}
+
+/* Build the image of the list mapped in @p map. Returns NULL if the list is
+ * invalid.
+ */
+static strdb_image_t *strlist_image_build(const file_map_t *map,
+                                          const char *file, bool reverse,
+                                          bool rhbl, bool dafsa)
+{
+    strdb_builder_t builder;
+    strdb_image_t *image;
+    uint32_t count = 0, domains = 0;
+
+    p_clear(&builder, 1);
+    if (!(rhbl ? strlist_rhbl_parse(&builder, map, file, &count, &domains)
+               : strlist_parse(&builder, map, file, reverse, true, &count))) {
+        strdb_builder_wipe(&builder);
+        return NULL;
+    }
+    image = strdb_image_build(&builder, dafsa);
+    image->rhbl    = rhbl;
+    image->reverse = reverse || rhbl;
+    image->domains = domains;
+    return image;
+}
+
+/* Load the trie of @p file in @p db. A compiled image is used in place
+ * whatever its engine, a text list is parsed in a DAFSA if @p dafsa is set.
+ * @p map is either kept by @p db or closed.
+ */
+static bool strlist_db_load(strdb_t *db, file_map_t *map, const char *file,
+                            bool reverse, bool rhbl, bool dafsa, bool lock)
+{
+    p_clear(db, 1);
+    if (strdb_image_is_compiled(map)) {
+        const strdb_image_t *image = (const strdb_image_t *)map->map;
+
+        if (!strdb_image_check(map, file)) {
+            file_map_close(map);
+            return false;
+        }
+        if (image->rhbl != rhbl || (!rhbl && image->reverse != reverse)) {
+            err("%s: string list image compiled for %s lookups", file,
+                image->rhbl ? "rbldns" : image->reverse ? "suffix" : "prefix");
+            file_map_close(map);
+            return false;
+        }
+        db->mapped = true;
+        db->map    = *map;
+        db->image  = (strdb_image_t *)map->map;
+    } else {
+        db->image = strlist_image_build(map, file, reverse, rhbl, dafsa);
+        file_map_close(map);
+        if (db->image == NULL) {
+            return false;
+        }
+    }
+    if (!strdb_setup(db, lock)) {
+        err("%s not loaded: invalid data", file);
+        strdb_wipe(db);
+        return false;
+    }
+    return true;
+}
+
+/* Key of the resource of a list. The lists are built for prefix or suffix
+ * lookups: a file is loaded once per orientation, the reversed ones share
+ * their key with the rbldns zones.
+ */
+static char *strlist_resource_key(const char *file, bool reverse)
+{
+    buffer_t key = ARRAY_INIT;
+    char *res;
+
+    buffer_addf(&key, "%s:%s", reverse ? "suffix" : "prefix", file);
+    res = m_strdup(key.data);
+    buffer_wipe(&key);
+    return res;
+}
+
+static bool strlist_create(strlist_local_t *local,
+                           const char *file, int weight, bool reverse,
+                           bool partial, bool dafsa, bool lock)
+{
+    file_map_t map;
+    time_t now = time(0);
+    char *key;
+
+    if (!file_map_open(&map, file, false)) {
         return false;
     }
 
     p_clear(local, 1);
-    local->filename = m_strdup(file);
-    local->db      = &res->trie1;
     local->weight  = weight;
     local->reverse = reverse;
     local->partial = partial;
-    if (res->size == map.st.st_size && res->mtime == map.st.st_mtime) {
-        notice("%s loaded: already up-to-date", file);
+    local->lock    = lock;
+    local->dafsa   = dafsa;
+
+    /* The current version of the list may be in use by running queries, so
+     * it is never modified: a new version is built if the file changed.
+     */
+    key = strlist_resource_key(file, reverse);
+    strlist_resource_t *res = resource_get("strlist", key);
+    if (res != NULL && res->rhbl) {
+        err("%s not loaded: the file is already used as a rbldns zone file",
+            file);
+        resource_release("strlist", key, res);
         file_map_close(&map);
-        return true;
+        p_delete(&key);
+        return false;
+    } else if (res != NULL) {
+        if (res->size == map.st.st_size && res->mtime == map.st.st_mtime) {
+            notice("%s loaded: already up-to-date", file);
+            file_map_close(&map);
+            local->key = key;
+            local->res = res;
+            return true;
+        }
+        resource_release("strlist", key, res);
     }
-    trie_delete(&res->trie1);
-    res->trie1 = trie_new();
+    res = p_new(strlist_resource_t, 1);
     res->size  = map.st.st_size;
     res->mtime = map.st.st_mtime;
-
-  #define CHECK_DATA(cond, message, ...)                                     \
-    if (!(cond)) {                                                           \
-        err(message, __VA_ARGS__);                                           \
-        file_map_close(&map);                                                \
-        trie_delete(&res->trie1);                                            \
-        strlist_local_wipe(local);                                           \
-        buffer_wipe(&anchor);                                                \
-        buffer_wipe(&regexp);                                                \
-        return false;                                                        \
-    }
-
-    while (p < end && p != NULL) {
-        const char *eol = (char *)memchr(p, '\n', end - p);
-        if (eol == NULL) {
-            eol = end;
-        }
-        CHECK_DATA(eol - p < BUFSIZ, "%s not loaded: unreasonnable long line",
-                   file);
-        if (*p != '#') {
-            const char *eos = eol;
-            while (p < eos && isspace(*p)) {
-                ++p;
-            }
-            while (p < eos && isspace(eos[-1])) {
-                --eos;
-            }
-            if (p < eos) {
-                clstr_t substr = { p, eos - p };
-                if (allowregexp && *p == '/') {
-                    CHECK_DATA(regexp_parse_str(&substr,
-                                                reverse ? NULL : &anchor,
-                                                &regexp,
-                                                reverse ? &anchor : NULL,
-                                                NULL),
-                               "cannot parse regexp %.*s", (int)substr.len,
-                               substr.str);
-                    strlist_copy(line, anchor.data, anchor.len, reverse);
-                    CHECK_DATA(anchor.len > 0, "no fix %s found in %.*s",
-                               reverse ? "suffix" : "prefix", (int)substr.len,
-                               substr.str);
-                    substr.str = line;
-                    substr.len = anchor.len;
-                    clstr_t restr = buffer_tostr(&regexp);
-                    CHECK_DATA(trie_insert_regexp_str(res->trie1, &substr,
-                                                      &restr),
-                               "connot insert regexp %.*s in the trie",
-                               (int)(eos - p), p);
-                } else {
-                    strlist_copy(line, substr.str, substr.len, reverse);
-                    CHECK_DATA(trie_insert(res->trie1, line),
-                               "connot insert string \"%.*s\" in the trie",
-                               (int)(eos - p), p);
-                }
-                ++count;
-            }
-        }
-        p = eol + 1;
-    }
-    file_map_close(&map);
-    buffer_wipe(&anchor);
-    buffer_wipe(&regexp);
-
-    if (!trie_compile(res->trie1, lock)) {
-        err("%s not loaded: invalid data", file);
+    if (!strlist_db_load(&res->db, &map, file, reverse, false, dafsa,
+                         lock)) {
+        p_delete(&res);
+        p_delete(&key);
         return false;
     }
-    notice("%s loaded: done in %us, %u entries", file,
-           (uint32_t)(time(0) - now), count);
+    res->counts[0] = res->db.image->entries;
+    resource_set("strlist", key, res,
+                 (resource_destructor_f)strlist_resource_wipe);
+    local->key = key;
+    local->res = res;
+    notice("%s loaded: done in %us, %u entries, %zukB%s%s", file,
+           (uint32_t)(time(0) - now), res->counts[0],
+           strdb_memory(&res->db) >> 10,
+           res->db.image->engine == STRDB_ENGINE_DAFSA ? " (dafsa)" : "",
+           res->db.mapped ? " (compiled image)" : "");
     return true;
 }
 
 static bool strlist_create_from_rhbl(strlist_local_t *hosts,
                                      strlist_local_t *domains,
-                                     const char *file, int weight, bool lock)
+                                     const char *file, int weight,
+                                     bool dafsa, bool lock)
 {
-    uint32_t host_count, domain_count;
     file_map_t map;
-    const char *p, *end;
-    char line[BUFSIZ];
     time_t now = time(0);
+    char *key;
 
     if (!file_map_open(&map, file, false)) {
         return false;
     }
-    p   = map.map;
-    end = map.end;
-    while (end > p && end[-1] != '\n') {
-        --end;
-    }
-    if (end != map.end) {
-        warn("%s: final \\n missing, ignoring last line", file);
-    }
-
-
-    strlist_resource_t *res = resource_get("strlist", file);
-    if (res == NULL) {
-        res = p_new(strlist_resource_t, 1);
-        resource_set("strlist", file, res,
-                     (resource_destructor_f)strlist_resource_wipe);
-    }
 
     p_clear(hosts, 1);
-    hosts->filename = m_strdup(file);
-    hosts->db = &res->trie1;
     hosts->weight = weight;
     hosts->reverse    = true;
-    host_count = 0;
+    hosts->lock       = lock;
+    hosts->dafsa      = dafsa;
 
     p_clear(domains, 1);
-    /* don't set filename */
-    domains->db = &res->trie2;
+    domains->list   = 1;
     domains->weight = weight;
     domains->reverse      = true;
     domains->partial      = true;
-    domain_count = 0;
+    domains->lock         = lock;
+    domains->dafsa        = dafsa;
 
-    if (map.st.st_size == res->size && map.st.st_mtime == res->mtime) {
-        notice("%s loaded: already up-to-date", file);
+    key = strlist_resource_key(file, true);
+    strlist_resource_t *res = resource_get("strlist", key);
+    if (res != NULL && !res->rhbl) {
+        err("%s not loaded: the file is already used for suffix lookups",
+            file);
+        resource_release("strlist", key, res);
         file_map_close(&map);
-        return true;
+        p_delete(&key);
+        return false;
+    } else if (res != NULL) {
+        if (map.st.st_size == res->size && map.st.st_mtime == res->mtime) {
+            notice("%s loaded: already up-to-date", file);
+            file_map_close(&map);
+            goto done;
+        }
+        resource_release("strlist", key, res);
     }
-
-    trie_delete(&res->trie1);
-    trie_delete(&res->trie2);
-    res->trie1 = trie_new();
-    res->trie2 = trie_new();
+    res = p_new(strlist_resource_t, 1);
+    res->rhbl  = true;
     res->size  = map.st.st_size;
     res->mtime = map.st.st_mtime;
+    if (!strlist_db_load(&res->db, &map, file, true, true, dafsa, lock)) {
+        p_delete(&res);
+        p_delete(&key);
+        return false;
+    }
+    res->counts[0] = res->db.image->entries - res->db.image->domains;
+    res->counts[1] = res->db.image->domains;
+    resource_set("strlist", key, res,
+                 (resource_destructor_f)strlist_resource_wipe);
+    notice("%s loaded: done in %us, %u hosts, %u domains, %zukB%s%s", file,
+         (uint32_t)(time(0) - now), res->counts[0], res->counts[1],
+         strdb_memory(&res->db) >> 10,
+         res->db.image->engine == STRDB_ENGINE_DAFSA ? " (dafsa)" : "",
+         res->db.mapped ? " (compiled image)" : "");
+
+  done:
+    /* Both lists hold a reference on the resource. The caller locked it, so
+     * the current version is still the one checked or built above.
+     */
+    hosts->key        = key;
+    hosts->res        = res;
+    domains->key      = m_strdup(key);
+    domains->res      = resource_get("strlist", key);
+    assert (domains->res == res);
+    return true;
+}
 
-    while (p < end && p != NULL) {
-        const char *eol = (char *)memchr(p, '\n', end - p);
-        if (eol == NULL) {
-            eol = end;
-        }
-        if (eol - p >= BUFSIZ) {
-            err("%s not loaded: unreasonnable long line", file);
-            file_map_close(&map);
-            trie_delete(&res->trie1);
-            trie_delete(&res->trie2);
-            strlist_local_wipe(hosts);
-            return false;
-        }
-        if (*p != '#') {
-            const char *eos = eol;
-            while (p < eos && isspace(*p)) {
-                ++p;
-            }
-            while (p < eos && isspace(eos[-1])) {
-                --eos;
-            }
-            if (p < eos) {
-                if (isalnum(*p)) {
-                    strlist_copy(line, p, eos - p, true);
-                    trie_insert(res->trie1, line);
-                    ++host_count;
-                } else if (*p == '*') {
-                    ++p;
-                    strlist_copy(line, p, eos - p, true);
-                    trie_insert(res->trie2, line);
-                    ++domain_count;
-                }
+bool strlist_compile(const char *file, const char *output, bool reverse,
+                     bool rhbl, bool dafsa)
+{
+    char tmp[PATH_MAX];
+    strdb_t db;
+    file_map_t map;
+    ssize_t written = 0;
+    int fd;
+
+    if (!file_map_open(&map, file, false)) {
+        return false;
+    }
+    if (strdb_image_is_compiled(&map)) {
+        err("%s is already a compiled string list", file);
+        file_map_close(&map);
+        return false;
+    }
+    p_clear(&db, 1);
+    db.image = strlist_image_build(&map, file, reverse, rhbl, dafsa);
+    file_map_close(&map);
+    if (db.image == NULL) {
+        return false;
+    }
+
+    /* The regexps are compiled by postlicyd when it loads the image, make
+     * sure they are valid.
+     */
+    if (!strdb_setup(&db, false)) {
+        err("%s not compiled: invalid data", file);
+        strdb_wipe(&db);
+        return false;
+    }
+
+    /* The image is renamed once complete since a running postlicyd may have
+     * the previous one mapped.
+     */
+    snprintf(tmp, sizeof(tmp), "%s.tmp", output);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        UNIXERR("open");
+        strdb_wipe(&db);
+        return false;
+    }
+    while (written < (ssize_t)db.image_size) {
+        ssize_t res = write(fd, (const char *)db.image + written,
+                            db.image_size - written);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
             }
+            UNIXERR("write");
+            break;
         }
-        p = eol + 1;
+        written += res;
     }
-    file_map_close(&map);
-    if (host_count > 0) {
-        if (!trie_compile(res->trie1, lock)) {
-            err("%s not loaded: invalid data", file);
-            strlist_local_wipe(hosts);
-            return false;
+    if (written != (ssize_t)db.image_size || fsync(fd) < 0) {
+        close(fd);
+        unlink(tmp);
+        strdb_wipe(&db);
+        return false;
+    }
+    close(fd);
+    if (rename(tmp, output) < 0) {
+        UNIXERR("rename");
+        unlink(tmp);
+        strdb_wipe(&db);
+        return false;
+    }
+    notice("%s compiled into %s, %u entries, %u regexps, %zukB (%s)", file,
+           output, db.image->entries, db.image->regexps, db.image_size >> 10,
+           dafsa ? "dafsa" : "trie");
+    strdb_wipe(&db);
+    return true;
+}
+
+strdb_t *strdb_create(const char *file, bool reverse, bool dafsa)
+{
+    strdb_t *db;
+    file_map_t map;
+
+    if (!file_map_open(&map, file, false)) {
+        return NULL;
+    }
+    db = p_new(strdb_t, 1);
+    if (!strlist_db_load(db, &map, file, reverse, false, dafsa, false)) {
+        p_delete(&db);
+        return NULL;
+    }
+    return db;
+}
+
+void strdb_delete(strdb_t **db)
+{
+    if (*db) {
+        strdb_wipe(*db);
+        p_delete(db);
+    }
+}
+
+/* Get the trie of the lists of @p set. The trie of a file is used as is if
+ * the set holds all its lists in order, the lists of several files are
+ * merged in a trie shared with the filters that use the same lists. The
+ * merged lists are stored in a DAFSA if one of them asked for it.
+ */
+static bool strlist_set_init(strlist_set_t *set,
+                             strlist_local_t * const *locals, int count)
+{
+    strlist_merge_resource_t *res;
+    strdb_builder_t builder;
+    buffer_t key = ARRAY_INIT;
+    char path[BUFSIZ];
+    time_t now = time(0);
+    bool lock = false;
+    bool dafsa = false;
+    int i;
+
+    if (count == 0) {
+        return true;
+    }
+    for (i = 0 ; i < count ; ++i) {
+        if (locals[i]->res != locals[0]->res || locals[i]->list != i) {
+            break;
         }
-    } else {
-        trie_delete(&res->trie1);
     }
-    if (domain_count > 0) {
-        if (!trie_compile(res->trie2, lock)) {
-            err("%s not loaded: invalid data", file);
-            strlist_local_wipe(hosts);
-            return false;
+    if (i == count) {
+        set->db = &locals[0]->res->db;
+        return true;
+    }
+
+    for (i = 0 ; i < count ; ++i) {
+        lock  |= locals[i]->lock;
+        dafsa |= locals[i]->dafsa;
+    }
+    buffer_addf(&key, "%s", dafsa ? "dafsa" : "trie");
+    for (i = 0 ; i < count ; ++i) {
+        buffer_addf(&key, "\n%d:%s", locals[i]->list, locals[i]->key);
+    }
+    resource_lock("strlist-merge", key.data);
+    res = resource_get("strlist-merge", key.data);
+    if (res != NULL) {
+        bool uptodate = res->count == count;
+
+        for (i = 0 ; uptodate && i < count ; ++i) {
+            uptodate = res->mtimes[i] == locals[i]->res->mtime
+                    && res->sizes[i] == locals[i]->res->size;
         }
-    } else {
-        trie_delete(&res->trie2);
+        if (uptodate) {
+            goto done;
+        }
+        resource_release("strlist-merge", key.data, res);
     }
-    if (res->trie1 == NULL && res->trie2 == NULL) {
-        err("%s not loaded: no data found", file);
-        strlist_local_wipe(hosts);
+
+    res = p_new(strlist_merge_resource_t, 1);
+    res->count = count;
+    p_clear(&builder, 1);
+    for (i = 0 ; i < count ; ++i) {
+        const strdb_t *db = &locals[i]->res->db;
+
+        res->mtimes[i] = locals[i]->res->mtime;
+        res->sizes[i]  = locals[i]->res->size;
+        strdb_builder_merge(&builder, db, db->nodes, path, 0,
+                            locals[i]->list, i);
+    }
+    if (!strdb_build(&builder, &res->db, dafsa, lock)) {
+        err("cannot merge the lists %s", key.data);
+        resource_unlock("strlist-merge", key.data);
+        p_delete(&res);
+        buffer_wipe(&key);
         return false;
     }
-    notice("%s loaded: done in %us, %u hosts, %u domains", file,
-         (uint32_t)(time(0) - now), host_count, domain_count);
+    resource_set("strlist-merge", key.data, res,
+                 (resource_destructor_f)strlist_merge_resource_wipe);
+    notice("%d lists merged: done in %us, %u entries, %u regexps, %zukB (%s)",
+           count, (uint32_t)(time(0) - now), res->db.image->entries,
+           res->db.image->regexps, strdb_memory(&res->db) >> 10,
+           dafsa ? "dafsa" : "trie");
+
+  done:
+    resource_unlock("strlist-merge", key.data);
+    set->merge_key = m_strdup(key.data);
+    set->merge     = res;
+    set->db        = &res->db;
+    buffer_wipe(&key);
     return true;
 }
 
+static bool strlist_load_job(void *data, int i)
+{
+    strlist_load_t *load = array_ptr(*(A(strlist_load_t) *)data, i);
+
+    /* Several configurations may load the same file at once.
+     */
+    resource_lock("strlist", load->file);
+    if (load->rhbl) {
+        load->loaded = strlist_create_from_rhbl(&load->hosts, &load->domains,
+                                                load->file, load->weight,
+                                                load->dafsa, load->lock);
+        if (!load->loaded) {
+            err("cannot load string list from rhbl %s", load->file);
+        }
+    } else {
+        load->loaded = strlist_create(&load->hosts, load->file, load->weight,
+                                      load->reverse, load->partial,
+                                      load->dafsa, load->lock);
+        if (!load->loaded) {
+            err("cannot load string list from %s", load->file);
+        }
+    }
+    resource_unlock("strlist", load->file);
+    return load->loaded;
+}
 
 static bool strlist_filter_constructor(filter_t *filter)
 {
     strlist_config_t *config = strlist_config_new();
+    A(strlist_load_t) loads = ARRAY_INIT;
+    bool loaded;
 
 #define PARSE_CHECK(Expr, Str, ...)                                          \
     if (!(Expr)) {                                                           \
         err(Str, ##__VA_ARGS__);                                             \
         strlist_config_delete(&config);                                      \
+        array_wipe(loads);                                                   \
         return false;                                                        \
     }
 
@@ -397,10 +1774,12 @@ static bool strlist_filter_constructor(filter_t *filter)
     foreach (param, filter->params) {
         switch (param->type) {
           /* file parameter is:
-           *  [no]lock:(partial-)(prefix|suffix):weight:filename
+           *  (dafsa-)[no]lock:(partial-)(prefix|suffix):weight:filename
            *  valid options are:
            *    - lock:   memlock the database in memory.
            *    - nolock: don't memlock the database in memory.
+           *    - dafsa-: store the list in a minimal automaton instead of a
+           *              trie.
            *    - prefix: perform "prefix" compression on storage.
            *    - suffix  perform "suffix" compression on storage.
            *    - \d+:    a number describing the weight to give to the match
@@ -411,6 +1790,7 @@ static bool strlist_filter_constructor(filter_t *filter)
            */
           case ATK_FILE: {
             bool lock = false;
+            bool dafsa = false;
             int  weight = 0;
             bool reverse = false;
             bool partial = false;
@@ -423,6 +1803,12 @@ static bool strlist_filter_constructor(filter_t *filter)
                             "and a weight option");
                 switch (i) {
                   case 0:
+                    if (p - current > (ssize_t)strlen("dafsa-")
+                        && strncmp(current, "dafsa-",
+                                   strlen("dafsa-")) == 0) {
+                        dafsa = true;
+                        current += strlen("dafsa-");
+                    }
                     if ((p - current) == 4
                         && strncmp(current, "lock", 4) == 0) {
                         lock = true;
@@ -463,11 +1849,15 @@ static bool strlist_filter_constructor(filter_t *filter)
                     break;
 
                   case 3: {
-                    strlist_local_t entry;
-                    PARSE_CHECK(strlist_create(&entry, current, weight,
-                                               reverse, partial, lock, true),
-                                "cannot load string list from %s", current);
-                    array_add(config->locals, entry);
+                    strlist_load_t load = {
+                        .file    = current,
+                        .weight  = weight,
+                        .reverse = reverse,
+                        .partial = partial,
+                        .lock    = lock,
+                        .dafsa   = dafsa,
+                    };
+                    array_add(loads, load);
                   } break;
                 }
                 if (i != 3) {
@@ -478,16 +1868,19 @@ static bool strlist_filter_constructor(filter_t *filter)
           } break;
 
           /* rbldns parameter is:
-           *  [no]lock::weight:filename
+           *  (dafsa-)[no]lock::weight:filename
            *  valid options are:
            *    - lock:   memlock the database in memory.
            *    - nolock: don't memlock the database in memory.
+           *    - dafsa-: store the list in a minimal automaton instead of a
+           *              trie.
            *    - \d+:    a number describing the weight to give to the match
            *              the given list [mandatory]
            *  directly import a file issued from a rhbl in rbldns format.
            */
           case ATK_RBLDNS: {
             bool lock = false;
+            bool dafsa = false;
             int  weight = 0;
             const char *current = param->value;
             const char *p = m_strchrnul(param->value, ':');
@@ -498,6 +1891,12 @@ static bool strlist_filter_constructor(filter_t *filter)
                             "and a weight option");
                 switch (i) {
                   case 0:
+                    if (p - current > (ssize_t)strlen("dafsa-")
+                        && strncmp(current, "dafsa-",
+                                   strlen("dafsa-")) == 0) {
+                        dafsa = true;
+                        current += strlen("dafsa-");
+                    }
                     if ((p - current) == 4
                         && strncmp(current, "lock", 4) == 0) {
                         lock = true;
@@ -518,19 +1917,14 @@ static bool strlist_filter_constructor(filter_t *filter)
                     break;
 
                   case 2: {
-                    strlist_local_t trie_hosts, trie_domains;
-                    PARSE_CHECK(strlist_create_from_rhbl(&trie_hosts,
-                                                         &trie_domains,
-                                                         current, weight,
-                                                         lock),
-                                "cannot load string list from rhbl %s",
-                                current);
-                    if (*(trie_hosts.db) != NULL) {
-                        array_add(config->locals, trie_hosts);
-                    }
-                    if (*(trie_domains.db) != NULL) {
-                        array_add(config->locals, trie_domains);
-                    }
+                    strlist_load_t load = {
+                        .file   = current,
+                        .weight = weight,
+                        .lock   = lock,
+                        .dafsa  = dafsa,
+                        .rhbl   = true,
+                    };
+                    array_add(loads, load);
                     config->is_hostname = true;
                   } break;
                 }
@@ -542,8 +1936,9 @@ static bool strlist_filter_constructor(filter_t *filter)
           } break;
 
           /* dns parameter.
-           *  weight:hostname.
-           * define a RBL to use through DNS resolution.
+           *  weight:hostname, weight:hostname=a.b.c.d or weight:hostname&mask
+           * define a RBL to use through DNS resolution. A RBL given several
+           * times with conditions on its answer is queried only once.
            */
           case ATK_DNS: {
             int  weight = 0;
@@ -562,9 +1957,8 @@ static bool strlist_filter_constructor(filter_t *filter)
                     break;
 
                   case 1:
-                    array_add(config->host_offsets, array_len(config->hosts));
-                    array_append(config->hosts, current, strlen(current) + 1);
-                    array_add(config->host_weights, weight);
+                    PARSE_CHECK(dns_zone_add(&config->zones, current, weight),
+                                "illegal dns list %s", current);
                     break;
                 }
                 if (i != 1) {
@@ -632,10 +2026,80 @@ static bool strlist_filter_constructor(filter_t *filter)
         }
     }
 
+    /* The files are parsed and compiled concurrently.
+     */
+    loaded = worker_parallel(loads.len, strlist_load_job, &loads);
+    foreach (load, loads) {
+        if (!load->loaded) {
+            continue;
+        }
+        if (!load->rhbl) {
+            array_add(config->locals, load->hosts);
+            continue;
+        }
+        if (load->hosts.res->counts[0] > 0) {
+            array_add(config->locals, load->hosts);
+        } else {
+            strlist_local_wipe(&load->hosts);
+        }
+        if (load->domains.res->counts[1] > 0) {
+            array_add(config->locals, load->domains);
+        } else {
+            strlist_local_wipe(&load->domains);
+        }
+    }
+    PARSE_CHECK(loaded, "cannot load the lists of the filter %s",
+                filter->name);
+    array_wipe(loads);
+
+    /* The lists of each orientation are looked up in a single trie, so that
+     * each field needs at most two descents whatever the number of lists.
+     */
+    for (int reverse = 0 ; reverse < 2 ; ++reverse) {
+        strlist_set_t *set = &config->sets[reverse];
+        strlist_local_t *locals[STRDB_LISTS_MAX];
+
+        foreach (local, config->locals) {
+            if (local->reverse != reverse) {
+                continue;
+            }
+            PARSE_CHECK(set->count < STRDB_LISTS_MAX,
+                        "too many %s lists in the filter %s (at most %d)",
+                        reverse ? "suffix" : "prefix", filter->name,
+                        STRDB_LISTS_MAX);
+            if (local->partial) {
+                set->partial |= 1ULL << set->count;
+            }
+            set->weights[set->count] = local->weight;
+            locals[set->count++] = local;
+        }
+        PARSE_CHECK(strlist_set_init(set, locals, set->count),
+                    "cannot build the lists of the filter %s", filter->name);
+    }
+
     PARSE_CHECK(config->is_email != config->is_hostname,
                 "matched field MUST be emails XOR hostnames");
-    PARSE_CHECK(config->locals.len || config->host_offsets.len,
+    PARSE_CHECK(config->locals.len || config->zones.len,
                 "no file parameter in the filter %s", filter->name);
+
+    /* The protocol state decides whether the fields are available.
+     */
+    filter_depends_on(filter, PTK_PROTOCOL_STATE);
+#define DEPENDS(Flag, Field)                                                 \
+    if (config->match_ ## Flag) {                                            \
+        filter_depends_on(filter, Field);                                    \
+    }
+    if (config->is_email) {
+        DEPENDS(sender, PTK_SENDER);
+        DEPENDS(recipient, PTK_RECIPIENT);
+    } else {
+        DEPENDS(helo, PTK_HELO_NAME);
+        DEPENDS(client, PTK_CLIENT_NAME);
+        DEPENDS(reverse, PTK_REVERSE_CLIENT_NAME);
+        DEPENDS(recipient, PTK_RECIPIENT_DOMAIN);
+        DEPENDS(sender, PTK_SENDER_DOMAIN);
+    }
+#undef  DEPENDS
     filter->data = config;
     return true;
 }
@@ -647,102 +2111,115 @@ static void strlist_filter_destructor(filter_t *filter)
     filter->data = config;
 }
 
-static void strlist_filter_async(dns_result_t *result, void *arg)
+/* Result of the filter given the answers received so far, HTK_ASYNC if the
+ * pending answers may still change it.
+ */
+static filter_result_t strlist_async_result(const strlist_config_t *config,
+                                            const strlist_async_data_t *async)
+{
+    const int64_t sum = async->sum;
+    const int64_t max = sum + async->pending;
+
+    if (sum >= config->hard_threshold) {
+        return HTK_HARD_MATCH;
+    }
+    if (async->error) {
+        return async->awaited > 0 ? HTK_ASYNC : HTK_ERROR;
+    }
+    if (max < config->hard_threshold) {
+        if (sum >= config->soft_threshold) {
+            return HTK_SOFT_MATCH;
+        } else if (max < config->soft_threshold) {
+            return HTK_FAIL;
+        }
+    }
+    return HTK_ASYNC;
+}
+
+static void strlist_filter_async(dns_answer_t *answer, void *arg)
 {
     filter_context_t   *context = arg;
     const filter_t      *filter = context->current_filter;
     const strlist_config_t *data = filter->data;
     strlist_async_data_t  *async = filter_context(filter, context);
+    const int pos = answer - array_ptr(async->results, 0);
+    /* The results are stored field by field, with one result per rhbl for
+     * each matched field.
+     */
+    const dns_zone_t *zone = array_ptr(data->zones,
+                                       pos % array_len(data->zones));
+    filter_result_t res;
 
-    if (*result != DNS_ERROR) {
+    if (answer->result != DNS_ERROR) {
         async->error = false;
     }
+    async->sum += dns_zone_score(zone, answer);
+    async->pending -= zone->weight;
     --async->awaited;
 
     debug("got asynchronous request result for filter %s, rbl %d, "
-          "still awaiting %d answers", filter->name,
-          (int)(result - array_ptr(async->results, 0)), async->awaited);
-
-    if (async->awaited == 0) {
-        filter_result_t res = HTK_FAIL;
-        if (async->error) {
-            res = HTK_ERROR;
-        } else {
-            uint32_t j = 0;
-#define DO_SUM(Field)                                                        \
-        if (data->match_ ## Field) {                                         \
-            for (uint32_t i = 0 ; i < array_len(data->host_offsets) ; ++i) { \
-                int weight = array_elt(data->host_weights, i);               \
-                                                                             \
-                switch (array_elt(async->results, j)) {                      \
-                  case DNS_ASYNC:                                            \
-                    crit("no more awaited answer but result is ASYNC");      \
-                    abort();                                                 \
-                  case DNS_FOUND:                                            \
-                    async->sum += weight;                                    \
-                    break;                                                   \
-                  default:                                                   \
-                    break;                                                   \
-                }                                                            \
-                ++j;                                                         \
-            }                                                                \
-        }
-            DO_SUM(helo);
-            DO_SUM(client);
-            DO_SUM(reverse);
-            DO_SUM(recipient);
-            DO_SUM(sender);
-#undef DO_SUM
-            debug("score is %d", async->sum);
-            if (async->sum >= (uint32_t)data->hard_threshold) {
-                res = HTK_HARD_MATCH;
-            } else if (async->sum >= (uint32_t)data->soft_threshold) {
-                res = HTK_SOFT_MATCH;
-            }
+          "still awaiting %d answers", filter->name, pos, async->awaited);
+
+    res = strlist_async_result(data, async);
+    if (res != HTK_ASYNC) {
+        if (async->awaited > 0) {
+            debug("filter %s decided, ignoring %d pending answers",
+                  filter->name, async->awaited);
+            dns_cancel(context);
         }
-        debug("answering to filter %s", filter->name);
+        debug("score is %d, answering to filter %s", async->sum,
+              filter->name);
         filter_post_async_result(context, res);
     }
 }
 
 
+/* The field in lowercase. It is normalized once per query and shared by the
+ * strlist filters, or copied in @p buf if the query has no room left for it.
+ * A field too long to be in a list is replaced by an empty string.
+ */
+static inline const clstr_t *strlist_field(const query_t *query,
+                                           postlicyd_token id,
+                                           char *buf, clstr_t *copy)
+{
+    const clstr_t *field = query_field_lowercase(query, id);
+
+    if (field == NULL) {
+        field = query_field_for_id(query, id);
+        copy->str = buf;
+        copy->len = field->len < BUFSIZ ? field->len : 0;
+        query_lowercase(buf, field->str, copy->len);
+        field = copy;
+    }
+    return field;
+}
+
 static inline bool strlist_trie_lookup(const strlist_config_t *config,
                                        filter_context_t *context,
                                        strlist_async_data_t *async,
                                        int *result_pos, const clstr_t *str,
                                        const char *fieldname)
 {
-    char reverse[BUFSIZ];
-    char normal[BUFSIZ];
-
-    const int len = str->len;
-    trie_match_t match;
-    strlist_copy(normal, str->str, len, false);
-    strlist_copy(reverse, str->str, len, true);
-    foreach (entry, config->locals) {
-        bool matched = false;
-        if (!entry->partial) {
-            matched = trie_lookup_match(*(entry->db),
-                               entry->reverse ? reverse : normal, &match);
-        } else {
-            matched = trie_prefix_match(*(entry->db),
-                               entry->reverse ? reverse : normal, &match);
-        }
-        if (matched && match.regexp == NULL) {
-            async->sum += entry->weight;
-        } else if (match.regexp != NULL) {
-            clstr_t substr;
-            substr.str = entry->reverse ? normal : normal + match.match_len;
-            substr.len = len - match.match_len;
-            if (regexp_match_str(match.regexp, &substr)) {
-                async->sum += entry->weight;
-            }
+    if (config->locals.len == 0) {
+        return false;
+    }
+    for (int reverse = 0 ; reverse < 2 ; ++reverse) {
+        const strlist_set_t *set = &config->sets[reverse];
+        uint64_t lists;
+
+        if (set->db == NULL) {
+            continue;
+        }
+        lists = strdb_lookup(set->db, set->partial, str->str, str->len,
+                             reverse);
+        for (; lists != 0 ; lists &= lists - 1) {
+            async->sum += set->weights[__builtin_ctzll(lists)];
         }
         if (async->sum >= (uint32_t)config->hard_threshold) {
             return true;
         }
-        async->error = false;
     }
+    async->error = false;
     return false;
 }
 
@@ -752,20 +2229,26 @@ static inline bool strlist_rhbl_lookup(const strlist_config_t *config,
                                        int *result_pos, const clstr_t *str,
                                        const char *fieldname)
 {
-    char normal[BUFSIZ];
+    if (str->len == 0) {
+        *result_pos += config->zones.len;
+        return false;
+    }
+    for (uint32_t i = 0 ; i < config->zones.len ; ++i) {
+        const dns_zone_t *zone = array_ptr(config->zones, i);
+        dns_answer_t *answer = array_ptr(async->results, *result_pos);
 
-    const int len = str->len;
-    strlist_copy(normal, str->str, len, false);
-    for (uint32_t i = 0 ; len > 0 && i < config->host_offsets.len ; ++i) {
-        const char *rbl = array_ptr(config->hosts,
-                                    array_elt(config->host_offsets, i));
         debug("running check of field %s (%s) against %s", fieldname,
-              normal, rbl);
-        if (dns_rhbl_check(rbl, normal, array_ptr(async->results,
-                                                  *result_pos),
-                           strlist_filter_async, context)) {
+              str->str, zone->name);
+        if (dns_rhbl_check(zone, str->str, answer, strlist_filter_async,
+                           context)) {
             async->error = false;
-            ++async->awaited;
+            if (answer->result == DNS_ASYNC) {
+                async->pending += zone->weight;
+                ++async->awaited;
+            } else {
+                /* Answer from the dns cache. */
+                async->sum += dns_zone_score(zone, answer);
+            }
         }
         ++(*result_pos);
     }
@@ -779,13 +2262,16 @@ static filter_result_t strlist_filter(const filter_t *filter,
     const strlist_config_t *config = filter->data;
     strlist_async_data_t *async = filter_context(filter, context);
     int result_pos = 0;
+    char buf[BUFSIZ];
+    clstr_t copy;
     async->sum = 0;
+    async->pending = 0;
     async->error = true;
     array_ensure_exact_capacity(async->results, (config->match_client
                                 + config->match_sender + config->match_helo
                                 + config->match_recipient
                                 + config->match_reverse)
-                                * array_len(config->host_offsets));
+                                * array_len(config->zones));
     async->awaited = 0;
 
 
@@ -803,33 +2289,39 @@ static filter_result_t strlist_filter(const filter_t *filter,
 
 #define LOOKUP(Flag, Field, Method)                                          \
     if (config->match_ ## Flag) {                                            \
+        const clstr_t *str = strlist_field(query, PTK_ ## Field, buf, &copy);\
         if (strlist_ ## Method ## _lookup(config, context, async,            \
-                                          &result_pos,                       \
-                                          &query->Field, STR(Field))) {      \
+                                          &result_pos, str,                  \
+                                          ptokens[PTK_ ## Field])) {         \
             return HTK_HARD_MATCH;                                           \
         }                                                                    \
     }
     if (config->is_email) {
-        LOOKUP(sender, sender, trie);
-        LOOKUP(recipient, recipient, trie);
-        LOOKUP(sender, sender, rhbl);
-        LOOKUP(recipient, recipient, rhbl);
+        LOOKUP(sender, SENDER, trie);
+        LOOKUP(recipient, RECIPIENT, trie);
+        LOOKUP(sender, SENDER, rhbl);
+        LOOKUP(recipient, RECIPIENT, rhbl);
     } else if (config->is_hostname) {
-        LOOKUP(helo, helo_name, trie);
-        LOOKUP(client, client_name, trie);
-        LOOKUP(reverse, reverse_client_name, trie);
-        LOOKUP(recipient, recipient_domain, trie);
-        LOOKUP(sender, sender_domain, trie);
-        LOOKUP(helo, helo_name, rhbl);
-        LOOKUP(client, client_name, rhbl);
-        LOOKUP(reverse, reverse_client_name, rhbl);
-        LOOKUP(recipient, recipient_domain, rhbl);
-        LOOKUP(sender, sender_domain, rhbl);
+        LOOKUP(helo, HELO_NAME, trie);
+        LOOKUP(client, CLIENT_NAME, trie);
+        LOOKUP(reverse, REVERSE_CLIENT_NAME, trie);
+        LOOKUP(recipient, RECIPIENT_DOMAIN, trie);
+        LOOKUP(sender, SENDER_DOMAIN, trie);
+        LOOKUP(helo, HELO_NAME, rhbl);
+        LOOKUP(client, CLIENT_NAME, rhbl);
+        LOOKUP(reverse, REVERSE_CLIENT_NAME, rhbl);
+        LOOKUP(recipient, RECIPIENT_DOMAIN, rhbl);
+        LOOKUP(sender, SENDER_DOMAIN, rhbl);
     }
 #undef  LOOKUP
 
     if (async->awaited > 0) {
-        return HTK_ASYNC;
+        filter_result_t res = strlist_async_result(config, async);
+
+        if (res != HTK_ASYNC) {
+            dns_cancel(context);
+        }
+        return res;
     }
     if (async->error) {
         err("filter %s: all the rbls returned an error", filter->name);
@@ -844,6 +2336,37 @@ static filter_result_t strlist_filter(const filter_t *filter,
     }
 }
 
+/* Only the client names are known as soon as the client connects.
+ */
+static void strlist_filter_prefetch(const filter_t *filter,
+                                    const query_t *query)
+{
+    const strlist_config_t *config = filter->data;
+    char buf[BUFSIZ];
+    clstr_t copy;
+
+    if (!config->is_hostname || config->zones.len == 0) {
+        return;
+    }
+#define PREFETCH(Flag, Field)                                                \
+    if (config->match_ ## Flag) {                                            \
+        const clstr_t *str = strlist_field(query, PTK_ ## Field, buf, &copy);\
+        if (str->len > 0) {                                                  \
+            foreach (zone, config->zones) {                                  \
+                dns_rhbl_prefetch(zone, str->str);                           \
+            }                                                                \
+        }                                                                    \
+    }
+    PREFETCH(client, CLIENT_NAME);
+    PREFETCH(reverse, REVERSE_CLIENT_NAME);
+#undef  PREFETCH
+}
+
+static void strlist_filter_cancel(filter_context_t *context)
+{
+    dns_cancel(context);
+}
+
 static void *strlist_context_constructor(void)
 {
     return p_new(strlist_async_data_t, 1);
@@ -874,6 +2397,9 @@ filter_constructor(strlist)
     filter_hook_forward_register(filter_type, HTK_ERROR, HTK_FAIL);
     filter_hook_forward_register(filter_type, HTK_SOFT_MATCH, HTK_HARD_MATCH);
 
+    filter_prefetcher_register(filter_type, strlist_filter_prefetch);
+    filter_canceler_register(filter_type, strlist_filter_cancel);
+
     /* Parameters.
      */
     (void)filter_param_register(filter_type, "file");
@@ -882,6 +2408,8 @@ filter_constructor(strlist)
     (void)filter_param_register(filter_type, "hard_threshold");
     (void)filter_param_register(filter_type, "soft_threshold");
     (void)filter_param_register(filter_type, "fields");
+
+    worker_atexit(strdb_exit);
     return 0;
 }
 
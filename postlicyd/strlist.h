@@ -0,0 +1,70 @@
+/****************************************************************************/
+/*          pfixtools: a collection of postfix related tools                */
+/*          ~~~~~~~~~                                                       */
+/*  ______________________________________________________________________  */
+/*                                                                          */
+/*  Redistribution and use in source and binary forms, with or without      */
+/*  modification, are permitted provided that the following conditions      */
+/*  are met:                                                                */
+/*                                                                          */
+/*  1. Redistributions of source code must retain the above copyright       */
+/*     notice, this list of conditions and the following disclaimer.        */
+/*  2. Redistributions in binary form must reproduce the above copyright    */
+/*     notice, this list of conditions and the following disclaimer in      */
+/*     the documentation and/or other materials provided with the           */
+/*     distribution.                                                        */
+/*  3. The names of its contributors may not be used to endorse or promote  */
+/*     products derived from this software without specific prior written   */
+/*     permission.                                                          */
+/*                                                                          */
+/*  THIS SOFTWARE IS PROVIDED BY THE CONTRIBUTORS ``AS IS'' AND ANY         */
+/*  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       */
+/*  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR      */
+/*  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE CONTRIBUTORS BE LIABLE   */
+/*  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR            */
+/*  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF    */
+/*  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR         */
+/*  BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,   */
+/*  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE    */
+/*  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,       */
+/*  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                      */
+/*                                                                          */
+/*   Copyright (c) 2006-2014 the Authors                                    */
+/*   see AUTHORS and source files for details                               */
+/****************************************************************************/
+
+#ifndef PFIXTOOLS_STRLIST_H
+#define PFIXTOOLS_STRLIST_H
+
+typedef struct strdb_t strdb_t;
+
+/** Load the string list @p file, looked up from the end of the strings
+ * (@p reverse) or from their beginning. A text list is stored in a trie, or
+ * in a minimal automaton if @p dafsa is set, a compiled image is mapped
+ * whatever its engine.
+ */
+strdb_t *strdb_create(const char *file, bool reverse, bool dafsa);
+void strdb_delete(strdb_t **db);
+
+/** Memory used by the lookup table of the list, in bytes.
+ */
+size_t strdb_memory(const strdb_t *db);
+
+/** Bitmask of the lists that match @p str. Bit i of @p partial is set if the
+ * list i matches the strings that begin (or end, when @p reverse is set) with
+ * one of its entries. @p str is read backwards when @p reverse is set.
+ */
+uint64_t strdb_lookup(const strdb_t *db, uint64_t partial,
+                      const char *str, int len, bool reverse);
+
+/** Compile the text list @p file into the image @p output. The list is
+ * either a rbldns zone file (@p rhbl) or a list of strings looked up from
+ * their end (@p reverse) or from their beginning. It is stored in a minimal
+ * automaton if @p dafsa is set, in a trie otherwise.
+ */
+bool strlist_compile(const char *file, const char *output, bool reverse,
+                     bool rhbl, bool dafsa);
+
+#endif
+
+/* vim:set et sw=4 sts=4 sws=4: */
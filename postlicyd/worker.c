@@ -0,0 +1,1497 @@
+/****************************************************************************/
+/*          pfixtools: a collection of postfix related tools                */
+/*          ~~~~~~~~~                                                       */
+/*  ______________________________________________________________________  */
+/*                                                                          */
+/*  Redistribution and use in source and binary forms, with or without      */
+/*  modification, are permitted provided that the following conditions      */
+/*  are met:                                                                */
+/*                                                                          */
+/*  1. Redistributions of source code must retain the above copyright       */
+/*     notice, this list of conditions and the following disclaimer.        */
+/*  2. Redistributions in binary form must reproduce the above copyright    */
+/*     notice, this list of conditions and the following disclaimer in      */
+/*     the documentation and/or other materials provided with the           */
+/*     distribution.                                                        */
+/*  3. The names of its contributors may not be used to endorse or promote  */
+/*     products derived from this software without specific prior written   */
+/*     permission.                                                          */
+/*                                                                          */
+/*  THIS SOFTWARE IS PROVIDED BY THE CONTRIBUTORS ``AS IS'' AND ANY         */
+/*  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       */
+/*  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR      */
+/*  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE CONTRIBUTORS BE LIABLE   */
+/*  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR            */
+/*  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF    */
+/*  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR         */
+/*  BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,   */
+/*  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE    */
+/*  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,       */
+/*  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                      */
+/*                                                                          */
+/*   Copyright (c) 2006-2014 the Authors                                    */
+/*   see AUTHORS and source files for details                               */
+/****************************************************************************/
+
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include "array.h"
+#include "worker.h"
+
+typedef struct worker_t worker_t;
+
+struct conn_t {
+    ev_io io;
+    worker_t *worker;
+    int events;
+
+    buffer_t ibuf;
+    buffer_t obuf;
+    void *data;
+
+    conn_t *prev;
+    conn_t *next;
+};
+
+struct worker_t {
+    int id;
+    pthread_t thread;
+    struct ev_loop *loop;
+
+    ev_async wakeup;
+    ev_io tcp;
+    ev_io unix_sock;
+
+    conn_t *conns;
+
+    /* Time the loop started to poll, the time the previous poll returned,
+     * and the time since which the events of the current iteration are
+     * pending.
+     */
+    ev_prepare prepare;
+    ev_check check;
+    ev_tstamp polling;
+    ev_tstamp polled;
+    ev_tstamp pending_since;
+
+    /* Prefork mode (master side).
+     */
+    pid_t pid;
+    ev_tstamp started;
+    ev_child child;
+    ev_io channel;
+    ev_timer respawn;
+};
+
+#define WORKER_MESSAGE_MAX  (64 << 10)
+
+/* Time a worker process waits for the answer of the master, the query
+ * goes on without it afterward.
+ */
+#define WORKER_MASTER_TIMEOUT  2
+
+/* A poll that returns within this time did not wait: the events were
+ * already pending when the loop called it.
+ */
+#define WORKER_POLL_IDLE  0.0005
+
+/* Time given to a stopped worker process to finish its queries.
+ */
+#define WORKER_DRAIN_TIMEOUT  60.
+
+/* Worker processes of a previous generation, that finish their queries
+ * before exiting. The release callback is called when the last of them
+ * exits.
+ */
+typedef struct worker_generation_t {
+    int children;
+    worker_release_f release;
+    void *data;
+} worker_generation_t;
+
+typedef struct worker_retired_t worker_retired_t;
+struct worker_retired_t {
+    pid_t pid;
+    ev_child child;
+    ev_io channel;
+    ev_timer timeout;
+    worker_generation_t *generation;
+
+    worker_retired_t *prev;
+    worker_retired_t *next;
+};
+
+/* Request of a worker process waiting for the answer of the master. The
+ * requests are answered in order, and they all wait for the same time: the
+ * first one is the first to time out.
+ */
+typedef struct worker_call_t worker_call_t;
+struct worker_call_t {
+    uint32_t seq;
+    ev_tstamp deadline;
+    worker_answer_f answer;
+    void *data;
+
+    worker_call_t *prev;
+    worker_call_t *next;
+};
+
+typedef worker_exit_f worker_exit_t;
+ARRAY(worker_exit_t);
+
+typedef worker_stats_f worker_stats_t;
+ARRAY(worker_stats_t);
+
+/* Delay given to the worker processes to send their counters to the master
+ * before they are logged.
+ */
+#define WORKER_STATS_DELAY  .5
+
+static struct {
+    int count;
+    int tcp_fds[WORKER_MAX];
+    int unix_fd;
+    worker_t workers[WORKER_MAX];
+
+    conn_starter_f starter;
+    conn_stopper_f stopper;
+    conn_runner_f runner;
+    worker_refresh_f refresh;
+    worker_notify_f notify;
+    void *config;
+
+    A(worker_exit_t) exits;
+    volatile bool stopping;
+
+    bool prefork;
+    bool child;
+    int channel;
+    uint32_t channel_seq;
+    worker_master_f master;
+    char message[WORKER_MESSAGE_MAX];
+    buffer_t answer;
+    worker_retired_t *retired;
+
+    /* Worker process side: the process is stopped once its connections
+     * are idle.
+     */
+    bool draining;
+    ev_signal sigdrain;
+
+    /* Worker process side: the requests waiting for the answer of the
+     * master.
+     */
+    ev_io calls_io;
+    ev_timer calls_timer;
+    worker_call_t *calls;
+    worker_call_t *calls_last;
+
+    /* In the master, the totals of the worker processes. In a worker
+     * process, the counters already sent to the master.
+     */
+    A(worker_stats_t) collectors;
+    A(worker_stat_t) stats;
+    ev_signal sigstats;
+    ev_timer stats_timer;
+
+    ev_signal sighup;
+    ev_signal sigint;
+    ev_signal sigterm;
+
+    int cpus;
+    int helpers;
+} worker_g = {
+#define _G  worker_g
+    .count   = 1,
+    .tcp_fds = { [0 ... WORKER_MAX - 1] = -1 },
+    .unix_fd = -1,
+    .channel = -1,
+};
+
+static __thread worker_t *worker_self_g;
+
+
+/* Connections {{{ */
+
+static void conn_update(conn_t *conn)
+{
+    struct ev_loop *loop = conn->worker->loop;
+    if (ev_is_active(&conn->io)) {
+        ev_io_stop(loop, &conn->io);
+    }
+    if (conn->events != 0) {
+        ev_io_set(&conn->io, conn->io.fd, conn->events);
+        ev_io_start(loop, &conn->io);
+    }
+}
+
+void conn_io_none(conn_t *conn)
+{
+    conn->events = 0;
+    conn_update(conn);
+}
+
+void conn_io_ro(conn_t *conn)
+{
+    conn->events = EV_READ;
+    conn_update(conn);
+}
+
+void conn_io_wo(conn_t *conn)
+{
+    conn->events = EV_WRITE;
+    conn_update(conn);
+}
+
+void conn_io_rw(conn_t *conn)
+{
+    conn->events = EV_READ | EV_WRITE;
+    conn_update(conn);
+}
+
+void *conn_data(conn_t *conn)
+{
+    return conn->data;
+}
+
+buffer_t *conn_input_buffer(conn_t *conn)
+{
+    return &conn->ibuf;
+}
+
+buffer_t *conn_output_buffer(conn_t *conn)
+{
+    return &conn->obuf;
+}
+
+int conn_read(conn_t *conn)
+{
+    return buffer_read(&conn->ibuf, conn->io.fd, -1);
+}
+
+void conn_release(conn_t *conn)
+{
+    worker_t *worker = conn->worker;
+
+    conn_io_none(conn);
+    if (_G.stopper != NULL) {
+        _G.stopper(&conn->data);
+    }
+    close(conn->io.fd);
+    buffer_wipe(&conn->ibuf);
+    buffer_wipe(&conn->obuf);
+
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        worker->conns = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+    p_delete(&conn);
+    if (_G.draining && worker->conns == NULL) {
+        ev_break(worker->loop, EVBREAK_ALL);
+    }
+}
+
+static void conn_event(struct ev_loop *loop, ev_io *io, int revents)
+{
+    conn_t *conn = (conn_t *)io;
+
+    if (revents & EV_WRITE) {
+        buffer_t *buf = &conn->obuf;
+        if (buf->len > 0) {
+            ssize_t nb = write(io->fd, buf->data, buf->len);
+            if (nb < 0) {
+                if (errno != EAGAIN && errno != EINTR) {
+                    UNIXERR("write");
+                    conn_release(conn);
+                }
+                return;
+            }
+            buffer_consume(buf, nb);
+        }
+        if (buf->len == 0) {
+            if (_G.draining && conn->ibuf.len == 0) {
+                conn_release(conn);
+                return;
+            }
+            conn_io_ro(conn);
+        }
+    }
+    if ((revents & EV_READ) && _G.runner(conn, _G.config) < 0) {
+        conn_release(conn);
+    }
+}
+
+static void conn_new(worker_t *worker, int fd)
+{
+    conn_t *conn = p_new(conn_t, 1);
+    conn->worker = worker;
+    ev_io_init(&conn->io, conn_event, fd, 0);
+    if (_G.starter != NULL) {
+        conn->data = _G.starter();
+    }
+    conn->next = worker->conns;
+    if (worker->conns != NULL) {
+        worker->conns->prev = conn;
+    }
+    worker->conns = conn;
+    conn_io_ro(conn);
+}
+
+/* }}} */
+/* Listeners {{{ */
+
+static void worker_accept(struct ev_loop *loop, ev_io *io, int revents)
+{
+    worker_t *worker = io->data;
+    int fd;
+
+    /* The unix socket is shared by all the workers, so a concurrent accept
+     * may already have consumed the connection: this is not an error.
+     */
+    while ((fd = accept4(io->fd, NULL, NULL,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        conn_new(worker, fd);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR
+        && errno != ECONNABORTED) {
+        UNIXERR("accept");
+    }
+}
+
+static int worker_socket(int family)
+{
+    int fd = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        UNIXERR("socket");
+    }
+    return fd;
+}
+
+bool worker_listen_tcp(uint16_t port)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port   = htons(port),
+        .sin_addr   = { htonl(INADDR_LOOPBACK) },
+    };
+
+    for (int i = 0 ; i < _G.count ; ++i) {
+        int fd = worker_socket(AF_INET);
+        int v  = 1;
+        if (fd < 0) {
+            return false;
+        }
+        _G.tcp_fds[i] = fd;
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &v, sizeof(v)) < 0) {
+            UNIXERR("setsockopt(SO_REUSEADDR)");
+            return false;
+        }
+        /* Each worker binds its own socket, the kernel balances the
+         * incoming connections between them.
+         */
+        if (_G.count > 1
+            && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &v, sizeof(v)) < 0) {
+            UNIXERR("setsockopt(SO_REUSEPORT)");
+            return false;
+        }
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            UNIXERR("bind");
+            return false;
+        }
+        if (listen(fd, SOMAXCONN) < 0) {
+            UNIXERR("listen");
+            return false;
+        }
+    }
+    return true;
+}
+
+bool worker_listen_unix(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd;
+
+    if (m_strlen(path) >= ssizeof(addr.sun_path)) {
+        err("socketfile is too long: %s", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+    if ((fd = worker_socket(AF_UNIX)) < 0) {
+        return false;
+    }
+    _G.unix_fd = fd;
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        UNIXERR("bind");
+        return false;
+    }
+    if (listen(fd, SOMAXCONN) < 0) {
+        UNIXERR("listen");
+        return false;
+    }
+    return true;
+}
+
+/* }}} */
+/* Workers {{{ */
+
+void worker_setup(int count, bool prefork)
+{
+    if (count <= 0) {
+        count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    _G.count   = MAX(1, MIN(count, WORKER_MAX));
+    _G.prefork = prefork;
+}
+
+bool worker_is_prefork(void)
+{
+    return _G.prefork;
+}
+
+bool worker_is_child(void)
+{
+    return _G.child;
+}
+
+int worker_count(void)
+{
+    return _G.count;
+}
+
+int worker_id(void)
+{
+    return worker_self_g != NULL ? worker_self_g->id : 0;
+}
+
+struct ev_loop *worker_ev_loop(void)
+{
+    return worker_self_g != NULL ? worker_self_g->loop : ev_default_loop(0);
+}
+
+void worker_atexit(worker_exit_f handler)
+{
+    array_add(_G.exits, handler);
+}
+
+void worker_notify_all(void)
+{
+    for (int i = 0 ; i < _G.count ; ++i) {
+        if (_G.workers[i].loop != NULL) {
+            ev_async_send(_G.workers[i].loop, &_G.workers[i].wakeup);
+        }
+    }
+}
+
+static void worker_wakeup(struct ev_loop *loop, ev_async *w, int revents)
+{
+    if (_G.stopping) {
+        ev_break(loop, EVBREAK_ALL);
+    } else if (_G.notify != NULL) {
+        _G.notify(_G.config);
+    }
+}
+
+static void worker_signal(struct ev_loop *loop, ev_signal *w, int revents)
+{
+    switch (w->signum) {
+      case SIGHUP:
+        if (_G.refresh != NULL && !_G.refresh(_G.config)) {
+            err("configuration refresh failed");
+        }
+        break;
+
+      default:
+        notice("received signal %s, exiting", strsignal(w->signum));
+        _G.stopping = true;
+        if (_G.prefork) {
+            ev_break(loop, EVBREAK_ALL);
+        } else {
+            worker_notify_all();
+        }
+        break;
+    }
+}
+
+ev_tstamp worker_pending_since(void)
+{
+    return worker_self_g != NULL ? worker_self_g->pending_since
+                                 : ev_now(ev_default_loop(0));
+}
+
+static void worker_prepare(struct ev_loop *loop, ev_prepare *w, int revents)
+{
+    worker_t *worker = w->data;
+
+    worker->polling = ev_time();
+}
+
+/* When the poll waited, the events arrived while it was waiting, that is
+ * when it returned. Otherwise, they arrived while the loop was busy: the
+ * previous poll returned without them, so they are pending since then at
+ * most.
+ */
+static void worker_check(struct ev_loop *loop, ev_check *w, int revents)
+{
+    worker_t *worker = w->data;
+    const ev_tstamp now = ev_now(loop);
+
+    if (now - worker->polling < WORKER_POLL_IDLE) {
+        worker->pending_since = worker->polled;
+    } else {
+        worker->pending_since = now;
+    }
+    worker->polled = now;
+}
+
+static void worker_start(worker_t *worker)
+{
+    worker_self_g = worker;
+    worker->polling = worker->polled = worker->pending_since = ev_time();
+    ev_prepare_init(&worker->prepare, worker_prepare);
+    worker->prepare.data = worker;
+    ev_prepare_start(worker->loop, &worker->prepare);
+    ev_check_init(&worker->check, worker_check);
+    ev_set_priority(&worker->check, EV_MAXPRI);
+    worker->check.data = worker;
+    ev_check_start(worker->loop, &worker->check);
+    ev_async_init(&worker->wakeup, worker_wakeup);
+    ev_async_start(worker->loop, &worker->wakeup);
+    if (_G.tcp_fds[worker->id] >= 0) {
+        ev_io_init(&worker->tcp, worker_accept, _G.tcp_fds[worker->id],
+                   EV_READ);
+        worker->tcp.data = worker;
+        ev_io_start(worker->loop, &worker->tcp);
+    }
+    if (_G.unix_fd >= 0) {
+        ev_io_init(&worker->unix_sock, worker_accept, _G.unix_fd, EV_READ);
+        worker->unix_sock.data = worker;
+        ev_io_start(worker->loop, &worker->unix_sock);
+    }
+}
+
+static void worker_stop(worker_t *worker)
+{
+    while (worker->conns != NULL) {
+        conn_release(worker->conns);
+    }
+    if (ev_is_active(&worker->tcp)) {
+        ev_io_stop(worker->loop, &worker->tcp);
+    }
+    if (ev_is_active(&worker->unix_sock)) {
+        ev_io_stop(worker->loop, &worker->unix_sock);
+    }
+    ev_async_stop(worker->loop, &worker->wakeup);
+    ev_check_stop(worker->loop, &worker->check);
+    ev_prepare_stop(worker->loop, &worker->prepare);
+}
+
+static void *worker_run(void *arg)
+{
+    worker_t *worker = arg;
+
+    ev_run(worker->loop, 0);
+    worker_stop(worker);
+    foreach (handler, _G.exits) {
+        (*handler)();
+    }
+    ev_loop_destroy(worker->loop);
+    return NULL;
+}
+
+/* }}} */
+/* Statistics {{{ */
+
+void worker_stats_register(worker_stats_f collect)
+{
+    array_add(_G.collectors, collect);
+}
+
+void worker_stat_add(A(worker_stat_t) *stats, const char *group,
+                     const char *name, uint64_t value, bool max)
+{
+    worker_stat_t stat = { .value = value, .max = max };
+
+    m_strcpy(stat.group, sizeof(stat.group), group);
+    m_strcpy(stat.name, sizeof(stat.name), name);
+    array_add(*stats, stat);
+}
+
+static worker_stat_t *worker_stat_find(A(worker_stat_t) *stats,
+                                       const worker_stat_t *stat)
+{
+    foreach (s, *stats) {
+        if (strcmp(s->group, stat->group) == 0
+            && strcmp(s->name, stat->name) == 0) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+static void worker_stats_merge(A(worker_stat_t) *stats,
+                               const worker_stat_t *from, int count)
+{
+    for (int i = 0 ; i < count ; ++i) {
+        worker_stat_t *stat = worker_stat_find(stats, &from[i]);
+
+        if (stat == NULL) {
+            array_add(*stats, from[i]);
+        } else if (from[i].max) {
+            stat->value = MAX(stat->value, from[i].value);
+        } else {
+            stat->value += from[i].value;
+        }
+    }
+}
+
+static void worker_stats_collect(A(worker_stat_t) *stats)
+{
+    foreach (collect, _G.collectors) {
+        (*collect)(stats);
+    }
+}
+
+/* The counters of a group are contiguous: one line per group, the groups
+ * with only zeros are skipped.
+ */
+static void worker_stats_log(const A(worker_stat_t) *stats)
+{
+    buffer_t line = ARRAY_INIT;
+    int i = 0;
+
+    while (i < stats->len) {
+        const worker_stat_t *first = array_ptr(*stats, i);
+        bool used = false;
+        int j;
+
+        buffer_reset(&line);
+        for (j = i ; j < stats->len ; ++j) {
+            const worker_stat_t *stat = array_ptr(*stats, j);
+
+            if (strcmp(stat->group, first->group) != 0) {
+                break;
+            }
+            buffer_addf(&line, "%s%s %llu", j > i ? ", " : "", stat->name,
+                        (unsigned long long)stat->value);
+            used |= stat->value != 0;
+        }
+        if (used) {
+            notice("%s: %s", first->group, line.data);
+        }
+        i = j;
+    }
+    buffer_wipe(&line);
+}
+
+/* Send the counters of this worker process to the master. The counts are
+ * sent as the difference with the ones already sent so that the master can
+ * sum them with the ones of the worker processes that exited.
+ */
+static void worker_stats_push(void)
+{
+    A(worker_stat_t) stats = ARRAY_INIT;
+    uint32_t seq = 0;
+    struct iovec iov[2] = {
+        { .iov_base = &seq, .iov_len = sizeof(seq) },
+    };
+    struct msghdr msg = {
+        .msg_iov    = iov,
+        .msg_iovlen = 2,
+    };
+
+    worker_stats_collect(&stats);
+    foreach (stat, stats) {
+        worker_stat_t *sent = worker_stat_find(&_G.stats, stat);
+
+        if (sent == NULL) {
+            array_add(_G.stats, *stat);
+        } else if (stat->max) {
+            sent->value = stat->value;
+        } else {
+            uint64_t value = stat->value;
+
+            stat->value -= sent->value;
+            sent->value  = value;
+        }
+    }
+    iov[1].iov_base = stats.data;
+    iov[1].iov_len  = MIN(stats.len, (WORKER_MESSAGE_MAX - ssizeof(seq))
+                                     / ssizeof(worker_stat_t))
+                    * sizeof(worker_stat_t);
+    if (sendmsg(_G.channel, &msg, MSG_NOSIGNAL) < 0) {
+        UNIXERR("sendmsg");
+    }
+    array_wipe(stats);
+}
+
+static void worker_stats_dump(struct ev_loop *loop, ev_timer *w, int revents)
+{
+    worker_stats_log(&_G.stats);
+}
+
+static void worker_stats_signal(struct ev_loop *loop, ev_signal *w,
+                                int revents)
+{
+    if (_G.child) {
+        worker_stats_push();
+    } else if (_G.prefork) {
+        for (int i = 0 ; i < _G.count ; ++i) {
+            if (_G.workers[i].pid > 0) {
+                kill(_G.workers[i].pid, SIGUSR1);
+            }
+        }
+        for (worker_retired_t *retired = _G.retired ; retired != NULL ;
+             retired = retired->next) {
+            kill(retired->pid, SIGUSR1);
+        }
+        ev_timer_stop(loop, &_G.stats_timer);
+        ev_timer_set(&_G.stats_timer, WORKER_STATS_DELAY, 0.);
+        ev_timer_start(loop, &_G.stats_timer);
+    } else {
+        array_len(_G.stats) = 0;
+        worker_stats_collect(&_G.stats);
+        worker_stats_log(&_G.stats);
+    }
+}
+
+/* }}} */
+/* Prefork mode {{{ */
+
+void worker_master_register(worker_master_f handler)
+{
+    _G.master = handler;
+}
+
+/* The messages on the channel start with a sequence number, the master
+ * copies the one of the request in its answer. The answer to a request that
+ * timed out or was forgotten is this way recognized and skipped.
+ */
+static void worker_calls_arm(struct ev_loop *loop)
+{
+    ev_timer_stop(loop, &_G.calls_timer);
+    if (_G.calls != NULL) {
+        ev_timer_set(&_G.calls_timer,
+                     MAX(_G.calls->deadline - ev_now(loop), 0.), 0.);
+        ev_timer_start(loop, &_G.calls_timer);
+    }
+}
+
+static void worker_call_remove(worker_call_t *call)
+{
+    if (call->prev != NULL) {
+        call->prev->next = call->next;
+    } else {
+        _G.calls = call->next;
+    }
+    if (call->next != NULL) {
+        call->next->prev = call->prev;
+    } else {
+        _G.calls_last = call->prev;
+    }
+    p_delete(&call);
+}
+
+uint32_t worker_master_call(const void *request, ssize_t len,
+                            worker_answer_f answer, void *data)
+{
+    struct ev_loop *loop = worker_ev_loop();
+    uint32_t seq;
+    struct iovec iov[2] = {
+        { .iov_base = &seq,            .iov_len = sizeof(seq) },
+        { .iov_base = (void *)request, .iov_len = len },
+    };
+    struct msghdr msg = {
+        .msg_iov    = iov,
+        .msg_iovlen = 2,
+    };
+    worker_call_t *call;
+
+    assert (_G.child);
+
+    /* 0 is the sequence number of the counters, see worker_stats_push().
+     */
+    if (++_G.channel_seq == 0) {
+        ++_G.channel_seq;
+    }
+    seq = _G.channel_seq;
+    if (sendmsg(_G.channel, &msg, MSG_NOSIGNAL | MSG_DONTWAIT)
+        != ssizeof(seq) + len) {
+        UNIXERR("sendmsg");
+        return 0;
+    }
+    if (answer == NULL) {
+        return seq;
+    }
+    call = p_new(worker_call_t, 1);
+    call->seq      = seq;
+    call->deadline = ev_now(loop) + WORKER_MASTER_TIMEOUT;
+    call->answer   = answer;
+    call->data     = data;
+    call->prev     = _G.calls_last;
+    if (_G.calls_last != NULL) {
+        _G.calls_last->next = call;
+    } else {
+        _G.calls = call;
+        worker_calls_arm(loop);
+    }
+    _G.calls_last = call;
+    return seq;
+}
+
+void *worker_master_forget(uint32_t seq)
+{
+    for (worker_call_t *call = _G.calls ; call != NULL ; call = call->next) {
+        if (call->seq == seq) {
+            void *data = call->data;
+            bool first = call == _G.calls;
+
+            worker_call_remove(call);
+            if (first) {
+                worker_calls_arm(worker_ev_loop());
+            }
+            return data;
+        }
+    }
+    return NULL;
+}
+
+static void worker_calls_answer(struct ev_loop *loop, ev_io *io, int revents)
+{
+    for (;;) {
+        ssize_t nb = recv(io->fd, _G.message, WORKER_MESSAGE_MAX,
+                          MSG_DONTWAIT);
+        worker_call_t *call = _G.calls;
+        uint32_t seq;
+
+        if (nb < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nb < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (nb <= 0) {
+            if (nb < 0) {
+                UNIXERR("recv");
+            }
+            ev_io_stop(loop, io);
+            return;
+        }
+        if (nb < ssizeof(seq)) {
+            continue;
+        }
+        memcpy(&seq, _G.message, sizeof(seq));
+        while (call != NULL && call->seq != seq) {
+            call = call->next;
+        }
+        if (call != NULL) {
+            worker_answer_f answer = call->answer;
+            void *data = call->data;
+
+            worker_call_remove(call);
+            worker_calls_arm(loop);
+            (*answer)(data, _G.message + sizeof(seq), nb - sizeof(seq));
+        }
+    }
+}
+
+static void worker_calls_timeout(struct ev_loop *loop, ev_timer *w,
+                                 int revents)
+{
+    while (_G.calls != NULL && _G.calls->deadline <= ev_now(loop)) {
+        worker_answer_f answer = _G.calls->answer;
+        void *data = _G.calls->data;
+
+        err("no answer from the master after %ds, going on without it",
+            WORKER_MASTER_TIMEOUT);
+        worker_call_remove(_G.calls);
+        (*answer)(data, NULL, -1);
+    }
+    worker_calls_arm(loop);
+}
+
+/* Handle the message of @p nb bytes in _G.message. The messages with the
+ * sequence number 0 are the counters of the worker process, they have no
+ * answer.
+ */
+static void worker_master_handle(int fd, ssize_t nb)
+{
+    uint32_t seq;
+
+    memcpy(&seq, _G.message, sizeof(seq));
+    if (seq == 0) {
+        worker_stats_merge(&_G.stats,
+                           (const worker_stat_t *)(_G.message + sizeof(seq)),
+                           (nb - sizeof(seq)) / sizeof(worker_stat_t));
+        return;
+    }
+    buffer_reset(&_G.answer);
+    buffer_add(&_G.answer, &seq, sizeof(seq));
+    if (_G.master != NULL) {
+        _G.master(_G.message + sizeof(seq), nb - sizeof(seq), &_G.answer);
+    }
+    if (send(fd, _G.answer.data, _G.answer.len, MSG_NOSIGNAL) < 0) {
+        UNIXERR("send");
+    }
+}
+
+static void worker_master_serve(struct ev_loop *loop, ev_io *io, int revents)
+{
+    ssize_t nb = recv(io->fd, _G.message, WORKER_MESSAGE_MAX, MSG_DONTWAIT);
+
+    if (nb <= 0) {
+        if (nb == 0 || (errno != EAGAIN && errno != EINTR)) {
+            ev_io_stop(loop, io);
+        }
+        return;
+    }
+    if (nb < ssizeof(uint32_t)) {
+        err("invalid request from worker");
+        return;
+    }
+    worker_master_handle(io->fd, nb);
+}
+
+/* Read the messages left on the channel of a worker process that exited.
+ */
+static void worker_master_flush(int fd)
+{
+    ssize_t nb;
+
+    while ((nb = recv(fd, _G.message, WORKER_MESSAGE_MAX, MSG_DONTWAIT))
+           >= ssizeof(uint32_t)) {
+        worker_master_handle(fd, nb);
+    }
+}
+
+/* The master stopped this worker process: stop accepting connections and
+ * exit once the ones that are open are idle. A connection is idle when it
+ * waits for a new query.
+ */
+static void worker_drain(struct ev_loop *loop, ev_signal *w, int revents)
+{
+    worker_t *worker = worker_self_g;
+    conn_t *conn = worker->conns;
+
+    if (_G.draining) {
+        return;
+    }
+    _G.draining = true;
+    if (ev_is_active(&worker->tcp)) {
+        ev_io_stop(loop, &worker->tcp);
+        close(worker->tcp.fd);
+    }
+    if (ev_is_active(&worker->unix_sock)) {
+        ev_io_stop(loop, &worker->unix_sock);
+        close(worker->unix_sock.fd);
+    }
+    while (conn != NULL) {
+        conn_t *next = conn->next;
+
+        if (conn->events == EV_READ && conn->ibuf.len == 0
+            && conn->obuf.len == 0) {
+            conn_release(conn);
+        }
+        conn = next;
+    }
+    if (worker->conns == NULL) {
+        ev_break(loop, EVBREAK_ALL);
+    }
+}
+
+static void worker_retired_forget(struct ev_loop *loop,
+                                  worker_retired_t *retired)
+{
+    if (ev_is_active(&retired->child)) {
+        ev_child_stop(loop, &retired->child);
+    }
+    if (ev_is_active(&retired->channel)) {
+        ev_io_stop(loop, &retired->channel);
+    }
+    if (ev_is_active(&retired->timeout)) {
+        ev_timer_stop(loop, &retired->timeout);
+    }
+    close(retired->channel.fd);
+    if (retired->prev != NULL) {
+        retired->prev->next = retired->next;
+    } else {
+        _G.retired = retired->next;
+    }
+    if (retired->next != NULL) {
+        retired->next->prev = retired->prev;
+    }
+}
+
+static void worker_child_run(worker_t *worker, int channel)
+{
+    struct ev_loop *loop = ev_default_loop(0);
+
+    ev_loop_fork(loop);
+    _G.child   = true;
+    _G.channel = channel;
+    ev_io_init(&_G.calls_io, worker_calls_answer, channel, EV_READ);
+    ev_io_start(loop, &_G.calls_io);
+    ev_init(&_G.calls_timer, worker_calls_timeout);
+
+    /* Forget about the master's business.
+     */
+    ev_signal_stop(loop, &_G.sighup);
+    signal(SIGHUP, SIG_IGN);
+    for (int i = 0 ; i < _G.count ; ++i) {
+        worker_t *other = &_G.workers[i];
+        if (ev_is_active(&other->child)) {
+            ev_child_stop(loop, &other->child);
+        }
+        if (ev_is_active(&other->respawn)) {
+            ev_timer_stop(loop, &other->respawn);
+        }
+        if (ev_is_active(&other->channel)) {
+            ev_io_stop(loop, &other->channel);
+            close(other->channel.fd);
+        }
+    }
+    while (_G.retired != NULL) {
+        worker_retired_forget(loop, _G.retired);
+    }
+    if (ev_is_active(&_G.stats_timer)) {
+        ev_timer_stop(loop, &_G.stats_timer);
+    }
+    array_len(_G.stats) = 0;
+    ev_signal_init(&_G.sigdrain, worker_drain, SIGUSR2);
+    ev_signal_start(loop, &_G.sigdrain);
+
+    worker->loop = loop;
+    worker_start(worker);
+    ev_run(loop, 0);
+    worker_stop(worker);
+    worker_stats_push();
+
+    /* The configuration and the databases belong to the master: do not run
+     * the module destructors.
+     */
+    _exit(EXIT_SUCCESS);
+}
+
+static void worker_child_exited(struct ev_loop *loop, ev_child *w, int revents);
+static void worker_respawn(struct ev_loop *loop, ev_timer *w, int revents);
+
+static bool worker_spawn(worker_t *worker)
+{
+    struct ev_loop *loop = ev_default_loop(0);
+    int sv[2];
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        UNIXERR("socketpair");
+        return false;
+    }
+    if ((pid = fork()) < 0) {
+        UNIXERR("fork");
+        close(sv[0]);
+        close(sv[1]);
+        return false;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        worker_child_run(worker, sv[1]);
+    }
+    close(sv[1]);
+    worker->pid     = pid;
+    worker->started = ev_now(loop);
+    ev_io_init(&worker->channel, worker_master_serve, sv[0], EV_READ);
+    ev_io_start(loop, &worker->channel);
+    ev_child_init(&worker->child, worker_child_exited, pid, 0);
+    worker->child.data = worker;
+    ev_child_start(loop, &worker->child);
+    return true;
+}
+
+static void worker_retired_release(struct ev_loop *loop,
+                                   worker_retired_t *retired)
+{
+    worker_generation_t *generation = retired->generation;
+
+    worker_retired_forget(loop, retired);
+    p_delete(&retired);
+    if (--generation->children == 0) {
+        generation->release(generation->data);
+        p_delete(&generation);
+    }
+}
+
+static void worker_retired_exited(struct ev_loop *loop, ev_child *w,
+                                  int revents)
+{
+    worker_retired_t *retired = w->data;
+
+    if (w->rstatus != 0) {
+        warn("stopped worker (pid %d) exited with status %d", w->rpid,
+             w->rstatus);
+    }
+    worker_master_flush(retired->channel.fd);
+    worker_retired_release(loop, retired);
+}
+
+static void worker_retired_timeout(struct ev_loop *loop, ev_timer *w,
+                                   int revents)
+{
+    worker_retired_t *retired = w->data;
+
+    warn("stopped worker (pid %d) still busy after %ds, killing it",
+         retired->pid, (int)WORKER_DRAIN_TIMEOUT);
+    kill(retired->pid, SIGKILL);
+}
+
+/* Ask @p worker to exit once its queries are answered. It keeps talking to
+ * the master meanwhile.
+ */
+static void worker_retire(worker_t *worker, worker_generation_t *generation)
+{
+    struct ev_loop *loop = ev_default_loop(0);
+    worker_retired_t *retired = p_new(worker_retired_t, 1);
+
+    retired->pid = worker->pid;
+    retired->generation = generation;
+    ++generation->children;
+
+    ev_child_stop(loop, &worker->child);
+    ev_child_init(&retired->child, worker_retired_exited, worker->pid, 0);
+    retired->child.data = retired;
+    ev_child_start(loop, &retired->child);
+
+    ev_io_stop(loop, &worker->channel);
+    ev_io_init(&retired->channel, worker_master_serve, worker->channel.fd,
+               EV_READ);
+    ev_io_start(loop, &retired->channel);
+
+    ev_timer_init(&retired->timeout, worker_retired_timeout,
+                  WORKER_DRAIN_TIMEOUT, 0.);
+    retired->timeout.data = retired;
+    ev_timer_start(loop, &retired->timeout);
+
+    retired->next = _G.retired;
+    if (_G.retired != NULL) {
+        _G.retired->prev = retired;
+    }
+    _G.retired = retired;
+
+    kill(worker->pid, SIGUSR2);
+    worker->pid = 0;
+}
+
+static void worker_kill(worker_t *worker)
+{
+    struct ev_loop *loop = ev_default_loop(0);
+
+    if (ev_is_active(&worker->respawn)) {
+        ev_timer_stop(loop, &worker->respawn);
+    }
+    if (worker->pid <= 0) {
+        return;
+    }
+    ev_child_stop(loop, &worker->child);
+    if (ev_is_active(&worker->channel)) {
+        ev_io_stop(loop, &worker->channel);
+    }
+    kill(worker->pid, SIGTERM);
+    waitpid(worker->pid, NULL, 0);
+
+    /* Its last counters.
+     */
+    worker_master_flush(worker->channel.fd);
+    close(worker->channel.fd);
+    worker->pid = 0;
+}
+
+static void worker_respawn(struct ev_loop *loop, ev_timer *w, int revents)
+{
+    worker_t *worker = w->data;
+    if (!worker_spawn(worker)) {
+        ev_timer_set(w, 1., 0.);
+        ev_timer_start(loop, w);
+    }
+}
+
+static void worker_child_exited(struct ev_loop *loop, ev_child *w, int revents)
+{
+    worker_t *worker = w->data;
+
+    ev_child_stop(loop, w);
+    if (ev_is_active(&worker->channel)) {
+        ev_io_stop(loop, &worker->channel);
+    }
+    worker_master_flush(worker->channel.fd);
+    close(worker->channel.fd);
+    worker->pid = 0;
+    if (_G.stopping) {
+        return;
+    }
+
+    err("worker %d (pid %d) died with status %d, respawning", worker->id,
+        w->rpid, w->rstatus);
+
+    /* Do not spin if the worker dies at startup.
+     */
+    ev_timer_set(&worker->respawn,
+                 ev_now(loop) - worker->started < 1. ? 1. : 0., 0.);
+    ev_timer_start(loop, &worker->respawn);
+}
+
+void worker_restart(worker_release_f release, void *data)
+{
+    struct ev_loop *loop = ev_default_loop(0);
+    worker_generation_t *generation = p_new(worker_generation_t, 1);
+
+    generation->release = release;
+    generation->data    = data;
+
+    /* The reference held by this function, the generation is released
+     * at the end if no worker was running.
+     */
+    generation->children = 1;
+    for (int i = 0 ; i < _G.count ; ++i) {
+        worker_t *worker = &_G.workers[i];
+
+        if (ev_is_active(&worker->respawn)) {
+            ev_timer_stop(loop, &worker->respawn);
+        }
+        if (worker->pid > 0) {
+            worker_retire(worker, generation);
+        }
+        ev_timer_set(&worker->respawn, 0., 0.);
+        ev_timer_start(loop, &worker->respawn);
+    }
+    if (--generation->children == 0) {
+        release(data);
+        p_delete(&generation);
+    }
+}
+
+static int worker_prefork_loop(void)
+{
+    struct ev_loop *loop = ev_default_loop(0);
+
+    for (int i = 0 ; i < _G.count ; ++i) {
+        worker_t *worker = &_G.workers[i];
+        worker->id = i;
+        ev_timer_init(&worker->respawn, worker_respawn, 0., 0.);
+        worker->respawn.data = worker;
+        if (!worker_spawn(worker)) {
+            _G.stopping = true;
+            break;
+        }
+    }
+    if (!_G.stopping) {
+        notice("running %d worker processes", _G.count);
+        ev_run(loop, 0);
+    }
+    for (int i = 0 ; i < _G.count ; ++i) {
+        worker_kill(&_G.workers[i]);
+    }
+    while (_G.retired != NULL) {
+        kill(_G.retired->pid, SIGTERM);
+        waitpid(_G.retired->pid, NULL, 0);
+        worker_master_flush(_G.retired->channel.fd);
+        worker_retired_release(loop, _G.retired);
+    }
+    if (ev_is_active(&_G.stats_timer)) {
+        ev_timer_stop(loop, &_G.stats_timer);
+    }
+    worker_stats_log(&_G.stats);
+    buffer_wipe(&_G.answer);
+    return _G.stopping ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* }}} */
+/* Parallel jobs {{{ */
+
+typedef struct worker_batch_t {
+    worker_job_f job;
+    void *data;
+    int count;
+    int next;
+    bool failed;
+} worker_batch_t;
+
+static void *worker_batch_run(void *arg)
+{
+    worker_batch_t *batch = arg;
+    int job;
+
+    while ((job = __sync_fetch_and_add(&batch->next, 1)) < batch->count) {
+        if (!batch->job(batch->data, job)) {
+            batch->failed = true;
+        }
+    }
+    return NULL;
+}
+
+/* Reserve a helper thread slot, helpers are shared by nested batches.
+ */
+static bool worker_helper_reserve(void)
+{
+    if (_G.cpus == 0) {
+        _G.cpus = MAX(1, (int)sysconf(_SC_NPROCESSORS_ONLN));
+    }
+    for (;;) {
+        int helpers = _G.helpers;
+        if (helpers >= _G.cpus - 1) {
+            return false;
+        }
+        if (__sync_bool_compare_and_swap(&_G.helpers, helpers, helpers + 1)) {
+            return true;
+        }
+    }
+}
+
+bool worker_parallel(int count, worker_job_f job, void *data)
+{
+    worker_batch_t batch = {
+        .job   = job,
+        .data  = data,
+        .count = count,
+    };
+    pthread_t helpers[WORKER_MAX];
+    sigset_t all, old;
+    int started = 0;
+
+    /* Signals are left to the threads of the daemon.
+     */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    while (started < MIN(count - 1, WORKER_MAX) && worker_helper_reserve()) {
+        if (pthread_create(&helpers[started], NULL, worker_batch_run,
+                           &batch) != 0) {
+            UNIXERR("pthread_create");
+            __sync_sub_and_fetch(&_G.helpers, 1);
+            break;
+        }
+        ++started;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    worker_batch_run(&batch);
+    for (int i = 0 ; i < started ; ++i) {
+        pthread_join(helpers[i], NULL);
+    }
+    __sync_sub_and_fetch(&_G.helpers, started);
+    return !batch.failed;
+}
+
+/* }}} */
+/* Main loop {{{ */
+
+int worker_loop(conn_starter_f starter, conn_stopper_f stopper,
+                conn_runner_f runner, worker_refresh_f refresh,
+                worker_notify_f notify, void *config)
+{
+    struct ev_loop *loop = ev_default_loop(0);
+    sigset_t all, old;
+    int started = 1;
+
+    _G.starter = starter;
+    _G.stopper = stopper;
+    _G.runner  = runner;
+    _G.refresh = refresh;
+    _G.notify  = notify;
+    _G.config  = config;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Sent by the master to the worker processes it stops: blocked until
+     * they install their handler, so that it is not lost.
+     */
+    {
+        sigset_t set;
+
+        sigemptyset(&set);
+        sigaddset(&set, SIGUSR2);
+        sigprocmask(SIG_BLOCK, &set, NULL);
+    }
+    ev_signal_init(&_G.sighup, worker_signal, SIGHUP);
+    ev_signal_init(&_G.sigint, worker_signal, SIGINT);
+    ev_signal_init(&_G.sigterm, worker_signal, SIGTERM);
+    ev_signal_init(&_G.sigstats, worker_stats_signal, SIGUSR1);
+    ev_timer_init(&_G.stats_timer, worker_stats_dump, 0., 0.);
+    ev_signal_start(loop, &_G.sighup);
+    ev_signal_start(loop, &_G.sigint);
+    ev_signal_start(loop, &_G.sigterm);
+    ev_signal_start(loop, &_G.sigstats);
+
+    if (_G.prefork) {
+        return worker_prefork_loop();
+    }
+
+    /* All the workers must exist before any of them runs since they notify
+     * each other.
+     */
+    for (int i = 0 ; i < _G.count ; ++i) {
+        _G.workers[i].id   = i;
+        _G.workers[i].loop = i == 0 ? loop : ev_loop_new(EVFLAG_AUTO);
+        worker_start(&_G.workers[i]);
+    }
+    worker_self_g = &_G.workers[0];
+
+    /* Signals are only handled by the default loop.
+     */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (; started < _G.count ; ++started) {
+        worker_t *worker = &_G.workers[started];
+        if (pthread_create(&worker->thread, NULL, worker_run, worker) != 0) {
+            UNIXERR("pthread_create");
+            _G.stopping = true;
+            worker_notify_all();
+            break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    notice("running %d worker%s", started, started > 1 ? "s" : "");
+
+    if (!_G.stopping) {
+        ev_run(loop, 0);
+    }
+    for (int i = 1 ; i < started ; ++i) {
+        pthread_join(_G.workers[i].thread, NULL);
+    }
+    worker_stop(&_G.workers[0]);
+    ev_signal_stop(loop, &_G.sighup);
+    ev_signal_stop(loop, &_G.sigint);
+    ev_signal_stop(loop, &_G.sigterm);
+    ev_signal_stop(loop, &_G.sigstats);
+    array_len(_G.stats) = 0;
+    worker_stats_collect(&_G.stats);
+    worker_stats_log(&_G.stats);
+    return _G.stopping ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* }}} */
+
+static void worker_shutdown(void)
+{
+    for (int i = 0 ; i < WORKER_MAX ; ++i) {
+        if (_G.tcp_fds[i] >= 0) {
+            close(_G.tcp_fds[i]);
+        }
+    }
+    if (_G.unix_fd >= 0) {
+        close(_G.unix_fd);
+    }
+    array_wipe(_G.exits);
+    array_wipe(_G.collectors);
+    array_wipe(_G.stats);
+}
+module_exit(worker_shutdown);
+
+/* vim:set et sw=4 sts=4 sws=4: */
@@ -0,0 +1,223 @@
+/****************************************************************************/
+/*          pfixtools: a collection of postfix related tools                */
+/*          ~~~~~~~~~                                                       */
+/*  ______________________________________________________________________  */
+/*                                                                          */
+/*  Redistribution and use in source and binary forms, with or without      */
+/*  modification, are permitted provided that the following conditions      */
+/*  are met:                                                                */
+/*                                                                          */
+/*  1. Redistributions of source code must retain the above copyright       */
+/*     notice, this list of conditions and the following disclaimer.        */
+/*  2. Redistributions in binary form must reproduce the above copyright    */
+/*     notice, this list of conditions and the following disclaimer in      */
+/*     the documentation and/or other materials provided with the           */
+/*     distribution.                                                        */
+/*  3. The names of its contributors may not be used to endorse or promote  */
+/*     products derived from this software without specific prior written   */
+/*     permission.                                                          */
+/*                                                                          */
+/*  THIS SOFTWARE IS PROVIDED BY THE CONTRIBUTORS ``AS IS'' AND ANY         */
+/*  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       */
+/*  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR      */
+/*  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE CONTRIBUTORS BE LIABLE   */
+/*  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR            */
+/*  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF    */
+/*  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR         */
+/*  BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,   */
+/*  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE    */
+/*  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,       */
+/*  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                      */
+/*                                                                          */
+/*   Copyright (c) 2006-2014 the Authors                                    */
+/*   see AUTHORS and source files for details                               */
+/****************************************************************************/
+
+#ifndef PFIXTOOLS_WORKER_H
+#define PFIXTOOLS_WORKER_H
+
+#include <ev.h>
+#include "common.h"
+#include "array.h"
+#include "buffer.h"
+
+/* Event loop workers.
+ *
+ * postlicyd runs one libev loop per worker, each one in its own thread (the
+ * worker 0 runs in the main thread on the default loop). Every worker owns
+ * its own TCP listening socket (bound with SO_REUSEPORT so that the kernel
+ * balances the incoming connections), its connections and whatever
+ * per-thread state the modules keep (DNS context, scratch buffers...).
+ * The configuration and the lists are shared read-only between the workers.
+ *
+ * In prefork mode, the workers are processes instead of threads: the master
+ * process builds the configuration and forks the workers, which share the
+ * lists with the master through copy-on-write pages. The master does not
+ * handle any query, it only respawns the workers (see worker_restart() and
+ * when one of them dies) and serves the requests they send with
+ * worker_master_call(). The workers do not wait for the answers: they are
+ * handled by their loop along with the queries.
+ */
+
+#define WORKER_MAX  64
+
+typedef struct conn_t conn_t;
+
+typedef void *(*conn_starter_f)(void);
+typedef void (*conn_stopper_f)(void *data);
+typedef int (*conn_runner_f)(conn_t *conn, void *config);
+typedef bool (*worker_refresh_f)(void *config);
+typedef void (*worker_notify_f)(void *config);
+typedef void (*worker_exit_f)(void);
+typedef void (*worker_release_f)(void *data);
+typedef bool (*worker_job_f)(void *data, int job);
+typedef void (*worker_master_f)(const void *request, ssize_t len,
+                                buffer_t *answer);
+typedef void (*worker_answer_f)(void *data, const void *answer, ssize_t len);
+
+/** A counter of the daemon, see worker_stats_register(). The counters of
+ * the same group are logged on a single line.
+ */
+typedef struct worker_stat_t {
+    char group[64];
+    char name[16];
+    uint64_t value;
+
+    /* The master keeps the maximum of the values of the worker processes
+     * instead of their sum (latencies...).
+     */
+    bool max;
+} worker_stat_t;
+ARRAY(worker_stat_t);
+
+typedef void (*worker_stats_f)(A(worker_stat_t) *stats);
+
+/** Open the listening sockets.
+ * The TCP socket is opened once per worker, the unix socket is shared by all
+ * the workers. Must be called after worker_setup().
+ */
+bool worker_listen_tcp(uint16_t port);
+
+__attribute__((nonnull(1)))
+bool worker_listen_unix(const char *path);
+
+/** Set the number of workers. 0 means "one per online CPU".
+ * If @p prefork is true, the workers are processes.
+ */
+void worker_setup(int count, bool prefork);
+
+/** Run the workers until SIGINT or SIGTERM is received.
+ *
+ * @param starter builds the private data of a new connection.
+ * @param stopper releases the private data of a connection.
+ * @param runner is called when data is available on a connection, the
+ *        connection is closed if it returns a negative value.
+ * @param refresh is called in the main thread when SIGHUP is received.
+ * @param notify is called in each worker thread after worker_notify_all().
+ */
+int worker_loop(conn_starter_f starter, conn_stopper_f stopper,
+                conn_runner_f runner, worker_refresh_f refresh,
+                worker_notify_f notify, void *config);
+
+/** Run the notify callback in every worker thread (asynchronously).
+ */
+void worker_notify_all(void);
+
+/** Event loop of the current thread.
+ */
+struct ev_loop *worker_ev_loop(void);
+
+/** Time since which the events handled by the current iteration of the loop
+ * of the worker are pending. When the loop was busy, this is the time its
+ * previous poll returned: the events may have been pending since then.
+ */
+ev_tstamp worker_pending_since(void);
+
+/** Identifier of the worker running in the current thread.
+ */
+int worker_id(void);
+
+/** Number of running workers.
+ */
+int worker_count(void);
+
+/** Prefork mode.
+ */
+bool worker_is_prefork(void);
+bool worker_is_child(void);
+
+/** Fork new worker processes (from the next loop iteration) and stop the
+ * running ones: they stop accepting connections, finish their queries and
+ * exit when their connections are idle. @p release is called with @p data
+ * once they all exited. This can only be called from the master in prefork
+ * mode.
+ */
+__attribute__((nonnull(1)))
+void worker_restart(worker_release_f release, void *data);
+
+/** Register the handler of the requests sent by the workers to the master.
+ */
+__attribute__((nonnull(1)))
+void worker_master_register(worker_master_f handler);
+
+/** Send a request to the master without waiting for its answer.
+ * @p answer is called with @p data from the loop of the worker when the
+ * answer is received, or with a NULL answer and a negative length if the
+ * master does not answer within a few seconds. @p answer may be NULL if the
+ * answer is not needed.
+ * Returns the identifier of the request, 0 if it cannot be sent (@p answer
+ * is not called then).
+ * This can only be called from a worker in prefork mode.
+ */
+__attribute__((nonnull(1)))
+uint32_t worker_master_call(const void *request, ssize_t len,
+                            worker_answer_f answer, void *data);
+
+/** Forget a request sent with worker_master_call(): its answer callback is
+ * not called. Returns the data of the request, NULL if it is not pending.
+ */
+void *worker_master_forget(uint32_t request);
+
+/** Register a cleanup function called at the end of each worker thread.
+ * Modules with per-thread state use this to release it, the main thread is
+ * cleaned up by the module_exit functions.
+ */
+__attribute__((nonnull(1)))
+void worker_atexit(worker_exit_f handler);
+
+/** Register a function that adds the counters of a module to @p stats with
+ * worker_stat_add(). The counters are logged when the daemon receives
+ * SIGUSR1 and when it exits. In prefork mode, the worker processes send
+ * their counters to the master, which sums them: the counts of the worker
+ * processes that exited are kept.
+ */
+__attribute__((nonnull(1)))
+void worker_stats_register(worker_stats_f collect);
+
+__attribute__((nonnull(1,2,3)))
+void worker_stat_add(A(worker_stat_t) *stats, const char *group,
+                     const char *name, uint64_t value, bool max);
+
+/** Run @p count independent jobs, using helper threads on the idle CPUs.
+ * The calling thread takes part in the work, so calls can be nested: the
+ * total number of helper threads is bounded by the number of online CPUs.
+ * Returns false if one of the jobs failed.
+ */
+__attribute__((nonnull(2)))
+bool worker_parallel(int count, worker_job_f job, void *data);
+
+/* Connections.
+ */
+int conn_read(conn_t *conn);
+void conn_io_none(conn_t *conn);
+void conn_io_ro(conn_t *conn);
+void conn_io_wo(conn_t *conn);
+void conn_io_rw(conn_t *conn);
+void conn_release(conn_t *conn);
+void *conn_data(conn_t *conn);
+buffer_t *conn_input_buffer(conn_t *conn);
+buffer_t *conn_output_buffer(conn_t *conn);
+
+#endif
+
+/* vim:set et sw=4 sts=4 sws=4: */
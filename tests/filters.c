@@ -35,6 +35,7 @@
 
 #include <common/str.h>
 #include <postlicyd/config.h>
+#include <postlicyd/worker.h>
 #include <common/file.h>
 #include <dirent.h>
 
@@ -234,6 +235,243 @@ static bool run_ratetest(const config_t *config, const char *basepath)
     return ok;
 }
 
+static bool run_memotest(const config_t *config, const char *basepath)
+{
+    char buff_q1[BUFSIZ];
+    char buff_q2[BUFSIZ];
+    char buff_q3[BUFSIZ];
+    query_t q1;
+    query_t q2;
+    query_t q3;
+    bool ok = true;
+
+    filter_t *match4;
+    filter_t *match5;
+
+#define QUERY(Q)                                                               \
+    if (read_query(basepath, "greylist_" STR(Q), buff_##Q, NULL, &Q) == NULL) {    \
+        return false;                                                          \
+    }
+    QUERY(q1);
+    QUERY(q2);
+    QUERY(q3);
+#undef QUERY
+
+#define FILTER(F)                                                              \
+    do {                                                                       \
+      int __p = filter_find_with_name(&config->filters, STR(F));               \
+      if (__p < 0) {                                                           \
+          return false;                                                        \
+      }                                                                        \
+      F = array_ptr(config->filters, __p);                                     \
+    } while (0)
+    FILTER(match4);
+    FILTER(match5);
+#undef FILTER
+
+    filter_context_t context;
+    filter_context_prepare(&context, NULL);
+
+    /* match4 only reads the sender and the recipient: q3 differs from q1 by
+     * its client address and reuses its result, q2 has other addresses.
+     */
+    filter_set_explanation(&context, "previous", -1);
+    TEST("first", filter_run(match4, &q1, &context)->type == HTK_FAIL);
+    TEST("explanation_kept", context.explanation.str != NULL
+                             && strcmp(context.explanation.str,
+                                       "previous") == 0);
+    foreach (memo, context.memos) {
+        if (memo->filter == match4) {
+            memo->result = HTK_MATCH;
+        }
+    }
+    TEST("reused", filter_run(match4, &q3, &context)->type == HTK_MATCH);
+    TEST("other_fields", filter_run(match4, &q2, &context)->type == HTK_FAIL);
+
+    /* match5 also refers to ${request} that is not a field of the query.
+     */
+    TEST("not_a_field", filter_run(match5, &q1, &context)->type == HTK_MATCH);
+    TEST("not_a_field_reused",
+         filter_run(match5, &q3, &context)->type == HTK_MATCH);
+
+    filter_context_wipe(&context);
+    return ok;
+}
+
+static bool run_paralleltest(const config_t *config, const char *basepath)
+{
+    char buff[BUFSIZ];
+    query_t query;
+    bool ok = true;
+
+    filter_t *parallel1;
+    filter_t *match1;
+    filter_t *match2;
+    filter_t *match3;
+
+    if (read_query(basepath, "testcase_1", buff, NULL, &query) == NULL) {
+        return false;
+    }
+
+#define FILTER(F)                                                              \
+    do {                                                                       \
+      int __p = filter_find_with_name(&config->filters, STR(F));               \
+      if (__p < 0) {                                                           \
+          return false;                                                        \
+      }                                                                        \
+      F = array_ptr(config->filters, __p);                                     \
+    } while (0)
+    FILTER(parallel1);
+    FILTER(match1);
+    FILTER(match2);
+    FILTER(match3);
+#undef FILTER
+
+    filter_context_t context;
+    filter_context_prepare(&context, NULL);
+
+    /* match1 and match3 match, match2 fails: the score is 1 + 4, the hook
+     * of the soft_match of parallel1 is followed, not the ones of the
+     * children. The results of the children are kept in the memos of the
+     * query.
+     */
+    const filter_hook_t *hook = filter_run(parallel1, &query, &context);
+    TEST("combined", hook != NULL && hook->type == HTK_SOFT_MATCH);
+    TEST("hook", hook != NULL && hook->postfix
+                 && strcmp(hook->value, "DUNNO") == 0);
+
+#define CHILD(F, Result)                                                       \
+    do {                                                                       \
+      bool __run = false;                                                      \
+      foreach (memo, context.memos) {                                          \
+          if (memo->filter == F) {                                             \
+              __run = memo->result == Result;                                  \
+          }                                                                    \
+      }                                                                        \
+      TEST(STR(F), __run);                                                     \
+    } while (0)
+    CHILD(match1, HTK_MATCH);
+    CHILD(match2, HTK_FAIL);
+    CHILD(match3, HTK_MATCH);
+#undef CHILD
+
+    filter_context_wipe(&context);
+    return ok;
+}
+
+static int deadline_answers;
+
+static void deadline_async_handler(filter_context_t *context,
+                                   const filter_hook_t *hook)
+{
+    ++deadline_answers;
+}
+
+typedef struct deadline_t {
+    const config_t *config;
+    filter_context_t *context;
+    const char *action;
+    bool expired;
+} deadline_t;
+
+/* Reach the deadline of the query as postlicyd does.
+ */
+static void deadline_reached(struct ev_loop *loop, ev_timer *timer,
+                             int revents)
+{
+    deadline_t *deadline = timer->data;
+
+    deadline->action = config_query_deadline(deadline->config,
+                                             deadline->context,
+                                             &deadline->expired);
+    ev_break(loop, EVBREAK_ALL);
+}
+
+static bool run_deadlinetest(const config_t *config, const char *basepath)
+{
+    char buff[BUFSIZ];
+    query_t query;
+    bool ok = true;
+
+    filter_t *hang1;
+    filter_t *match1;
+    struct ev_loop *loop = ev_default_loop(0);
+    const char *fallback = "DEFER_IF_PERMIT query timeout";
+    int waited;
+
+    if (read_query(basepath, "testcase_1", buff, NULL, &query) == NULL) {
+        return false;
+    }
+    int pos = filter_find_with_name(&config->filters, "hang1");
+    if (pos < 0 || config->query_deadline_ms <= 0) {
+        return false;
+    }
+    hang1 = array_ptr(config->filters, pos);
+    pos = filter_find_with_name(&config->filters, "match1");
+    if (pos < 0 || config->query_shed_latency_ms <= 0) {
+        return false;
+    }
+    match1 = array_ptr(config->filters, pos);
+
+    filter_context_t context;
+    filter_context_prepare(&context, NULL);
+    filter_async_handler_register(deadline_async_handler);
+
+    /* hang1 answers after 1s, the deadline is reached before.
+     */
+    deadline_t reached = { config, &context, NULL, false };
+    ev_timer deadline;
+    ev_timer_init(&deadline, deadline_reached,
+                  config->query_deadline_ms / 1000., 0.);
+    deadline.data = &reached;
+
+    const ev_tstamp start = ev_time();
+    TEST("async", filter_run(hang1, &query, &context)->async);
+    TEST("running", context.current_filter == hang1);
+    ev_timer_start(loop, &deadline);
+    ev_run(loop, 0);
+
+    const ev_tstamp elapsed = ev_time() - start;
+    TEST("reached", elapsed >= config->query_deadline_ms / 1000. - 0.005
+                    && elapsed < 1.);
+    TEST("canceled", context.current_filter == NULL && !reached.expired);
+    TEST("fallback", reached.action != NULL
+                     && strcmp(reached.action, fallback) == 0);
+
+    /* The canceled filter does not answer.
+     */
+    ev_run(loop, 0);
+    TEST("no_answer", deadline_answers == 0);
+
+    /* No filter is running, the query was already answered.
+     */
+    TEST("answered", config_query_deadline(config, &context,
+                                           &reached.expired) == NULL);
+
+    /* A match filter cannot be canceled: the query gets the fallback
+     * answer, the result of the filter is still expected.
+     */
+    context.current_filter = match1;
+    reached.action = config_query_deadline(config, &context,
+                                           &reached.expired);
+    TEST("expired", reached.expired && context.current_filter == match1);
+    TEST("expired_fallback", reached.action != NULL
+                             && strcmp(reached.action, fallback) == 0);
+    context.current_filter = NULL;
+
+    /* Out of a worker, the queries are pending since the last iteration of
+     * the loop: they are shed once the loop stayed busy for too long.
+     */
+    ev_now_update(loop);
+    TEST("not_shed", config_query_shed(config, &waited) == NULL);
+    usleep((config->query_shed_latency_ms + 10) * 1000);
+    const char *shed = config_query_shed(config, &waited);
+    TEST("shed", shed != NULL && strcmp(shed, fallback) == 0
+                 && waited >= config->query_shed_latency_ms);
+
+    filter_context_wipe(&context);
+    return ok;
+}
 
 int main(int argc, char *argv[])
 {
@@ -296,6 +534,15 @@ int main(int argc, char *argv[])
     /* Test rate control */
     RUN("rate", ratetest);
 
+    /* Test the reuse of the results of the filters */
+    RUN("memo", memotest);
+
+    /* Test the combination of the results of the children */
+    RUN("parallel", paralleltest);
+
+    /* Test the deadline of the queries */
+    RUN("deadline", deadlinetest);
+
 
 #undef RUN
     return 0;
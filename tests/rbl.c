@@ -40,19 +40,326 @@
 #include <common/common.h>
 #include <postlicyd/iplist.h>
 #include <common/array.h>
+#include <arpa/inet.h>
+
+/* Layout of the ip lists up to postlicyd 0.9: one growable array per /16,
+ * kept here as the reference for the memory report and the benchmark.
+ */
+typedef struct legacy_rbl_t {
+    A(uint16_t) ips[1 << 16];
+} legacy_rbl_t;
+
+static legacy_rbl_t *legacy_create(const char *file)
+{
+    legacy_rbl_t *rbl;
+    unsigned a, b, c, d;
+    char line[BUFSIZ];
+    FILE *f = fopen(file, "r");
+
+    if (f == NULL) {
+        return NULL;
+    }
+    rbl = p_new(legacy_rbl_t, 1);
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%u.%u.%u.%u", &a, &b, &c, &d) == 4
+            && a < 256 && b < 256 && c < 256 && d < 256) {
+            array_add(rbl->ips[(a << 8) | b], (c << 8) | d);
+        }
+    }
+    fclose(f);
+    for (int i = 0 ; i < 1 << 16 ; ++i) {
+        array_adjust(rbl->ips[i]);
+        if (rbl->ips[i].len) {
+#       define QSORT_TYPE uint16_t
+#       define QSORT_BASE rbl->ips[i].data
+#       define QSORT_NELT rbl->ips[i].len
+#       define QSORT_LT(a,b) *a < *b
+#       include <common/qsort.c>
+        }
+    }
+    return rbl;
+}
+
+static void legacy_delete(legacy_rbl_t **rbl)
+{
+    for (int i = 0 ; i < 1 << 16 ; ++i) {
+        array_wipe((*rbl)->ips[i]);
+    }
+    p_delete(rbl);
+}
+
+/* Without the overhead of malloc (at least 16 bytes per allocation).
+ */
+static size_t legacy_memory(const legacy_rbl_t *rbl, int *allocs)
+{
+    size_t size = sizeof(legacy_rbl_t);
+    *allocs = 0;
+    for (int i = 0 ; i < 1 << 16 ; ++i) {
+        size += rbl->ips[i].size * sizeof(uint16_t);
+        *allocs += rbl->ips[i].size > 0;
+    }
+    return size;
+}
+
+static bool legacy_lookup(const legacy_rbl_t *rbl, uint32_t ip)
+{
+    const uint16_t hip = ip >> 16;
+    const uint16_t lip = ip & 0xffff;
+    int l = 0, r = rbl->ips[hip].len;
+
+    while (l < r) {
+        int i = (r + l) / 2;
+
+        if (array_elt(rbl->ips[hip], i) == lip)
+            return true;
+
+        if (lip < array_elt(rbl->ips[hip], i)) {
+            r = i;
+        } else {
+            l = i + 1;
+        }
+    }
+    return false;
+}
+
+static double elapsed(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec)
+         + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+#define PROBES      (1 << 20)
+#define ITERATIONS  64
+
+typedef struct ip_check_t {
+    const char *ip;
+    bool        hit;
+} ip_check_t;
+
+/* Bounds of the networks of data/test_ip_3.
+ */
+static const ip_check_t ipv4_checks[] = {
+    { "9.255.255.255",   false }, { "10.0.0.0",        true  },
+    { "10.255.255.255",  true  }, { "11.0.0.0",        false },
+    { "192.168.9.255",   false }, { "192.168.10.0",    true  },
+    { "192.168.11.255",  true  }, { "192.168.12.0",    false },
+    { "172.16.5.9",      false }, { "172.16.5.10",     true  },
+    { "172.16.5.20",     true  }, { "172.16.5.21",     false },
+    { "172.16.6.249",    false }, { "172.16.6.250",    true  },
+    { "172.16.6.255",    true  }, { "172.16.7.0",      false },
+    { "100.64.0.255",    false }, { "100.64.1.0",      true  },
+    { "100.64.1.255",    true  }, { "100.64.2.0",      false },
+    { "100.64.255.255",  false }, { "100.65.0.0",      true  },
+    { "100.65.255.255",  true  }, { "100.66.0.0",      false },
+    { "8.8.8.7",         false }, { "8.8.8.8",         true  },
+    { "8.8.8.9",         false }, { "8.8.8.10",        true  },
+    { "8.8.8.11",        false }, { "255.255.254.255", false },
+    { "255.255.255.0",   true  }, { "255.255.255.255", true  },
+    { "19.255.255.255",  false }, { "20.0.0.0",        true  },
+    { "20.0.0.255",      true  }, { "20.0.1.0",        true  },
+    { "20.0.1.255",      true  }, { "20.0.2.0",        false },
+    { "0.0.0.0",         false }, { NULL,              false },
+};
+
+/* Bounds of the prefixes of data/test_ip_4.
+ */
+static const ip_check_t ipv6_checks[] = {
+    { "2001:db8:0:ffff:ffff:ffff:ffff:ffff",  false },
+    { "2001:db8:1::",                         true  },
+    { "2001:db8:1:ffff:ffff:ffff:ffff:ffff",  true  },
+    { "2001:db8:2::",                         false },
+    { "2001:db8:2:2:ffff:ffff:ffff:ffff",     false },
+    { "2001:db8:2:3::",                       true  },
+    { "2001:db8:2:3:ffff:ffff:ffff:ffff",     true  },
+    { "2001:db8:2:4::",                       false },
+    { "2001:db8:4::4",                        false },
+    { "2001:db8:4::5",                        true  },
+    { "2001:db8:4::6",                        false },
+    { "2001:db8:4::7",                        true  },
+    { "2001:db8:4::8",                        false },
+    { "2001:db9:7fff:ffff:ffff:ffff:ffff:ffff", false },
+    { "2001:db9:8000::",                      true  },
+    { "2001:db9:ffff:ffff:ffff:ffff:ffff:ffff", true  },
+    { "2001:dba::",                           false },
+    { "::",                                   false },
+    { NULL,                                   false },
+};
+
+static bool check_ipv4(const rbldb_t *db, const char *file)
+{
+    bool ok = true;
+
+    for (const ip_check_t *check = ipv4_checks ; check->ip ; ++check) {
+        struct in_addr addr;
+        bool hit;
+
+        inet_pton(AF_INET, check->ip, &addr);
+        hit = rbldb_ipv4_lookup(db, ntohl(addr.s_addr));
+        if (hit != check->hit) {
+            printf("%s: %s %s\n", file, check->ip,
+                   hit ? "found" : "not found");
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+static bool check_ipv6(const rbldb_t *db, const char *file)
+{
+    bool ok = true;
+
+    for (const ip_check_t *check = ipv6_checks ; check->ip ; ++check) {
+        uint8_t addr[16];
+        bool hit;
+
+        inet_pton(AF_INET6, check->ip, addr);
+        hit = rbldb_ipv6_lookup(db, addr);
+        if (hit != check->hit) {
+            printf("%s: %s %s\n", file, check->ip,
+                   hit ? "found" : "not found");
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+/* Check the lookups of a list of the data directory, parsed and compiled.
+ */
+static bool check_list(const char *basepath, const char *name,
+                       bool (*check)(const rbldb_t *, const char *))
+{
+    char path[FILENAME_MAX];
+    char image[FILENAME_MAX];
+    rbldb_t *db;
+    bool ok;
+
+    snprintf(path, FILENAME_MAX, "%s%s", basepath, name);
+    snprintf(image, FILENAME_MAX, "%s%s.img", basepath, name);
+    db = rbldb_create(path, false);
+    if (db == NULL) {
+        return false;
+    }
+    ok = check(db, path);
+    rbldb_delete(&db);
+
+    if (!rbldb_compile(path, image)
+        || (db = rbldb_create(image, false)) == NULL) {
+        return false;
+    }
+    ok = check(db, image) && ok;
+    rbldb_delete(&db);
+    unlink(image);
+    return ok;
+}
 
 int main(int argc, char *argv[])
 {
+    if (argc == 1) {
+        char basepath[FILENAME_MAX];
+        const char *p = strrchr(argv[0], '/');
+        bool ok;
+
+        p = p == NULL ? argv[0] : p + 1;
+        snprintf(basepath, FILENAME_MAX, "%.*sdata/", (int)(p - argv[0]),
+                 argv[0]);
+        ok = check_list(basepath, "test_ip_3", check_ipv4);
+        ok = check_list(basepath, "test_ip_4", check_ipv6) && ok;
+        printf("%s\n", ok ? "SUCCESS" : "FAILED");
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
     if (argc > 1) {
         rbldb_t *db = rbldb_create(argv[1], false);
-        printf("loaded: %s, %d ips, %d o\n", argv[1], rbldb_stats(db),
-               rbldb_stats(db) * 2 + 65536 * (int) sizeof(A(uint16_t)));
+        legacy_rbl_t *legacy = legacy_create(argv[1]);
+        uint32_t *probes = p_new(uint32_t, PROBES);
+        uint32_t seed = 42, hits = 0, legacy_hits = 0;
+        struct timespec start;
+        size_t legacy_size;
+        uint32_t ipv4, ipv6;
+        int allocs;
+
+        if (db == NULL || legacy == NULL) {
+            return EXIT_FAILURE;
+        }
+        legacy_size = legacy_memory(legacy, &allocs);
+        rbldb_stats(db, &ipv4, &ipv6);
+        printf("loaded: %s, %u ipv4, %u ipv6\n", argv[1], ipv4, ipv6);
+        printf("memory: %zu o (csr), %zu o in %d allocations (legacy)\n",
+               rbldb_memory(db), legacy_size, allocs + 1);
+
+        /* Half of the probes are entries of the list, half are random
+         * addresses, in a random order.
+         */
+        for (int i = 0 ; i < PROBES ; ++i) {
+            seed = seed * 1103515245 + 12345;
+            probes[i] = seed ^ (seed >> 16);
+            if (i & 1) {
+                const uint16_t hip = probes[i] >> 16;
+                if (legacy->ips[hip].len) {
+                    probes[i] = (hip << 16)
+                              | array_elt(legacy->ips[hip],
+                                          seed % legacy->ips[hip].len);
+                }
+            }
+            /* The legacy layout ignores the networks of the list.
+             */
+            if (legacy_lookup(legacy, probes[i])
+                && !rbldb_ipv4_lookup(db, probes[i])) {
+                printf("lookup mismatch for %08x\n", probes[i]);
+                return EXIT_FAILURE;
+            }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int j = 0 ; j < ITERATIONS ; ++j) {
+            for (int i = 0 ; i < PROBES ; ++i) {
+                hits += rbldb_ipv4_lookup(db, probes[i]);
+            }
+        }
+        printf("csr:    %.0f lookups per second\n",
+               (double)PROBES * ITERATIONS / elapsed(&start));
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int j = 0 ; j < ITERATIONS ; ++j) {
+            for (int i = 0 ; i < PROBES ; ++i) {
+                legacy_hits += legacy_lookup(legacy, probes[i]);
+            }
+        }
+        printf("legacy: %.0f lookups per second\n",
+               (double)PROBES * ITERATIONS / elapsed(&start));
+        printf("hits: %u (csr), %u (legacy)\n", hits, legacy_hits);
+        p_delete(&probes);
+        legacy_delete(&legacy);
+
+        /* With a second argument, compile the list into that image and check
+         * the image gives the same answers.
+         */
+        if (argc > 2) {
+            if (!rbldb_compile(argv[1], argv[2])) {
+                return EXIT_FAILURE;
+            }
+            rbldb_t *img = rbldb_create(argv[2], false);
+            uint32_t img_ipv4 = 0, img_ipv6 = 0;
 
-        time_t now = time(NULL);
-        for (uint32_t i = 0 ; i < 1000000000 ; ++i) {
-            rbldb_ipv4_lookup(db, (88 << 24) | (170 << 16) | (239 << 8) | (132));
+            if (img != NULL) {
+                rbldb_stats(img, &img_ipv4, &img_ipv6);
+            }
+            if (img == NULL || img_ipv4 != ipv4 || img_ipv6 != ipv6) {
+                printf("image %s does not match %s\n", argv[2], argv[1]);
+                return EXIT_FAILURE;
+            }
+            for (uint32_t ip = 0 ; ip < 1u << 24 ; ++ip) {
+                const uint32_t probe = ip * 257;
+                if (rbldb_ipv4_lookup(img, probe)
+                    != rbldb_ipv4_lookup(db, probe)) {
+                    printf("image %s does not match %s\n", argv[2], argv[1]);
+                    return EXIT_FAILURE;
+                }
+            }
+            printf("image %s matches %s\n", argv[2], argv[1]);
+            rbldb_delete(&img);
         }
-        printf("%ld request per second\n", 1000000000 / (time(NULL) - now));
         rbldb_delete(&db);
     }
     return 0;
@@ -35,9 +35,13 @@
 
 #include <time.h>
 #include <sys/time.h>
+#include <pcre.h>
 #include "file.h"
 #include "array.h"
 #include "regexp.h"
+#include <postlicyd/regexpset.h>
+
+#define NELEMS(t)  (sizeof(t) / sizeof((t)[0]))
 
 static regexp_t *create_regex_from_file(const char *file)
 {
@@ -91,6 +95,235 @@ static regexp_t *create_regex_from_file(const char *file)
     return re;
 }
 
+/* Compile each line of @p file both alone and in @p set, with the same
+ * escaping as create_regex_from_file.
+ */
+static bool create_regexps_from_file(const char *file, A(regexp_t) *res,
+                                     regexp_set_t *set)
+{
+    buffer_t pattern = ARRAY_INIT;
+    file_map_t map;
+    const char *p, *end;
+
+    if (!file_map_open(&map, file, false)) {
+        return false;
+    }
+    p   = map.map;
+    end = map.end;
+    while (p < end && p != NULL) {
+        const char *eol = (char *)memchr(p, '\n', end - p);
+        if (eol == NULL) {
+            eol = end;
+        }
+        buffer_reset(&pattern);
+        buffer_addch(&pattern, '^');
+        for (const char *s = p ; s < eol ; ++s) {
+            if (*s == '.') {
+                buffer_addstr(&pattern, "\\.");
+            } else {
+                buffer_addch(&pattern, *s);
+            }
+        }
+        buffer_addch(&pattern, '$');
+        p = eol + 1;
+
+        clstr_t str = { pattern.data, pattern.len };
+        regexp_t re;
+        p_clear(&re, 1);
+        if (!regexp_compile_str(&re, &str, false)
+            || regexp_set_add(set, &str, false) != res->len) {
+            regexp_wipe(&re);
+            buffer_wipe(&pattern);
+            file_map_close(&map);
+            return false;
+        }
+        array_add(*res, re);
+    }
+    buffer_wipe(&pattern);
+    file_map_close(&map);
+    return regexp_set_compile(set);
+}
+
+static double elapsed(const struct timeval *start)
+{
+    struct timeval end;
+
+    gettimeofday(&end, NULL);
+    return (end.tv_sec - start->tv_sec)
+         + (double)(end.tv_usec - start->tv_usec) / 1e6;
+}
+
+/* Match the strings of @p strs against the regexps of @p file one by one and
+ * with a regexp set, and check that they give the same results.
+ */
+static bool bench_regexp_set(const char *file, char **strs, int count)
+{
+    const uint32_t how_many = 1000;
+    A(regexp_t) res = ARRAY_INIT;
+    A(uint64_t) matches = ARRAY_INIT;
+    regexp_set_t *set = regexp_set_new();
+    struct timeval start;
+    uint32_t found_alone = 0, found_set = 0;
+    double alone, combined;
+    bool ok = true;
+
+    if (!create_regexps_from_file(file, &res, set)) {
+        array_deep_wipe(res, regexp_wipe);
+        regexp_set_delete(&set);
+        return false;
+    }
+    array_ensure_exact_capacity(matches, REGEXP_SET_WORDS(res.len));
+
+    for (int i = 0 ; i < count ; ++i) {
+        clstr_t str = { strs[i], strlen(strs[i]) };
+
+        regexp_set_match(set, &str, array_start(matches));
+        for (int j = 0 ; j < res.len ; ++j) {
+            bool alone_match = regexp_match_str(array_ptr(res, j), &str);
+            bool set_match = array_elt(matches, j / 64) & (1ULL << (j % 64));
+
+            if (alone_match != set_match) {
+                printf("%s: regexp %d %s alone, %s in the set: FAILED\n",
+                       strs[i], j, alone_match ? "matches" : "does not match",
+                       set_match ? "matches" : "does not match");
+                ok = false;
+            }
+        }
+    }
+
+    gettimeofday(&start, NULL);
+    for (uint32_t i = 0 ; i < how_many ; ++i) {
+        clstr_t str = { strs[i % count], strlen(strs[i % count]) };
+
+        foreach (re, res) {
+            found_alone += regexp_match_str(re, &str);
+        }
+    }
+    alone = elapsed(&start);
+
+    gettimeofday(&start, NULL);
+    for (uint32_t i = 0 ; i < how_many ; ++i) {
+        clstr_t str = { strs[i % count], strlen(strs[i % count]) };
+
+        found_set += regexp_set_match(set, &str, array_start(matches));
+    }
+    combined = elapsed(&start);
+
+    printf("%d regexps: %u lookups per second one by one, "
+           "%u with a regexp set\n", res.len, (int)(how_many / alone),
+           (int)(how_many / combined));
+    if (found_alone != found_set) {
+        printf("%u matches one by one, %u with a regexp set: FAILED\n",
+               found_alone, found_set);
+        ok = false;
+    }
+    array_deep_wipe(res, regexp_wipe);
+    array_wipe(matches);
+    regexp_set_delete(&set);
+    return ok;
+}
+
+/* Check the matches of a regexp set against the matches of its patterns
+ * compiled alone. The patterns mix groups, options, alternations and
+ * lookarounds, and the backtracking of (?:a|aa)+b exceeds the match limit on
+ * the long strings of a, aborting the scan of the whole set.
+ */
+static bool check_regexp_set(void)
+{
+    static const struct {
+        const char *pattern;
+        bool cs;
+    } patterns[] = {
+        { "^a\\.b$", false },
+        { "^(mail|smtp)\\d*\\.example\\.(com|net)$", false },
+        { "(?i)^mx[0-9]+\\.", true },
+        { "^a(b|c)d", true },
+        { "foo(?=bar)", true },
+        { "(?<!www\\.)example\\.org$", true },
+        { "^(?:[a-z]+-)+[a-z]+$", true },
+        { "(?:a|aa)+b", true },
+        { "a$", true },
+        { "^[0-9]{1,3}(\\.[0-9]{1,3}){3}$", true },
+        { "(?i:ExAmPlE)\\.(?!org)", true },
+    };
+    static const char *strs[] = {
+        "a.b", "A.B", "a-b", "mail12.example.net", "SMTP.Example.COM",
+        "mail.example.org", "www.example.org", "MX10.example.com", "mx.host",
+        "abd", "acd", "aed", "foobar", "foobaz", "a-b-c-d", "-a-b", "a-b-",
+        "192.168.0.1", "192.168.0", "aab",
+        "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa",
+        "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaab",
+    };
+    const int count = (int)NELEMS(patterns);
+    pcre *res[NELEMS(patterns)];
+    uint64_t matches[REGEXP_SET_WORDS(NELEMS(patterns))];
+    regexp_set_t *set = regexp_set_new();
+    bool ok = true;
+    bool built;
+    int compiled;
+
+    for (compiled = 0 ; compiled < count ; ++compiled) {
+        const int i = compiled;
+        clstr_t pattern = { patterns[i].pattern, strlen(patterns[i].pattern) };
+        const char *error;
+        int erroffset;
+
+        res[i] = pcre_compile(patterns[i].pattern,
+                              patterns[i].cs ? 0 : PCRE_CASELESS,
+                              &error, &erroffset, NULL);
+        if (res[i] == NULL) {
+            printf("%s: invalid regexp (%s): FAILED\n", patterns[i].pattern,
+                   error);
+            ok = false;
+            break;
+        }
+        if (regexp_set_add(set, &pattern, patterns[i].cs) != i) {
+            printf("%s: cannot add the regexp to the set: FAILED\n",
+                   patterns[i].pattern);
+            pcre_free(res[i]);
+            ok = false;
+            break;
+        }
+    }
+    if (ok && !regexp_set_compile(set)) {
+        printf("cannot compile the regexp set: FAILED\n");
+        ok = false;
+    }
+    built = ok;
+
+    /* Twice, the scans that failed the first time are retried. */
+    for (int round = 0 ; built && round < 2 ; ++round) {
+        for (int i = 0 ; i < (int)NELEMS(strs) ; ++i) {
+            clstr_t str = { strs[i], strlen(strs[i]) };
+            int found = 0;
+
+            regexp_set_match(set, &str, matches);
+            for (int j = 0 ; j < count ; ++j) {
+                bool alone_match = pcre_exec(res[j], NULL, str.str, str.len,
+                                             0, 0, NULL, 0) >= 0;
+                bool set_match = matches[j / 64] & (1ULL << (j % 64));
+
+                if (alone_match != set_match) {
+                    printf("%s: %s %s alone, %s in the set: FAILED\n",
+                           strs[i], patterns[j].pattern,
+                           alone_match ? "matches" : "does not match",
+                           set_match ? "matches" : "does not match");
+                    ok = false;
+                }
+                found += alone_match;
+            }
+            if (round == 0) {
+                printf("%s: %d regexps match\n", strs[i], found);
+            }
+        }
+    }
+    for (int i = 0 ; i < compiled ; ++i) {
+        pcre_free(res[i]);
+    }
+    regexp_set_delete(&set);
+    return ok;
+}
+
 static bool check_parse(const char *str, const char *prefix, const char *suffix,
                         const char *wildcard, bool cs) {
     buffer_t reprefix = ARRAY_INIT;
@@ -158,6 +391,12 @@ int main(int argc, char *argv[])
     CHECK("/^mail\\d+\\.telekom\\.de$/", "mail", NULL, "^\\d+\\.telekom\\.de$", true);
     CHECK("/\\dmachin$/", NULL, "machin", "\\d$", true);
 
+    /* Regexp sets
+     */
+    if (!check_regexp_set()) {
+        return -1;
+    }
+
     /* Perf test
      */
     if (argc > 1) {
@@ -178,6 +417,10 @@ int main(int argc, char *argv[])
             printf("%u lookups per second\n", (int)(how_many / diff));
         }
         regexp_delete(&re);
+
+        if (argc > 2 && !bench_regexp_set(argv[1], argv + 2, argc - 2)) {
+            return -1;
+        }
     }
     return 0;
 }
@@ -44,7 +44,7 @@
  * !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!! */
 
 #include <postlicyd/spf.h>
-#include "server.h"
+#include <postlicyd/worker.h>
 
 typedef struct spf_test_t {
     const char* testid;
@@ -279,7 +279,9 @@ static void spf_test_done(spf_code_t code, const char* explanation, void* data)
     spf_test_next(current);
 }
 
-static void exit_cb(void* arg)
+static ev_timer exit_timer;
+
+static void exit_cb(struct ev_loop *loop, ev_timer *timer, int revents)
 {
     exit(0);
 }
@@ -294,7 +296,8 @@ static void spf_test_next(spf_test_t *current)
         }
         if (current->testid == NULL) {
             fprintf(stderr, "DONE: %d tests %d success (%d%%)\n", tested, passed, (passed * 100) / tested);
-            start_timer(2000, exit_cb, NULL);
+            ev_timer_init(&exit_timer, exit_cb, 2., 0.);
+            ev_timer_start(worker_ev_loop(), &exit_timer);
             return;
         }
     } while (to_run != NULL && strcmp(to_run, current->testid) != 0);
@@ -326,7 +329,7 @@ int main(int argc, char *argv[])
 
     dns_use_local_conf("resolv.conf");
     spf_test_next(NULL);
-    return server_loop(NULL, NULL, NULL, NULL, NULL);
+    return ev_run(worker_ev_loop(), 0);
 }
 
 /* vim:set et sw=4 sts=4 sws=4: */
@@ -0,0 +1,493 @@
+/****************************************************************************/
+/*          pfixtools: a collection of postfix related tools                */
+/*          ~~~~~~~~~                                                       */
+/*  ______________________________________________________________________  */
+/*                                                                          */
+/*  Redistribution and use in source and binary forms, with or without      */
+/*  modification, are permitted provided that the following conditions      */
+/*  are met:                                                                */
+/*                                                                          */
+/*  1. Redistributions of source code must retain the above copyright       */
+/*     notice, this list of conditions and the following disclaimer.        */
+/*  2. Redistributions in binary form must reproduce the above copyright    */
+/*     notice, this list of conditions and the following disclaimer in      */
+/*     the documentation and/or other materials provided with the           */
+/*     distribution.                                                        */
+/*  3. The names of its contributors may not be used to endorse or promote  */
+/*     products derived from this software without specific prior written   */
+/*     permission.                                                          */
+/*                                                                          */
+/*  THIS SOFTWARE IS PROVIDED BY THE CONTRIBUTORS ``AS IS'' AND ANY         */
+/*  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       */
+/*  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR      */
+/*  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE CONTRIBUTORS BE LIABLE   */
+/*  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR            */
+/*  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF    */
+/*  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR         */
+/*  BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,   */
+/*  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE    */
+/*  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,       */
+/*  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                      */
+/*                                                                          */
+/*   Copyright (c) 2006-2014 the Authors                                    */
+/*   see AUTHORS and source files for details                               */
+/****************************************************************************/
+
+#include <common/common.h>
+#include <common/buffer.h>
+#include <common/file.h>
+#include <postlicyd/strlist.h>
+
+#define NELEMS(t)  (sizeof(t) / sizeof((t)[0]))
+
+/* Host names that look like the ones of a rhsbl: random names under a few
+ * hundred domains, with the usual prefixes and numbering schemes.
+ */
+static const char *generate(uint32_t count)
+{
+    static char file[] = "/tmp/strlist-test.XXXXXX";
+    static const char *tlds[] = {
+        "com", "net", "org", "info", "biz", "ru", "cn", "de", "fr", "co.uk",
+    };
+    static const char *prefixes[] = {
+        "", "", "mail.", "smtp.", "mx.", "mx1.", "www.", "dsl-", "host-",
+        "static-",
+    };
+    static const char *syllables[] = {
+        "ka", "lo", "mi", "ne", "ru", "sa", "ti", "vo", "ze", "bar", "net",
+        "web", "tel", "com", "dyn", "pool", "srv", "link", "fast", "cloud",
+    };
+    uint32_t seed = 42;
+    FILE *f;
+    int fd = mkstemp(file);
+
+    if (fd < 0 || (f = fdopen(fd, "w")) == NULL) {
+        return NULL;
+    }
+    for (uint32_t i = 0 ; i < count ; ++i) {
+        char name[64];
+        int len = 0;
+
+        seed = seed * 1103515245 + 12345;
+        for (uint32_t s = seed >> 8, n = 2 + s % 3 ; n > 0 ; --n) {
+            s /= 3;
+            len += snprintf(name + len, sizeof(name) - len, "%s",
+                            syllables[s % NELEMS(syllables)]);
+            s /= NELEMS(syllables);
+        }
+        if ((seed >> 3) % 4 == 0) {
+            fprintf(f, "%s%u-%u-%u.%s%u.%s\n",
+                    prefixes[(seed >> 5) % NELEMS(prefixes)],
+                    (seed >> 7) % 256, (seed >> 15) % 256, i % 256,
+                    name, (seed >> 23) % 16, tlds[seed % NELEMS(tlds)]);
+        } else {
+            fprintf(f, "%s%s%u.%s\n",
+                    prefixes[(seed >> 5) % NELEMS(prefixes)], name,
+                    i % 1000, tlds[seed % NELEMS(tlds)]);
+        }
+    }
+    fclose(f);
+    return file;
+}
+
+typedef struct str_check_t {
+    const char *str;
+    bool        hit;
+    bool        partial_hit;
+} str_check_t;
+
+/* Entries of data/test_hostnames_1, looked up by suffix.
+ */
+static const str_check_t hostnames_checks[] = {
+    { "example.com",                 true,  true  },
+    { "foo.example.com",             true,  true  },
+    { "test.foobar.example.com",     true,  true  },
+    { "bar.example.com",             false, true  },
+    { "www.test.foobar.example.com", false, true  },
+    { "xample.com",                  false, false },
+    { "example.co",                  false, false },
+    { "example.comx",                false, false },
+    { "",                            false, false },
+    { NULL,                          false, false },
+};
+
+/* Entries of data/test_emails_2, looked up by prefix.
+ */
+static const str_check_t emails_checks[] = {
+    { "contact@example.org",         true,  true  },
+    { "test@foo.example.org",        true,  true  },
+    { "contact@example.org.uk",      false, true  },
+    { "contact@example.or",          false, false },
+    { "ontact@example.org",          false, false },
+    { "postmaster@",                 false, false },
+    { NULL,                          false, false },
+};
+
+/* Entries and regexps of data/test_hostnames_5, looked up by suffix.
+ */
+static const str_check_t regexps_checks[] = {
+    { ".domain.tld",                 true,  true  },
+    { "www.domain.tld",              false, true  },
+    { "domain.tld",                  false, false },
+    { "kiko.example.net",            true,  true  },
+    { "kikooo.example.net",          true,  true  },
+    { "kik.example.net",             false, false },
+    { "www.kiko.example.net",        false, false },
+    { NULL,                          false, false },
+};
+
+static bool check_lookups(const strdb_t *db, const char *file, bool reverse,
+                          const str_check_t *checks)
+{
+    bool ok = true;
+
+    for (const str_check_t *check = checks ; check->str ; ++check) {
+        const int len = strlen(check->str);
+        const bool hit = strdb_lookup(db, 0, check->str, len, reverse) != 0;
+        const bool partial_hit = strdb_lookup(db, 1, check->str, len,
+                                              reverse) != 0;
+
+        if (hit != check->hit || partial_hit != check->partial_hit) {
+            printf("%s: %s %s, %s as a partial match\n", file, check->str,
+                   hit ? "found" : "not found",
+                   partial_hit ? "found" : "not found");
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+/* The entries of a list as read from its text, sorted: the ground truth of
+ * the lookups. The regexps are ignored.
+ */
+typedef char *entry_t;
+
+typedef struct entries_t {
+    entry_t *strs;
+    int      len;
+} entries_t;
+
+static bool entries_load(entries_t *entries, const char *file)
+{
+    file_map_t map;
+    const char *p;
+
+    if (!file_map_open(&map, file, false)) {
+        return false;
+    }
+    entries->len  = 0;
+    entries->strs = p_new(entry_t, map.end - map.map + 1);
+    for (p = map.map ; p < map.end ; ) {
+        const char *eol = memchr(p, '\n', map.end - p);
+        const char *eos;
+
+        if (eol == NULL) {
+            break;
+        }
+        for (eos = eol ; p < eos && isspace(*p) ; ++p);
+        for (; p < eos && isspace(eos[-1]) ; --eos);
+        if (p < eos && *p != '#' && *p != '/') {
+            char *str = p_dupstr(p, eos - p);
+
+            for (char *c = str ; *c ; ++c) {
+                *c = tolower(*c);
+            }
+            entries->strs[entries->len++] = str;
+        }
+        p = eol + 1;
+    }
+    file_map_close(&map);
+
+    if (entries->len > 0) {
+#       define QSORT_TYPE entry_t
+#       define QSORT_BASE entries->strs
+#       define QSORT_NELT entries->len
+#       define QSORT_LT(a,b) strcmp(*a, *b) < 0
+#       include <common/qsort.c>
+    }
+    return true;
+}
+
+static void entries_wipe(entries_t *entries)
+{
+    for (int i = 0 ; i < entries->len ; ++i) {
+        p_delete(&entries->strs[i]);
+    }
+    p_delete(&entries->strs);
+}
+
+static bool entries_has(const entries_t *entries, const char *str, int len)
+{
+    int l = 0, r = entries->len;
+
+    while (l < r) {
+        const int i = (l + r) / 2;
+        const char *entry = entries->strs[i];
+        int cmp = strncmp(entry, str, len);
+
+        if (cmp == 0 && entry[len] != '\0') {
+            cmp = 1;
+        }
+        if (cmp == 0) {
+            return true;
+        }
+        if (cmp > 0) {
+            r = i;
+        } else {
+            l = i + 1;
+        }
+    }
+    return false;
+}
+
+/* Whether one of the entries is a prefix of @p str (a suffix if
+ * @p reverse is set).
+ */
+static bool entries_has_fix(const entries_t *entries, const char *str,
+                            int len, bool reverse)
+{
+    for (int i = 1 ; i <= len ; ++i) {
+        if (entries_has(entries, reverse ? str + len - i : str, i)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Look up every entry of the list, and the strings around it: the entry
+ * without its first or last character, with a character added at either
+ * end or with a character changed. The answers must be the ones of the
+ * entries of the text.
+ */
+static bool check_entries(const strdb_t *db, const char *file, bool reverse,
+                          const entries_t *entries)
+{
+    char probe[BUFSIZ];
+
+    for (int i = 0 ; i < entries->len ; ++i) {
+        const char *entry = entries->strs[i];
+        const int len = strlen(entry);
+
+        if (len + 2 > BUFSIZ) {
+            continue;
+        }
+        for (int variant = 0 ; variant < 6 ; ++variant) {
+            const char *str = probe;
+            int plen = len;
+            bool hit, partial_hit;
+
+            switch (variant) {
+              case 0: str = entry; break;
+              case 1: str = entry + 1; plen = len - 1; break;
+              case 2: str = entry; plen = len - 1; break;
+              case 3:
+                probe[0] = 'x';
+                memcpy(probe + 1, entry, len);
+                plen = len + 1;
+                break;
+              case 4:
+                memcpy(probe, entry, len);
+                probe[len] = 'x';
+                plen = len + 1;
+                break;
+              case 5:
+                memcpy(probe, entry, len);
+                probe[len / 2] ^= 1;
+                break;
+            }
+            if (plen < 0) {
+                continue;
+            }
+            hit = strdb_lookup(db, 0, str, plen, reverse) != 0;
+            partial_hit = strdb_lookup(db, 1, str, plen, reverse) != 0;
+            if (hit != entries_has(entries, str, plen)
+                || partial_hit != entries_has_fix(entries, str, plen,
+                                                  reverse)) {
+                printf("%s: %.*s %s, %s as a partial match\n", file, plen,
+                       str, hit ? "found" : "not found",
+                       partial_hit ? "found" : "not found");
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static double elapsed(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec)
+         + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+#define PROBES      (1 << 20)
+#define ITERATIONS  8
+
+/* Build PROBES strings from random entries: half of them are entries, the
+ * others are subdomains of entries or entries with a character changed.
+ */
+static void probes_build(const entries_t *entries, buffer_t *probes,
+                         int *offsets)
+{
+    uint32_t seed = 7;
+
+    for (int i = 0 ; i < PROBES ; ++i) {
+        const char *entry;
+        int len;
+
+        seed = seed * 1103515245 + 12345;
+        entry = entries->strs[(seed >> 4) % entries->len];
+        len = strlen(entry);
+        offsets[i] = probes->len;
+        if (i % 4 == 1) {
+            buffer_addstr(probes, "relay.");
+        }
+        buffer_add(probes, entry, len);
+        if (i % 4 == 3 && len > 0) {
+            probes->data[probes->len - 1 - (seed % len)] ^= 1;
+        }
+        buffer_addch(probes, '\0');
+    }
+    offsets[PROBES] = probes->len;
+}
+
+static void bench(const strdb_t *db, const char *name, const buffer_t *probes,
+                  const int *offsets)
+{
+    struct timespec start;
+    uint32_t hits = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int j = 0 ; j < ITERATIONS ; ++j) {
+        for (int i = 0 ; i < PROBES ; ++i) {
+            hits += strdb_lookup(db, 1, probes->data + offsets[i],
+                                 offsets[i + 1] - offsets[i] - 1, true) != 0;
+        }
+    }
+    printf("%s: %.0f lookups per second, %u hits\n", name,
+           (double)PROBES * ITERATIONS / elapsed(&start), hits);
+}
+
+/* Check the lookups of a list of the data directory, parsed and compiled by
+ * strlist_compile() as postlicyd-compile-strlist does, against the given
+ * checks and against the entries of the text.
+ */
+static bool check_list(const char *basepath, const char *name, bool reverse,
+                       const str_check_t *checks)
+{
+    char path[FILENAME_MAX];
+    char image[FILENAME_MAX];
+    entries_t entries;
+    strdb_t *db;
+    bool ok = true;
+
+    snprintf(path, FILENAME_MAX, "%s%s", basepath, name);
+    snprintf(image, FILENAME_MAX, "%s%s.img", basepath, name);
+    if (!entries_load(&entries, path)) {
+        return false;
+    }
+    for (int dafsa = 0 ; ok && dafsa < 2 ; ++dafsa) {
+        for (int compiled = 0 ; ok && compiled < 2 ; ++compiled) {
+            const char *file = compiled ? image : path;
+
+            if (compiled && !strlist_compile(path, image, reverse, false,
+                                             dafsa)) {
+                ok = false;
+                break;
+            }
+            db = strdb_create(file, reverse, dafsa);
+            if (db == NULL) {
+                ok = false;
+                break;
+            }
+            if (checks != NULL) {
+                ok = check_lookups(db, file, reverse, checks) && ok;
+            }
+            ok = check_entries(db, file, reverse, &entries) && ok;
+            strdb_delete(&db);
+        }
+        unlink(image);
+    }
+    entries_wipe(&entries);
+    return ok;
+}
+
+/* Without argument, check the lookups in the lists of the data directory.
+ * Otherwise, check the trie and the DAFSA engines of the string lists on a
+ * list of host names looked up by suffix, and report their memory. The
+ * argument is either a list or the number of host names to generate
+ * (5000000 for a large rhsbl).
+ */
+int main(int argc, char *argv[])
+{
+    if (argc == 1) {
+        char basepath[FILENAME_MAX];
+        const char *p = strrchr(argv[0], '/');
+        bool ok;
+
+        p = p == NULL ? argv[0] : p + 1;
+        snprintf(basepath, FILENAME_MAX, "%.*sdata/", (int)(p - argv[0]),
+                 argv[0]);
+        ok = check_list(basepath, "test_hostnames_1", true, hostnames_checks);
+        ok = check_list(basepath, "test_hostnames_2", false, NULL) && ok;
+        ok = check_list(basepath, "test_hostnames_3", true, NULL) && ok;
+        ok = check_list(basepath, "test_emails_1", true, NULL) && ok;
+        ok = check_list(basepath, "test_emails_2", false, emails_checks)
+          && ok;
+        ok = check_list(basepath, "test_emails_3", true, NULL) && ok;
+        ok = check_list(basepath, "test_hostnames_5", true, regexps_checks)
+          && ok;
+        printf("%s\n", ok ? "SUCCESS" : "FAILED");
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    } else {
+        const char *file = argv[1];
+        char *end;
+        uint32_t count = strtoul(argv[1], &end, 10);
+        entries_t entries;
+        buffer_t probes = ARRAY_INIT;
+        int *offsets = p_new(int, PROBES + 1);
+        bool ok = true;
+
+        if (*end == '\0' && (file = generate(count)) == NULL) {
+            return EXIT_FAILURE;
+        }
+        if (!entries_load(&entries, file) || entries.len == 0) {
+            return EXIT_FAILURE;
+        }
+        probes_build(&entries, &probes, offsets);
+
+        /* Compare the memory and the lookup speed of the trie and the
+         * DAFSA engines, on a list looked up by suffix.
+         */
+        for (int dafsa = 0 ; ok && dafsa < 2 ; ++dafsa) {
+            const char *name = dafsa ? "dafsa" : "trie";
+            struct timespec start;
+            strdb_t *db;
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            db = strdb_create(file, true, dafsa);
+            if (db == NULL) {
+                ok = false;
+                break;
+            }
+            printf("%s: %d entries, loaded in %.2fs, %zu o\n", name,
+                   entries.len, elapsed(&start), strdb_memory(db));
+            ok = check_entries(db, file, true, &entries);
+            if (ok) {
+                bench(db, name, &probes, offsets);
+            }
+            strdb_delete(&db);
+        }
+        if (*end == '\0') {
+            unlink(file);
+        }
+        entries_wipe(&entries);
+        buffer_wipe(&probes);
+        p_delete(&offsets);
+        printf("%s\n", ok ? "SUCCESS" : "FAILED");
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+}
+
+/* vim:set et sw=4 sts=4 sws=4: */